@@ -0,0 +1 @@
+0x07230203, 0x00010000
@@ -0,0 +1,358 @@
+#include "app.h"
+#include "mesh.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+// Drives the renderer headless through one synthetic scene and prints a
+// single JSON object with frame time percentiles and memory usage.
+
+// Matches Vertex in app.c, the renderer rejects meshes with another stride
+typedef struct {
+	float pos[3];
+	float color[3];
+} BenchVertex;
+
+typedef struct {
+	const char *name;
+	uint32_t objects;
+	uint32_t triangles;
+	uint32_t instances;
+	uint32_t frames;
+	uint32_t warmup;
+	uint32_t frames_in_flight;
+	uint32_t record_threads;
+	uint32_t job_threads;
+	bool gpu_culling;
+	bool depth_prepass;
+	bool bindless;
+	const char *texture;
+	uint32_t texture_budget_mib;
+	uint32_t particles;
+	float lod_error;
+	const char *mesh;
+	const char *output;
+} BenchConfig;
+
+static void usage(const char *program)
+{
+	fprintf(stderr,
+		"usage: %s [--name NAME] [--objects N] [--triangles N]\n"
+		"          [--instances N] [--frames N] [--warmup N]\n"
+		"          [--frames-in-flight N] [--record-threads N]\n"
+		"          [--job-threads N] [--gpu-cull] [--depth-prepass]\n"
+		"          [--bindless] [--texture FILE]\n"
+		"          [--texture-budget MIB] [--particles N]\n"
+		"          [--lod-error PIXELS] [--mesh FILE]\n"
+		"          [--output FILE]\n",
+		program);
+	exit(1);
+}
+
+static size_t align_up(size_t value)
+{
+	return (value + MESH_ALIGNMENT - 1) & ~(size_t)(MESH_ALIGNMENT - 1);
+}
+
+// Every object is a grid patch of exactly `triangles` triangles in its own
+// column of the unit square, stored as one submesh
+static void write_scene(const BenchConfig *config, const char *path)
+{
+	uint32_t columns = 1;
+	while ((uint64_t)columns * columns * 2 < config->triangles) {
+		columns++;
+	}
+	uint32_t rows = (config->triangles + columns * 2 - 1) / (columns * 2);
+	uint32_t object_vertices = (columns + 1) * (rows + 1);
+	uint32_t object_indices = config->triangles * 3;
+	uint32_t index_size = object_vertices > UINT16_MAX ? 4 : 2;
+	uint64_t vertex_count = (uint64_t)object_vertices * config->objects;
+	uint64_t index_count = (uint64_t)object_indices * config->objects;
+	if (vertex_count > INT32_MAX || index_count > UINT32_MAX) {
+		fprintf(stderr, "scene too large\n");
+		exit(1);
+	}
+
+	MeshHeader header = {
+		.magic = MESH_MAGIC,
+		.version = MESH_VERSION,
+		.vertex_stride = sizeof(BenchVertex),
+		.index_size = index_size,
+		.vertex_count = vertex_count,
+		.index_count = index_count,
+		.submesh_count = config->objects,
+	};
+	header.submesh_offset = align_up(sizeof(header));
+	header.vertex_offset = align_up(header.submesh_offset +
+					sizeof(MeshSubmesh) * config->objects);
+	header.index_offset = align_up(header.vertex_offset +
+				       vertex_count * sizeof(BenchVertex));
+	size_t size = header.index_offset + index_count * index_size;
+
+	unsigned char *data = calloc(1, size);
+	if (data == nullptr) {
+		fprintf(stderr, "Can't allocate %zu bytes for the scene\n",
+			size);
+		exit(1);
+	}
+	memcpy(data, &header, sizeof(header));
+	MeshSubmesh *submeshes = (MeshSubmesh *)(data + header.submesh_offset);
+	BenchVertex *vertices = (BenchVertex *)(data + header.vertex_offset);
+	unsigned char *indices = data + header.index_offset;
+
+	float width = 1.0f / config->objects;
+	for (uint32_t object = 0; object < config->objects; object++) {
+		submeshes[object] = (MeshSubmesh){
+			.first_index = object * object_indices,
+			.index_count = object_indices,
+			.vertex_offset = object * object_vertices
+		};
+		BenchVertex *v = vertices + (size_t)object * object_vertices;
+		for (uint32_t y = 0; y <= rows; y++) {
+			for (uint32_t x = 0; x <= columns; x++) {
+				float u = (float)x / columns;
+				float t = (float)y / rows;
+				*v++ = (BenchVertex){
+					{ -0.5f + (object + u * 0.9f) * width,
+					  t - 0.5f, 0.0f },
+					{ u, t, 1.0f - u }
+				};
+			}
+		}
+		uint64_t written = 0;
+		uint64_t base = (uint64_t)object * object_indices;
+		for (uint32_t quad = 0; written < object_indices; quad++) {
+			uint32_t x = quad % columns;
+			uint32_t y = quad / columns;
+			uint32_t a = y * (columns + 1) + x;
+			uint32_t quad_indices[6] = { a, a + 1, a + columns + 1,
+						     a + 1, a + columns + 2,
+						     a + columns + 1 };
+			for (uint32_t i = 0; i < 6 && written < object_indices;
+			     i++, written++) {
+				if (index_size == 4) {
+					((uint32_t *)indices)[base + written] =
+						quad_indices[i];
+				} else {
+					((uint16_t *)indices)[base + written] =
+						quad_indices[i];
+				}
+			}
+		}
+	}
+
+	FILE *file = fopen(path, "wb");
+	if (file == nullptr || fwrite(data, 1, size, file) != size ||
+	    fclose(file) != 0) {
+		perror(path);
+		exit(1);
+	}
+	free(data);
+}
+
+static int compare_double(const void *a, const void *b)
+{
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+// Nearest rank percentile of sorted values
+static double percentile(const double *sorted, uint32_t count, double p)
+{
+	uint32_t rank = (uint32_t)ceil(p / 100.0 * count);
+	return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+static void summarize(FILE *out, const char *key, double *values,
+		      uint32_t count)
+{
+	double sum = 0.0;
+	for (uint32_t i = 0; i < count; i++) {
+		sum += values[i];
+	}
+	qsort(values, count, sizeof(double), compare_double);
+	fprintf(out,
+		"\"%s\":{\"mean\":%.4f,\"p50\":%.4f,\"p95\":%.4f,"
+		"\"p99\":%.4f,\"max\":%.4f}",
+		key, sum / count, percentile(values, count, 50),
+		percentile(values, count, 95), percentile(values, count, 99),
+		values[count - 1]);
+}
+
+int main(int argc, char **argv)
+{
+	BenchConfig config = { .name = "scene",
+			       .objects = 1,
+			       .triangles = 2,
+			       .instances = 1,
+			       .frames = 300,
+			       .warmup = 30,
+			       .frames_in_flight = DEFAULT_FRAMES_IN_FLIGHT };
+	for (int i = 1; i < argc; i++) {
+		const char *arg = argv[i];
+		if (strcmp(arg, "--gpu-cull") == 0) {
+			config.gpu_culling = true;
+			continue;
+		}
+		if (strcmp(arg, "--depth-prepass") == 0) {
+			config.depth_prepass = true;
+			continue;
+		}
+		if (strcmp(arg, "--bindless") == 0) {
+			config.bindless = true;
+			continue;
+		}
+		if (i + 1 >= argc) {
+			usage(argv[0]);
+		}
+		const char *value = argv[++i];
+		if (strcmp(arg, "--name") == 0) {
+			config.name = value;
+		} else if (strcmp(arg, "--objects") == 0) {
+			config.objects = (uint32_t)atoi(value);
+		} else if (strcmp(arg, "--triangles") == 0) {
+			config.triangles = (uint32_t)atoi(value);
+		} else if (strcmp(arg, "--instances") == 0) {
+			config.instances = (uint32_t)atoi(value);
+		} else if (strcmp(arg, "--frames") == 0) {
+			config.frames = (uint32_t)atoi(value);
+		} else if (strcmp(arg, "--warmup") == 0) {
+			config.warmup = (uint32_t)atoi(value);
+		} else if (strcmp(arg, "--frames-in-flight") == 0) {
+			config.frames_in_flight = (uint32_t)atoi(value);
+		} else if (strcmp(arg, "--record-threads") == 0) {
+			config.record_threads = (uint32_t)atoi(value);
+		} else if (strcmp(arg, "--job-threads") == 0) {
+			config.job_threads = (uint32_t)atoi(value);
+		} else if (strcmp(arg, "--texture") == 0) {
+			config.texture = value;
+		} else if (strcmp(arg, "--texture-budget") == 0) {
+			config.texture_budget_mib = (uint32_t)atoi(value);
+		} else if (strcmp(arg, "--particles") == 0) {
+			config.particles = (uint32_t)atoi(value);
+		} else if (strcmp(arg, "--lod-error") == 0) {
+			config.lod_error = strtof(value, nullptr);
+		} else if (strcmp(arg, "--mesh") == 0) {
+			config.mesh = value;
+		} else if (strcmp(arg, "--output") == 0) {
+			config.output = value;
+		} else {
+			usage(argv[0]);
+		}
+	}
+	if (config.objects < 1 || config.triangles < 1 || config.frames < 1) {
+		usage(argv[0]);
+	}
+
+	// A cooked mesh replaces the synthetic scene
+	char mesh_path[] = "/tmp/nebula-bench-XXXXXX";
+	if (config.mesh == nullptr) {
+		int fd = mkstemp(mesh_path);
+		if (fd < 0) {
+			perror("mkstemp");
+			return 1;
+		}
+		close(fd);
+		write_scene(&config, mesh_path);
+	}
+
+	uint32_t total = config.warmup + config.frames;
+	AppStats stats = { .frame_ms = malloc(sizeof(double) * total),
+			   .submit_ms = malloc(sizeof(double) * total),
+			   .capacity = total };
+	AppConfig app = { .frames_in_flight = config.frames_in_flight,
+			  .headless = true,
+			  .frame_count = total,
+			  .mesh_path = config.mesh != nullptr ? config.mesh
+							      : mesh_path,
+			  .instance_count = config.instances,
+			  .record_threads = config.record_threads,
+			  .job_threads = config.job_threads,
+			  .gpu_culling = config.gpu_culling,
+			  .depth_prepass = config.depth_prepass,
+			  .bindless = config.bindless,
+			  .particle_count = config.particles,
+			  .lod_pixel_error = config.lod_error,
+			  .texture_path = config.texture,
+			  .texture_budget = (uint64_t)config.texture_budget_mib
+					    << 20,
+			  .pipeline_cache_path = DEFAULT_PIPELINE_CACHE_PATH,
+			  .stats = &stats };
+	app_run(&app);
+	if (config.mesh == nullptr) {
+		unlink(mesh_path);
+	}
+	if (stats.frames <= config.warmup) {
+		fprintf(stderr, "no frames measured\n");
+		return 1;
+	}
+
+	struct rusage resources;
+	getrusage(RUSAGE_SELF, &resources);
+	FILE *out = stdout;
+	if (config.output != nullptr) {
+		out = fopen(config.output, "a");
+		if (out == nullptr) {
+			perror(config.output);
+			return 1;
+		}
+	}
+	uint32_t measured = stats.frames - config.warmup;
+	// Every frame advances every particle by one step
+	double measured_ms = 0.0;
+	for (uint32_t i = config.warmup; i < stats.frames; i++) {
+		measured_ms += stats.frame_ms[i];
+	}
+	fprintf(out,
+		"{\"name\":\"%s\",\"objects\":%u,\"triangles\":%u,"
+		"\"instances\":%u,\"frames\":%u,\"frames_in_flight\":%u,"
+		"\"record_threads\":%u,\"job_threads\":%u,\"gpu_cull\":%s,"
+		"\"depth_prepass\":%s,\"bindless\":%s,",
+		config.name, config.objects, config.triangles,
+		config.instances, measured, config.frames_in_flight,
+		config.record_threads, config.job_threads,
+		config.gpu_culling ? "true" : "false",
+		config.depth_prepass ? "true" : "false",
+		config.bindless ? "true" : "false");
+	summarize(out, "frame_ms", stats.frame_ms + config.warmup, measured);
+	fprintf(out, ",");
+	summarize(out, "submit_ms", stats.submit_ms + config.warmup, measured);
+	// Bind counts are only summed, so they average over the warmup too
+	fprintf(out,
+		",\"render_queue\":{\"draws_per_frame\":%.1f,"
+		"\"binds_per_frame\":%.1f,\"binds_skipped_per_frame\":%.1f}",
+		(double)stats.render.draws / stats.frames,
+		(double)stats.render.binds / stats.frames,
+		(double)stats.render.binds_skipped / stats.frames);
+	fprintf(out,
+		",\"textures\":{\"resident_bytes\":%llu,\"budget_bytes\":%llu,"
+		"\"complete\":%u,\"promotions\":%llu,\"demotions\":%llu}",
+		(unsigned long long)stats.textures.resident_bytes,
+		(unsigned long long)stats.textures.budget_bytes,
+		stats.textures.complete,
+		(unsigned long long)stats.textures.promotions,
+		(unsigned long long)stats.textures.demotions);
+	fprintf(out, ",\"particles\":{\"count\":%u,\"per_second\":%.0f}",
+		stats.particles,
+		measured_ms > 0.0 ?
+			(double)stats.particles * measured / measured_ms * 1e3 :
+			0.0);
+	fprintf(out,
+		",\"device_memory\":{\"allocations\":%u,"
+		"\"device_allocations\":%u,\"used_bytes\":%llu,"
+		"\"reserved_bytes\":%llu},\"max_rss_kib\":%ld}\n",
+		stats.memory.allocations, stats.memory.device_allocations,
+		(unsigned long long)stats.memory.used_bytes,
+		(unsigned long long)stats.memory.reserved_bytes,
+		resources.ru_maxrss);
+	if (out != stdout) {
+		fclose(out);
+	}
+	free(stats.frame_ms);
+	free(stats.submit_ms);
+	return 0;
+}
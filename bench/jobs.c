@@ -0,0 +1,194 @@
+#include "jobs.h"
+#include "profiler.h"
+#include <cglm/cglm.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Measures how the job system scales with its thread count. Prints one JSON
+// object per thread count with the time of a transform-style parallel_for
+// and of a tree of tiny recursively spawned jobs, which mostly measures
+// queueing and stealing overhead.
+
+typedef struct {
+	uint32_t items;
+	uint32_t depth;
+	uint32_t repeats;
+	uint32_t max_threads;
+	const char *output;
+} JobsConfig;
+
+typedef struct {
+	mat4 *local;
+	mat4 *world;
+	mat4 parent;
+} TransformWork;
+
+typedef struct {
+	uint32_t depth;
+	atomic_uint *leaves;
+} SpawnWork;
+
+static void usage(const char *program)
+{
+	fprintf(stderr,
+		"usage: %s [--items N] [--depth N] [--repeats N]\n"
+		"          [--max-threads N] [--output FILE]\n",
+		program);
+	exit(1);
+}
+
+static void transform_range(void *data, uint32_t begin, uint32_t end)
+{
+	TransformWork *work = data;
+	for (uint32_t i = begin; i < end; i++) {
+		mat4 world;
+		glm_mat4_mul(work->parent, work->local[i], world);
+		// A few more rounds so the work is compute bound
+		for (uint32_t round = 0; round < 4; round++) {
+			glm_mat4_mul(world, work->local[i], world);
+		}
+		glm_mat4_copy(world, work->world[i]);
+	}
+}
+
+// Binary tree of jobs, every inner node queues one child and runs the other
+static void spawn_node(void *data)
+{
+	SpawnWork *work = data;
+	if (work->depth == 0) {
+		atomic_fetch_add_explicit(work->leaves, 1,
+					  memory_order_relaxed);
+		return;
+	}
+	SpawnWork children[2] = { { work->depth - 1, work->leaves },
+				  { work->depth - 1, work->leaves } };
+	JobCounter counter = {};
+	jobs_run(spawn_node, &children[0], &counter);
+	spawn_node(&children[1]);
+	jobs_wait(&counter);
+}
+
+static double elapsed_ms(uint64_t start)
+{
+	return (profiler_now() - start) / 1e6;
+}
+
+int main(int argc, char **argv)
+{
+	long online = sysconf(_SC_NPROCESSORS_ONLN);
+	JobsConfig config = { .items = 1 << 20,
+			      .depth = 16,
+			      .repeats = 20,
+			      .max_threads = online > 0 ? (uint32_t)online :
+							  1 };
+	for (int i = 1; i < argc; i++) {
+		const char *arg = argv[i];
+		if (i + 1 >= argc) {
+			usage(argv[0]);
+		}
+		const char *value = argv[++i];
+		if (strcmp(arg, "--items") == 0) {
+			config.items = (uint32_t)atoi(value);
+		} else if (strcmp(arg, "--depth") == 0) {
+			config.depth = (uint32_t)atoi(value);
+		} else if (strcmp(arg, "--repeats") == 0) {
+			config.repeats = (uint32_t)atoi(value);
+		} else if (strcmp(arg, "--max-threads") == 0) {
+			config.max_threads = (uint32_t)atoi(value);
+		} else if (strcmp(arg, "--output") == 0) {
+			config.output = value;
+		} else {
+			usage(argv[0]);
+		}
+	}
+	if (config.items < 1 || config.repeats < 1 || config.max_threads < 1 ||
+	    config.depth > 24) {
+		usage(argv[0]);
+	}
+	if (config.max_threads > JOBS_MAX_THREADS) {
+		config.max_threads = JOBS_MAX_THREADS;
+	}
+
+	TransformWork transforms = {
+		.local = aligned_alloc(32, sizeof(mat4) * config.items),
+		.world = aligned_alloc(32, sizeof(mat4) * config.items)
+	};
+	if (transforms.local == nullptr || transforms.world == nullptr) {
+		fprintf(stderr, "Can't allocate %u transforms\n", config.items);
+		return 1;
+	}
+	glm_mat4_identity(transforms.parent);
+	glm_translate(transforms.parent, (vec3){ 1.0f, 2.0f, 3.0f });
+	for (uint32_t i = 0; i < config.items; i++) {
+		glm_mat4_identity(transforms.local[i]);
+		glm_rotate_y(transforms.local[i], i * 0.001f,
+			     transforms.local[i]);
+	}
+
+	FILE *out = stdout;
+	if (config.output != nullptr) {
+		out = fopen(config.output, "a");
+		if (out == nullptr) {
+			perror(config.output);
+			return 1;
+		}
+	}
+	double baseline_for = 0.0;
+	double baseline_spawn = 0.0;
+	// 1, 2, 4, ... threads and finally max_threads
+	for (uint32_t threads = 1;; threads *= 2) {
+		if (threads > config.max_threads) {
+			threads = config.max_threads;
+		}
+		jobs_init(threads);
+		double for_ms = 1e30;
+		double spawn_ms = 1e30;
+		// Best of the repeats, the first one also warms the caches
+		for (uint32_t repeat = 0; repeat < config.repeats; repeat++) {
+			uint64_t start = profiler_now();
+			jobs_parallel_for(config.items, 1024, transform_range,
+					  &transforms);
+			double ms = elapsed_ms(start);
+			for_ms = ms < for_ms ? ms : for_ms;
+
+			atomic_uint leaves = 0;
+			SpawnWork root = { config.depth, &leaves };
+			start = profiler_now();
+			spawn_node(&root);
+			ms = elapsed_ms(start);
+			spawn_ms = ms < spawn_ms ? ms : spawn_ms;
+			if (atomic_load(&leaves) != 1u << config.depth) {
+				fprintf(stderr, "lost jobs: %u of %u leaves\n",
+					atomic_load(&leaves),
+					1u << config.depth);
+				return 1;
+			}
+		}
+		jobs_destroy();
+		if (threads == 1) {
+			baseline_for = for_ms;
+			baseline_spawn = spawn_ms;
+		}
+		// Every inner node of the tree queues one job
+		double spawned = (double)((1u << config.depth) - 1);
+		fprintf(out,
+			"{\"name\":\"jobs\",\"threads\":%u,\"items\":%u,"
+			"\"parallel_for_ms\":%.4f,\"parallel_for_speedup\":%.2f,"
+			"\"spawn_depth\":%u,\"spawn_ms\":%.4f,"
+			"\"spawn_speedup\":%.2f,\"jobs_per_s\":%.0f}\n",
+			threads, config.items, for_ms, baseline_for / for_ms,
+			config.depth, spawn_ms, baseline_spawn / spawn_ms,
+			spawned / (spawn_ms / 1e3));
+		if (threads == config.max_threads) {
+			break;
+		}
+	}
+	if (out != stdout) {
+		fclose(out);
+	}
+	free(transforms.local);
+	free(transforms.world);
+	return 0;
+}
@@ -0,0 +1,491 @@
+#include "allocator.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MIN_NODE_SHIFT 8
+#define MAX_BLOCK_SIZE (64ull << 20)
+#define MIN_BLOCK_SIZE (1ull << 20)
+#define MAX_LEVELS 32
+#define NO_NODE UINT32_MAX
+#define NOT_FREE 0xff
+#define POOL_COUNT (VK_MAX_MEMORY_TYPES * 2)
+
+// A block is a single vkAllocateMemory split into power-of-two nodes. Nodes
+// are addressed by the index of their first minimum-sized leaf; a free node
+// at level l covers leaves [index, index + 2^l).
+typedef struct {
+	VkDeviceMemory memory;
+	void *mapped;
+	uint32_t free_head[MAX_LEVELS];
+	uint32_t *next;
+	uint32_t *prev;
+	uint8_t *free_level;
+	VkDeviceSize used;
+	uint32_t allocations;
+} Block;
+
+typedef struct {
+	Block *blocks;
+	uint32_t block_count;
+	uint32_t live_blocks;
+	VkDeviceSize block_size;
+	uint32_t levels;
+} Pool;
+
+static VkDevice device;
+static VkPhysicalDeviceMemoryProperties memory_properties;
+static Pool pools[POOL_COUNT];
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t device_allocations;
+static uint32_t max_device_allocations;
+static uint32_t allocation_count;
+static VkDeviceSize dedicated_bytes;
+
+static uint32_t log2_ceil(VkDeviceSize value)
+{
+	uint32_t shift = 0;
+	while ((1ull << shift) < value) {
+		shift++;
+	}
+	return shift;
+}
+
+static void node_push(Block *block, uint32_t node, uint32_t level)
+{
+	block->free_level[node] = level;
+	block->prev[node] = NO_NODE;
+	block->next[node] = block->free_head[level];
+	if (block->free_head[level] != NO_NODE) {
+		block->prev[block->free_head[level]] = node;
+	}
+	block->free_head[level] = node;
+}
+
+static void node_remove(Block *block, uint32_t node)
+{
+	uint32_t level = block->free_level[node];
+	if (block->prev[node] != NO_NODE) {
+		block->next[block->prev[node]] = block->next[node];
+	} else {
+		block->free_head[level] = block->next[node];
+	}
+	if (block->next[node] != NO_NODE) {
+		block->prev[block->next[node]] = block->prev[node];
+	}
+	block->free_level[node] = NOT_FREE;
+}
+
+static VkResult device_allocate(uint32_t memory_type, VkDeviceSize size,
+				VkDeviceMemory *memory, void **mapped)
+{
+	if (device_allocations >= max_device_allocations) {
+		return VK_ERROR_TOO_MANY_OBJECTS;
+	}
+	VkMemoryAllocateInfo allocInfo = {
+		.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+		.allocationSize = size,
+		.memoryTypeIndex = memory_type
+	};
+	VkResult result = vkAllocateMemory(device, &allocInfo, nullptr, memory);
+	if (result != VK_SUCCESS) {
+		return result;
+	}
+	*mapped = nullptr;
+	if (allocator_memory_flags(memory_type) &
+	    VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+		// Host visible blocks stay mapped for their whole lifetime,
+		// Vulkan does not allow mapping the same memory twice. Callers
+		// write through the mapping, so a failed map fails the
+		// allocation.
+		result = vkMapMemory(device, *memory, 0, VK_WHOLE_SIZE, 0,
+				     mapped);
+		if (result != VK_SUCCESS) {
+			vkFreeMemory(device, *memory, nullptr);
+			*memory = VK_NULL_HANDLE;
+			*mapped = nullptr;
+			return result;
+		}
+	}
+	device_allocations++;
+	return VK_SUCCESS;
+}
+
+static void device_free(VkDeviceMemory memory, void *mapped)
+{
+	if (mapped != nullptr) {
+		vkUnmapMemory(device, memory);
+	}
+	vkFreeMemory(device, memory, nullptr);
+	device_allocations--;
+}
+
+static bool block_create(Pool *pool, uint32_t memory_type, uint32_t *index)
+{
+	uint32_t slot = pool->block_count;
+	for (uint32_t i = 0; i < pool->block_count; i++) {
+		if (pool->blocks[i].memory == VK_NULL_HANDLE) {
+			slot = i;
+			break;
+		}
+	}
+	if (slot == pool->block_count) {
+		Block *blocks = realloc(pool->blocks, (pool->block_count + 1) *
+							      sizeof(Block));
+		if (blocks == nullptr) {
+			fprintf(stderr, "Can't allocate memory block list\n");
+			exit(1);
+		}
+		pool->blocks = blocks;
+		pool->block_count++;
+	}
+	Block *block = &pool->blocks[slot];
+	memset(block, 0, sizeof(*block));
+	if (device_allocate(memory_type, pool->block_size, &block->memory,
+			    &block->mapped) != VK_SUCCESS) {
+		block->memory = VK_NULL_HANDLE;
+		return false;
+	}
+	size_t leaves = pool->block_size >> MIN_NODE_SHIFT;
+	block->next = malloc(leaves * sizeof(uint32_t));
+	block->prev = malloc(leaves * sizeof(uint32_t));
+	block->free_level = malloc(leaves);
+	if (block->next == nullptr || block->prev == nullptr ||
+	    block->free_level == nullptr) {
+		fprintf(stderr, "Can't allocate free lists for %zu nodes\n",
+			leaves);
+		exit(1);
+	}
+	memset(block->free_level, NOT_FREE, leaves);
+	for (uint32_t i = 0; i < MAX_LEVELS; i++) {
+		block->free_head[i] = NO_NODE;
+	}
+	node_push(block, 0, pool->levels - 1);
+	pool->live_blocks++;
+	*index = slot;
+	return true;
+}
+
+static void block_destroy(Pool *pool, Block *block)
+{
+	device_free(block->memory, block->mapped);
+	free(block->next);
+	free(block->prev);
+	free(block->free_level);
+	memset(block, 0, sizeof(*block));
+	pool->live_blocks--;
+}
+
+static bool block_alloc(Block *block, uint32_t levels, uint32_t level,
+			uint32_t *node)
+{
+	uint32_t found = level;
+	while (found < levels && block->free_head[found] == NO_NODE) {
+		found++;
+	}
+	if (found == levels) {
+		return false;
+	}
+	uint32_t index = block->free_head[found];
+	node_remove(block, index);
+	// Split down, handing the upper halves back to the free lists
+	while (found > level) {
+		found--;
+		node_push(block, index + (1u << found), found);
+	}
+	*node = index;
+	return true;
+}
+
+static void block_release(Block *block, uint32_t levels, uint32_t node,
+			  uint32_t level)
+{
+	while (level + 1 < levels) {
+		uint32_t buddy = node ^ (1u << level);
+		if (block->free_level[buddy] != level) {
+			break;
+		}
+		node_remove(block, buddy);
+		node = node < buddy ? node : buddy;
+		level++;
+	}
+	node_push(block, node, level);
+}
+
+void allocator_init(VkPhysicalDevice physical_device, VkDevice logical_device)
+{
+	device = logical_device;
+	vkGetPhysicalDeviceMemoryProperties(physical_device, &memory_properties);
+	VkPhysicalDeviceProperties properties;
+	vkGetPhysicalDeviceProperties(physical_device, &properties);
+	max_device_allocations = properties.limits.maxMemoryAllocationCount;
+
+	for (uint32_t type = 0; type < memory_properties.memoryTypeCount;
+	     type++) {
+		uint32_t heap = memory_properties.memoryTypes[type].heapIndex;
+		VkDeviceSize heap_size = memory_properties.memoryHeaps[heap].size;
+		// Small heaps (e.g. 256MiB BAR windows) get smaller blocks so
+		// one block never claims a large share of them
+		VkDeviceSize block_size = MAX_BLOCK_SIZE;
+		while (block_size > MIN_BLOCK_SIZE && block_size > heap_size / 8) {
+			block_size >>= 1;
+		}
+		for (uint32_t kind = 0; kind < 2; kind++) {
+			Pool *pool = &pools[type * 2 + kind];
+			pool->block_size = block_size;
+			pool->levels = log2_ceil(block_size) - MIN_NODE_SHIFT + 1;
+		}
+	}
+}
+
+void allocator_destroy()
+{
+	for (uint32_t i = 0; i < POOL_COUNT; i++) {
+		Pool *pool = &pools[i];
+		for (uint32_t b = 0; b < pool->block_count; b++) {
+			if (pool->blocks[b].memory != VK_NULL_HANDLE) {
+				block_destroy(pool, &pool->blocks[b]);
+			}
+		}
+		free(pool->blocks);
+		pool->blocks = nullptr;
+		pool->block_count = 0;
+	}
+}
+
+uint32_t allocator_find_memory_type(uint32_t type_bits,
+				    VkMemoryPropertyFlags required,
+				    VkMemoryPropertyFlags preferred)
+{
+	uint32_t best = UINT32_MAX;
+	int best_score = -1;
+	for (uint32_t i = 0; i < memory_properties.memoryTypeCount; i++) {
+		VkMemoryPropertyFlags flags =
+			memory_properties.memoryTypes[i].propertyFlags;
+		if (!(type_bits & (1u << i)) || (flags & required) != required) {
+			continue;
+		}
+		int score = __builtin_popcount(flags & preferred);
+		if (score > best_score) {
+			best = i;
+			best_score = score;
+		}
+	}
+	return best;
+}
+
+VkMemoryPropertyFlags allocator_memory_flags(uint32_t memory_type)
+{
+	return memory_properties.memoryTypes[memory_type].propertyFlags;
+}
+
+static bool alloc_dedicated(uint32_t memory_type, VkDeviceSize size,
+			    Allocation *allocation)
+{
+	void *mapped;
+	if (device_allocate(memory_type, size, &allocation->memory, &mapped) !=
+	    VK_SUCCESS) {
+		return false;
+	}
+	allocation->offset = 0;
+	allocation->size = size;
+	allocation->mapped = mapped;
+	allocation->block = UINT32_MAX;
+	dedicated_bytes += size;
+	return true;
+}
+
+static bool alloc_from_pool(uint32_t pool_index, VkDeviceSize size,
+			    VkDeviceSize alignment, Allocation *allocation)
+{
+	Pool *pool = &pools[pool_index];
+	// Buddy nodes are aligned to their own size, so rounding the request
+	// up to the alignment also satisfies it
+	VkDeviceSize need = size > alignment ? size : alignment;
+	uint32_t shift = log2_ceil(need);
+	uint32_t level = shift > MIN_NODE_SHIFT ? shift - MIN_NODE_SHIFT : 0;
+	if (level >= pool->levels) {
+		return false;
+	}
+
+	uint32_t node;
+	uint32_t block_index = UINT32_MAX;
+	for (uint32_t i = 0; i < pool->block_count; i++) {
+		Block *block = &pool->blocks[i];
+		if (block->memory != VK_NULL_HANDLE &&
+		    block_alloc(block, pool->levels, level, &node)) {
+			block_index = i;
+			break;
+		}
+	}
+	if (block_index == UINT32_MAX) {
+		if (!block_create(pool, pool_index / 2, &block_index) ||
+		    !block_alloc(&pool->blocks[block_index], pool->levels,
+				 level, &node)) {
+			return false;
+		}
+	}
+	Block *block = &pool->blocks[block_index];
+	VkDeviceSize node_size = 1ull << (level + MIN_NODE_SHIFT);
+	block->used += node_size;
+	block->allocations++;
+
+	allocation->memory = block->memory;
+	allocation->offset = (VkDeviceSize)node << MIN_NODE_SHIFT;
+	allocation->size = node_size;
+	allocation->mapped = block->mapped != nullptr ?
+				     (char *)block->mapped + allocation->offset :
+				     nullptr;
+	allocation->block = block_index;
+	allocation->pool = pool_index;
+	allocation->level = level;
+	return true;
+}
+
+bool allocator_alloc(const VkMemoryRequirements *requirements,
+		     VkMemoryPropertyFlags required,
+		     VkMemoryPropertyFlags preferred, bool optimal_image,
+		     Allocation *allocation)
+{
+	uint32_t memory_type = allocator_find_memory_type(
+		requirements->memoryTypeBits, required, preferred);
+	if (memory_type == UINT32_MAX) {
+		return false;
+	}
+	memset(allocation, 0, sizeof(*allocation));
+	allocation->memory_type = memory_type;
+
+	pthread_mutex_lock(&lock);
+	uint32_t pool_index = memory_type * 2 + (optimal_image ? 1 : 0);
+	bool ok;
+	if (requirements->size > pools[pool_index].block_size / 2) {
+		// Anything bigger than half a block would waste most of it
+		ok = alloc_dedicated(memory_type, requirements->size,
+				     allocation);
+	} else {
+		ok = alloc_from_pool(pool_index, requirements->size,
+				     requirements->alignment, allocation);
+	}
+	if (ok) {
+		allocation_count++;
+	}
+	pthread_mutex_unlock(&lock);
+	return ok;
+}
+
+void allocator_free(Allocation *allocation)
+{
+	if (allocation->memory == VK_NULL_HANDLE) {
+		return;
+	}
+	pthread_mutex_lock(&lock);
+	if (allocation->block == UINT32_MAX) {
+		device_free(allocation->memory, allocation->mapped);
+		dedicated_bytes -= allocation->size;
+	} else {
+		Pool *pool = &pools[allocation->pool];
+		Block *block = &pool->blocks[allocation->block];
+		uint32_t node = allocation->offset >> MIN_NODE_SHIFT;
+		block_release(block, pool->levels, node, allocation->level);
+		block->used -= allocation->size;
+		block->allocations--;
+		// Keep one empty block around so alloc/free cycles do not
+		// thrash vkAllocateMemory
+		if (block->allocations == 0 && pool->live_blocks > 1) {
+			block_destroy(pool, block);
+		}
+	}
+	allocation_count--;
+	pthread_mutex_unlock(&lock);
+	memset(allocation, 0, sizeof(*allocation));
+}
+
+void allocator_create_buffer(VkDeviceSize size, VkBufferUsageFlags usage,
+			     VkMemoryPropertyFlags required,
+			     VkMemoryPropertyFlags preferred, VkBuffer *buffer,
+			     Allocation *allocation)
+{
+	VkBufferCreateInfo bufferInfo = {
+		.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+		.size = size,
+		.usage = usage,
+		.sharingMode = VK_SHARING_MODE_EXCLUSIVE
+	};
+	allocator_create_buffer_info(&bufferInfo, required, preferred, buffer,
+				     allocation);
+}
+
+void allocator_create_buffer_info(const VkBufferCreateInfo *info,
+				  VkMemoryPropertyFlags required,
+				  VkMemoryPropertyFlags preferred,
+				  VkBuffer *buffer, Allocation *allocation)
+{
+	if (vkCreateBuffer(device, info, nullptr, buffer) != VK_SUCCESS) {
+		fprintf(stderr, "Can't create buffer");
+		exit(1);
+	}
+	VkMemoryRequirements requirements;
+	vkGetBufferMemoryRequirements(device, *buffer, &requirements);
+	if (!allocator_alloc(&requirements, required, preferred, false,
+			     allocation)) {
+		fprintf(stderr, "Can't allocate memory");
+		exit(1);
+	}
+	vkBindBufferMemory(device, *buffer, allocation->memory,
+			   allocation->offset);
+}
+
+void allocator_destroy_buffer(VkBuffer buffer, Allocation *allocation)
+{
+	vkDestroyBuffer(device, buffer, nullptr);
+	allocator_free(allocation);
+}
+
+void allocator_create_image(const VkImageCreateInfo *info,
+			    VkMemoryPropertyFlags required, VkImage *image,
+			    Allocation *allocation)
+{
+	if (vkCreateImage(device, info, nullptr, image) != VK_SUCCESS) {
+		fprintf(stderr, "Can't create image");
+		exit(1);
+	}
+	VkMemoryRequirements requirements;
+	vkGetImageMemoryRequirements(device, *image, &requirements);
+	// Optimal images live in their own pools so linear and non-linear
+	// resources never share a bufferImageGranularity page
+	if (!allocator_alloc(&requirements, required, 0,
+			     info->tiling == VK_IMAGE_TILING_OPTIMAL,
+			     allocation)) {
+		fprintf(stderr, "Can't allocate image memory");
+		exit(1);
+	}
+	vkBindImageMemory(device, *image, allocation->memory,
+			  allocation->offset);
+}
+
+void allocator_destroy_image(VkImage image, Allocation *allocation)
+{
+	vkDestroyImage(device, image, nullptr);
+	allocator_free(allocation);
+}
+
+void allocator_get_stats(AllocatorStats *stats)
+{
+	pthread_mutex_lock(&lock);
+	memset(stats, 0, sizeof(*stats));
+	stats->device_allocations = device_allocations;
+	stats->allocations = allocation_count;
+	stats->reserved_bytes = dedicated_bytes;
+	stats->used_bytes = dedicated_bytes;
+	for (uint32_t i = 0; i < POOL_COUNT; i++) {
+		const Pool *pool = &pools[i];
+		for (uint32_t b = 0; b < pool->block_count; b++) {
+			if (pool->blocks[b].memory != VK_NULL_HANDLE) {
+				stats->reserved_bytes += pool->block_size;
+				stats->used_bytes += pool->blocks[b].used;
+			}
+		}
+	}
+	pthread_mutex_unlock(&lock);
+}
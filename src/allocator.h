@@ -0,0 +1,58 @@
+#pragma once
+#include <vulkan/vulkan.h>
+
+// Device memory sub-allocator. Memory is taken from the driver in large
+// blocks per memory type and carved up with a buddy scheme, so the number
+// of vkAllocateMemory calls stays far below maxMemoryAllocationCount.
+
+typedef struct {
+	VkDeviceMemory memory;
+	VkDeviceSize offset;
+	VkDeviceSize size;
+	// Host pointer to offset, nullptr unless the memory is host visible
+	void *mapped;
+	uint32_t memory_type;
+	// Owning pool block, UINT32_MAX for dedicated allocations
+	uint32_t block;
+	uint32_t pool;
+	uint32_t level;
+} Allocation;
+
+typedef struct {
+	uint32_t device_allocations;
+	uint32_t allocations;
+	VkDeviceSize reserved_bytes;
+	VkDeviceSize used_bytes;
+} AllocatorStats;
+
+void allocator_init(VkPhysicalDevice physical_device, VkDevice device);
+void allocator_destroy();
+
+// Picks a memory type that has all of `required` and as many of
+// `preferred` as possible. Returns UINT32_MAX when none fits.
+uint32_t allocator_find_memory_type(uint32_t type_bits,
+				    VkMemoryPropertyFlags required,
+				    VkMemoryPropertyFlags preferred);
+VkMemoryPropertyFlags allocator_memory_flags(uint32_t memory_type);
+
+bool allocator_alloc(const VkMemoryRequirements *requirements,
+		     VkMemoryPropertyFlags required,
+		     VkMemoryPropertyFlags preferred, bool optimal_image,
+		     Allocation *allocation);
+void allocator_free(Allocation *allocation);
+
+void allocator_create_buffer(VkDeviceSize size, VkBufferUsageFlags usage,
+			     VkMemoryPropertyFlags required,
+			     VkMemoryPropertyFlags preferred, VkBuffer *buffer,
+			     Allocation *allocation);
+void allocator_create_buffer_info(const VkBufferCreateInfo *info,
+				  VkMemoryPropertyFlags required,
+				  VkMemoryPropertyFlags preferred,
+				  VkBuffer *buffer, Allocation *allocation);
+void allocator_destroy_buffer(VkBuffer buffer, Allocation *allocation);
+void allocator_create_image(const VkImageCreateInfo *info,
+			    VkMemoryPropertyFlags required, VkImage *image,
+			    Allocation *allocation);
+void allocator_destroy_image(VkImage image, Allocation *allocation);
+
+void allocator_get_stats(AllocatorStats *stats);
@@ -1,19 +1,46 @@
 #include "app.h"
+#include "allocator.h"
+#include "cull.h"
+#include "descriptors.h"
+#include "jobs.h"
+#include "mesh.h"
+#include "particles.h"
+#include "pipeline_cache.h"
+#include "profiler.h"
+#include "record.h"
+#include "render_queue.h"
+#include "scene.h"
+#include "shaders.h"
+#include "texture.h"
+#include "transform.h"
+#include "uniform_ring.h"
+#include "upload.h"
 #include "SDL_video.h"
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_vulkan.h>
 #include <assert.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <vulkan/vulkan.h>
 #include <vulkan/vulkan_core.h>
-#include "utils.h"
 #include <cglm/cglm.h>
 #include <time.h>
 
 #define NUM_VALIDATION_LAYERS 1
 #define NUM_DEVICE_EXTENSIONS 1
-#define NUM_DESCRIPTOR_SETS 1
 #define WIDTH 800
 #define HEIGHT 600
+#define OFFSCREEN_FORMAT VK_FORMAT_B8G8R8A8_SRGB
+// Objects one CPU culling job tests, a multiple of SCENE_CULL_BLOCK
+#define CULL_JOB_OBJECTS 8192
+// Every draw reads the one mesh's vertex and index buffers
+#define DRAW_MESH 0
+// The particles bring their own vertex stream and draw without indices
+#define DRAW_PARTICLES 1
+// Render queue index of the particle draw, which is not in the draw list
+#define DRAW_ITEM_PARTICLES UINT32_MAX
 
 #ifdef NDEBUG
 const bool enableValidationLayers = false;
@@ -34,58 +61,135 @@ VkDynamicState dynamicStates[] = { VK_DYNAMIC_STATE_VIEWPORT,
 typedef struct {
 	uint32_t graphicsFamily;
 	uint32_t presentFamily;
+	// Compute family without graphics, usually an async compute engine,
+	// else graphicsFamily
+	uint32_t computeFamily;
+	// Transfer-only family, usually a copy engine, else computeFamily
+	uint32_t transferFamily;
 } QueueFamilyIndices;
 
 typedef struct {
-	vec2 pos;
+	vec3 pos;
 	vec3 color;
 } Vertex;
 
+// Per-frame camera, per-draw data goes through DrawConstants
 typedef struct {
-	mat4 model;
 	mat4 view;
 	mat4 proj;
 } UniformBufferObject;
 
-const Vertex vertices[] = { { { -0.5f, -0.5f }, { 1.0f, 0.0f, 0.0f } },
-			    { { 0.5f, -0.5f }, { 0.0f, 1.0f, 0.0f } },
-			    { { 0.5f, 0.5f }, { 0.0f, 0.0f, 1.0f } },
-			    { { -0.5f, 0.5f }, { 1.0f, 1.0f, 1.0f } } };
+// Per-instance vertex stream, binding 1
+typedef struct {
+	mat4 model;
+} InstanceData;
 
-const size_t num_vertices = 4;
-const uint16_t indices[] = { 0, 1, 2, 2, 3, 0 };
-const size_t num_indices = 6;
+// Everything tied to a swap chain that was replaced. Frames still in flight
+// may reference it, so it lives until their fences signaled.
+typedef struct {
+	VkSwapchainKHR swap_chain;
+	VkImage *images;
+	VkImageView *image_views;
+	VkFramebuffer *framebuffers;
+	VkSemaphore *present_semaphores;
+	uint32_t image_count;
+	// The depth buffer matches the swap chain's extent
+	VkImage depth_image;
+	VkImageView depth_view;
+	Allocation depth_allocation;
+	// Value of frames_submitted when it was replaced
+	uint64_t retired_at;
+} RetiredSwapChain;
+
+#define MAX_RETIRED_SWAP_CHAINS 8
 
-VkVertexInputAttributeDescription attributeDescriptions[2];
-static VkVertexInputBindingDescription vert_get_binding_description()
-{
-	VkVertexInputBindingDescription bindingDescription = {};
-	bindingDescription.binding = 0;
-	bindingDescription.stride = sizeof(Vertex);
-	bindingDescription.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+typedef struct {
+	VkCommandBuffer command_buffer;
+	VkSemaphore image_available_semaphore;
+	VkFence in_flight_fence;
+	// Dynamic offset of this frame's UniformBufferObject in the ring
+	uint32_t uniform_offset;
+	// This slot's copy of the instance stream and the generation it holds
+	InstanceData *instance_mapped;
+	uint64_t instance_generation;
+	VkBuffer readback_buffer;
+	Allocation readback_allocation;
+	// Material textures as of this frame, from the slot's descriptor chain
+	VkDescriptorSet material_set;
+	// GPU culling on the async compute queue, reused once the slot's
+	// fence signaled since the graphics submission waits on it
+	VkCommandBuffer compute_command_buffer;
+	VkSemaphore cull_finished_semaphore;
+} FrameData;
+
+// Drawn when no mesh file is given
+const Vertex quad_vertices[] = {
+	{ { -0.5f, -0.5f, 0.0f }, { 1.0f, 0.0f, 0.0f } },
+	{ { 0.5f, -0.5f, 0.0f }, { 0.0f, 1.0f, 0.0f } },
+	{ { 0.5f, 0.5f, 0.0f }, { 0.0f, 0.0f, 1.0f } },
+	{ { -0.5f, 0.5f, 0.0f }, { 1.0f, 1.0f, 1.0f } }
+};
+const uint16_t quad_indices[] = { 0, 1, 2, 2, 3, 0 };
 
-	return bindingDescription;
+// Mesh bytes handed to the upload path per frame while streaming
+#define MESH_STREAM_BUDGET (8ull << 20)
+// Squares of the texture used when no texture file is given
+#define CHECKER_SIZE 256
+#define CHECKER_SQUARES 8
+
+VkVertexInputBindingDescription bindingDescriptions[2];
+VkVertexInputAttributeDescription attributeDescriptions[6];
+static VkVertexInputBindingDescription *vert_get_binding_description()
+{
+	bindingDescriptions[0].binding = 0;
+	bindingDescriptions[0].stride = sizeof(Vertex);
+	bindingDescriptions[0].inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+
+	bindingDescriptions[1].binding = 1;
+	bindingDescriptions[1].stride = sizeof(InstanceData);
+	bindingDescriptions[1].inputRate = VK_VERTEX_INPUT_RATE_INSTANCE;
+	return bindingDescriptions;
 }
 static VkVertexInputAttributeDescription *vert_get_attributes_description()
 {
 	attributeDescriptions[0].binding = 0;
 	attributeDescriptions[0].location = 0;
-	attributeDescriptions[0].format = VK_FORMAT_R32G32_SFLOAT;
+	attributeDescriptions[0].format = VK_FORMAT_R32G32B32_SFLOAT;
 	attributeDescriptions[0].offset = offsetof(Vertex, pos);
 
 	attributeDescriptions[1].binding = 0;
 	attributeDescriptions[1].location = 1;
 	attributeDescriptions[1].format = VK_FORMAT_R32G32B32_SFLOAT;
 	attributeDescriptions[1].offset = offsetof(Vertex, color);
+
+	// A mat4 attribute takes one location per column
+	for (uint32_t i = 0; i < 4; i++) {
+		attributeDescriptions[2 + i].binding = 1;
+		attributeDescriptions[2 + i].location = 2 + i;
+		attributeDescriptions[2 + i].format =
+			VK_FORMAT_R32G32B32A32_SFLOAT;
+		attributeDescriptions[2 + i].offset =
+			offsetof(InstanceData, model) + i * sizeof(vec4);
+	}
 	return attributeDescriptions;
 }
 static SDL_Window *window;
+static bool headless;
+static uint32_t frame_count;
+static const char *readback_path;
+static const char *trace_path;
+static AppStats *stats;
 static VkInstance instance;
 static VkPhysicalDevice physical_device;
 static VkDevice device;
 static VkQueue graphics_queue;
 static VkSurfaceKHR surface;
 static VkQueue present_queue;
+static VkQueue transfer_queue;
+static VkQueue compute_queue;
+// GPU culling runs on compute_queue, concurrently with rendering
+static bool async_compute;
+static VkCommandPool compute_command_pool;
 static VkSwapchainKHR swap_chain;
 static VkImage *swap_chain_images;
 static uint32_t swap_chain_image_count;
@@ -93,24 +197,138 @@ static VkFramebuffer *swapChainFramebuffers;
 static VkFormat swap_chain_image_format;
 static VkExtent2D swap_chain_extent;
 static VkImageView *swap_chain_image_views;
+// present_semaphores[i] is signaled by the frame rendering into image i and
+// waited on by its present. They belong to images rather than frame slots:
+// a slot comes around again while its last present may still be waiting.
+static VkSemaphore *present_semaphores;
+static PresentMode present_mode;
+// Picked for the first swap chain and kept, the render pass depends on it
+static VkSurfaceFormatKHR surface_format;
+// Set by window events, the swap chain is recreated before the next frame
+static bool framebuffer_resized;
+static RetiredSwapChain retired_swap_chains[MAX_RETIRED_SWAP_CHAINS];
+static uint32_t retired_swap_chain_count;
+static uint64_t frames_submitted;
+static Allocation *offscreen_image_allocations;
+// Shared by every framebuffer. Render passes run in submission order and
+// the subpass dependency orders one frame's depth writes after the last's.
+static VkFormat depth_format;
+static VkImage depth_image;
+static VkImageView depth_view;
+static Allocation depth_allocation;
+// Draw the visible draws depth only first, then shade with an EQUAL test
+// so every pixel is shaded once
+static bool depth_prepass;
+static VkPipeline depth_pipeline;
+// Simulated on the GPU and drawn after the opaque passes, 0 disables them
+static uint32_t particle_count;
+static VkPipeline particle_pipeline;
+// Draws read resources through the bindless set, bound once per command
+// buffer next to the frame's uniforms
+static bool bindless;
 static VkPipelineLayout pipeline_layout;
 static VkRenderPass render_pass;
 static VkDescriptorSetLayout descriptorSetLayout;
 static VkPipeline graphics_pipeline;
+static const char *pipeline_cache_path;
+// Shared by every pipeline creation
+static VkPipelineCache pipeline_cache;
 static VkCommandPool command_pool;
-static VkCommandBuffer command_buffer;
-static VkSemaphore image_available_semaphore;
-static VkSemaphore render_finished_semaphore;
-static VkFence in_flight_fence;
+static FrameData frames[MAX_FRAMES_IN_FLIGHT];
+static uint32_t frames_in_flight = DEFAULT_FRAMES_IN_FLIGHT;
+static uint32_t current_frame;
 static VkBuffer vertexBuffer;
-static VkDeviceMemory vertexBufferMemory;
+static Allocation vertexBufferAllocation;
 static VkBuffer indexBuffer;
-static VkDeviceMemory indexBufferMemory;
-static VkBuffer uniformBuffer;
-static VkDeviceMemory uniformBufferMemory;
-static VkDescriptorPool descriptorPool;
-static VkDescriptorSet descriptorSets[NUM_DESCRIPTOR_SETS];
-static void *uniformBufferMapped;
+static Allocation indexBufferAllocation;
+static const char *mesh_path;
+static Mesh mesh;
+static const char *texture_path;
+static VkDeviceSize texture_budget;
+// Every submesh uses the one material so far, textured with this
+static TextureId material_texture = TEXTURE_NONE;
+// Set 1 without bindless descriptors, the material's texture
+static VkDescriptorSetLayout materialSetLayout;
+// Geometry is drawn only once the mesh is fully streamed and the upload
+// carrying its last chunk has finished
+static bool mesh_streamed;
+static UploadTicket geometry_ticket;
+static bool geometry_ready;
+// One draw per submesh, split across the record workers when there are any
+static DrawCommand *draw_list;
+static uint32_t draw_count;
+static uint32_t record_threads;
+static uint32_t job_threads;
+static bool gpu_culling;
+// vkCmdDrawIndexedIndirectCountKHR when VK_KHR_draw_indirect_count is there
+static PFN_vkCmdDrawIndexedIndirectCount draw_indirect_count;
+static bool multi_draw_indirect;
+// Frustum of the current frame in the space the instance transforms use
+static vec4 frustum_planes[6];
+// Swap chain extent the cached projection was built for, zero until the
+// first frame
+static VkExtent2D camera_extent;
+static mat4 camera_view;
+static mat4 camera_proj;
+static mat4 camera_view_proj;
+// Scene objects that passed CPU culling this frame. Object
+// i * instance_count + j is instance j of draw i.
+static uint32_t *visible_ids;
+static uint32_t visible_count;
+// CPU culling runs as one job per block of objects, each block writes its
+// ids at its own offset in visible_ids and queues them at that offset
+static uint32_t cull_block_count;
+static uint32_t *cull_block_visible;
+static uint32_t *cull_block_offset;
+// Pipelines draws are queued with, the sort key holds the index
+typedef enum {
+	DRAW_PIPELINE_COLOR,
+	DRAW_PIPELINE_DEPTH,
+	DRAW_PIPELINE_PARTICLES
+} DrawPipeline;
+// This frame's render queue while the cull jobs fill it in, one item per
+// visible draw and pass
+static RenderItem *queue_items;
+// The visible draws in queue order with the key each was queued with:
+// by pass, then state, then front to back so early depth testing rejects
+// as much as it can
+static DrawCommand *queued_draws;
+static uint64_t *queued_keys;
+static uint32_t queued_count;
+// View depth of a point p in object space is dot(axis, (p, 1))
+static vec4 depth_axis;
+// Levels of detail: a draw uses the coarsest level whose error projects to
+// less than lod_pixel_error pixels. Disabled levels leave lod_levels at 1.
+static float lod_pixel_error;
+static uint32_t lod_levels = 1;
+// Object space error allowed per unit of view depth this frame, for an
+// object the instances don't scale
+static float lod_error_per_depth;
+// Level each visible scene object was queued with this frame
+static uint8_t *object_lods;
+// Bounding sphere of every draw's submesh, scene objects place it under
+// their instance's transform
+static vec4 *draw_spheres;
+// Binds of the frame being recorded, summed over the record jobs
+static atomic_uint frame_draws;
+static atomic_uint frame_binds;
+static atomic_uint frame_binds_skipped;
+static uint32_t instance_count = 1;
+// CPU side instance stream, copied into a frame slot whenever the slot
+// holds an older generation
+static InstanceData *instances;
+static uint64_t instance_generation;
+// Transform nodes: the animated model root, and under a static layout root
+// one node per instance, instance i being first_instance_node + i
+static uint32_t model_node;
+static uint32_t first_instance_node;
+static VkBuffer instanceBuffer;
+static Allocation instanceBufferAllocation;
+// Shared by all frame slots, they differ in the dynamic offset only
+static VkDescriptorSet descriptorSet;
+// Seconds between the starts of the last two frames, drives the animation
+// and the particle simulation
+static float frame_delta;
 static void app_init_window();
 static void app_init_vulkan();
 static void app_main_loop();
@@ -124,25 +342,116 @@ static QueueFamilyIndices vk_find_queue_families(VkPhysicalDevice device);
 static void vk_create_logical_device();
 static void vk_create_surface();
 static void vk_create_swap_chain();
+static bool vk_recreate_swap_chain();
+static void vk_destroy_retired_swap_chains(bool all);
+static VkPresentModeKHR vk_choose_present_mode();
+static void vk_create_offscreen_targets();
+static void vk_create_readback_buffers();
+static void vk_write_readback(const FrameData *frame, const char *path);
 static void vk_create_image_views();
+static VkFormat vk_find_depth_format();
+static void vk_create_depth_resources();
 static void vk_create_graphics_pipeline();
+static void
+vk_create_particle_pipeline(const VkGraphicsPipelineCreateInfo *base);
 static void vk_create_render_pass();
 static void vk_create_framebuffers();
 static void vk_create_command_pool();
-static void vk_create_command_buffer();
+static void vk_create_command_buffers();
 static void vk_create_sync_objects();
+static void vk_load_mesh();
+static void vk_stream_mesh();
+static void vk_load_texture();
+static void vk_update_materials();
+static void vk_write_material_set(FrameData *frame);
 static void vk_create_vertex_buffer();
 static void vk_create_index_buffer();
-static void vk_create_uniform_buffer();
+static void vk_create_instance_buffer();
+static void update_instance_buffer(FrameData *frame);
+static void vk_update_transforms();
+static void vk_update_camera();
 static void vk_record_command_buffer(VkCommandBuffer commandBuffer,
 				     uint32_t imageIndex);
+static void vk_record_draws(VkCommandBuffer commandBuffer, uint32_t first,
+			    uint32_t count, void *user);
+static void vk_record_particles(VkCommandBuffer commandBuffer,
+				const FrameData *frame);
+static void vk_cmd_draw(VkCommandBuffer commandBuffer,
+			const DrawCommand *draw);
+static uint32_t vk_draw_pass_count();
+static DrawPipeline vk_draw_pass_pipeline(uint32_t pass);
+static VkPipeline vk_draw_pipeline(DrawPipeline pipeline);
+static void vk_cmd_set_viewport(VkCommandBuffer commandBuffer);
+static void vk_cmd_bind_material(VkCommandBuffer commandBuffer,
+				 const FrameData *frame, uint32_t material);
+static void vk_cmd_bind_mesh(VkCommandBuffer commandBuffer, uint32_t meshId,
+			     VkBuffer instanceStream,
+			     VkDeviceSize instanceOffset);
+static void vk_bind_draw_state(VkCommandBuffer commandBuffer,
+			       const FrameData *frame, VkPipeline pipeline,
+			       VkBuffer instanceStream,
+			       VkDeviceSize instanceOffset);
+static void vk_build_draw_list();
+static void vk_create_cull_objects();
+static void vk_create_scene_objects();
+static void vk_submesh_sphere(uint32_t submesh, vec4 sphere);
+static void vk_cull_draws();
+static uint32_t vk_select_lod(uint32_t draw, float depth, float scale);
+static void vk_update_scene_object(uint32_t object);
+static void vk_submit_cull(FrameData *frame,
+			   const VkSemaphore *uploadSemaphores,
+			   uint32_t uploadCount);
+static bool vk_has_device_extension(const char *name);
 static void vk_draw_frame();
-static void update_uniform_buffer();
+static void vk_end_frame(uint64_t frameStart, uint64_t submitStart,
+			 uint64_t submitEnd);
+static void update_uniform_buffer(FrameData *frame);
 static void vk_create_descriptor_set_layout();
-static void vk_create_descriptor_pool();
 static void vk_create_descriptor_sets();
-void app_run()
+void app_run(const AppConfig *config)
 {
+	if (config->frames_in_flight < 1 ||
+	    config->frames_in_flight > MAX_FRAMES_IN_FLIGHT) {
+		fprintf(stderr, "frames in flight must be between 1 and %d\n",
+			MAX_FRAMES_IN_FLIGHT);
+		exit(1);
+	}
+	if (config->record_threads > MAX_RECORD_THREADS) {
+		fprintf(stderr, "at most %d record threads\n",
+			MAX_RECORD_THREADS);
+		exit(1);
+	}
+	if (config->instance_count < 1) {
+		fprintf(stderr, "instance count must be at least 1\n");
+		exit(1);
+	}
+	frames_in_flight = config->frames_in_flight;
+	headless = config->headless;
+	present_mode = config->present_mode;
+	frame_count = config->frame_count;
+	readback_path = config->readback_path;
+	mesh_path = config->mesh_path;
+	texture_path = config->texture_path;
+	texture_budget = config->texture_budget;
+	instance_count = config->instance_count;
+	record_threads = config->record_threads;
+	job_threads = config->job_threads;
+	gpu_culling = config->gpu_culling;
+	depth_prepass = config->depth_prepass;
+	bindless = config->bindless;
+	particle_count = config->particle_count;
+	lod_pixel_error = config->lod_pixel_error;
+	pipeline_cache_path = config->pipeline_cache_path;
+	trace_path = config->trace_path;
+	stats = config->stats;
+	if (headless && frame_count == 0) {
+		fprintf(stderr, "headless mode needs a frame count\n");
+		exit(1);
+	}
+	if (!headless && readback_path != nullptr) {
+		fprintf(stderr, "readback is only available in headless mode\n");
+		exit(1);
+	}
 	app_init_window();
 	app_init_vulkan();
 	app_main_loop();
@@ -151,109 +460,103 @@ void app_run()
 
 void app_init_window()
 {
+	if (headless) {
+		return;
+	}
 	SDL_Init(SDL_INIT_EVERYTHING);
 	window = SDL_CreateWindow("my test window", SDL_WINDOWPOS_CENTERED,
 				  SDL_WINDOWPOS_CENTERED, WIDTH, HEIGHT,
-				  SDL_WINDOW_VULKAN | SDL_WINDOW_SHOWN);
+				  SDL_WINDOW_VULKAN | SDL_WINDOW_SHOWN |
+					  SDL_WINDOW_RESIZABLE);
 }
 
 void app_init_vulkan()
 {
+	jobs_init(job_threads);
+	printf("Job system running on %u threads\n", jobs_thread_count());
 	vk_create_instance();
-	vk_create_surface();
+	if (!headless) {
+		vk_create_surface();
+	}
 	vk_pick_physical_device();
 	vk_create_logical_device();
-	vk_create_swap_chain();
+	allocator_init(physical_device, device);
+	descriptors_init(physical_device, device, frames_in_flight, bindless);
+	profiler_init(physical_device, device,
+		      vk_find_queue_families(physical_device).graphicsFamily,
+		      frames_in_flight);
+	if (headless) {
+		vk_create_offscreen_targets();
+	} else {
+		vk_create_swap_chain();
+	}
 	vk_create_image_views();
+	depth_format = vk_find_depth_format();
+	vk_create_depth_resources();
 	vk_create_render_pass();
-	vk_create_uniform_buffer();
+	uniform_ring_init(physical_device, frames_in_flight);
+	vk_create_instance_buffer();
 	vk_create_descriptor_set_layout();
-	vk_create_descriptor_pool();
 	vk_create_descriptor_sets();
+	pipeline_cache = pipeline_cache_init(physical_device, device,
+					     pipeline_cache_path);
+	struct timespec pipelineStart, pipelineEnd;
+	clock_gettime(CLOCK_MONOTONIC, &pipelineStart);
 	vk_create_graphics_pipeline();
+	clock_gettime(CLOCK_MONOTONIC, &pipelineEnd);
+	printf("Pipelines created in %.2f ms (%s cache)\n",
+	       (pipelineEnd.tv_sec - pipelineStart.tv_sec) * 1e3 +
+		       (pipelineEnd.tv_nsec - pipelineStart.tv_nsec) / 1e6,
+	       pipeline_cache_warm() ? "warm" : "cold");
 	vk_create_framebuffers();
 	vk_create_command_pool();
+	QueueFamilyIndices indices = vk_find_queue_families(physical_device);
+	upload_init(physical_device, device, indices.transferFamily,
+		    transfer_queue, indices.graphicsFamily,
+		    indices.computeFamily);
+	texture_init(physical_device, device, frames_in_flight,
+		     texture_budget);
+	if (particle_count > 0) {
+		particles_init(device, pipeline_cache, particle_count);
+	}
+	vk_load_texture();
+	vk_load_mesh();
 	vk_create_vertex_buffer();
 	vk_create_index_buffer();
-	vk_create_command_buffer();
-	vk_create_sync_objects();
-}
-
-void vk_create_buffer(VkDevice device, VkBuffer *buffer, VkDeviceMemory *memory,
-		      size_t size, VkBufferUsageFlagBits usage)
-{
-	VkBufferCreateInfo bufferInfo = {};
-	bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-	bufferInfo.size = size;
-	bufferInfo.usage = usage;
-	bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-	if (vkCreateBuffer(device, &bufferInfo, nullptr, buffer) !=
-	    VK_SUCCESS) {
-		fprintf(stderr, "Can't create buffer");
-		exit(1);
+	vk_build_draw_list();
+	if (gpu_culling) {
+		vk_create_cull_objects();
+	} else {
+		vk_create_scene_objects();
 	}
-	VkMemoryAllocateInfo allocInfo = {};
-	allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-	allocInfo.allocationSize = size;
-	allocInfo.memoryTypeIndex = 0;
-	if (vkAllocateMemory(device, &allocInfo, nullptr, memory) !=
-	    VK_SUCCESS) {
-		fprintf(stderr, "Can't allocate memory");
-		exit(1);
+	if (record_threads > 0 && !gpu_culling) {
+		record_init(device, indices.graphicsFamily, record_threads,
+			    frames_in_flight);
 	}
-	vkBindBufferMemory(device, *buffer, *memory, 0);
-}
-void vk_create_mapped_buffer(VkDevice device, void *src, VkBuffer *buffer,
-			     VkDeviceMemory *memory, size_t size,
-			     VkBufferUsageFlagBits usage)
-{
-	vk_create_buffer(device, buffer, memory, size, usage);
-	void *data;
-	vkMapMemory(device, *memory, 0, size, 0, &data);
-	memcpy(data, src, (size_t)size);
-	vkUnmapMemory(device, *memory);
-}
-
-void vk_create_descriptor_pool()
-{
-	VkDescriptorPoolSize poolSize = {};
-	poolSize.type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-	poolSize.descriptorCount = 1;
-	VkDescriptorPoolCreateInfo poolInfo = {};
-	poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
-	poolInfo.poolSizeCount = 1;
-	poolInfo.pPoolSizes = &poolSize;
-	poolInfo.maxSets = NUM_DESCRIPTOR_SETS;
-
-	if (vkCreateDescriptorPool(device, &poolInfo, nullptr,
-				   &descriptorPool) != VK_SUCCESS) {
-		fprintf(stderr, "Can't create Descriptor pool");
-		exit(1);
+	vk_create_command_buffers();
+	vk_create_sync_objects();
+	if (readback_path != nullptr) {
+		vk_create_readback_buffers();
 	}
 }
+
 void vk_create_descriptor_sets()
 {
-	VkDescriptorSetLayout layouts[] = { descriptorSetLayout };
-	VkDescriptorSetAllocateInfo allocInfo = {};
-	allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
-	allocInfo.descriptorPool = descriptorPool;
-	allocInfo.descriptorSetCount = NUM_DESCRIPTOR_SETS;
-	allocInfo.pSetLayouts = layouts;
-	if (vkAllocateDescriptorSets(device, &allocInfo, descriptorSets) !=
-	    VK_SUCCESS) {
-		fprintf(stderr, "Can't create descriptor sets");
-		exit(1);
-	}
+	descriptorSet = descriptors_allocate(descriptorSetLayout);
+
+	// The whole ring is visible through one window the size of a
+	// UniformBufferObject, moved by the dynamic offset at bind time
 	VkDescriptorBufferInfo bufferInfo = {};
-	bufferInfo.buffer = uniformBuffer;
+	bufferInfo.buffer = uniform_ring_buffer();
 	bufferInfo.offset = 0;
 	bufferInfo.range = sizeof(UniformBufferObject);
 	VkWriteDescriptorSet descriptorWrite = {};
 	descriptorWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-	descriptorWrite.dstSet = descriptorSets[0];
+	descriptorWrite.dstSet = descriptorSet;
 	descriptorWrite.dstBinding = 0;
 	descriptorWrite.dstArrayElement = 0;
-	descriptorWrite.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+	descriptorWrite.descriptorType =
+		VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
 	descriptorWrite.descriptorCount = 1;
 	descriptorWrite.pBufferInfo = &bufferInfo;
 	descriptorWrite.pImageInfo = nullptr; // Optional
@@ -264,44 +567,475 @@ void vk_create_descriptor_set_layout()
 {
 	VkDescriptorSetLayoutBinding uboLayoutBinding = {};
 	uboLayoutBinding.binding = 0;
-	uboLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+	uboLayoutBinding.descriptorType =
+		VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
 	uboLayoutBinding.descriptorCount = 1;
 	uboLayoutBinding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
 	VkDescriptorSetLayoutCreateInfo layoutInfo = {};
 	layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
 	layoutInfo.bindingCount = 1;
 	layoutInfo.pBindings = &uboLayoutBinding;
+	descriptorSetLayout = descriptors_layout(&layoutInfo);
+
+	if (!bindless) {
+		VkDescriptorSetLayoutBinding textureBinding = {
+			.binding = 0,
+			.descriptorType =
+				VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+			.descriptorCount = 1,
+			.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT
+		};
+		layoutInfo.pBindings = &textureBinding;
+		materialSetLayout = descriptors_layout(&layoutInfo);
+	}
+}
 
-	if (vkCreateDescriptorSetLayout(device, &layoutInfo, nullptr,
-					&descriptorSetLayout) != VK_SUCCESS) {
-		fprintf(stderr, "Can't create descriptor set layout");
+// Lays the instances out on a square grid in the z = 0 plane, scaled so the
+// whole grid covers the area of a single mesh
+void vk_create_instance_buffer()
+{
+	instances = malloc(sizeof(InstanceData) * instance_count);
+	if (instances == nullptr) {
+		fprintf(stderr, "Can't allocate %u instances", instance_count);
 		exit(1);
 	}
+	uint32_t side = 1;
+	while ((uint64_t)side * side < instance_count) {
+		side++;
+	}
+	float spacing = 1.0f / side;
+	mat4 identity = GLM_MAT4_IDENTITY_INIT;
+	transform_init(instance_count + 2);
+	model_node = transform_add(TRANSFORM_NONE, identity);
+	uint32_t layoutNode = transform_add(TRANSFORM_NONE, identity);
+	first_instance_node = transform_count();
+	for (uint32_t i = 0; i < instance_count; i++) {
+		vec3 position = { ((i % side) - (side - 1) * 0.5f) * spacing,
+				  ((i / side) - (side - 1) * 0.5f) * spacing,
+				  0.0f };
+		mat4 placement;
+		glm_translate_make(placement, position);
+		glm_scale_uni(placement, spacing);
+		transform_add(layoutNode, placement);
+	}
+	// Fills `instances`, the culling setup reads them before the first
+	// frame
+	vk_update_transforms();
+	printf("Composing transforms with the %s kernel\n", transform_kernel());
+
+	VkDeviceSize slotSize = sizeof(InstanceData) * instance_count;
+	allocator_create_buffer(slotSize * frames_in_flight,
+				VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+				VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+					VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+				VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+				&instanceBuffer, &instanceBufferAllocation);
+	for (uint32_t i = 0; i < frames_in_flight; i++) {
+		frames[i].instance_mapped =
+			(InstanceData *)((char *)instanceBufferAllocation.mapped +
+					 i * slotSize);
+		frames[i].instance_generation = 0;
+	}
+}
+void vk_load_mesh()
+{
+	if (mesh_path == nullptr) {
+		mesh_from_memory(&mesh, quad_vertices, 4, sizeof(Vertex),
+				 quad_indices, 6, sizeof(uint16_t));
+		return;
+	}
+	if (!mesh_open(mesh_path, &mesh)) {
+		exit(1);
+	}
+	if (mesh.header.vertex_stride != sizeof(Vertex)) {
+		fprintf(stderr, "%s: vertex stride %u, expected %zu\n",
+			mesh_path, mesh.header.vertex_stride, sizeof(Vertex));
+		exit(1);
+	}
+}
+// Feeds the next chunk of the mesh to the upload path, called once a frame
+// so a large mesh streams in while frames keep being presented
+void vk_stream_mesh()
+{
+	if (!mesh_streamed) {
+		mesh_streamed = mesh_stream(&mesh, vertexBuffer, indexBuffer,
+					    MESH_STREAM_BUDGET);
+		geometry_ticket = upload_flush();
+	} else if (!geometry_ready) {
+		geometry_ready = upload_is_visible(geometry_ticket);
+	}
+}
+// The texture decodes in the background, white until its first levels
+// arrive
+void vk_load_texture()
+{
+	if (texture_path != nullptr) {
+		material_texture = texture_load(texture_path);
+		return;
+	}
+	uint8_t *pixels = malloc(CHECKER_SIZE * CHECKER_SIZE * 4);
+	if (pixels == nullptr) {
+		fprintf(stderr, "Can't allocate the checker texture");
+		exit(1);
+	}
+	uint32_t square = CHECKER_SIZE / CHECKER_SQUARES;
+	for (uint32_t y = 0; y < CHECKER_SIZE; y++) {
+		for (uint32_t x = 0; x < CHECKER_SIZE; x++) {
+			bool light = (x / square + y / square) % 2;
+			uint8_t value = light ? 255 : 160;
+			uint8_t *texel = pixels + (y * CHECKER_SIZE + x) * 4;
+			texel[0] = texel[1] = texel[2] = value;
+			texel[3] = 255;
+		}
+	}
+	material_texture = texture_create(CHECKER_SIZE, CHECKER_SIZE, pixels);
+	free(pixels);
+}
+// With bindless descriptors a draw's material is the image slot its
+// fragments index, which moves whenever the texture gains or loses levels
+void vk_update_materials()
+{
+	uint32_t material = bindless ? texture_slot(material_texture) : 0;
+	for (uint32_t i = 0; i < draw_count; i++) {
+		draw_list[i].constants.material = material;
+	}
+}
+// Without bindless descriptors every frame gets a set pointing at the
+// texture's current view, views of earlier frames stay valid until their
+// slot's fence signaled
+void vk_write_material_set(FrameData *frame)
+{
+	frame->material_set =
+		descriptors_allocate_frame(current_frame, materialSetLayout);
+	VkDescriptorImageInfo imageInfo = {
+		.sampler = texture_sampler(),
+		.imageView = texture_view(material_texture),
+		.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL
+	};
+	VkWriteDescriptorSet write = {
+		.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+		.dstSet = frame->material_set,
+		.dstBinding = 0,
+		.descriptorCount = 1,
+		.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+		.pImageInfo = &imageInfo
+	};
+	vkUpdateDescriptorSets(device, 1, &write, 0, nullptr);
+}
+void vk_build_draw_list()
+{
+	draw_count = mesh.header.submesh_count;
+	lod_levels = lod_pixel_error > 0.0f ? mesh_lod_count(&mesh) : 1;
+	if (lod_levels > 1) {
+		printf("Selecting among %u levels of detail at %.2f pixels\n",
+		       lod_levels, lod_pixel_error);
+	}
+	draw_list = malloc(sizeof(DrawCommand) * draw_count);
+	if (draw_list == nullptr) {
+		fprintf(stderr, "Can't allocate draw list");
+		exit(1);
+	}
+	for (uint32_t i = 0; i < draw_count; i++) {
+		draw_list[i] = (DrawCommand){
+			.index_count = mesh.submeshes[i].index_count,
+			.instance_count = instance_count,
+			.first_index = mesh.submeshes[i].first_index,
+			.vertex_offset = mesh.submeshes[i].vertex_offset
+		};
+		// Later changes arrive through vk_update_transforms
+		transform_get_world(model_node, draw_list[i].constants.model);
+	}
+	vk_update_materials();
+}
+// One object per submesh and instance, bounded by a sphere around the
+// submesh's box. Object i is drawn with firstInstance i, so its transform is
+// element i of the transform buffer.
+void vk_create_cull_objects()
+{
+	if ((uint64_t)draw_count * instance_count > UINT32_MAX) {
+		fprintf(stderr, "Too many objects to cull");
+		exit(1);
+	}
+	uint32_t objectCount = draw_count * instance_count;
+	CullObject *objects = malloc(sizeof(CullObject) * objectCount);
+	mat4 *transforms = malloc(sizeof(mat4) * objectCount);
+	MeshLod *lods = malloc(sizeof(MeshLod) * draw_count * lod_levels);
+	if (objects == nullptr || transforms == nullptr || lods == nullptr) {
+		fprintf(stderr, "Can't allocate %u cull objects", objectCount);
+		exit(1);
+	}
+	for (uint32_t i = 0; i < draw_count; i++) {
+		vec4 sphere;
+		vk_submesh_sphere(i, sphere);
+		for (uint32_t level = 0; level < lod_levels; level++) {
+			lods[i * lod_levels + level] =
+				mesh_lod(&mesh, i, level);
+		}
+		for (uint32_t j = 0; j < instance_count; j++) {
+			uint32_t object = i * instance_count + j;
+			objects[object] = (CullObject){
+				.first_index = draw_list[i].first_index,
+				.index_count = draw_list[i].index_count,
+				.vertex_offset = draw_list[i].vertex_offset,
+				.first_lod = i * lod_levels
+			};
+			glm_vec4_copy(sphere, objects[object].sphere);
+			glm_mat4_copy(instances[j].model, transforms[object]);
+		}
+	}
+	QueueFamilyIndices indices = vk_find_queue_families(physical_device);
+	cull_init(physical_device, device, pipeline_cache, frames_in_flight,
+		  objects, transforms, objectCount, lods, draw_count,
+		  lod_levels, draw_indirect_count, multi_draw_indirect,
+		  async_compute ? indices.computeFamily :
+				  indices.graphicsFamily,
+		  indices.graphicsFamily);
+	free(objects);
+	free(transforms);
+	free(lods);
+}
+// Sphere around the box of a submesh, in the space of its vertices
+void vk_submesh_sphere(uint32_t submesh, vec4 sphere)
+{
+	vec3 min = {}, max = {};
+	glm_vec4_zero(sphere);
+	if (mesh_submesh_bounds(&mesh, submesh, min, max)) {
+		glm_vec3_center(min, max, sphere);
+		sphere[3] = glm_vec3_distance(min, max) * 0.5f;
+	}
 }
 
-void vk_create_uniform_buffer()
+// One scene object per draw and instance, so culling, depth sorting and
+// levels of detail all work per instance
+void vk_create_scene_objects()
 {
-	VkDeviceSize bufferSize = sizeof(UniformBufferObject);
+	if ((uint64_t)draw_count * instance_count > UINT32_MAX) {
+		fprintf(stderr, "Too many objects to cull");
+		exit(1);
+	}
+	uint32_t objectCount = draw_count * instance_count;
+	draw_spheres = malloc(sizeof(vec4) * draw_count);
+	if (draw_spheres == nullptr) {
+		fprintf(stderr, "Can't allocate %u bounding spheres",
+			draw_count);
+		exit(1);
+	}
+	for (uint32_t i = 0; i < draw_count; i++) {
+		vk_submesh_sphere(i, draw_spheres[i]);
+	}
+	scene_init(objectCount);
+	for (uint32_t object = 0; object < objectCount; object++) {
+		scene_add((vec3){}, 0.0f);
+		vk_update_scene_object(object);
+	}
+	uint32_t queueCapacity =
+		objectCount * vk_draw_pass_count() + (particle_count > 0);
+	render_queue_init(queueCapacity);
+	visible_ids = malloc(sizeof(uint32_t) * objectCount);
+	object_lods = calloc(objectCount, sizeof(uint8_t));
+	queued_draws = malloc(sizeof(DrawCommand) * queueCapacity);
+	queued_keys = malloc(sizeof(uint64_t) * queueCapacity);
+	cull_block_count =
+		(objectCount + CULL_JOB_OBJECTS - 1) / CULL_JOB_OBJECTS;
+	cull_block_visible = malloc(sizeof(uint32_t) * cull_block_count);
+	cull_block_offset = malloc(sizeof(uint32_t) * cull_block_count);
+	if (visible_ids == nullptr || object_lods == nullptr ||
+	    queued_draws == nullptr ||
+	    queued_keys == nullptr || cull_block_visible == nullptr ||
+	    cull_block_offset == nullptr) {
+		fprintf(stderr, "Can't allocate visibility lists");
+		exit(1);
+	}
+	printf("CPU culling %u objects with the %s kernel\n", objectCount,
+	       scene_cull_kernel());
+}
 
-	vk_create_buffer(device, &uniformBuffer, &uniformBufferMemory,
-			 bufferSize, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT);
+// Places the object's submesh sphere under its instance's transform. The
+// radius grows with the transform's largest axis scale.
+void vk_update_scene_object(uint32_t object)
+{
+	vec4 *sphere = &draw_spheres[object / instance_count];
+	mat4 *model = &instances[object % instance_count].model;
+	vec3 center;
+	glm_mat4_mulv3(*model, *sphere, 1.0f, center);
+	float scale = glm_max(glm_vec3_norm((*model)[0]),
+			      glm_max(glm_vec3_norm((*model)[1]),
+				      glm_vec3_norm((*model)[2])));
+	scene_set_bounds(object, center, (*sphere)[3] * scale);
+}
+
+static void vk_cull_blocks(void *data, uint32_t begin, uint32_t end)
+{
+	(void)data;
+	for (uint32_t block = begin; block < end; block++) {
+		uint32_t first = block * CULL_JOB_OBJECTS;
+		cull_block_visible[block] =
+			scene_cull_range(frustum_planes, first,
+					 first + CULL_JOB_OBJECTS,
+					 visible_ids + first);
+	}
+}
+
+static void vk_queue_blocks(void *data, uint32_t begin, uint32_t end)
+{
+	(void)data;
+	uint32_t passCount = vk_draw_pass_count();
+	for (uint32_t block = begin; block < end; block++) {
+		const uint32_t *ids = visible_ids + block * CULL_JOB_OBJECTS;
+		RenderItem *out =
+			queue_items + cull_block_offset[block] * passCount;
+		for (uint32_t i = 0; i < cull_block_visible[block]; i++) {
+			vec3 center;
+			float radius;
+			scene_get_bounds(ids[i], center, &radius);
+			float depth = glm_vec3_dot(depth_axis, center) +
+				      depth_axis[3];
+			uint32_t drawIndex = ids[i] / instance_count;
+			vec4 *sphere = &draw_spheres[drawIndex];
+			float scale = (*sphere)[3] > 0.0f ?
+					      radius / (*sphere)[3] :
+					      1.0f;
+			object_lods[ids[i]] = vk_select_lod(
+				drawIndex, depth - radius, scale);
+			const DrawCommand *draw = &draw_list[drawIndex];
+			for (uint32_t pass = 0; pass < passCount; pass++) {
+				*out++ = (RenderItem){
+					render_key(pass,
+						   vk_draw_pass_pipeline(pass),
+						   draw->constants.material,
+						   DRAW_MESH, depth),
+					ids[i]
+				};
+			}
+		}
+	}
+}
+
+static void vk_gather_draws(void *data, uint32_t begin, uint32_t end)
+{
+	(void)data;
+	const RenderItem *items = render_queue_items();
+	for (uint32_t i = begin; i < end; i++) {
+		uint32_t index = items[i].index;
+		queued_keys[i] = items[i].key;
+		// The particle draw takes nothing from its DrawCommand
+		if (index == DRAW_ITEM_PARTICLES) {
+			queued_draws[i] = (DrawCommand){};
+			continue;
+		}
+		uint32_t drawIndex = index / instance_count;
+		queued_draws[i] = draw_list[drawIndex];
+		queued_draws[i].first_instance = index % instance_count;
+		queued_draws[i].instance_count = 1;
+		if (object_lods[index] > 0) {
+			MeshLod lod = mesh_lod(&mesh, drawIndex,
+					       object_lods[index]);
+			queued_draws[i].first_index = lod.first_index;
+			queued_draws[i].index_count = lod.index_count;
+		}
+	}
+}
 
-	vkMapMemory(device, uniformBufferMemory, 0, bufferSize, 0,
-		    &uniformBufferMapped);
+// Queues a draw of one instance per object intersecting this frame's
+// frustum, once per pass, and gathers them in key order, after
+// update_uniform_buffer wrote their constants. Blocks are culled and queued
+// on the job system.
+void vk_cull_draws()
+{
+	jobs_parallel_for(cull_block_count, 1, vk_cull_blocks, nullptr);
+	visible_count = 0;
+	for (uint32_t block = 0; block < cull_block_count; block++) {
+		cull_block_offset[block] = visible_count;
+		visible_count += cull_block_visible[block];
+	}
+	uint32_t passCount = vk_draw_pass_count();
+	queued_count = visible_count * passCount + (particle_count > 0);
+	queue_items = render_queue_begin(queued_count);
+	jobs_parallel_for(cull_block_count, 1, vk_queue_blocks, nullptr);
+	if (particle_count > 0) {
+		// A pass of its own after the opaque ones, the particles blend
+		// over what they drew and test against its depth
+		queue_items[queued_count - 1] = (RenderItem){
+			render_key(passCount, DRAW_PIPELINE_PARTICLES, 0,
+				   DRAW_PARTICLES, 0.0f),
+			DRAW_ITEM_PARTICLES
+		};
+	}
+	render_queue_sort();
+	jobs_parallel_for(queued_count, CULL_JOB_OBJECTS, vk_gather_draws,
+			  nullptr);
+}
+// Coarsest level of `draw` whose error stays under lod_pixel_error pixels
+// at view depth `depth`, the depth of the nearest point of its bounds, for
+// an instance scaling it by `scale`
+uint32_t vk_select_lod(uint32_t draw, float depth, float scale)
+{
+	if (lod_levels == 1 || depth <= 0.0f) {
+		return 0;
+	}
+	float allowed = depth * lod_error_per_depth / scale;
+	uint32_t level = 0;
+	while (level + 1 < lod_levels &&
+	       mesh_lod(&mesh, draw, level + 1).error <= allowed) {
+		level++;
+	}
+	return level;
+}
+
+// Submits the frame's culling dispatch to the async compute queue. It waits
+// on the frame's uploads, the objects it reads may have just arrived, and
+// signals the semaphore the graphics submission waits on before drawing.
+void vk_submit_cull(FrameData *frame, const VkSemaphore *uploadSemaphores,
+		    uint32_t uploadCount)
+{
+	VkCommandBuffer commandBuffer = frame->compute_command_buffer;
+	vkResetCommandBuffer(commandBuffer, 0);
+	VkCommandBufferBeginInfo beginInfo = {
+		.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+		.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT
+	};
+	if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS) {
+		fprintf(stderr, "Failed to begin cull command buffer\n");
+		exit(1);
+	}
+	cull_dispatch(commandBuffer, current_frame, frustum_planes, depth_axis,
+		      lod_error_per_depth);
+	if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
+		fprintf(stderr, "Failed to record cull command buffer\n");
+		exit(1);
+	}
+
+	VkPipelineStageFlags waitStages[UPLOAD_MAX_BATCHES];
+	for (uint32_t i = 0; i < uploadCount; i++) {
+		waitStages[i] = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+	}
+	VkSubmitInfo submitInfo = {
+		.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+		.waitSemaphoreCount = uploadCount,
+		.pWaitSemaphores = uploadSemaphores,
+		.pWaitDstStageMask = waitStages,
+		.commandBufferCount = 1,
+		.pCommandBuffers = &commandBuffer,
+		.signalSemaphoreCount = 1,
+		.pSignalSemaphores = &frame->cull_finished_semaphore
+	};
+	if (vkQueueSubmit(compute_queue, 1, &submitInfo, VK_NULL_HANDLE) !=
+	    VK_SUCCESS) {
+		fprintf(stderr, "Failed to submit culling");
+		exit(1);
+	}
 }
 void vk_create_index_buffer()
 {
-	vk_create_mapped_buffer(device, (void *)indices, &indexBuffer,
-				&indexBufferMemory,
-				sizeof(indices[0]) * num_indices,
-				VK_BUFFER_USAGE_INDEX_BUFFER_BIT);
+	upload_create_buffer(mesh_index_bytes(&mesh),
+			     VK_BUFFER_USAGE_INDEX_BUFFER_BIT, &indexBuffer,
+			     &indexBufferAllocation);
 }
 void vk_create_vertex_buffer()
 {
-	vk_create_mapped_buffer(device, (void *)vertices, &vertexBuffer,
-				&vertexBufferMemory,
-				sizeof(vertices[0]) * num_vertices,
-				VK_BUFFER_USAGE_VERTEX_BUFFER_BIT);
+	upload_create_buffer(mesh_vertex_bytes(&mesh),
+			     VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, &vertexBuffer,
+			     &vertexBufferAllocation);
 }
 void vk_create_sync_objects()
 {
@@ -311,41 +1045,68 @@ void vk_create_sync_objects()
 	fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
 	fenceInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
 
-	if (vkCreateSemaphore(device, &semaphoreInfo, nullptr,
-			      &image_available_semaphore) != VK_SUCCESS ||
-	    vkCreateSemaphore(device, &semaphoreInfo, nullptr,
-			      &render_finished_semaphore) != VK_SUCCESS ||
-	    vkCreateFence(device, &fenceInfo, nullptr, &in_flight_fence) !=
-		    VK_SUCCESS) {
-		fprintf(stderr, "Can't create sync objects");
+	for (uint32_t i = 0; i < frames_in_flight; i++) {
+		if (vkCreateSemaphore(device, &semaphoreInfo, nullptr,
+				      &frames[i].image_available_semaphore) !=
+			    VK_SUCCESS ||
+		    vkCreateFence(device, &fenceInfo, nullptr,
+				  &frames[i].in_flight_fence) != VK_SUCCESS) {
+			fprintf(stderr, "Can't create sync objects");
+			exit(1);
+		}
+		if (async_compute &&
+		    vkCreateSemaphore(device, &semaphoreInfo, nullptr,
+				      &frames[i].cull_finished_semaphore) !=
+			    VK_SUCCESS) {
+			fprintf(stderr, "Can't create sync objects");
+			exit(1);
+		}
 	}
 }
 
-void vk_record_command_buffer(VkCommandBuffer commandBuffer,
-			      uint32_t imageIndex)
+// Copy the rendered target into the frame's host-visible buffer. The render
+// pass leaves offscreen targets in TRANSFER_SRC_OPTIMAL.
+static void vk_record_readback(VkCommandBuffer commandBuffer,
+			       const FrameData *frame, uint32_t imageIndex)
 {
-	VkCommandBufferBeginInfo beginInfo = {};
-	beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-	beginInfo.flags = 0; // Optional
-	beginInfo.pInheritanceInfo = nullptr; // Optional
-	if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS) {
-		fprintf(stderr, "Failed to create command buffers");
-	}
-	VkRenderPassBeginInfo renderPassInfo = {};
-	renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-	renderPassInfo.renderPass = render_pass;
-	renderPassInfo.framebuffer = swapChainFramebuffers[imageIndex];
-	renderPassInfo.renderArea.offset = (VkOffset2D){ 0, 0 };
-	renderPassInfo.renderArea.extent = swap_chain_extent;
-	VkClearValue clearColor = { { { 0.0f, 0.0f, 0.0f, 1.0f } } };
-	renderPassInfo.clearValueCount = 1;
-	renderPassInfo.pClearValues = &clearColor;
-
-	vkCmdBeginRenderPass(commandBuffer, &renderPassInfo,
-			     VK_SUBPASS_CONTENTS_INLINE);
-	vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
-			  graphics_pipeline);
+	VkMemoryBarrier barrier = {
+		.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+		.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+		.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT
+	};
+	vkCmdPipelineBarrier(commandBuffer,
+			     VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+			     VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &barrier, 0,
+			     nullptr, 0, nullptr);
+	VkBufferImageCopy region = {
+		.bufferOffset = 0,
+		.bufferRowLength = 0,
+		.bufferImageHeight = 0,
+		.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+		.imageSubresource.mipLevel = 0,
+		.imageSubresource.baseArrayLayer = 0,
+		.imageSubresource.layerCount = 1,
+		.imageOffset = { 0, 0, 0 },
+		.imageExtent = { swap_chain_extent.width,
+				 swap_chain_extent.height, 1 }
+	};
+	vkCmdCopyImageToBuffer(commandBuffer, swap_chain_images[imageIndex],
+			       VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+			       frame->readback_buffer, 1, &region);
+	VkMemoryBarrier host_barrier = {
+		.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+		.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+		.dstAccessMask = VK_ACCESS_HOST_READ_BIT
+	};
+	vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+			     VK_PIPELINE_STAGE_HOST_BIT, 0, 1, &host_barrier, 0,
+			     nullptr, 0, nullptr);
+}
 
+// Viewport and scissor are dynamic in both draw pipelines, so they survive
+// pipeline binds and are set once per command buffer
+void vk_cmd_set_viewport(VkCommandBuffer commandBuffer)
+{
 	VkViewport viewport = {};
 	viewport.x = 0.0f;
 	viewport.y = 0.0f;
@@ -359,23 +1120,252 @@ void vk_record_command_buffer(VkCommandBuffer commandBuffer,
 	scissor.offset = (VkOffset2D){ 0, 0 };
 	scissor.extent = swap_chain_extent;
 	vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
+}
 
-	VkBuffer vertexBuffers[] = { vertexBuffer };
-	VkDeviceSize offsets[] = { 0 };
-	vkCmdBindVertexBuffers(commandBuffer, 0, 1, vertexBuffers, offsets);
-	vkCmdBindIndexBuffer(commandBuffer, indexBuffer, 0,
-			     VK_INDEX_TYPE_UINT16);
+// Every material reads the frame's uniforms through set 0 and its texture
+// through set 1, the frame's material set or the bindless set. The
+// pipelines share their layout, the sets stay bound across pipeline binds.
+void vk_cmd_bind_material(VkCommandBuffer commandBuffer,
+			  const FrameData *frame, uint32_t material)
+{
+	(void)material;
+	VkDescriptorSet sets[2] = { descriptorSet,
+				    bindless ? descriptors_bindless_set() :
+					       frame->material_set };
 	vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
-				pipeline_layout, 0, 1, &descriptorSets[0], 0,
-				nullptr);
-	vkCmdDrawIndexed(commandBuffer, num_indices, 1, 0, 0, 0);
+				pipeline_layout, 0, 2, sets, 1,
+				&frame->uniform_offset);
+}
+
+// `instanceStream` feeds the per-instance transforms. The particles bind
+// their current state when they draw, it changes every step.
+void vk_cmd_bind_mesh(VkCommandBuffer commandBuffer, uint32_t meshId,
+		      VkBuffer instanceStream, VkDeviceSize instanceOffset)
+{
+	if (meshId == DRAW_PARTICLES) {
+		return;
+	}
+	VkBuffer vertexBuffers[] = { vertexBuffer, instanceStream };
+	VkDeviceSize offsets[] = { 0, instanceOffset };
+	vkCmdBindVertexBuffers(commandBuffer, 0, 2, vertexBuffers, offsets);
+	vkCmdBindIndexBuffer(commandBuffer, indexBuffer, 0,
+			     mesh_index_type(&mesh));
+}
+
+// Binds the pipeline and everything the draws read
+void vk_bind_draw_state(VkCommandBuffer commandBuffer, const FrameData *frame,
+			VkPipeline pipeline, VkBuffer instanceStream,
+			VkDeviceSize instanceOffset)
+{
+	vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+			  pipeline);
+	vk_cmd_set_viewport(commandBuffer);
+	vk_cmd_bind_mesh(commandBuffer, DRAW_MESH, instanceStream,
+			 instanceOffset);
+	vk_cmd_bind_material(commandBuffer, frame, 0);
+}
+
+// Draw passes, pass 0 is the depth pre-pass only when it is enabled
+uint32_t vk_draw_pass_count()
+{
+	return depth_prepass ? 2 : 1;
+}
+
+DrawPipeline vk_draw_pass_pipeline(uint32_t pass)
+{
+	return depth_prepass && pass == 0 ? DRAW_PIPELINE_DEPTH :
+					    DRAW_PIPELINE_COLOR;
+}
+
+VkPipeline vk_draw_pipeline(DrawPipeline pipeline)
+{
+	switch (pipeline) {
+	case DRAW_PIPELINE_DEPTH:
+		return depth_pipeline;
+	case DRAW_PIPELINE_PARTICLES:
+		return particle_pipeline;
+	default:
+		return graphics_pipeline;
+	}
+}
+
+// Records a slice of the sorted queue, so the same code serves the primary
+// buffer and the secondaries of the record jobs. Nothing is bound at the
+// start of a command buffer, after that state is only bound when a draw's
+// key asks for something else than the draw before it.
+void vk_record_draws(VkCommandBuffer commandBuffer, uint32_t first,
+		     uint32_t count, void *user)
+{
+	FrameData *frame = user;
+	if (count == 0) {
+		return;
+	}
+	VkDeviceSize instanceOffset = (char *)frame->instance_mapped -
+				      (char *)instanceBufferAllocation.mapped;
+	vk_cmd_set_viewport(commandBuffer);
+	RenderStats binds = { .draws = count };
+	uint32_t pipeline = UINT32_MAX;
+	uint32_t material = UINT32_MAX;
+	uint32_t meshId = UINT32_MAX;
+	for (uint32_t i = first; i < first + count; i++) {
+		uint64_t key = queued_keys[i];
+		if (render_key_pipeline(key) != pipeline) {
+			pipeline = render_key_pipeline(key);
+			vkCmdBindPipeline(commandBuffer,
+					  VK_PIPELINE_BIND_POINT_GRAPHICS,
+					  vk_draw_pipeline(pipeline));
+			binds.binds++;
+		} else {
+			binds.binds_skipped++;
+		}
+		// Bindless materials differ in the slots they index only
+		uint32_t keyMaterial = bindless ? 0 : render_key_material(key);
+		if (keyMaterial != material) {
+			material = keyMaterial;
+			vk_cmd_bind_material(commandBuffer, frame, material);
+			binds.binds++;
+		} else {
+			binds.binds_skipped++;
+		}
+		if (render_key_mesh(key) != meshId) {
+			meshId = render_key_mesh(key);
+			vk_cmd_bind_mesh(commandBuffer, meshId, instanceBuffer,
+					 instanceOffset);
+			binds.binds++;
+		} else {
+			binds.binds_skipped++;
+		}
+		if (meshId == DRAW_PARTICLES) {
+			particles_draw(commandBuffer);
+		} else {
+			vk_cmd_draw(commandBuffer, &queued_draws[i]);
+		}
+	}
+	atomic_fetch_add_explicit(&frame_draws, binds.draws,
+				  memory_order_relaxed);
+	atomic_fetch_add_explicit(&frame_binds, binds.binds,
+				  memory_order_relaxed);
+	atomic_fetch_add_explicit(&frame_binds_skipped, binds.binds_skipped,
+				  memory_order_relaxed);
+}
+
+// Draws the particles with state of their own, for the paths recording
+// without the render queue
+void vk_record_particles(VkCommandBuffer commandBuffer, const FrameData *frame)
+{
+	if (particle_count == 0) {
+		return;
+	}
+	vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+			  particle_pipeline);
+	vk_cmd_set_viewport(commandBuffer);
+	vk_cmd_bind_material(commandBuffer, frame, 0);
+	particles_draw(commandBuffer);
+}
+
+// Emits one draw with its per-draw constants, the pipeline and buffers must
+// already be bound
+void vk_cmd_draw(VkCommandBuffer commandBuffer, const DrawCommand *draw)
+{
+	vkCmdPushConstants(commandBuffer, pipeline_layout,
+			   VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(DrawConstants),
+			   &draw->constants);
+	vkCmdDrawIndexed(commandBuffer, draw->index_count,
+			 draw->instance_count, draw->first_index,
+			 draw->vertex_offset, draw->first_instance);
+}
+void vk_record_command_buffer(VkCommandBuffer commandBuffer,
+			      uint32_t imageIndex)
+{
+	FrameData *frame = &frames[current_frame];
+	VkCommandBufferBeginInfo beginInfo = {};
+	beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+	beginInfo.flags = 0; // Optional
+	beginInfo.pInheritanceInfo = nullptr; // Optional
+	if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS) {
+		fprintf(stderr, "Failed to create command buffers");
+	}
+	VkRenderPassBeginInfo renderPassInfo = {};
+	renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+	renderPassInfo.renderPass = render_pass;
+	renderPassInfo.framebuffer = swapChainFramebuffers[imageIndex];
+	renderPassInfo.renderArea.offset = (VkOffset2D){ 0, 0 };
+	renderPassInfo.renderArea.extent = swap_chain_extent;
+	VkClearValue clearValues[2] = {
+		{ .color = { { 0.0f, 0.0f, 0.0f, 1.0f } } },
+		{ .depthStencil = { 1.0f, 0 } }
+	};
+	renderPassInfo.clearValueCount = 2;
+	renderPassInfo.pClearValues = clearValues;
+
+	atomic_store_explicit(&frame_draws, 0, memory_order_relaxed);
+	atomic_store_explicit(&frame_binds, 0, memory_order_relaxed);
+	atomic_store_explicit(&frame_binds_skipped, 0, memory_order_relaxed);
+	profiler_gpu_begin(commandBuffer, current_frame);
+	if (geometry_ready && gpu_culling && async_compute) {
+		cull_acquire(commandBuffer, current_frame);
+	} else if (geometry_ready && gpu_culling) {
+		cull_dispatch(commandBuffer, current_frame, frustum_planes,
+			      depth_axis, lod_error_per_depth);
+	}
+	if (particle_count > 0) {
+		particles_simulate(commandBuffer, frame_delta);
+	}
+	if (!geometry_ready) {
+		vkCmdBeginRenderPass(commandBuffer, &renderPassInfo,
+				     VK_SUBPASS_CONTENTS_INLINE);
+		vk_record_particles(commandBuffer, frame);
+	} else if (gpu_culling) {
+		// Every object shares the frame's model matrix, objects differ
+		// in their instance transform only
+		vkCmdBeginRenderPass(commandBuffer, &renderPassInfo,
+				     VK_SUBPASS_CONTENTS_INLINE);
+		for (uint32_t pass = 0; pass < vk_draw_pass_count(); pass++) {
+			vk_bind_draw_state(
+				commandBuffer, frame,
+				vk_draw_pipeline(vk_draw_pass_pipeline(pass)),
+				cull_transform_buffer(current_frame), 0);
+			vkCmdPushConstants(commandBuffer, pipeline_layout,
+					   VK_SHADER_STAGE_VERTEX_BIT, 0,
+					   sizeof(DrawConstants),
+					   &draw_list[0].constants);
+			cull_draw(commandBuffer, current_frame);
+		}
+		vk_record_particles(commandBuffer, frame);
+	} else if (record_threads == 0) {
+		vkCmdBeginRenderPass(commandBuffer, &renderPassInfo,
+				     VK_SUBPASS_CONTENTS_INLINE);
+		vk_record_draws(commandBuffer, 0, queued_count, frame);
+	} else {
+		vkCmdBeginRenderPass(
+			commandBuffer, &renderPassInfo,
+			VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+		VkCommandBufferInheritanceInfo inheritance = {
+			.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO,
+			.renderPass = render_pass,
+			.subpass = 0,
+			.framebuffer = swapChainFramebuffers[imageIndex]
+		};
+		VkCommandBuffer secondaries[MAX_RECORD_THREADS];
+		uint32_t secondaryCount = record_secondaries(
+			current_frame, &inheritance, queued_count,
+			vk_record_draws, frame, secondaries);
+		if (secondaryCount > 0) {
+			vkCmdExecuteCommands(commandBuffer, secondaryCount,
+					     secondaries);
+		}
+	}
 	vkCmdEndRenderPass(commandBuffer);
+	profiler_gpu_end(commandBuffer, current_frame);
+	if (frame->readback_buffer != VK_NULL_HANDLE) {
+		vk_record_readback(commandBuffer, frame, imageIndex);
+	}
 	if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
 		fprintf(stderr, "failed to record command buffer!");
 	}
 }
 
-void vk_create_command_buffer()
+void vk_create_command_buffers()
 {
 	VkCommandBufferAllocateInfo allocInfo = {};
 	allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
@@ -383,9 +1373,25 @@ void vk_create_command_buffer()
 	allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
 	allocInfo.commandBufferCount = 1;
 
-	if (vkAllocateCommandBuffers(device, &allocInfo, &command_buffer) !=
-	    VK_SUCCESS) {
-		fprintf(stderr, "Failed to create Command buffers");
+	for (uint32_t i = 0; i < frames_in_flight; i++) {
+		if (vkAllocateCommandBuffers(device, &allocInfo,
+					     &frames[i].command_buffer) !=
+		    VK_SUCCESS) {
+			fprintf(stderr, "Failed to create Command buffers");
+			exit(1);
+		}
+	}
+	if (!async_compute) {
+		return;
+	}
+	allocInfo.commandPool = compute_command_pool;
+	for (uint32_t i = 0; i < frames_in_flight; i++) {
+		if (vkAllocateCommandBuffers(
+			    device, &allocInfo,
+			    &frames[i].compute_command_buffer) != VK_SUCCESS) {
+			fprintf(stderr, "Failed to create Command buffers");
+			exit(1);
+		}
 	}
 }
 
@@ -402,6 +1408,15 @@ void vk_create_command_pool()
 	    VK_SUCCESS) {
 		fprintf(stderr, "Failed to create command pool");
 	}
+	if (!async_compute) {
+		return;
+	}
+	poolInfo.queueFamilyIndex = queueFamilyIndices.computeFamily;
+	if (vkCreateCommandPool(device, &poolInfo, nullptr,
+				&compute_command_pool) != VK_SUCCESS) {
+		fprintf(stderr, "Failed to create command pool");
+		exit(1);
+	}
 }
 
 void vk_create_framebuffers()
@@ -410,13 +1425,14 @@ void vk_create_framebuffers()
 		calloc(swap_chain_image_count, sizeof(VkFramebuffer));
 
 	for (size_t i = 0; i < swap_chain_image_count; i++) {
-		VkImageView attachments[] = { swap_chain_image_views[i] };
+		VkImageView attachments[] = { swap_chain_image_views[i],
+					      depth_view };
 
 		VkFramebufferCreateInfo framebufferInfo = {};
 		framebufferInfo.sType =
 			VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
 		framebufferInfo.renderPass = render_pass;
-		framebufferInfo.attachmentCount = 1;
+		framebufferInfo.attachmentCount = 2;
 		framebufferInfo.pAttachments = attachments;
 		framebufferInfo.width = swap_chain_extent.width;
 		framebufferInfo.height = swap_chain_extent.height;
@@ -439,27 +1455,52 @@ void vk_create_render_pass()
 	colorAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
 	colorAttachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
 	colorAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-	colorAttachment.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+	colorAttachment.finalLayout =
+		headless ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL :
+			   VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+	// Depth is cleared every frame and never read after the pass
+	VkAttachmentDescription depthAttachment = {
+		.format = depth_format,
+		.samples = VK_SAMPLE_COUNT_1_BIT,
+		.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
+		.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
+		.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
+		.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
+		.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+		.finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL
+	};
+	VkAttachmentDescription attachments[] = { colorAttachment,
+						  depthAttachment };
 	VkAttachmentReference colorAttachmentRef = {};
 	colorAttachmentRef.attachment = 0;
 	colorAttachmentRef.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+	VkAttachmentReference depthAttachmentRef = {
+		.attachment = 1,
+		.layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL
+	};
 	VkSubpassDescription subpass = {};
 	subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
 	subpass.colorAttachmentCount = 1;
 	subpass.pColorAttachments = &colorAttachmentRef;
+	subpass.pDepthStencilAttachment = &depthAttachmentRef;
 	VkRenderPassCreateInfo renderPassInfo = {};
 	renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
-	renderPassInfo.attachmentCount = 1;
-	renderPassInfo.pAttachments = &colorAttachment;
+	renderPassInfo.attachmentCount = 2;
+	renderPassInfo.pAttachments = attachments;
 	renderPassInfo.subpassCount = 1;
 	renderPassInfo.pSubpasses = &subpass;
+	// Also orders this frame's depth clear after the previous frame's
+	// depth tests, the depth buffer is shared
 	VkSubpassDependency dependency = {};
 	dependency.srcSubpass = VK_SUBPASS_EXTERNAL;
 	dependency.dstSubpass = 0;
-	dependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-	dependency.srcAccessMask = 0;
-	dependency.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-	dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+	dependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT |
+				  VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+	dependency.srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+	dependency.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT |
+				  VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
+	dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT |
+				   VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
 	renderPassInfo.dependencyCount = 1;
 	renderPassInfo.pDependencies = &dependency;
 
@@ -469,30 +1510,27 @@ void vk_create_render_pass()
 	}
 }
 
-VkShaderModule createShaderModule(unsigned char *code, size_t size)
+VkShaderModule createShaderModule(const char *name)
 {
+	ShaderBinary binary = shader_get(name);
 	VkShaderModuleCreateInfo createInfo = {};
 	createInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
-	createInfo.codeSize = size;
-	createInfo.pCode = (uint32_t *)code;
+	createInfo.codeSize = binary.size;
+	createInfo.pCode = binary.code;
 	VkShaderModule shaderModule;
 	if (vkCreateShaderModule(device, &createInfo, nullptr, &shaderModule) !=
 	    VK_SUCCESS) {
 		fprintf(stderr, "Failed to create shader");
 		exit(1);
 	}
+	shader_release(binary);
 	return shaderModule;
 }
 
 void vk_create_graphics_pipeline()
 {
-	size_t frag_buf_size = 0;
-	size_t vert_buf_size = 0;
-
-	auto frag_buf = read_binary_file("frag.spv", &frag_buf_size);
-	auto vert_buf = read_binary_file("vert.spv", &vert_buf_size);
-	auto frag_module = createShaderModule(frag_buf, frag_buf_size);
-	auto vert_module = createShaderModule(vert_buf, vert_buf_size);
+	auto frag_module = createShaderModule(bindless ? "bindless" : "frag");
+	auto vert_module = createShaderModule("vert");
 
 	VkPipelineShaderStageCreateInfo vertShaderStageInfo = {
 		.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
@@ -518,9 +1556,9 @@ void vk_create_graphics_pipeline()
 	vertexInputInfo.sType =
 		VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
 
-	vertexInputInfo.vertexBindingDescriptionCount = 1;
-	vertexInputInfo.vertexAttributeDescriptionCount = 2;
-	vertexInputInfo.pVertexBindingDescriptions = &bindingDescription;
+	vertexInputInfo.vertexBindingDescriptionCount = 2;
+	vertexInputInfo.vertexAttributeDescriptionCount = 6;
+	vertexInputInfo.pVertexBindingDescriptions = bindingDescription;
 	vertexInputInfo.pVertexAttributeDescriptions = attributeDescriptions;
 
 	VkPipelineInputAssemblyStateCreateInfo inputAssembly = {};
@@ -582,13 +1620,36 @@ void vk_create_graphics_pipeline()
 	colorBlending.attachmentCount = 1;
 	colorBlending.pAttachments = &colorBlendAttachment;
 
+	// With the pre-pass depth is final before shading, so the color pass
+	// only shades the fragment that won and leaves depth alone
+	VkPipelineDepthStencilStateCreateInfo depthStencil = {
+		.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO,
+		.depthTestEnable = VK_TRUE,
+		.depthWriteEnable = depth_prepass ? VK_FALSE : VK_TRUE,
+		.depthCompareOp = depth_prepass ? VK_COMPARE_OP_EQUAL :
+						  VK_COMPARE_OP_LESS,
+		.depthBoundsTestEnable = VK_FALSE,
+		.stencilTestEnable = VK_FALSE
+	};
+
 	VkPipelineLayoutCreateInfo pipelineLayoutInfo = {};
 	pipelineLayoutInfo.sType =
 		VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-	pipelineLayoutInfo.setLayoutCount = 1; // Optional
-	pipelineLayoutInfo.pSetLayouts = &descriptorSetLayout; // Optional
-	pipelineLayoutInfo.pushConstantRangeCount = 0; // Optional
-	pipelineLayoutInfo.pPushConstantRanges = nullptr; // Optional
+	// Set 0 holds the frame's uniforms, set 1 the material's texture or
+	// the bindless arrays
+	VkDescriptorSetLayout setLayouts[2] = {
+		descriptorSetLayout,
+		bindless ? descriptors_bindless_layout() : materialSetLayout
+	};
+	pipelineLayoutInfo.setLayoutCount = 2;
+	pipelineLayoutInfo.pSetLayouts = setLayouts;
+	VkPushConstantRange pushConstantRange = {
+		.stageFlags = VK_SHADER_STAGE_VERTEX_BIT,
+		.offset = 0,
+		.size = sizeof(DrawConstants)
+	};
+	pipelineLayoutInfo.pushConstantRangeCount = 1;
+	pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
 
 	if (vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr,
 				   &pipeline_layout) != VK_SUCCESS) {
@@ -605,7 +1666,7 @@ void vk_create_graphics_pipeline()
 	pipelineInfo.pViewportState = &viewportState;
 	pipelineInfo.pRasterizationState = &rasterizer;
 	pipelineInfo.pMultisampleState = &multisampling;
-	pipelineInfo.pDepthStencilState = nullptr; // Optional
+	pipelineInfo.pDepthStencilState = &depthStencil;
 	pipelineInfo.pColorBlendState = &colorBlending;
 	pipelineInfo.pDynamicState = &dynamicState;
 	pipelineInfo.layout = pipeline_layout;
@@ -613,15 +1674,116 @@ void vk_create_graphics_pipeline()
 	pipelineInfo.subpass = 0;
 	pipelineInfo.basePipelineHandle = VK_NULL_HANDLE; // Optional
 	pipelineInfo.basePipelineIndex = -1;
-	if (vkCreateGraphicsPipelines(device, VK_NULL_HANDLE, 1, &pipelineInfo,
+	if (vkCreateGraphicsPipelines(device, pipeline_cache, 1, &pipelineInfo,
 				      nullptr,
 				      &graphics_pipeline) != VK_SUCCESS) {
 		fprintf(stderr, "Faile to create pipeline");
 	}
+	if (depth_prepass) {
+		// Same vertex stage, which keeps positions invariant for the
+		// EQUAL test, and no fragment stage or color writes
+		VkPipelineDepthStencilStateCreateInfo depthOnly = depthStencil;
+		depthOnly.depthWriteEnable = VK_TRUE;
+		depthOnly.depthCompareOp = VK_COMPARE_OP_LESS;
+		VkPipelineColorBlendAttachmentState noColor =
+			colorBlendAttachment;
+		noColor.colorWriteMask = 0;
+		VkPipelineColorBlendStateCreateInfo noBlending = colorBlending;
+		noBlending.pAttachments = &noColor;
+		VkGraphicsPipelineCreateInfo depthInfo = pipelineInfo;
+		depthInfo.stageCount = 1;
+		depthInfo.pStages = &vertShaderStageInfo;
+		depthInfo.pDepthStencilState = &depthOnly;
+		depthInfo.pColorBlendState = &noBlending;
+		if (vkCreateGraphicsPipelines(device, pipeline_cache, 1,
+					      &depthInfo, nullptr,
+					      &depth_pipeline) != VK_SUCCESS) {
+			fprintf(stderr, "Failed to create depth pipeline");
+			exit(1);
+		}
+	}
+	if (particle_count > 0) {
+		vk_create_particle_pipeline(&pipelineInfo);
+	}
 	vkDestroyShaderModule(device, frag_module, nullptr);
 	vkDestroyShaderModule(device, vert_module, nullptr);
 }
 
+// Points read straight from the simulation's buffer, blended additively
+// over the opaque passes. They test against their depth without writing it,
+// so the order particles are drawn in doesn't matter.
+void vk_create_particle_pipeline(const VkGraphicsPipelineCreateInfo *base)
+{
+	VkShaderModule vertModule = createShaderModule("particle_vert");
+	VkShaderModule fragModule = createShaderModule("particle_frag");
+	VkPipelineShaderStageCreateInfo stages[2] = {
+		{ .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+		  .stage = VK_SHADER_STAGE_VERTEX_BIT,
+		  .module = vertModule,
+		  .pName = "main" },
+		{ .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+		  .stage = VK_SHADER_STAGE_FRAGMENT_BIT,
+		  .module = fragModule,
+		  .pName = "main" },
+	};
+	VkVertexInputBindingDescription binding = {
+		.binding = 0,
+		.stride = sizeof(Particle),
+		.inputRate = VK_VERTEX_INPUT_RATE_VERTEX
+	};
+	VkVertexInputAttributeDescription attributes[2] = {
+		{ .location = 0,
+		  .binding = 0,
+		  .format = VK_FORMAT_R32G32B32A32_SFLOAT,
+		  .offset = offsetof(Particle, position) },
+		{ .location = 1,
+		  .binding = 0,
+		  .format = VK_FORMAT_R32G32B32A32_SFLOAT,
+		  .offset = offsetof(Particle, color) },
+	};
+	VkPipelineVertexInputStateCreateInfo vertexInput = {
+		.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO,
+		.vertexBindingDescriptionCount = 1,
+		.pVertexBindingDescriptions = &binding,
+		.vertexAttributeDescriptionCount = 2,
+		.pVertexAttributeDescriptions = attributes
+	};
+	VkPipelineInputAssemblyStateCreateInfo points =
+		*base->pInputAssemblyState;
+	points.topology = VK_PRIMITIVE_TOPOLOGY_POINT_LIST;
+	VkPipelineDepthStencilStateCreateInfo depthTest =
+		*base->pDepthStencilState;
+	depthTest.depthWriteEnable = VK_FALSE;
+	depthTest.depthCompareOp = VK_COMPARE_OP_LESS_OR_EQUAL;
+	VkPipelineColorBlendAttachmentState additive =
+		base->pColorBlendState->pAttachments[0];
+	additive.blendEnable = VK_TRUE;
+	additive.srcColorBlendFactor = VK_BLEND_FACTOR_ONE;
+	additive.dstColorBlendFactor = VK_BLEND_FACTOR_ONE;
+	additive.colorBlendOp = VK_BLEND_OP_ADD;
+	additive.srcAlphaBlendFactor = VK_BLEND_FACTOR_ZERO;
+	additive.dstAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
+	additive.alphaBlendOp = VK_BLEND_OP_ADD;
+	VkPipelineColorBlendStateCreateInfo blending = *base->pColorBlendState;
+	blending.pAttachments = &additive;
+
+	VkGraphicsPipelineCreateInfo pipelineInfo = *base;
+	pipelineInfo.stageCount = 2;
+	pipelineInfo.pStages = stages;
+	pipelineInfo.pVertexInputState = &vertexInput;
+	pipelineInfo.pInputAssemblyState = &points;
+	pipelineInfo.pDepthStencilState = &depthTest;
+	pipelineInfo.pColorBlendState = &blending;
+	if (vkCreateGraphicsPipelines(device, pipeline_cache, 1, &pipelineInfo,
+				      nullptr,
+				      &particle_pipeline) != VK_SUCCESS) {
+		fprintf(stderr, "Failed to create particle pipeline");
+		exit(1);
+	}
+	vkDestroyShaderModule(device, fragModule, nullptr);
+	vkDestroyShaderModule(device, vertModule, nullptr);
+}
+
 void vk_create_image_views()
 {
 	swap_chain_image_views =
@@ -653,20 +1815,157 @@ void vk_create_image_views()
 	}
 }
 
-void vk_create_swap_chain()
+// First format of the list usable as an optimally tiled depth attachment,
+// every device supports at least one of D32 and D24S8
+VkFormat vk_find_depth_format()
+{
+	static const VkFormat candidates[] = { VK_FORMAT_D32_SFLOAT,
+					       VK_FORMAT_D32_SFLOAT_S8_UINT,
+					       VK_FORMAT_D24_UNORM_S8_UINT };
+	for (uint32_t i = 0; i < sizeof(candidates) / sizeof(candidates[0]);
+	     i++) {
+		VkFormatProperties properties;
+		vkGetPhysicalDeviceFormatProperties(physical_device,
+						    candidates[i], &properties);
+		if (properties.optimalTilingFeatures &
+		    VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT) {
+			return candidates[i];
+		}
+	}
+	fprintf(stderr, "No supported depth format");
+	exit(1);
+}
+
+// Sized like the swap chain, so it is replaced along with it
+void vk_create_depth_resources()
+{
+	VkImageCreateInfo imageInfo = {
+		.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+		.imageType = VK_IMAGE_TYPE_2D,
+		.format = depth_format,
+		.extent = { swap_chain_extent.width, swap_chain_extent.height,
+			    1 },
+		.mipLevels = 1,
+		.arrayLayers = 1,
+		.samples = VK_SAMPLE_COUNT_1_BIT,
+		.tiling = VK_IMAGE_TILING_OPTIMAL,
+		.usage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT,
+		.sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+		.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED
+	};
+	allocator_create_image(&imageInfo, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+			       &depth_image, &depth_allocation);
+	VkImageViewCreateInfo viewInfo = {
+		.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+		.image = depth_image,
+		.viewType = VK_IMAGE_VIEW_TYPE_2D,
+		.format = depth_format,
+		.subresourceRange.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT,
+		.subresourceRange.levelCount = 1,
+		.subresourceRange.layerCount = 1
+	};
+	if (vkCreateImageView(device, &viewInfo, nullptr, &depth_view) !=
+	    VK_SUCCESS) {
+		fprintf(stderr, "Failed to create depth view");
+		exit(1);
+	}
+}
+
+// Uses the requested mode when the surface offers it. MAILBOX and IMMEDIATE
+// stand in for each other since both avoid waiting for vsync, FIFO is
+// always available.
+VkPresentModeKHR vk_choose_present_mode()
 {
-	VkSurfaceFormatKHR surfaceFormat = {
-		.format = VK_FORMAT_B8G8R8A8_SRGB,
-		.colorSpace = VK_COLOR_SPACE_SRGB_NONLINEAR_KHR
+	static const VkPresentModeKHR modes[] = {
+		[PRESENT_FIFO] = VK_PRESENT_MODE_FIFO_KHR,
+		[PRESENT_FIFO_RELAXED] = VK_PRESENT_MODE_FIFO_RELAXED_KHR,
+		[PRESENT_MAILBOX] = VK_PRESENT_MODE_MAILBOX_KHR,
+		[PRESENT_IMMEDIATE] = VK_PRESENT_MODE_IMMEDIATE_KHR,
 	};
-	VkPresentModeKHR presentMode = VK_PRESENT_MODE_FIFO_KHR;
-	VkExtent2D actualExtent = { WIDTH, HEIGHT };
+	VkPresentModeKHR preferred[2] = { modes[present_mode],
+					  modes[present_mode] };
+	if (present_mode == PRESENT_MAILBOX) {
+		preferred[1] = VK_PRESENT_MODE_IMMEDIATE_KHR;
+	} else if (present_mode == PRESENT_IMMEDIATE) {
+		preferred[1] = VK_PRESENT_MODE_MAILBOX_KHR;
+	}
+
+	uint32_t count = 0;
+	vkGetPhysicalDeviceSurfacePresentModesKHR(physical_device, surface,
+						  &count, nullptr);
+	VkPresentModeKHR available[count];
+	vkGetPhysicalDeviceSurfacePresentModesKHR(physical_device, surface,
+						  &count, available);
+	for (uint32_t i = 0; i < 2; i++) {
+		for (uint32_t j = 0; j < count; j++) {
+			if (available[j] == preferred[i]) {
+				return preferred[i];
+			}
+		}
+	}
+	return VK_PRESENT_MODE_FIFO_KHR;
+}
+
+// Creates the swap chain from the surface's current capabilities. An
+// existing swap chain is handed over as oldSwapchain so the presentation
+// engine can reuse its resources, the caller retires it.
+void vk_create_swap_chain()
+{
+	VkSurfaceCapabilitiesKHR capabilities;
+	vkGetPhysicalDeviceSurfaceCapabilitiesKHR(physical_device, surface,
+						  &capabilities);
+	if (surface_format.format == VK_FORMAT_UNDEFINED) {
+		uint32_t formatCount = 0;
+		vkGetPhysicalDeviceSurfaceFormatsKHR(physical_device, surface,
+						     &formatCount, nullptr);
+		VkSurfaceFormatKHR formats[formatCount];
+		vkGetPhysicalDeviceSurfaceFormatsKHR(physical_device, surface,
+						     &formatCount, formats);
+		surface_format = formats[0];
+		for (uint32_t i = 0; i < formatCount; i++) {
+			if (formats[i].format == VK_FORMAT_B8G8R8A8_SRGB &&
+			    formats[i].colorSpace ==
+				    VK_COLOR_SPACE_SRGB_NONLINEAR_KHR) {
+				surface_format = formats[i];
+			}
+		}
+	}
+
+	// UINT32_MAX means the surface size follows the swap chain's
+	VkExtent2D actualExtent = capabilities.currentExtent;
+	if (actualExtent.width == UINT32_MAX) {
+		int width, height;
+		SDL_Vulkan_GetDrawableSize(window, &width, &height);
+		VkExtent2D min = capabilities.minImageExtent;
+		VkExtent2D max = capabilities.maxImageExtent;
+		actualExtent.width = (uint32_t)width;
+		actualExtent.height = (uint32_t)height;
+		if (actualExtent.width < min.width) {
+			actualExtent.width = min.width;
+		} else if (actualExtent.width > max.width) {
+			actualExtent.width = max.width;
+		}
+		if (actualExtent.height < min.height) {
+			actualExtent.height = min.height;
+		} else if (actualExtent.height > max.height) {
+			actualExtent.height = max.height;
+		}
+	}
+	// One more than the minimum so acquiring never waits on the driver,
+	// 0 means no upper limit
+	uint32_t imageCount = capabilities.minImageCount + 1;
+	if (capabilities.maxImageCount > 0 &&
+	    imageCount > capabilities.maxImageCount) {
+		imageCount = capabilities.maxImageCount;
+	}
+	VkPresentModeKHR presentMode = vk_choose_present_mode();
+
 	VkSwapchainCreateInfoKHR createInfo = {
 		.sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR,
 		.surface = surface,
-		.minImageCount = 3,
-		.imageFormat = surfaceFormat.format,
-		.imageColorSpace = surfaceFormat.colorSpace,
+		.minImageCount = imageCount,
+		.imageFormat = surface_format.format,
+		.imageColorSpace = surface_format.colorSpace,
 		.imageExtent = actualExtent,
 		.imageArrayLayers = 1,
 		.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT
@@ -686,8 +1985,8 @@ void vk_create_swap_chain()
 	createInfo.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
 	createInfo.presentMode = presentMode;
 	createInfo.clipped = VK_TRUE;
-	createInfo.oldSwapchain = VK_NULL_HANDLE;
-	createInfo.preTransform = VK_SURFACE_TRANSFORM_IDENTITY_BIT_KHR;
+	createInfo.oldSwapchain = swap_chain;
+	createInfo.preTransform = capabilities.currentTransform;
 	if (vkCreateSwapchainKHR(device, &createInfo, nullptr, &swap_chain) !=
 	    VK_SUCCESS) {
 		fprintf(stderr, "Faild to create Swap Chain");
@@ -699,8 +1998,170 @@ void vk_create_swap_chain()
 	swap_chain_images = calloc(swap_chain_image_count, sizeof(VkImage));
 	vkGetSwapchainImagesKHR(device, swap_chain, &swap_chain_image_count,
 				swap_chain_images);
-	swap_chain_image_format = surfaceFormat.format;
+	present_semaphores =
+		calloc(swap_chain_image_count, sizeof(VkSemaphore));
+	VkSemaphoreCreateInfo semaphoreInfo = {
+		.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO
+	};
+	for (uint32_t i = 0; i < swap_chain_image_count; i++) {
+		if (vkCreateSemaphore(device, &semaphoreInfo, nullptr,
+				      &present_semaphores[i]) != VK_SUCCESS) {
+			fprintf(stderr, "Can't create sync objects");
+			exit(1);
+		}
+	}
+	swap_chain_image_format = surface_format.format;
 	swap_chain_extent = actualExtent;
+	printf("Swap chain %ux%u, %u images, present mode %d\n",
+	       actualExtent.width, actualExtent.height, swap_chain_image_count,
+	       presentMode);
+}
+
+// Replaces the swap chain without waiting for the device. The old one and
+// its views and framebuffers are retired until the frames that used them
+// completed. Returns false when the window has no area to present to.
+bool vk_recreate_swap_chain()
+{
+	int width, height;
+	SDL_Vulkan_GetDrawableSize(window, &width, &height);
+	if (width == 0 || height == 0) {
+		return false;
+	}
+	if (retired_swap_chain_count == MAX_RETIRED_SWAP_CHAINS) {
+		// Resized faster than frames complete
+		vkDeviceWaitIdle(device);
+		vk_destroy_retired_swap_chains(true);
+	}
+	retired_swap_chains[retired_swap_chain_count++] = (RetiredSwapChain){
+		.swap_chain = swap_chain,
+		.images = swap_chain_images,
+		.image_views = swap_chain_image_views,
+		.framebuffers = swapChainFramebuffers,
+		.present_semaphores = present_semaphores,
+		.image_count = swap_chain_image_count,
+		.depth_image = depth_image,
+		.depth_view = depth_view,
+		.depth_allocation = depth_allocation,
+		.retired_at = frames_submitted
+	};
+	vk_create_swap_chain();
+	vk_create_image_views();
+	vk_create_depth_resources();
+	vk_create_framebuffers();
+	framebuffer_resized = false;
+	return true;
+}
+
+// Frames submitted before a swap chain was retired are complete once
+// frames_in_flight later frames waited on their slot's fence
+void vk_destroy_retired_swap_chains(bool all)
+{
+	uint32_t kept = 0;
+	for (uint32_t i = 0; i < retired_swap_chain_count; i++) {
+		RetiredSwapChain *retired = &retired_swap_chains[i];
+		if (!all &&
+		    frames_submitted < retired->retired_at + frames_in_flight) {
+			retired_swap_chains[kept++] = *retired;
+			continue;
+		}
+		for (uint32_t j = 0; j < retired->image_count; j++) {
+			vkDestroyFramebuffer(device, retired->framebuffers[j],
+					     nullptr);
+			vkDestroyImageView(device, retired->image_views[j],
+					   nullptr);
+			vkDestroySemaphore(device,
+					   retired->present_semaphores[j],
+					   nullptr);
+		}
+		vkDestroyImageView(device, retired->depth_view, nullptr);
+		allocator_destroy_image(retired->depth_image,
+					&retired->depth_allocation);
+		vkDestroySwapchainKHR(device, retired->swap_chain, nullptr);
+		free(retired->framebuffers);
+		free(retired->present_semaphores);
+		free(retired->image_views);
+		free(retired->images);
+	}
+	retired_swap_chain_count = kept;
+}
+
+// Headless replacement for the swap chain: one offscreen image per frame slot
+// so that a slot never renders into an image the GPU is still using.
+void vk_create_offscreen_targets()
+{
+	swap_chain_image_count = frames_in_flight;
+	swap_chain_image_format = OFFSCREEN_FORMAT;
+	swap_chain_extent = (VkExtent2D){ WIDTH, HEIGHT };
+	swap_chain_images = calloc(swap_chain_image_count, sizeof(VkImage));
+	offscreen_image_allocations =
+		calloc(swap_chain_image_count, sizeof(Allocation));
+
+	for (uint32_t i = 0; i < swap_chain_image_count; i++) {
+		VkImageCreateInfo imageInfo = {
+			.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+			.imageType = VK_IMAGE_TYPE_2D,
+			.format = swap_chain_image_format,
+			.extent = { swap_chain_extent.width,
+				    swap_chain_extent.height, 1 },
+			.mipLevels = 1,
+			.arrayLayers = 1,
+			.samples = VK_SAMPLE_COUNT_1_BIT,
+			.tiling = VK_IMAGE_TILING_OPTIMAL,
+			.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT |
+				 VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
+			.sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+			.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED
+		};
+		allocator_create_image(&imageInfo,
+				       VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+				       &swap_chain_images[i],
+				       &offscreen_image_allocations[i]);
+	}
+}
+
+void vk_create_readback_buffers()
+{
+	VkDeviceSize size = (VkDeviceSize)swap_chain_extent.width *
+			    swap_chain_extent.height * 4;
+	for (uint32_t i = 0; i < frames_in_flight; i++) {
+		// Cached memory makes the CPU side of the readback fast, it is
+		// only a preference since not every device exposes it
+		allocator_create_buffer(size, VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+					VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+						VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+					VK_MEMORY_PROPERTY_HOST_CACHED_BIT,
+					&frames[i].readback_buffer,
+					&frames[i].readback_allocation);
+	}
+}
+
+// Writes a frame's readback buffer as a binary PPM. The target format is
+// BGRA so channels are swizzled on the way out.
+void vk_write_readback(const FrameData *frame, const char *path)
+{
+	FILE *file = fopen(path, "wb");
+	if (file == nullptr) {
+		perror("Error opening readback file");
+		return;
+	}
+	uint32_t width = swap_chain_extent.width;
+	uint32_t height = swap_chain_extent.height;
+	const unsigned char *pixels = frame->readback_allocation.mapped;
+	unsigned char *row = malloc(width * 3);
+
+	fprintf(file, "P6\n%u %u\n255\n", width, height);
+	for (uint32_t y = 0; y < height; y++) {
+		for (uint32_t x = 0; x < width; x++) {
+			const unsigned char *pixel =
+				&pixels[((size_t)y * width + x) * 4];
+			row[x * 3 + 0] = pixel[2];
+			row[x * 3 + 1] = pixel[1];
+			row[x * 3 + 2] = pixel[0];
+		}
+		fwrite(row, 1, width * 3, file);
+	}
+	free(row);
+	fclose(file);
 }
 
 void vk_create_surface()
@@ -716,21 +2177,72 @@ void vk_create_logical_device()
 	QueueFamilyIndices indices = vk_find_queue_families(physical_device);
 
 	float queue_priority = { 1.0f };
-	VkDeviceQueueCreateInfo queueCreateInfo = {
-		.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
-		.queueFamilyIndex = indices.graphicsFamily,
-		.queueCount = 1,
-		.pQueuePriorities = &queue_priority
-	};
+	uint32_t families[] = { indices.graphicsFamily, indices.presentFamily,
+				indices.computeFamily, indices.transferFamily };
+	VkDeviceQueueCreateInfo queueCreateInfos[4];
+	uint32_t queueCreateInfoCount = 0;
+	for (uint32_t i = 0; i < 4; i++) {
+		bool seen = false;
+		for (uint32_t j = 0; j < queueCreateInfoCount; j++) {
+			seen |= queueCreateInfos[j].queueFamilyIndex ==
+				families[i];
+		}
+		if (seen) {
+			continue;
+		}
+		queueCreateInfos[queueCreateInfoCount++] =
+			(VkDeviceQueueCreateInfo){
+				.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
+				.queueFamilyIndex = families[i],
+				.queueCount = 1,
+				.pQueuePriorities = &queue_priority
+			};
+	}
 
 	VkPhysicalDeviceFeatures deviceFeatures = {};
+	const char *extensions[NUM_DEVICE_EXTENSIONS + 1];
+	uint32_t extensionCount = 0;
+	if (!headless) {
+		for (uint32_t i = 0; i < NUM_DEVICE_EXTENSIONS; i++) {
+			extensions[extensionCount++] = device_extensions[i];
+		}
+	}
+	bool indirectCount = false;
+	if (gpu_culling) {
+		// Indirect draws pick the object's transform through
+		// firstInstance, which is optional in indirect commands
+		VkPhysicalDeviceFeatures supported;
+		vkGetPhysicalDeviceFeatures(physical_device, &supported);
+		if (!supported.drawIndirectFirstInstance) {
+			printf("No drawIndirectFirstInstance, culling on the GPU is disabled\n");
+			gpu_culling = false;
+		}
+		deviceFeatures.drawIndirectFirstInstance =
+			supported.drawIndirectFirstInstance;
+		deviceFeatures.multiDrawIndirect = supported.multiDrawIndirect;
+		multi_draw_indirect = supported.multiDrawIndirect;
+		indirectCount = gpu_culling &&
+				vk_has_device_extension(
+					VK_KHR_DRAW_INDIRECT_COUNT_EXTENSION_NAME);
+		if (indirectCount) {
+			extensions[extensionCount++] =
+				VK_KHR_DRAW_INDIRECT_COUNT_EXTENSION_NAME;
+		}
+	}
+	VkPhysicalDeviceDescriptorIndexingFeatures indexingFeatures = {};
+	if (bindless && !descriptors_bindless_supported(physical_device,
+							&indexingFeatures)) {
+		printf("No descriptor indexing, bindless descriptors are disabled\n");
+		bindless = false;
+	}
 	VkDeviceCreateInfo createInfo = {
 		.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
-		.pQueueCreateInfos = &queueCreateInfo,
-		.queueCreateInfoCount = 1,
+		.pNext = bindless ? &indexingFeatures : nullptr,
+		.pQueueCreateInfos = queueCreateInfos,
+		.queueCreateInfoCount = queueCreateInfoCount,
 		.pEnabledFeatures = &deviceFeatures,
-		.enabledExtensionCount = NUM_DEVICE_EXTENSIONS,
-		.ppEnabledExtensionNames = device_extensions
+		.enabledExtensionCount = extensionCount,
+		.ppEnabledExtensionNames = extensions
 	};
 
 	if (vkCreateDevice(physical_device, &createInfo, nullptr, &device) !=
@@ -739,8 +2251,35 @@ void vk_create_logical_device()
 		exit(1);
 	}
 	vkGetDeviceQueue(device, indices.graphicsFamily, 0, &graphics_queue);
-	printf("%d", indices.graphicsFamily);
 	vkGetDeviceQueue(device, indices.presentFamily, 0, &present_queue);
+	vkGetDeviceQueue(device, indices.computeFamily, 0, &compute_queue);
+	vkGetDeviceQueue(device, indices.transferFamily, 0, &transfer_queue);
+	async_compute =
+		gpu_culling && indices.computeFamily != indices.graphicsFamily;
+	printf("Queue families: graphics %u, compute %u, transfer %u\n",
+	       indices.graphicsFamily, indices.computeFamily,
+	       indices.transferFamily);
+	if (indirectCount) {
+		draw_indirect_count = (PFN_vkCmdDrawIndexedIndirectCount)
+			vkGetDeviceProcAddr(device,
+					    "vkCmdDrawIndexedIndirectCountKHR");
+	}
+}
+
+bool vk_has_device_extension(const char *name)
+{
+	uint32_t count = 0;
+	vkEnumerateDeviceExtensionProperties(physical_device, nullptr, &count,
+					     nullptr);
+	VkExtensionProperties properties[count];
+	vkEnumerateDeviceExtensionProperties(physical_device, nullptr, &count,
+					     properties);
+	for (uint32_t i = 0; i < count; i++) {
+		if (strcmp(properties[i].extensionName, name) == 0) {
+			return true;
+		}
+	}
+	return false;
 }
 
 void vk_pick_physical_device()
@@ -758,7 +2297,8 @@ void vk_pick_physical_device()
 
 QueueFamilyIndices vk_find_queue_families(VkPhysicalDevice device)
 {
-	QueueFamilyIndices indices = { UINT32_MAX, UINT32_MAX };
+	QueueFamilyIndices indices = { UINT32_MAX, UINT32_MAX, UINT32_MAX,
+				       UINT32_MAX };
 	uint32_t queueFamilyCount = {};
 	vkGetPhysicalDeviceQueueFamilyProperties(device, &queueFamilyCount,
 						 nullptr);
@@ -766,9 +2306,30 @@ QueueFamilyIndices vk_find_queue_families(VkPhysicalDevice device)
 	vkGetPhysicalDeviceQueueFamilyProperties(device, &queueFamilyCount,
 						 queueFamilies);
 
+	uint32_t computeFamily = UINT32_MAX;
 	for (uint32_t i = 0; i < queueFamilyCount; i++) {
+		// A transfer-only family is usually backed by a copy engine
+		// and a compute family without graphics by an async compute
+		// engine, both run alongside rendering
+		VkQueueFlags flags = queueFamilies[i].queueFlags;
+		if ((flags & VK_QUEUE_TRANSFER_BIT) &&
+		    !(flags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT)) &&
+		    indices.transferFamily == UINT32_MAX) {
+			indices.transferFamily = i;
+		}
+		if ((flags & VK_QUEUE_COMPUTE_BIT) &&
+		    !(flags & VK_QUEUE_GRAPHICS_BIT) &&
+		    computeFamily == UINT32_MAX) {
+			computeFamily = i;
+		}
 		if (queueFamilies[i].queueFlags & VK_QUEUE_GRAPHICS_BIT) {
 			indices.graphicsFamily = i;
+			if (headless) {
+				// Nothing is presented, the graphics queue
+				// stands in so callers need no special case
+				indices.presentFamily = i;
+				continue;
+			}
 			VkBool32 presentSupport = false;
 			vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface,
 							     &presentSupport);
@@ -777,6 +2338,13 @@ QueueFamilyIndices vk_find_queue_families(VkPhysicalDevice device)
 			}
 		}
 	}
+	indices.computeFamily = computeFamily != UINT32_MAX ?
+					computeFamily :
+					indices.graphicsFamily;
+	// Compute queues can copy as well
+	if (indices.transferFamily == UINT32_MAX) {
+		indices.transferFamily = indices.computeFamily;
+	}
 
 	return indices;
 }
@@ -801,18 +2369,21 @@ void vk_create_instance()
 		.applicationVersion = VK_MAKE_VERSION(1, 0, 0),
 		.pEngineName = "No Engine",
 		.engineVersion = VK_MAKE_VERSION(1, 0, 0),
-		.apiVersion = VK_API_VERSION_1_0
+		// Descriptor indexing is core in 1.2
+		.apiVersion = bindless ? VK_API_VERSION_1_2 : VK_API_VERSION_1_0
 	};
 
 	uint32_t enabled_extension_count = 0;
-	if (!SDL_Vulkan_GetInstanceExtensions(window, &enabled_extension_count,
+	if (!headless &&
+	    !SDL_Vulkan_GetInstanceExtensions(window, &enabled_extension_count,
 					      nullptr)) {
 		fprintf(stderr, "SDL Vulkan Extensions Failed");
 	}
 
-	const char *extension_names[enabled_extension_count];
+	const char *extension_names[enabled_extension_count + 1];
 
-	if (!SDL_Vulkan_GetInstanceExtensions(window, &enabled_extension_count,
+	if (!headless &&
+	    !SDL_Vulkan_GetInstanceExtensions(window, &enabled_extension_count,
 					      extension_names)) {
 		fprintf(stderr, "SDL Vulkan Extensions Names Failed");
 	}
@@ -864,109 +2435,433 @@ float interpolate(float from, float to, float progress)
 {
 	return from + progress * (to - from);
 }
-float elapsed = 0;
-float current = 0;
-void update_uniform_buffer()
+static uint64_t last_frame_start;
+static float rotation;
+
+// Copies world matrices recomputed by the transform hierarchy to the draw
+// list and the instance stream. Untouched nodes are not even visited.
+void vk_update_transforms()
 {
-	clock_t start = clock();
-	UniformBufferObject ubo = {};
+	uint32_t updatedCount = transform_update();
+	const uint32_t *updated = transform_updated();
+	bool instancesChanged = false;
+	for (uint32_t i = 0; i < updatedCount; i++) {
+		uint32_t id = updated[i];
+		if (id >= first_instance_node) {
+			uint32_t instance = id - first_instance_node;
+			transform_get_world(id, instances[instance].model);
+			instancesChanged = true;
+			// The scene objects are made from the first update
+			for (uint32_t draw = 0;
+			     draw_spheres != nullptr && draw < draw_count;
+			     draw++) {
+				vk_update_scene_object(draw * instance_count +
+						       instance);
+			}
+		} else if (id == model_node) {
+			// The draw list is only read while recording, which
+			// happens after this, so it can be updated in place
+			mat4 model;
+			transform_get_world(model_node, model);
+			for (uint32_t draw = 0; draw < draw_count; draw++) {
+				glm_mat4_copy(model,
+					      draw_list[draw].constants.model);
+			}
+		}
+	}
+	if (instancesChanged) {
+		instance_generation++;
+	}
+}
 
-	//ubo.model = rotate(mat4(1.0f), time * radians(90.0f), vec3(0.0f, 0.0f, 1.0f));
-	glm_mat4_identity(ubo.model);
-	current += (elapsed * 50.0f);
-	glm_rotate(ubo.model, current, (vec3){ 0.0f, 0.0f, 1.0f });
+// The camera is fixed, so view and projection only change with the extent
+void vk_update_camera()
+{
+	if (camera_extent.width == swap_chain_extent.width &&
+	    camera_extent.height == swap_chain_extent.height) {
+		return;
+	}
+	camera_extent = swap_chain_extent;
 	//ubo.view = glm::lookAt(glm::vec3(2.0f, 2.0f, 2.0f), glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(0.0f, 0.0f, 1.0f));
 	glm_lookat((vec3){ 2.0f, 2.0f, 2.0f }, (vec3){ 0.0f, 0.0f, 0.0f },
-		   (vec3){ 0.0f, 0.0f, 1.0f }, ubo.view);
+		   (vec3){ 0.0f, 0.0f, 1.0f }, camera_view);
 	//ubo.proj = glm::perspective(glm::radians(45.0f), swapChainExtent.width / (float) swapChainExtent.height, 0.1f, 10.0f);
 	glm_perspective(glm_rad(45.0f),
 			swap_chain_extent.width /
 				(float)swap_chain_extent.height,
-			0.1f, 10.0f, ubo.proj);
-	ubo.proj[1][1] *= -1;
-	memcpy(uniformBufferMapped, &ubo, sizeof(ubo));
+			0.1f, 10.0f, camera_proj);
+	camera_proj[1][1] *= -1;
+	glm_mat4_mul(camera_proj, camera_view, camera_view_proj);
+}
+
+// The slot is free once its fence signaled, so it can be rewritten in place
+void update_instance_buffer(FrameData *frame)
+{
+	if (frame->instance_generation == instance_generation) {
+		return;
+	}
+	memcpy(frame->instance_mapped, instances,
+	       sizeof(InstanceData) * instance_count);
+	if (gpu_culling) {
+		// Object i * instance_count + j is instance j of submesh i
+		mat4 *transforms = cull_transforms(frame - frames);
+		for (uint32_t i = 0; i < draw_count; i++) {
+			for (uint32_t j = 0; j < instance_count; j++) {
+				glm_mat4_copy(instances[j].model,
+					      transforms[i * instance_count +
+							 j]);
+			}
+		}
+	}
+	frame->instance_generation = instance_generation;
+}
+void update_uniform_buffer(FrameData *frame)
+{
+	UniformBufferObject ubo = {};
 
-	elapsed = (clock() - start) / (float)CLOCKS_PER_SEC;
+	if (frame_delta != 0.0f) {
+		rotation += frame_delta * glm_rad(90.0f);
+		mat4 model;
+		glm_rotate_make(model, rotation, (vec3){ 0.0f, 0.0f, 1.0f });
+		transform_set_local(model_node, model);
+	}
+	vk_update_transforms();
+	vk_update_camera();
+	glm_mat4_copy(camera_view, ubo.view);
+	glm_mat4_copy(camera_proj, ubo.proj);
+	mat4 model, modelViewProj;
+	transform_get_world(model_node, model);
+	glm_mat4_mul(camera_view_proj, model, modelViewProj);
+	glm_frustum_planes(modelViewProj, frustum_planes);
+	// Bounds are in object space, the camera looks down -z in view space
+	mat4 viewModel;
+	glm_mat4_mul(camera_view, model, viewModel);
+	for (uint32_t axis = 0; axis < 4; axis++) {
+		depth_axis[axis] = -viewModel[axis][2];
+	}
+	// An object space error e at view depth d covers
+	// e * scale * |proj[1][1]| * height / 2 / d pixels
+	lod_error_per_depth = 2.0f * lod_pixel_error /
+			      (glm_vec3_norm(viewModel[0]) *
+			       fabsf(camera_proj[1][1]) * camera_extent.height);
+	frame->uniform_offset = uniform_ring_push(&ubo, sizeof(ubo));
 }
 void vk_draw_frame()
 {
-	vkWaitForFences(device, 1, &in_flight_fence, VK_TRUE, UINT64_MAX);
-	vkResetFences(device, 1, &in_flight_fence);
-	uint32_t imageIndex;
-	vkAcquireNextImageKHR(device, swap_chain, UINT64_MAX,
-			      image_available_semaphore, VK_NULL_HANDLE,
-			      &imageIndex);
-	vkResetCommandBuffer(command_buffer, 0);
-	vk_record_command_buffer(command_buffer, imageIndex);
+	FrameData *frame = &frames[current_frame];
+	profiler_frame_begin();
+	uint64_t frameStart = profiler_begin();
+	// Offscreen runs advance a fixed step so their output is reproducible
+	if (headless) {
+		frame_delta = 1.0f / 60.0f;
+	} else if (last_frame_start != 0) {
+		frame_delta = (frameStart - last_frame_start) / 1e9f;
+	}
+	last_frame_start = frameStart;
+
+	// Only wait for the GPU to release this slot, earlier slots may still
+	// be in flight
+	uint64_t scope = profiler_begin();
+	vkWaitForFences(device, 1, &frame->in_flight_fence, VK_TRUE,
+			UINT64_MAX);
+	profiler_end("wait fence", scope);
+	profiler_gpu_collect(current_frame);
+	descriptors_reset_frame(current_frame);
+	uint32_t imageIndex = current_frame;
+	if (!headless) {
+		vk_destroy_retired_swap_chains(false);
+		scope = profiler_begin();
+		VkResult result = vkAcquireNextImageKHR(
+			device, swap_chain, UINT64_MAX,
+			frame->image_available_semaphore, VK_NULL_HANDLE,
+			&imageIndex);
+		profiler_end("acquire", scope);
+		// Nothing was submitted yet, the fence stays signaled and the
+		// slot is reused by the next attempt
+		if (result == VK_ERROR_OUT_OF_DATE_KHR) {
+			vk_recreate_swap_chain();
+			return;
+		}
+		if (result != VK_SUCCESS && result != VK_SUBOPTIMAL_KHR) {
+			fprintf(stderr, "Failed to acquire swap chain image");
+			exit(1);
+		}
+	}
+	vkResetFences(device, 1, &frame->in_flight_fence);
+	uint64_t submitStart = profiler_begin();
+	scope = submitStart;
+	// This frame's submission waits on every upload that finished so far,
+	// which is what makes them visible. Taken before anything checks
+	// visibility, so data is first used by the frame that waits on it.
+	VkSemaphore uploadSemaphores[UPLOAD_MAX_BATCHES];
+	uint32_t uploadCount =
+		upload_take_semaphores(uploadSemaphores, UPLOAD_MAX_BATCHES);
+	vk_stream_mesh();
+	if (texture_update()) {
+		vk_update_materials();
+	}
+	if (!bindless) {
+		vk_write_material_set(frame);
+	}
+	profiler_end("stream", scope);
+	// Uniform offsets are baked into the commands, so the data is placed
+	// before recording. The slot's fence signaled, its region is free.
+	scope = profiler_begin();
+	uniform_ring_begin(current_frame);
+	update_uniform_buffer(frame);
+	update_instance_buffer(frame);
+	profiler_end("update buffers", scope);
+	if (!gpu_culling && geometry_ready) {
+		scope = profiler_begin();
+		vk_cull_draws();
+		profiler_end("cull", scope);
+	}
+	scope = profiler_begin();
+	vkResetCommandBuffer(frame->command_buffer, 0);
+	vk_record_command_buffer(frame->command_buffer, imageIndex);
+	profiler_end("record", scope);
 	VkSubmitInfo submitInfo = {};
 	submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
 
-	VkSemaphore waitSemaphores[] = { image_available_semaphore };
-	VkPipelineStageFlags waitStages[] = {
-		VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT
-	};
-	submitInfo.waitSemaphoreCount = 1;
+	// The uploads taken above are already signaled and never stall
+	VkSemaphore waitSemaphores[2 + UPLOAD_MAX_BATCHES];
+	VkPipelineStageFlags waitStages[2 + UPLOAD_MAX_BATCHES];
+	uint32_t waitCount = 0;
+	if (!headless) {
+		waitSemaphores[waitCount] = frame->image_available_semaphore;
+		waitStages[waitCount++] =
+			VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+	}
+	if (geometry_ready && gpu_culling && async_compute) {
+		scope = profiler_begin();
+		vk_submit_cull(frame, uploadSemaphores, uploadCount);
+		profiler_end("cull", scope);
+		// The culling submission waited on the uploads, they reach
+		// the stages reading them through its semaphore
+		waitSemaphores[waitCount] = frame->cull_finished_semaphore;
+		waitStages[waitCount++] = VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT |
+					  VK_PIPELINE_STAGE_VERTEX_INPUT_BIT |
+					  VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+		uploadCount = 0;
+	}
+	for (uint32_t i = 0; i < uploadCount; i++) {
+		waitSemaphores[waitCount] = uploadSemaphores[i];
+		// The culling pass reads uploaded objects before any vertex
+		// input, textures are first sampled by fragments
+		waitStages[waitCount++] = VK_PIPELINE_STAGE_VERTEX_INPUT_BIT |
+					  VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT |
+					  VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+	}
+	submitInfo.waitSemaphoreCount = waitCount;
 	submitInfo.pWaitSemaphores = waitSemaphores;
 	submitInfo.pWaitDstStageMask = waitStages;
 	submitInfo.commandBufferCount = 1;
-	submitInfo.pCommandBuffers = &command_buffer;
-	VkSemaphore signalSemaphores[] = { render_finished_semaphore };
-	submitInfo.signalSemaphoreCount = 1;
-	submitInfo.pSignalSemaphores = signalSemaphores;
-	update_uniform_buffer();
-	if (vkQueueSubmit(graphics_queue, 1, &submitInfo, in_flight_fence) !=
-	    VK_SUCCESS) {
+	submitInfo.pCommandBuffers = &frame->command_buffer;
+	submitInfo.signalSemaphoreCount = headless ? 0 : 1;
+	submitInfo.pSignalSemaphores =
+		headless ? nullptr : &present_semaphores[imageIndex];
+	scope = profiler_begin();
+	if (vkQueueSubmit(graphics_queue, 1, &submitInfo,
+			  frame->in_flight_fence) != VK_SUCCESS) {
 		fprintf(stderr, "Failed to submit command in queue");
 		exit(1);
 	}
+	profiler_gpu_submitted(current_frame);
+	profiler_end("submit", scope);
+	frames_submitted++;
+	uint64_t submitEnd = profiler_now();
+	if (headless) {
+		current_frame = (current_frame + 1) % frames_in_flight;
+		vk_end_frame(frameStart, submitStart, submitEnd);
+		return;
+	}
 
 	VkPresentInfoKHR presentInfo = {};
 	presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
 	presentInfo.waitSemaphoreCount = 1;
-	presentInfo.pWaitSemaphores = signalSemaphores;
+	presentInfo.pWaitSemaphores = &present_semaphores[imageIndex];
 	VkSwapchainKHR swapChains[] = { swap_chain };
 	presentInfo.swapchainCount = 1;
 	presentInfo.pSwapchains = swapChains;
 	presentInfo.pImageIndices = &imageIndex;
-	vkQueuePresentKHR(present_queue, &presentInfo);
+	scope = profiler_begin();
+	VkResult result = vkQueuePresentKHR(present_queue, &presentInfo);
+	profiler_end("present", scope);
+	if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR) {
+		vk_recreate_swap_chain();
+	} else if (result != VK_SUCCESS) {
+		fprintf(stderr, "Failed to present swap chain image");
+		exit(1);
+	}
+
+	current_frame = (current_frame + 1) % frames_in_flight;
+	vk_end_frame(frameStart, submitStart, submitEnd);
+}
+
+// Submit time covers the CPU work of producing a frame, from the moment the
+// slot and image are available until the submit returned
+void vk_end_frame(uint64_t frameStart, uint64_t submitStart,
+		  uint64_t submitEnd)
+{
+	profiler_end("frame", frameStart);
+	if (stats == nullptr || stats->frames >= stats->capacity) {
+		return;
+	}
+	stats->frame_ms[stats->frames] = (profiler_now() - frameStart) / 1e6;
+	stats->submit_ms[stats->frames] = (submitEnd - submitStart) / 1e6;
+	stats->render.draws +=
+		atomic_load_explicit(&frame_draws, memory_order_relaxed);
+	stats->render.binds +=
+		atomic_load_explicit(&frame_binds, memory_order_relaxed);
+	stats->render.binds_skipped += atomic_load_explicit(
+		&frame_binds_skipped, memory_order_relaxed);
+	stats->frames++;
 }
 
 void app_main_loop()
 {
 	SDL_Event event;
 	bool running = true;
+	uint32_t frames_drawn = 0;
+	if (headless) {
+		// Offscreen runs render a fixed number of frames, every one of
+		// them should contain the mesh
+		while (!mesh_streamed) {
+			vk_stream_mesh();
+		}
+		upload_wait(geometry_ticket);
+	}
 	while (running) {
-		while (SDL_PollEvent(&event)) {
+		while (!headless && SDL_PollEvent(&event)) {
 			if (event.type == SDL_QUIT) {
 				running = false;
+			} else if (event.type == SDL_WINDOWEVENT &&
+				   (event.window.event ==
+					    SDL_WINDOWEVENT_SIZE_CHANGED ||
+				    event.window.event ==
+					    SDL_WINDOWEVENT_RESIZED)) {
+				framebuffer_resized = true;
 			}
 		}
+		// A minimized window has no extent to present to, sleep until
+		// it is restored
+		if (!headless &&
+		    SDL_GetWindowFlags(window) & SDL_WINDOW_MINIMIZED) {
+			SDL_WaitEvent(nullptr);
+			continue;
+		}
+		if (!headless && framebuffer_resized &&
+		    !vk_recreate_swap_chain()) {
+			continue;
+		}
 		vk_draw_frame();
-		vkDeviceWaitIdle(device);
+		frames_drawn++;
+		if (frame_count > 0 && frames_drawn >= frame_count) {
+			running = false;
+		}
+	}
+	vkDeviceWaitIdle(device);
+	if (stats != nullptr) {
+		allocator_get_stats(&stats->memory);
+		texture_get_stats(&stats->textures);
+		stats->particles = particle_count;
+	}
+	for (uint32_t i = 0; i < frames_in_flight; i++) {
+		profiler_gpu_collect(i);
+	}
+	if (trace_path != nullptr) {
+		profiler_export(trace_path);
+	}
+	if (readback_path != nullptr && frames_drawn > 0) {
+		uint32_t last = (current_frame + frames_in_flight - 1) %
+				frames_in_flight;
+		vk_write_readback(&frames[last], readback_path);
 	}
 }
 
 void app_clean_up()
 {
-	vkFreeMemory(device, uniformBufferMemory, nullptr);
-	vkDestroyBuffer(device, uniformBuffer, nullptr);
-	vkDestroyDescriptorPool(device, descriptorPool, nullptr);
-	vkDestroyDescriptorSetLayout(device, descriptorSetLayout, nullptr);
-	vkFreeMemory(device, indexBufferMemory, nullptr);
-	vkDestroyBuffer(device, indexBuffer, nullptr);
-	vkFreeMemory(device, vertexBufferMemory, nullptr);
-	vkDestroyBuffer(device, vertexBuffer, nullptr);
-	vkDestroySemaphore(device, image_available_semaphore, nullptr);
-	vkDestroySemaphore(device, render_finished_semaphore, nullptr);
-	vkDestroyFence(device, in_flight_fence, nullptr);
+	uniform_ring_destroy();
+	allocator_destroy_buffer(instanceBuffer, &instanceBufferAllocation);
+	free(instances);
+	transform_destroy();
+	allocator_destroy_buffer(indexBuffer, &indexBufferAllocation);
+	allocator_destroy_buffer(vertexBuffer, &vertexBufferAllocation);
+	texture_destroy();
+	if (particle_count > 0) {
+		particles_destroy();
+	}
+	upload_destroy();
+	mesh_close(&mesh);
+	if (record_threads > 0 && !gpu_culling) {
+		record_destroy();
+	}
+	if (gpu_culling) {
+		cull_destroy();
+	} else {
+		scene_destroy();
+		render_queue_destroy();
+		free(visible_ids);
+		free(object_lods);
+		free(draw_spheres);
+		free(queued_draws);
+		free(queued_keys);
+		free(cull_block_visible);
+		free(cull_block_offset);
+	}
+	descriptors_destroy();
+	free(draw_list);
+	jobs_destroy();
+	for (uint32_t i = 0; i < frames_in_flight; i++) {
+		vkDestroySemaphore(device, frames[i].image_available_semaphore,
+				   nullptr);
+		vkDestroyFence(device, frames[i].in_flight_fence, nullptr);
+		if (async_compute) {
+			vkDestroySemaphore(device,
+					   frames[i].cull_finished_semaphore,
+					   nullptr);
+		}
+		if (frames[i].readback_buffer != VK_NULL_HANDLE) {
+			allocator_destroy_buffer(frames[i].readback_buffer,
+						 &frames[i].readback_allocation);
+		}
+	}
 	vkDestroyCommandPool(device, command_pool, nullptr);
+	if (async_compute) {
+		vkDestroyCommandPool(device, compute_command_pool, nullptr);
+	}
 	vkDestroyRenderPass(device, render_pass, nullptr);
 	vkDestroyPipeline(device, graphics_pipeline, nullptr);
+	if (depth_prepass) {
+		vkDestroyPipeline(device, depth_pipeline, nullptr);
+	}
+	if (particle_count > 0) {
+		vkDestroyPipeline(device, particle_pipeline, nullptr);
+	}
 	vkDestroyPipelineLayout(device, pipeline_layout, nullptr);
+	pipeline_cache_destroy();
+	profiler_destroy();
 	for (uint32_t i = 0; i < swap_chain_image_count; i++) {
 		vkDestroyFramebuffer(device, swapChainFramebuffers[i], nullptr);
 		vkDestroyImageView(device, swap_chain_image_views[i], nullptr);
+		if (headless) {
+			allocator_destroy_image(swap_chain_images[i],
+						&offscreen_image_allocations[i]);
+		}
+	}
+	vkDestroyImageView(device, depth_view, nullptr);
+	allocator_destroy_image(depth_image, &depth_allocation);
+	allocator_destroy();
+	if (headless) {
+		vkDestroyDevice(device, nullptr);
+		vkDestroyInstance(instance, nullptr);
+		return;
+	}
+	vk_destroy_retired_swap_chains(true);
+	for (uint32_t i = 0; i < swap_chain_image_count; i++) {
+		vkDestroySemaphore(device, present_semaphores[i], nullptr);
 	}
+	free(present_semaphores);
 	vkDestroySwapchainKHR(device, swap_chain, nullptr);
 	vkDestroyDevice(device, nullptr);
 	vkDestroySurfaceKHR(instance, surface, nullptr);
@@ -1,2 +1,93 @@
 #pragma once
-void app_run();
+#include "allocator.h"
+#include "render_queue.h"
+#include "texture.h"
+#include <stdint.h>
+
+#define MAX_FRAMES_IN_FLIGHT 3
+#define DEFAULT_FRAMES_IN_FLIGHT 2
+#define DEFAULT_PIPELINE_CACHE_PATH "pipeline_cache.bin"
+#define DEFAULT_LOD_PIXEL_ERROR 1.0f
+
+// How frames reach the screen, falls back to what the surface supports
+typedef enum {
+	// Vsync, never tears, the only mode every surface supports
+	PRESENT_FIFO,
+	// Vsync that tears when a frame misses its interval
+	PRESENT_FIFO_RELAXED,
+	// Lowest latency without tearing, newer frames replace queued ones
+	PRESENT_MAILBOX,
+	// Uncapped, tears, for throughput measurements
+	PRESENT_IMMEDIATE
+} PresentMode;
+
+typedef struct {
+	// Caller owned arrays with room for `capacity` frames
+	double *frame_ms;
+	double *submit_ms;
+	uint32_t capacity;
+	// Frames written to the arrays
+	uint32_t frames;
+	// Device memory in use after the last frame
+	AllocatorStats memory;
+	// Draws recorded from the render queue and the binds issued and
+	// skipped for them, summed over the frames written. Stays zero with
+	// GPU culling, which draws indirectly.
+	RenderStats render;
+	// Texture residency after the last frame
+	TextureStats textures;
+	// Particles simulated and drawn every frame
+	uint32_t particles;
+} AppStats;
+
+typedef struct {
+	// Number of frames the CPU may record ahead of the GPU
+	uint32_t frames_in_flight;
+	// Render into offscreen images without a window or swap chain
+	bool headless;
+	// Requested swap chain present mode, ignored when headless
+	PresentMode present_mode;
+	// Stop after this many frames, 0 runs until the window is closed
+	uint32_t frame_count;
+	// Optional PPM file receiving the last rendered frame
+	const char *readback_path;
+	// Binary mesh file to draw, nullptr draws the built-in quad
+	const char *mesh_path;
+	// Texture of the mesh, a .ntex container or a binary PPM. nullptr
+	// uses a built-in checkerboard.
+	const char *texture_path;
+	// Device memory the texture's levels may take in bytes, 0 for
+	// TEXTURE_DEFAULT_BUDGET
+	uint64_t texture_budget;
+	// Copies of the mesh drawn with a single instanced draw call
+	uint32_t instance_count;
+	// Secondary command buffers recorded in parallel on the job system,
+	// 0 records inline
+	uint32_t record_threads;
+	// Threads of the job system including the main thread, 0 uses every
+	// online CPU
+	uint32_t job_threads;
+	// Cull on the GPU and draw indirectly, every submesh of every
+	// instance is one object. Recording is always inline then.
+	bool gpu_culling;
+	// Lay down depth in a first pass and shade each pixel once in a
+	// second pass testing for EQUAL depth
+	bool depth_prepass;
+	// Bind one update-after-bind set of buffer and image arrays instead
+	// of sets per material, when the device has descriptor indexing
+	bool bindless;
+	// Particles simulated by a compute pass and drawn as points, 0 for
+	// none
+	uint32_t particle_count;
+	// Largest error in pixels a mesh's level of detail may show, 0 always
+	// draws level 0. Levels come from meshes cooked by nebula-cook.
+	float lod_pixel_error;
+	// File the pipeline cache is loaded from and saved to
+	const char *pipeline_cache_path;
+	// Chrome trace JSON, or CSV when it ends in .csv, written on exit
+	const char *trace_path;
+	// Optional, receives per-frame CPU timings and memory usage
+	AppStats *stats;
+} AppConfig;
+
+void app_run(const AppConfig *config);
@@ -0,0 +1,17 @@
+#version 450
+#extension GL_EXT_nonuniform_qualifier : require
+
+// The bindless image array, see descriptors.h
+layout(set = 1, binding = 1) uniform sampler2D textures[];
+
+layout(location = 0) in vec3 fragColor;
+layout(location = 1) in vec2 fragTexCoord;
+// Bindless image slot of the draw's texture
+layout(location = 2) flat in uint fragMaterial;
+
+layout(location = 0) out vec4 outColor;
+
+void main() {
+    outColor = vec4(fragColor, 1.0) *
+               texture(textures[nonuniformEXT(fragMaterial)], fragTexCoord);
+}
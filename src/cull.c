@@ -0,0 +1,372 @@
+#include "cull.h"
+#include "allocator.h"
+#include "app.h"
+#include "descriptors.h"
+#include "shaders.h"
+#include "upload.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CULL_GROUP_SIZE 64
+
+// Push constants of cull.comp
+typedef struct {
+	vec4 planes[6];
+	vec4 depth_axis;
+	uint32_t object_count;
+	uint32_t compact;
+	uint32_t lod_count;
+	float lod_error_per_depth;
+} CullConstants;
+
+typedef struct {
+	// Host written, the slot's copy of the transforms is rewritten once
+	// the frames that read it finished
+	VkBuffer transforms;
+	Allocation transforms_allocation;
+	VkBuffer draws;
+	Allocation draws_allocation;
+	VkBuffer count;
+	Allocation count_allocation;
+	VkDescriptorSet descriptor_set;
+} CullSlot;
+
+static VkDevice device;
+static uint32_t object_count;
+static uint32_t slot_count;
+static VkBuffer object_buffer;
+static Allocation object_allocation;
+static VkBuffer lod_buffer;
+static Allocation lod_allocation;
+static uint32_t levels;
+static CullSlot slots[MAX_FRAMES_IN_FLIGHT];
+static VkDescriptorSetLayout set_layout;
+static VkPipelineLayout pipeline_layout;
+static VkPipeline pipeline;
+static PFN_vkCmdDrawIndexedIndirectCount draw_indirect_count;
+static bool multi_draw;
+static uint32_t max_draw_count;
+static uint32_t compute_queue_family;
+static uint32_t graphics_queue_family;
+
+static void create_pipeline(VkPipelineCache pipeline_cache)
+{
+	VkDescriptorSetLayoutBinding bindings[5];
+	for (uint32_t i = 0; i < 5; i++) {
+		bindings[i] = (VkDescriptorSetLayoutBinding){
+			.binding = i,
+			.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+			.descriptorCount = 1,
+			.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT
+		};
+	}
+	VkDescriptorSetLayoutCreateInfo layoutInfo = {
+		.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+		.bindingCount = 5,
+		.pBindings = bindings
+	};
+	set_layout = descriptors_layout(&layoutInfo);
+	VkPushConstantRange pushConstantRange = {
+		.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+		.offset = 0,
+		.size = sizeof(CullConstants)
+	};
+	VkPipelineLayoutCreateInfo pipelineLayoutInfo = {
+		.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+		.setLayoutCount = 1,
+		.pSetLayouts = &set_layout,
+		.pushConstantRangeCount = 1,
+		.pPushConstantRanges = &pushConstantRange
+	};
+	if (vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr,
+				   &pipeline_layout) != VK_SUCCESS) {
+		fprintf(stderr, "Can't create culling pipeline layout");
+		exit(1);
+	}
+
+	ShaderBinary code = shader_get("cull");
+	VkShaderModuleCreateInfo moduleInfo = {
+		.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
+		.codeSize = code.size,
+		.pCode = code.code
+	};
+	VkShaderModule module;
+	if (vkCreateShaderModule(device, &moduleInfo, nullptr, &module) !=
+	    VK_SUCCESS) {
+		fprintf(stderr, "Can't create culling shader module");
+		exit(1);
+	}
+	shader_release(code);
+	VkComputePipelineCreateInfo pipelineInfo = {
+		.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
+		.stage = {
+			.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+			.stage = VK_SHADER_STAGE_COMPUTE_BIT,
+			.module = module,
+			.pName = "main" },
+		.layout = pipeline_layout
+	};
+	if (vkCreateComputePipelines(device, pipeline_cache, 1, &pipelineInfo,
+				     nullptr, &pipeline) != VK_SUCCESS) {
+		fprintf(stderr, "Can't create culling pipeline");
+		exit(1);
+	}
+	vkDestroyShaderModule(device, module, nullptr);
+}
+
+static void create_descriptor_sets()
+{
+	for (uint32_t i = 0; i < slot_count; i++) {
+		slots[i].descriptor_set = descriptors_allocate(set_layout);
+		VkDescriptorBufferInfo buffers[5] = {
+			{ object_buffer, 0, VK_WHOLE_SIZE },
+			{ slots[i].transforms, 0, VK_WHOLE_SIZE },
+			{ slots[i].draws, 0, VK_WHOLE_SIZE },
+			{ slots[i].count, 0, VK_WHOLE_SIZE },
+			{ lod_buffer, 0, VK_WHOLE_SIZE },
+		};
+		VkWriteDescriptorSet writes[5];
+		for (uint32_t j = 0; j < 5; j++) {
+			writes[j] = (VkWriteDescriptorSet){
+				.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+				.dstSet = slots[i].descriptor_set,
+				.dstBinding = j,
+				.descriptorCount = 1,
+				.descriptorType =
+					VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+				.pBufferInfo = &buffers[j]
+			};
+		}
+		vkUpdateDescriptorSets(device, 5, writes, 0, nullptr);
+	}
+}
+
+void cull_init(VkPhysicalDevice physical_device, VkDevice logical_device,
+	       VkPipelineCache pipeline_cache, uint32_t frame_slots,
+	       const CullObject *objects, const mat4 *transforms,
+	       uint32_t count, const MeshLod *lods, uint32_t submesh_count,
+	       uint32_t lod_count,
+	       PFN_vkCmdDrawIndexedIndirectCount indirect_count,
+	       bool multi_draw_indirect, uint32_t compute_family,
+	       uint32_t graphics_family)
+{
+	device = logical_device;
+	compute_queue_family = compute_family;
+	graphics_queue_family = graphics_family;
+	object_count = count;
+	levels = lod_count;
+	slot_count = frame_slots;
+	draw_indirect_count = indirect_count;
+	multi_draw = multi_draw_indirect;
+	VkPhysicalDeviceProperties properties;
+	vkGetPhysicalDeviceProperties(physical_device, &properties);
+	max_draw_count = properties.limits.maxDrawIndirectCount;
+
+	upload_create_buffer(sizeof(CullObject) * object_count,
+			     VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+			     &object_buffer, &object_allocation);
+	upload_buffer(object_buffer, 0, objects,
+		      sizeof(CullObject) * object_count);
+	upload_create_buffer(sizeof(MeshLod) * submesh_count * levels,
+			     VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, &lod_buffer,
+			     &lod_allocation);
+	upload_buffer(lod_buffer, 0, lods,
+		      sizeof(MeshLod) * submesh_count * levels);
+
+	// One output per slot, a frame's dispatch must not overwrite the
+	// draws an earlier frame in flight still reads
+	uint32_t families[] = { compute_family, graphics_family };
+	uint32_t familyCount = compute_family != graphics_family ? 2 : 1;
+	VkBufferCreateInfo transformInfo = {
+		.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+		.size = sizeof(mat4) * object_count,
+		.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+			 VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+		// Read by the dispatch and by the draws, written by neither
+		.sharingMode = familyCount > 1 ? VK_SHARING_MODE_CONCURRENT :
+						 VK_SHARING_MODE_EXCLUSIVE,
+		.queueFamilyIndexCount = familyCount,
+		.pQueueFamilyIndices = families
+	};
+	for (uint32_t i = 0; i < slot_count; i++) {
+		allocator_create_buffer_info(
+			&transformInfo,
+			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+				VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+			VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+			&slots[i].transforms, &slots[i].transforms_allocation);
+		memcpy(slots[i].transforms_allocation.mapped, transforms,
+		       sizeof(mat4) * object_count);
+		allocator_create_buffer(
+			sizeof(VkDrawIndexedIndirectCommand) * object_count,
+			VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+				VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+			VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0,
+			&slots[i].draws, &slots[i].draws_allocation);
+		allocator_create_buffer(sizeof(uint32_t),
+					VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+						VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT |
+						VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+					VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0,
+					&slots[i].count,
+					&slots[i].count_allocation);
+	}
+	create_pipeline(pipeline_cache);
+	create_descriptor_sets();
+	printf("GPU culling %u objects, %s, %s\n", object_count,
+	       draw_indirect_count != nullptr ? "indirect count" :
+						"zero instance draws",
+	       compute_family != graphics_family ? "async compute" :
+						   "graphics queue");
+}
+
+void cull_destroy()
+{
+	vkDestroyPipeline(device, pipeline, nullptr);
+	vkDestroyPipelineLayout(device, pipeline_layout, nullptr);
+	for (uint32_t i = 0; i < slot_count; i++) {
+		allocator_destroy_buffer(slots[i].transforms,
+					 &slots[i].transforms_allocation);
+		allocator_destroy_buffer(slots[i].draws,
+					 &slots[i].draws_allocation);
+		allocator_destroy_buffer(slots[i].count,
+					 &slots[i].count_allocation);
+	}
+	allocator_destroy_buffer(lod_buffer, &lod_allocation);
+	allocator_destroy_buffer(object_buffer, &object_allocation);
+}
+
+VkBuffer cull_transform_buffer(uint32_t slot)
+{
+	return slots[slot].transforms;
+}
+
+mat4 *cull_transforms(uint32_t slot)
+{
+	return slots[slot].transforms_allocation.mapped;
+}
+
+// Both halves of moving a slot's draw and count buffers from the compute to
+// the graphics family must describe the same transfer
+static void ownership_barriers(const CullSlot *cull, VkAccessFlags src,
+			       VkAccessFlags dst,
+			       VkBufferMemoryBarrier barriers[2])
+{
+	VkBuffer buffers[2] = { cull->draws, cull->count };
+	for (uint32_t i = 0; i < 2; i++) {
+		barriers[i] = (VkBufferMemoryBarrier){
+			.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+			.srcAccessMask = src,
+			.dstAccessMask = dst,
+			.srcQueueFamilyIndex = compute_queue_family,
+			.dstQueueFamilyIndex = graphics_queue_family,
+			.buffer = buffers[i],
+			.offset = 0,
+			.size = VK_WHOLE_SIZE
+		};
+	}
+}
+
+void cull_dispatch(VkCommandBuffer command_buffer, uint32_t slot,
+		   vec4 planes[6], vec4 depth_axis,
+		   float lod_error_per_depth)
+{
+	CullSlot *cull = &slots[slot];
+	CullConstants constants = {
+		.object_count = object_count,
+		.compact = draw_indirect_count != nullptr,
+		.lod_count = levels,
+		.lod_error_per_depth = lod_error_per_depth
+	};
+	for (uint32_t i = 0; i < 6; i++) {
+		glm_vec4_copy(planes[i], constants.planes[i]);
+	}
+	glm_vec4_copy(depth_axis, constants.depth_axis);
+	if (constants.compact) {
+		vkCmdFillBuffer(command_buffer, cull->count, 0,
+				sizeof(uint32_t), 0);
+		VkMemoryBarrier clear = {
+			.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+			.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+			.dstAccessMask = VK_ACCESS_SHADER_READ_BIT |
+					 VK_ACCESS_SHADER_WRITE_BIT
+		};
+		vkCmdPipelineBarrier(command_buffer,
+				     VK_PIPELINE_STAGE_TRANSFER_BIT,
+				     VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1,
+				     &clear, 0, nullptr, 0, nullptr);
+	}
+	vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+			  pipeline);
+	vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+				pipeline_layout, 0, 1, &cull->descriptor_set, 0,
+				nullptr);
+	vkCmdPushConstants(command_buffer, pipeline_layout,
+			   VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(constants),
+			   &constants);
+	vkCmdDispatch(command_buffer,
+		      (object_count + CULL_GROUP_SIZE - 1) / CULL_GROUP_SIZE, 1,
+		      1);
+	if (compute_queue_family != graphics_queue_family) {
+		// The release half of the ownership transfer. The draws are
+		// rewritten from scratch every frame, so nothing is handed
+		// back after drawing.
+		VkBufferMemoryBarrier release[2];
+		ownership_barriers(cull, VK_ACCESS_SHADER_WRITE_BIT, 0,
+				   release);
+		vkCmdPipelineBarrier(command_buffer,
+				     VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+				     VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0,
+				     nullptr, 2, release, 0, nullptr);
+		return;
+	}
+	VkMemoryBarrier written = {
+		.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+		.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+		.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT
+	};
+	vkCmdPipelineBarrier(command_buffer,
+			     VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+			     VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT, 0, 1, &written,
+			     0, nullptr, 0, nullptr);
+}
+
+void cull_acquire(VkCommandBuffer command_buffer, uint32_t slot)
+{
+	if (compute_queue_family == graphics_queue_family) {
+		return;
+	}
+	VkBufferMemoryBarrier acquire[2];
+	ownership_barriers(&slots[slot], 0, VK_ACCESS_INDIRECT_COMMAND_READ_BIT,
+			   acquire);
+	// The semaphore wait blocks DRAW_INDIRECT, the acquire chains to it
+	vkCmdPipelineBarrier(command_buffer,
+			     VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT,
+			     VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT, 0, 0, nullptr,
+			     2, acquire, 0, nullptr);
+}
+
+void cull_draw(VkCommandBuffer command_buffer, uint32_t slot)
+{
+	CullSlot *cull = &slots[slot];
+	uint32_t stride = sizeof(VkDrawIndexedIndirectCommand);
+	if (draw_indirect_count != nullptr) {
+		uint32_t maxCount = object_count < max_draw_count ?
+					    object_count :
+					    max_draw_count;
+		draw_indirect_count(command_buffer, cull->draws, 0, cull->count,
+				    0, maxCount, stride);
+		return;
+	}
+	// Without multiDrawIndirect every indirect draw holds one command
+	uint32_t batch = multi_draw ? max_draw_count : 1;
+	for (uint32_t first = 0; first < object_count; first += batch) {
+		uint32_t count = object_count - first < batch ?
+					 object_count - first :
+					 batch;
+		vkCmdDrawIndexedIndirect(command_buffer, cull->draws,
+					 (VkDeviceSize)first * stride, count,
+					 stride);
+	}
+}
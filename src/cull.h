@@ -0,0 +1,70 @@
+#pragma once
+#include "mesh.h"
+#include <cglm/cglm.h>
+#include <vulkan/vulkan.h>
+
+// GPU driven drawing. A compute pass frustum culls every object and writes
+// one VkDrawIndexedIndirectCommand per visible object, which the graphics
+// pass consumes without any per-object work on the CPU. Draws use the
+// object index as firstInstance, so the transform buffer doubles as the
+// per-instance vertex stream. Each object is drawn at the coarsest level of
+// detail whose error projects small enough.
+//
+// The dispatch can run on a compute queue of its own family, concurrently
+// with the graphics queue. The draw buffers are then released by the
+// compute queue at the end of the dispatch and acquired by the graphics
+// queue before drawing, with a semaphore between the two submissions.
+
+// Laid out like Object in cull.comp
+typedef struct {
+	// Object space bounding sphere, xyz center and w radius
+	vec4 sphere;
+	uint32_t first_index;
+	uint32_t index_count;
+	int32_t vertex_offset;
+	// Level 0 of the object's levels of detail
+	uint32_t first_lod;
+} CullObject;
+
+// Uploads the objects through the upload path, they are usable once the
+// current upload batch completed. Every slot starts with a copy of
+// `transforms`. `lods` holds
+// `lod_count` levels for each of `submesh_count` submeshes, objects are
+// drawn with the index ranges of the levels from their first_lod on.
+// `draw_indirect_count`
+// is vkCmdDrawIndexedIndirectCount(KHR) or nullptr when the device lacks
+// it, in which case culled objects are written with instanceCount 0.
+// Dispatches are recorded for `compute_family`, draws for
+// `graphics_family`.
+void cull_init(VkPhysicalDevice physical_device, VkDevice device,
+	       VkPipelineCache pipeline_cache, uint32_t frame_slots,
+	       const CullObject *objects, const mat4 *transforms,
+	       uint32_t object_count, const MeshLod *lods,
+	       uint32_t submesh_count, uint32_t lod_count,
+	       PFN_vkCmdDrawIndexedIndirectCount draw_indirect_count,
+	       bool multi_draw_indirect, uint32_t compute_family,
+	       uint32_t graphics_family);
+void cull_destroy();
+
+// `slot`'s mat4 per object, bind as the per-instance vertex stream
+VkBuffer cull_transform_buffer(uint32_t slot);
+// Host coherent mapping of `slot`'s transforms. Only write it once the
+// frames that used the slot finished, the next submission sees the writes
+// without a barrier.
+mat4 *cull_transforms(uint32_t slot);
+
+// Records the culling dispatch for `slot`, outside of a render pass.
+// `planes` are normalized frustum planes in the space of the transforms,
+// the view depth of a point p in that space is dot(depth_axis, (p, 1)).
+// Levels are chosen so their error, scaled by the object's transform,
+// stays under `lod_error_per_depth` times the view depth.
+void cull_dispatch(VkCommandBuffer command_buffer, uint32_t slot,
+		   vec4 planes[6], vec4 depth_axis,
+		   float lod_error_per_depth);
+// Takes `slot`'s draws over from the compute family, outside of a render
+// pass on the graphics queue after waiting for the dispatch. Records
+// nothing when both families are the same.
+void cull_acquire(VkCommandBuffer command_buffer, uint32_t slot);
+// Records the indirect draws written by `slot`'s dispatch. The graphics
+// pipeline, vertex, index and descriptor state must already be bound.
+void cull_draw(VkCommandBuffer command_buffer, uint32_t slot);
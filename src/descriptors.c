@@ -0,0 +1,559 @@
+#include "descriptors.h"
+#include "app.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Sets of a chain's first pool, every further pool doubles up to the max
+#define POOL_FIRST_SETS 64
+#define POOL_MAX_SETS 4096
+// Layout cache slots to start with, kept at most half full
+#define LAYOUT_CACHE_FIRST 64
+
+// Descriptors of each type a pool holds per set
+static const struct {
+	VkDescriptorType type;
+	uint32_t per_set;
+} pool_ratios[] = {
+	{ VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1 },
+	{ VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, 1 },
+	{ VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 4 },
+	{ VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC, 1 },
+	{ VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 4 },
+	{ VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE, 2 },
+	{ VK_DESCRIPTOR_TYPE_SAMPLER, 1 },
+	{ VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1 },
+};
+#define POOL_TYPES (sizeof(pool_ratios) / sizeof(pool_ratios[0]))
+
+typedef struct {
+	VkDescriptorPool *pools;
+	uint32_t count;
+	uint32_t capacity;
+	// Pool allocations are served from, the ones before it are full
+	uint32_t current;
+	// Sets of the next pool created
+	uint32_t next_sets;
+} PoolChain;
+
+// A layout's create info flattened into words, compared on hash hits
+typedef struct {
+	uint64_t hash;
+	uint32_t *key;
+	uint32_t key_size;
+	VkDescriptorSetLayout layout;
+} LayoutEntry;
+
+static VkDevice device;
+static PoolChain persistent;
+static PoolChain frame_chains[MAX_FRAMES_IN_FLIGHT];
+static uint32_t slot_count;
+
+static LayoutEntry *layouts;
+static uint32_t layout_capacity;
+static uint32_t layout_count;
+
+static bool bindless;
+static VkDescriptorSetLayout bindless_layout;
+static VkDescriptorPool bindless_pool;
+static VkDescriptorSet bindless_set;
+static uint32_t bindless_buffer_count;
+static uint32_t bindless_image_count;
+// Free slots of each array, used as a stack
+static uint32_t *free_buffers;
+static uint32_t free_buffer_count;
+static uint32_t *free_images;
+static uint32_t free_image_count;
+
+static VkDescriptorPool create_pool(uint32_t sets)
+{
+	VkDescriptorPoolSize sizes[POOL_TYPES];
+	for (uint32_t i = 0; i < POOL_TYPES; i++) {
+		sizes[i] = (VkDescriptorPoolSize){
+			pool_ratios[i].type, pool_ratios[i].per_set * sets
+		};
+	}
+	VkDescriptorPoolCreateInfo poolInfo = {
+		.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+		.maxSets = sets,
+		.poolSizeCount = POOL_TYPES,
+		.pPoolSizes = sizes
+	};
+	VkDescriptorPool pool;
+	if (vkCreateDescriptorPool(device, &poolInfo, nullptr, &pool) !=
+	    VK_SUCCESS) {
+		fprintf(stderr, "Can't create descriptor pool");
+		exit(1);
+	}
+	return pool;
+}
+
+static VkDescriptorSet chain_allocate(PoolChain *chain,
+				      VkDescriptorSetLayout layout)
+{
+	for (;;) {
+		bool created = chain->current == chain->count;
+		if (created) {
+			if (chain->count == chain->capacity) {
+				chain->capacity = chain->capacity > 0 ?
+							  chain->capacity * 2 :
+							  4;
+				chain->pools = realloc(
+					chain->pools, sizeof(VkDescriptorPool) *
+							      chain->capacity);
+				if (chain->pools == nullptr) {
+					fprintf(stderr,
+						"Can't grow descriptor pool chain");
+					exit(1);
+				}
+			}
+			chain->pools[chain->count++] =
+				create_pool(chain->next_sets);
+			if (chain->next_sets < POOL_MAX_SETS) {
+				chain->next_sets *= 2;
+			}
+		}
+		VkDescriptorSetAllocateInfo allocInfo = {
+			.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+			.descriptorPool = chain->pools[chain->current],
+			.descriptorSetCount = 1,
+			.pSetLayouts = &layout
+		};
+		VkDescriptorSet set;
+		VkResult result = vkAllocateDescriptorSets(device, &allocInfo,
+							   &set);
+		if (result == VK_SUCCESS) {
+			return set;
+		}
+		// Move on to the next pool when this one is full, a pool
+		// created for this very set that can't hold it never will
+		if ((result != VK_ERROR_OUT_OF_POOL_MEMORY &&
+		     result != VK_ERROR_FRAGMENTED_POOL) ||
+		    created) {
+			fprintf(stderr, "Can't allocate descriptor set (%d)\n",
+				result);
+			exit(1);
+		}
+		chain->current++;
+	}
+}
+
+static void chain_reset(PoolChain *chain)
+{
+	for (uint32_t i = 0; i < chain->count && i <= chain->current; i++) {
+		vkResetDescriptorPool(device, chain->pools[i], 0);
+	}
+	chain->current = 0;
+}
+
+static void chain_destroy(PoolChain *chain)
+{
+	for (uint32_t i = 0; i < chain->count; i++) {
+		vkDestroyDescriptorPool(device, chain->pools[i], nullptr);
+	}
+	free(chain->pools);
+	*chain = (PoolChain){ .next_sets = POOL_FIRST_SETS };
+}
+
+// FNV-1a over the flattened create info
+static uint64_t hash_key(const uint32_t *key, uint32_t size)
+{
+	uint64_t hash = 0xcbf29ce484222325ull;
+	for (uint32_t i = 0; i < size; i++) {
+		hash = (hash ^ key[i]) * 0x100000001b3ull;
+	}
+	return hash;
+}
+
+// Flattens `info` into words, `key` has room for key_words(info) of them
+static uint32_t key_words(const VkDescriptorSetLayoutCreateInfo *info)
+{
+	uint32_t words = 2 + info->bindingCount * 5;
+	for (uint32_t i = 0; i < info->bindingCount; i++) {
+		if (info->pBindings[i].pImmutableSamplers != nullptr) {
+			words += info->pBindings[i].descriptorCount * 2;
+		}
+	}
+	return words;
+}
+
+static void flatten(const VkDescriptorSetLayoutCreateInfo *info,
+		    uint32_t *key)
+{
+	const VkDescriptorSetLayoutBindingFlagsCreateInfo *flags = nullptr;
+	for (const VkBaseInStructure *next = info->pNext; next != nullptr;
+	     next = next->pNext) {
+		if (next->sType ==
+		    VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO) {
+			flags = (const void *)next;
+		}
+	}
+	uint32_t n = 0;
+	key[n++] = info->flags;
+	key[n++] = info->bindingCount;
+	for (uint32_t i = 0; i < info->bindingCount; i++) {
+		const VkDescriptorSetLayoutBinding *binding =
+			&info->pBindings[i];
+		key[n++] = binding->binding;
+		key[n++] = binding->descriptorType;
+		key[n++] = binding->descriptorCount;
+		key[n++] = binding->stageFlags;
+		key[n++] = flags != nullptr && i < flags->bindingCount ?
+				   flags->pBindingFlags[i] :
+				   0;
+		if (binding->pImmutableSamplers == nullptr) {
+			continue;
+		}
+		for (uint32_t j = 0; j < binding->descriptorCount; j++) {
+			uint64_t sampler =
+				(uint64_t)binding->pImmutableSamplers[j];
+			key[n++] = (uint32_t)sampler;
+			key[n++] = (uint32_t)(sampler >> 32);
+		}
+	}
+}
+
+// Open addressing with linear probing, returns the entry for `hash` and
+// `key` or the empty slot it belongs in
+static LayoutEntry *find_layout(uint64_t hash, const uint32_t *key,
+				uint32_t size)
+{
+	uint32_t mask = layout_capacity - 1;
+	for (uint32_t i = hash & mask;; i = (i + 1) & mask) {
+		LayoutEntry *entry = &layouts[i];
+		if (entry->key == nullptr ||
+		    (entry->hash == hash && entry->key_size == size &&
+		     memcmp(entry->key, key, size * sizeof(uint32_t)) == 0)) {
+			return entry;
+		}
+	}
+}
+
+static void grow_layouts()
+{
+	LayoutEntry *old = layouts;
+	uint32_t oldCapacity = layout_capacity;
+	layout_capacity = oldCapacity > 0 ? oldCapacity * 2 :
+					    LAYOUT_CACHE_FIRST;
+	layouts = calloc(layout_capacity, sizeof(LayoutEntry));
+	if (layouts == nullptr) {
+		fprintf(stderr, "Can't grow the layout cache");
+		exit(1);
+	}
+	for (uint32_t i = 0; i < oldCapacity; i++) {
+		if (old[i].key != nullptr) {
+			*find_layout(old[i].hash, old[i].key,
+				     old[i].key_size) = old[i];
+		}
+	}
+	free(old);
+}
+
+VkDescriptorSetLayout
+descriptors_layout(const VkDescriptorSetLayoutCreateInfo *info)
+{
+	uint32_t size = key_words(info);
+	uint32_t *key = malloc(sizeof(uint32_t) * size);
+	if (key == nullptr) {
+		fprintf(stderr, "Can't allocate a layout key");
+		exit(1);
+	}
+	flatten(info, key);
+	uint64_t hash = hash_key(key, size);
+	LayoutEntry *entry = find_layout(hash, key, size);
+	if (entry->key != nullptr) {
+		free(key);
+		return entry->layout;
+	}
+
+	VkDescriptorSetLayout layout;
+	if (vkCreateDescriptorSetLayout(device, info, nullptr, &layout) !=
+	    VK_SUCCESS) {
+		fprintf(stderr, "Can't create descriptor set layout");
+		exit(1);
+	}
+	*entry = (LayoutEntry){ hash, key, size, layout };
+	if (++layout_count * 2 > layout_capacity) {
+		grow_layouts();
+	}
+	return layout;
+}
+
+bool descriptors_bindless_supported(
+	VkPhysicalDevice physical_device,
+	VkPhysicalDeviceDescriptorIndexingFeatures *features)
+{
+	VkPhysicalDeviceProperties properties;
+	vkGetPhysicalDeviceProperties(physical_device, &properties);
+	if (properties.apiVersion < VK_API_VERSION_1_2) {
+		return false;
+	}
+	VkPhysicalDeviceDescriptorIndexingFeatures supported = {
+		.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES
+	};
+	VkPhysicalDeviceFeatures2 features2 = {
+		.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2,
+		.pNext = &supported
+	};
+	vkGetPhysicalDeviceFeatures2(physical_device, &features2);
+	*features = (VkPhysicalDeviceDescriptorIndexingFeatures){
+		.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES,
+		.shaderSampledImageArrayNonUniformIndexing = VK_TRUE,
+		.shaderStorageBufferArrayNonUniformIndexing = VK_TRUE,
+		.descriptorBindingSampledImageUpdateAfterBind = VK_TRUE,
+		.descriptorBindingStorageBufferUpdateAfterBind = VK_TRUE,
+		.descriptorBindingUpdateUnusedWhilePending = VK_TRUE,
+		.descriptorBindingPartiallyBound = VK_TRUE,
+		.runtimeDescriptorArray = VK_TRUE
+	};
+	return supported.shaderSampledImageArrayNonUniformIndexing &&
+	       supported.shaderStorageBufferArrayNonUniformIndexing &&
+	       supported.descriptorBindingSampledImageUpdateAfterBind &&
+	       supported.descriptorBindingStorageBufferUpdateAfterBind &&
+	       supported.descriptorBindingUpdateUnusedWhilePending &&
+	       supported.descriptorBindingPartiallyBound &&
+	       supported.runtimeDescriptorArray;
+}
+
+static uint32_t min_u32(uint32_t a, uint32_t b)
+{
+	return a < b ? a : b;
+}
+
+static void create_bindless(VkPhysicalDevice physical_device)
+{
+	VkPhysicalDeviceDescriptorIndexingProperties limits = {
+		.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_PROPERTIES
+	};
+	VkPhysicalDeviceProperties2 properties = {
+		.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2,
+		.pNext = &limits
+	};
+	vkGetPhysicalDeviceProperties2(physical_device, &properties);
+	// Both arrays share the per-stage resource limit. Combined image
+	// samplers count as sampled images and as samplers.
+	uint32_t resources = limits.maxPerStageUpdateAfterBindResources / 2;
+	uint32_t buffers = min_u32(DESCRIPTORS_BINDLESS_BUFFERS, resources);
+	buffers = min_u32(
+		buffers, limits.maxPerStageDescriptorUpdateAfterBindStorageBuffers);
+	buffers = min_u32(buffers,
+			  limits.maxDescriptorSetUpdateAfterBindStorageBuffers);
+	uint32_t images = min_u32(DESCRIPTORS_BINDLESS_IMAGES, resources);
+	images = min_u32(
+		images, limits.maxPerStageDescriptorUpdateAfterBindSampledImages);
+	images = min_u32(images,
+			 limits.maxDescriptorSetUpdateAfterBindSampledImages);
+	images = min_u32(images,
+			 limits.maxPerStageDescriptorUpdateAfterBindSamplers);
+	images = min_u32(images,
+			 limits.maxDescriptorSetUpdateAfterBindSamplers);
+	bindless_buffer_count = buffers;
+	bindless_image_count = images;
+
+	VkDescriptorSetLayoutBinding bindings[2] = {
+		{ .binding = DESCRIPTORS_BINDLESS_BUFFER_BINDING,
+		  .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+		  .descriptorCount = bindless_buffer_count,
+		  .stageFlags = VK_SHADER_STAGE_ALL },
+		{ .binding = DESCRIPTORS_BINDLESS_IMAGE_BINDING,
+		  .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+		  .descriptorCount = bindless_image_count,
+		  .stageFlags = VK_SHADER_STAGE_ALL },
+	};
+	VkDescriptorBindingFlags flags =
+		VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT |
+		VK_DESCRIPTOR_BINDING_UPDATE_UNUSED_WHILE_PENDING_BIT |
+		VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT;
+	VkDescriptorBindingFlags bindingFlags[2] = { flags, flags };
+	VkDescriptorSetLayoutBindingFlagsCreateInfo flagsInfo = {
+		.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO,
+		.bindingCount = 2,
+		.pBindingFlags = bindingFlags
+	};
+	VkDescriptorSetLayoutCreateInfo layoutInfo = {
+		.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+		.pNext = &flagsInfo,
+		.flags = VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT,
+		.bindingCount = 2,
+		.pBindings = bindings
+	};
+	bindless_layout = descriptors_layout(&layoutInfo);
+
+	// Update-after-bind sets need a pool of their own
+	VkDescriptorPoolSize sizes[2] = {
+		{ VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, bindless_buffer_count },
+		{ VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+		  bindless_image_count },
+	};
+	VkDescriptorPoolCreateInfo poolInfo = {
+		.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+		.flags = VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT,
+		.maxSets = 1,
+		.poolSizeCount = 2,
+		.pPoolSizes = sizes
+	};
+	if (vkCreateDescriptorPool(device, &poolInfo, nullptr,
+				   &bindless_pool) != VK_SUCCESS) {
+		fprintf(stderr, "Can't create bindless descriptor pool");
+		exit(1);
+	}
+	VkDescriptorSetAllocateInfo allocInfo = {
+		.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+		.descriptorPool = bindless_pool,
+		.descriptorSetCount = 1,
+		.pSetLayouts = &bindless_layout
+	};
+	if (vkAllocateDescriptorSets(device, &allocInfo, &bindless_set) !=
+	    VK_SUCCESS) {
+		fprintf(stderr, "Can't allocate bindless descriptor set");
+		exit(1);
+	}
+
+	// Hand out low slots first
+	free_buffers = malloc(sizeof(uint32_t) * bindless_buffer_count);
+	free_images = malloc(sizeof(uint32_t) * bindless_image_count);
+	if (free_buffers == nullptr || free_images == nullptr) {
+		fprintf(stderr, "Can't allocate bindless slots");
+		exit(1);
+	}
+	for (uint32_t i = 0; i < bindless_buffer_count; i++) {
+		free_buffers[i] = bindless_buffer_count - 1 - i;
+	}
+	for (uint32_t i = 0; i < bindless_image_count; i++) {
+		free_images[i] = bindless_image_count - 1 - i;
+	}
+	free_buffer_count = bindless_buffer_count;
+	free_image_count = bindless_image_count;
+	printf("Bindless descriptors: %u buffers, %u images\n",
+	       bindless_buffer_count, bindless_image_count);
+}
+
+void descriptors_init(VkPhysicalDevice physical_device,
+		      VkDevice logical_device, uint32_t frame_slots,
+		      bool use_bindless)
+{
+	device = logical_device;
+	slot_count = frame_slots;
+	persistent = (PoolChain){ .next_sets = POOL_FIRST_SETS };
+	for (uint32_t i = 0; i < slot_count; i++) {
+		frame_chains[i] = (PoolChain){ .next_sets = POOL_FIRST_SETS };
+	}
+	grow_layouts();
+	bindless = use_bindless;
+	if (bindless) {
+		create_bindless(physical_device);
+	}
+}
+
+void descriptors_destroy()
+{
+	if (bindless) {
+		vkDestroyDescriptorPool(device, bindless_pool, nullptr);
+		free(free_buffers);
+		free(free_images);
+		bindless = false;
+	}
+	chain_destroy(&persistent);
+	for (uint32_t i = 0; i < slot_count; i++) {
+		chain_destroy(&frame_chains[i]);
+	}
+	for (uint32_t i = 0; i < layout_capacity; i++) {
+		if (layouts[i].key != nullptr) {
+			vkDestroyDescriptorSetLayout(device, layouts[i].layout,
+						     nullptr);
+			free(layouts[i].key);
+		}
+	}
+	free(layouts);
+	layouts = nullptr;
+	layout_capacity = 0;
+	layout_count = 0;
+}
+
+VkDescriptorSet descriptors_allocate(VkDescriptorSetLayout layout)
+{
+	return chain_allocate(&persistent, layout);
+}
+
+VkDescriptorSet descriptors_allocate_frame(uint32_t slot,
+					   VkDescriptorSetLayout layout)
+{
+	return chain_allocate(&frame_chains[slot], layout);
+}
+
+void descriptors_reset_frame(uint32_t slot)
+{
+	chain_reset(&frame_chains[slot]);
+}
+
+bool descriptors_bindless()
+{
+	return bindless;
+}
+
+VkDescriptorSetLayout descriptors_bindless_layout()
+{
+	return bindless_layout;
+}
+
+VkDescriptorSet descriptors_bindless_set()
+{
+	return bindless_set;
+}
+
+uint32_t descriptors_bindless_add_buffer(VkBuffer buffer, VkDeviceSize offset,
+					 VkDeviceSize range)
+{
+	if (free_buffer_count == 0) {
+		fprintf(stderr, "All %u bindless buffer slots in use\n",
+			bindless_buffer_count);
+		exit(1);
+	}
+	uint32_t slot = free_buffers[--free_buffer_count];
+	VkDescriptorBufferInfo bufferInfo = { buffer, offset, range };
+	VkWriteDescriptorSet write = {
+		.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+		.dstSet = bindless_set,
+		.dstBinding = DESCRIPTORS_BINDLESS_BUFFER_BINDING,
+		.dstArrayElement = slot,
+		.descriptorCount = 1,
+		.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+		.pBufferInfo = &bufferInfo
+	};
+	vkUpdateDescriptorSets(device, 1, &write, 0, nullptr);
+	return slot;
+}
+
+uint32_t descriptors_bindless_add_image(VkImageView view, VkSampler sampler)
+{
+	if (free_image_count == 0) {
+		fprintf(stderr, "All %u bindless image slots in use\n",
+			bindless_image_count);
+		exit(1);
+	}
+	uint32_t slot = free_images[--free_image_count];
+	VkDescriptorImageInfo imageInfo = {
+		sampler, view, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL
+	};
+	VkWriteDescriptorSet write = {
+		.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+		.dstSet = bindless_set,
+		.dstBinding = DESCRIPTORS_BINDLESS_IMAGE_BINDING,
+		.dstArrayElement = slot,
+		.descriptorCount = 1,
+		.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+		.pImageInfo = &imageInfo
+	};
+	vkUpdateDescriptorSets(device, 1, &write, 0, nullptr);
+	return slot;
+}
+
+void descriptors_bindless_remove_buffer(uint32_t slot)
+{
+	free_buffers[free_buffer_count++] = slot;
+}
+
+void descriptors_bindless_remove_image(uint32_t slot)
+{
+	free_images[free_image_count++] = slot;
+}
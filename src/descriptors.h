@@ -0,0 +1,64 @@
+#pragma once
+#include <stdint.h>
+#include <vulkan/vulkan.h>
+
+// Descriptor sets. Layouts are created through a cache keyed by a hash of
+// their bindings, so identical layouts are shared. Sets come from pool
+// chains that move on to a new, larger pool whenever the current one runs
+// out, and a reset recycles every pool of a chain at once. Sets living as
+// long as the device come from the persistent chain, sets of one frame from
+// the frame slot's chain, which is reset once the slot's fence signaled.
+//
+// With descriptor indexing there is also one bindless set: large
+// update-after-bind arrays of storage buffers and sampled images that
+// shaders index with slots handed out here. It is bound once per command
+// buffer instead of a set per material.
+//
+// Not thread safe, allocate and update from the main thread.
+
+// Array sizes of the bindless set, lowered to what the device supports
+#define DESCRIPTORS_BINDLESS_BUFFERS 4096
+#define DESCRIPTORS_BINDLESS_IMAGES 4096
+// Bindings of the arrays in the bindless set
+#define DESCRIPTORS_BINDLESS_BUFFER_BINDING 0
+#define DESCRIPTORS_BINDLESS_IMAGE_BINDING 1
+
+// `bindless` requires the descriptor indexing features the bindless set
+// uses to be enabled on `device`, see descriptors_bindless_supported
+void descriptors_init(VkPhysicalDevice physical_device, VkDevice device,
+		      uint32_t frame_slots, bool bindless);
+// Destroys every layout, pool and set handed out
+void descriptors_destroy();
+
+// Whether `physical_device` can run the bindless set. Fills `features`,
+// chained into VkDeviceCreateInfo, with exactly what it needs.
+bool descriptors_bindless_supported(
+	VkPhysicalDevice physical_device,
+	VkPhysicalDeviceDescriptorIndexingFeatures *features);
+
+// Returns the cached layout for `info`, creating it on first use. The
+// cache owns it, don't destroy it.
+VkDescriptorSetLayout
+descriptors_layout(const VkDescriptorSetLayoutCreateInfo *info);
+
+// Allocates a set that lives until descriptors_destroy
+VkDescriptorSet descriptors_allocate(VkDescriptorSetLayout layout);
+// Allocates a set valid until `slot` is reset
+VkDescriptorSet descriptors_allocate_frame(uint32_t slot,
+					   VkDescriptorSetLayout layout);
+// Frees every set of `slot` at once, call after its fence signaled
+void descriptors_reset_frame(uint32_t slot);
+
+// Whether the bindless set exists
+bool descriptors_bindless();
+VkDescriptorSetLayout descriptors_bindless_layout();
+VkDescriptorSet descriptors_bindless_set();
+// Writes a descriptor into a free slot of the buffer or image array and
+// returns the slot for shaders to index. Slots not in use are never read,
+// so writing them while frames using the set are in flight is fine.
+uint32_t descriptors_bindless_add_buffer(VkBuffer buffer, VkDeviceSize offset,
+					 VkDeviceSize range);
+uint32_t descriptors_bindless_add_image(VkImageView view, VkSampler sampler);
+// Returns a slot for reuse, once no frame in flight reads it anymore
+void descriptors_bindless_remove_buffer(uint32_t slot);
+void descriptors_bindless_remove_image(uint32_t slot);
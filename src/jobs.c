@@ -0,0 +1,373 @@
+#include "jobs.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdalign.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// Failed attempts to find work before a thread goes to sleep
+#define JOBS_SPIN_COUNT 64
+// parallel_for makes at most this many chunks per thread
+#define JOBS_CHUNKS_PER_THREAD 4
+
+// Fields are atomic because a thief may read a slot the owner is
+// rewriting, the thief's CAS on top then fails and the value is dropped
+typedef struct {
+	_Atomic(JobFn) fn;
+	_Atomic(void *) data;
+	_Atomic(JobCounter *) counter;
+} JobSlot;
+
+typedef struct {
+	JobFn fn;
+	void *data;
+	JobCounter *counter;
+} Job;
+
+typedef struct {
+	alignas(64) atomic_int_fast64_t top;
+	alignas(64) atomic_int_fast64_t bottom;
+	JobSlot slots[JOBS_DEQUE_SIZE];
+	pthread_t thread;
+	// xorshift state for picking steal victims
+	uint32_t random;
+} JobThread;
+
+typedef struct {
+	JobRangeFn fn;
+	void *data;
+	uint32_t begin;
+	uint32_t end;
+} JobRange;
+
+static JobThread *threads;
+static uint32_t thread_count;
+static _Thread_local uint32_t thread_index;
+static atomic_bool quitting;
+
+// Bumped for every queued job, sleeping threads wait for it to change
+static atomic_uint work_epoch;
+static atomic_uint sleepers;
+static pthread_mutex_t sleep_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_ready = PTHREAD_COND_INITIALIZER;
+
+// FIFO of background jobs, only idle workers take from it
+static pthread_mutex_t background_lock = PTHREAD_MUTEX_INITIALIZER;
+static Job background[JOBS_DEQUE_SIZE];
+static uint32_t background_head;
+static atomic_uint background_count;
+
+static bool deque_push(JobThread *thread, Job job)
+{
+	int_fast64_t bottom =
+		atomic_load_explicit(&thread->bottom, memory_order_relaxed);
+	int_fast64_t top =
+		atomic_load_explicit(&thread->top, memory_order_acquire);
+	if (bottom - top >= JOBS_DEQUE_SIZE) {
+		return false;
+	}
+	JobSlot *slot = &thread->slots[bottom % JOBS_DEQUE_SIZE];
+	atomic_store_explicit(&slot->fn, job.fn, memory_order_relaxed);
+	atomic_store_explicit(&slot->data, job.data, memory_order_relaxed);
+	atomic_store_explicit(&slot->counter, job.counter,
+			      memory_order_relaxed);
+	// Publishes the slot to thieves, which load bottom with acquire
+	atomic_store_explicit(&thread->bottom, bottom + 1,
+			      memory_order_release);
+	return true;
+}
+
+static Job slot_load(JobSlot *slot)
+{
+	return (Job){
+		atomic_load_explicit(&slot->fn, memory_order_relaxed),
+		atomic_load_explicit(&slot->data, memory_order_relaxed),
+		atomic_load_explicit(&slot->counter, memory_order_relaxed)
+	};
+}
+
+// Owner side, newest job first
+static bool deque_take(JobThread *thread, Job *job)
+{
+	int_fast64_t bottom =
+		atomic_load_explicit(&thread->bottom, memory_order_relaxed) -
+		1;
+	atomic_store_explicit(&thread->bottom, bottom, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+	int_fast64_t top =
+		atomic_load_explicit(&thread->top, memory_order_relaxed);
+	if (top > bottom) {
+		atomic_store_explicit(&thread->bottom, bottom + 1,
+				      memory_order_relaxed);
+		return false;
+	}
+	*job = slot_load(&thread->slots[bottom % JOBS_DEQUE_SIZE]);
+	if (top == bottom) {
+		// Last job, race the thieves for it
+		bool won = atomic_compare_exchange_strong_explicit(
+			&thread->top, &top, top + 1, memory_order_seq_cst,
+			memory_order_relaxed);
+		atomic_store_explicit(&thread->bottom, bottom + 1,
+				      memory_order_relaxed);
+		return won;
+	}
+	return true;
+}
+
+// Thief side, oldest job first
+static bool deque_steal(JobThread *thread, Job *job)
+{
+	int_fast64_t top =
+		atomic_load_explicit(&thread->top, memory_order_acquire);
+	atomic_thread_fence(memory_order_seq_cst);
+	int_fast64_t bottom =
+		atomic_load_explicit(&thread->bottom, memory_order_acquire);
+	if (top >= bottom) {
+		return false;
+	}
+	*job = slot_load(&thread->slots[top % JOBS_DEQUE_SIZE]);
+	return atomic_compare_exchange_strong_explicit(&thread->top, &top,
+						       top + 1,
+						       memory_order_seq_cst,
+						       memory_order_relaxed);
+}
+
+static void job_execute(Job job)
+{
+	job.fn(job.data);
+	if (job.counter != nullptr) {
+		atomic_fetch_sub_explicit(&job.counter->pending, 1,
+					  memory_order_release);
+	}
+}
+
+static bool find_job(Job *job)
+{
+	JobThread *self = &threads[thread_index];
+	if (deque_take(self, job)) {
+		return true;
+	}
+	if (thread_count < 2) {
+		return false;
+	}
+	// Start at a random victim so thieves spread over the deques
+	self->random ^= self->random << 13;
+	self->random ^= self->random >> 17;
+	self->random ^= self->random << 5;
+	uint32_t first = self->random % thread_count;
+	for (uint32_t i = 0; i < thread_count; i++) {
+		uint32_t victim = (first + i) % thread_count;
+		if (victim != thread_index &&
+		    deque_steal(&threads[victim], job)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool take_background(Job *job)
+{
+	if (atomic_load_explicit(&background_count, memory_order_relaxed) ==
+	    0) {
+		return false;
+	}
+	pthread_mutex_lock(&background_lock);
+	uint32_t count = atomic_load_explicit(&background_count,
+					      memory_order_relaxed);
+	if (count > 0) {
+		*job = background[background_head];
+		background_head = (background_head + 1) % JOBS_DEQUE_SIZE;
+		atomic_store_explicit(&background_count, count - 1,
+				      memory_order_relaxed);
+	}
+	pthread_mutex_unlock(&background_lock);
+	return count > 0;
+}
+
+static void wake_worker()
+{
+	atomic_fetch_add(&work_epoch, 1);
+	if (atomic_load(&sleepers) > 0) {
+		pthread_mutex_lock(&sleep_lock);
+		pthread_cond_signal(&work_ready);
+		pthread_mutex_unlock(&sleep_lock);
+	}
+}
+
+static void *worker_main(void *arg)
+{
+	thread_index = (uint32_t)(uintptr_t)arg;
+	uint32_t idle = 0;
+	while (!atomic_load_explicit(&quitting, memory_order_acquire)) {
+		uint32_t epoch = atomic_load(&work_epoch);
+		Job job;
+		if (find_job(&job) || take_background(&job)) {
+			job_execute(job);
+			idle = 0;
+			continue;
+		}
+		if (++idle < JOBS_SPIN_COUNT) {
+			sched_yield();
+			continue;
+		}
+		// Sleep unless a job was queued since the epoch was read
+		pthread_mutex_lock(&sleep_lock);
+		atomic_fetch_add(&sleepers, 1);
+		while (atomic_load(&work_epoch) == epoch &&
+		       !atomic_load(&quitting)) {
+			pthread_cond_wait(&work_ready, &sleep_lock);
+		}
+		atomic_fetch_sub(&sleepers, 1);
+		pthread_mutex_unlock(&sleep_lock);
+		idle = 0;
+	}
+	return nullptr;
+}
+
+void jobs_init(uint32_t count)
+{
+	if (count == 0) {
+		long online = sysconf(_SC_NPROCESSORS_ONLN);
+		count = online > 0 ? (uint32_t)online : 1;
+	}
+	if (count > JOBS_MAX_THREADS) {
+		count = JOBS_MAX_THREADS;
+	}
+	threads = aligned_alloc(alignof(JobThread), sizeof(JobThread) * count);
+	if (threads == nullptr) {
+		fprintf(stderr, "Can't allocate job threads\n");
+		exit(1);
+	}
+	thread_count = count;
+	thread_index = 0;
+	atomic_store(&quitting, false);
+	background_head = 0;
+	atomic_store(&background_count, 0);
+	for (uint32_t i = 0; i < thread_count; i++) {
+		atomic_init(&threads[i].top, 0);
+		atomic_init(&threads[i].bottom, 0);
+		threads[i].random = 0x9e3779b9u * (i + 1);
+	}
+	for (uint32_t i = 1; i < thread_count; i++) {
+		if (pthread_create(&threads[i].thread, nullptr, worker_main,
+				   (void *)(uintptr_t)i) != 0) {
+			fprintf(stderr, "Failed to start job thread\n");
+			exit(1);
+		}
+	}
+}
+
+void jobs_destroy()
+{
+	pthread_mutex_lock(&sleep_lock);
+	atomic_store(&quitting, true);
+	pthread_cond_broadcast(&work_ready);
+	pthread_mutex_unlock(&sleep_lock);
+	for (uint32_t i = 1; i < thread_count; i++) {
+		pthread_join(threads[i].thread, nullptr);
+	}
+	free(threads);
+	threads = nullptr;
+	thread_count = 0;
+}
+
+uint32_t jobs_thread_count()
+{
+	return thread_count;
+}
+
+uint32_t jobs_thread_index()
+{
+	return thread_index;
+}
+
+void jobs_run(JobFn fn, void *data, JobCounter *counter)
+{
+	if (counter != nullptr) {
+		atomic_fetch_add_explicit(&counter->pending, 1,
+					  memory_order_relaxed);
+	}
+	Job job = { fn, data, counter };
+	if (!deque_push(&threads[thread_index], job)) {
+		job_execute(job);
+		return;
+	}
+	wake_worker();
+}
+
+void jobs_run_background(JobFn fn, void *data, JobCounter *counter)
+{
+	if (counter != nullptr) {
+		atomic_fetch_add_explicit(&counter->pending, 1,
+					  memory_order_relaxed);
+	}
+	Job job = { fn, data, counter };
+	pthread_mutex_lock(&background_lock);
+	uint32_t count = atomic_load_explicit(&background_count,
+					      memory_order_relaxed);
+	bool queued = thread_count > 1 && count < JOBS_DEQUE_SIZE;
+	if (queued) {
+		background[(background_head + count) % JOBS_DEQUE_SIZE] = job;
+		atomic_store_explicit(&background_count, count + 1,
+				      memory_order_relaxed);
+	}
+	pthread_mutex_unlock(&background_lock);
+	if (!queued) {
+		job_execute(job);
+		return;
+	}
+	wake_worker();
+}
+
+void jobs_wait(JobCounter *counter)
+{
+	while (atomic_load_explicit(&counter->pending, memory_order_acquire) >
+	       0) {
+		Job job;
+		if (find_job(&job)) {
+			job_execute(job);
+		} else {
+			sched_yield();
+		}
+	}
+}
+
+static void range_job(void *data)
+{
+	JobRange *range = data;
+	range->fn(range->data, range->begin, range->end);
+}
+
+void jobs_parallel_for(uint32_t count, uint32_t grain, JobRangeFn fn,
+		       void *data)
+{
+	if (count == 0) {
+		return;
+	}
+	uint32_t maxChunks = thread_count * JOBS_CHUNKS_PER_THREAD;
+	if (grain < 1) {
+		grain = 1;
+	}
+	if ((count + grain - 1) / grain > maxChunks) {
+		grain = (count + maxChunks - 1) / maxChunks;
+	}
+	uint32_t chunks = (count + grain - 1) / grain;
+	if (chunks == 1) {
+		fn(data, 0, count);
+		return;
+	}
+	JobRange ranges[chunks];
+	JobCounter counter = {};
+	for (uint32_t i = 0; i < chunks; i++) {
+		uint32_t end = (i + 1) * grain;
+		ranges[i] = (JobRange){ fn, data, i * grain,
+					end < count ? end : count };
+	}
+	// The caller takes the first chunk itself, the rest is up for grabs
+	for (uint32_t i = 1; i < chunks; i++) {
+		jobs_run(range_job, &ranges[i], &counter);
+	}
+	fn(data, ranges[0].begin, ranges[0].end);
+	jobs_wait(&counter);
+}
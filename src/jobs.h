@@ -0,0 +1,45 @@
+#pragma once
+#include <stdatomic.h>
+#include <stdint.h>
+
+// Work-stealing job system. Every thread owns a Chase-Lev deque: it pushes
+// and pops jobs at the bottom while idle threads steal from the top, so
+// jobs spawned by a job mostly stay on the core that made them. The thread
+// calling jobs_init takes part as thread 0 whenever it waits.
+//
+// Jobs may only be submitted from thread 0 or from inside other jobs.
+
+// Jobs one thread can have queued, further submissions run inline
+#define JOBS_DEQUE_SIZE 4096
+#define JOBS_MAX_THREADS 64
+
+// Completion counter, a group of jobs is done when it drops to zero
+typedef struct {
+	atomic_uint pending;
+} JobCounter;
+
+typedef void (*JobFn)(void *data);
+// Processes [begin, end) of a parallel_for range
+typedef void (*JobRangeFn)(void *data, uint32_t begin, uint32_t end);
+
+// `thread_count` includes the calling thread, 0 uses every online CPU
+void jobs_init(uint32_t thread_count);
+void jobs_destroy();
+uint32_t jobs_thread_count();
+// Index of the calling thread, 0 for the thread that called jobs_init
+uint32_t jobs_thread_index();
+
+// Queues `fn(data)` and adds it to `counter`, which may be nullptr for
+// fire and forget jobs
+void jobs_run(JobFn fn, void *data, JobCounter *counter);
+// Queues `fn(data)` for the workers only, after every job they can find on
+// the deques. For long jobs that must not stall the frame when a waiting
+// thread helps out. Runs inline without workers or when the queue is full.
+void jobs_run_background(JobFn fn, void *data, JobCounter *counter);
+// Runs other jobs until `counter` reached zero, background jobs excepted
+void jobs_wait(JobCounter *counter);
+
+// Splits [0, count) into chunks of at least `grain` items and blocks until
+// every chunk ran. The caller works on chunks too.
+void jobs_parallel_for(uint32_t count, uint32_t grain, JobRangeFn fn,
+		       void *data);
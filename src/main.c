@@ -1,8 +1,94 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <app.h>
 
+static const char *present_mode_names[] = {
+	[PRESENT_FIFO] = "fifo",
+	[PRESENT_FIFO_RELAXED] = "fifo-relaxed",
+	[PRESENT_MAILBOX] = "mailbox",
+	[PRESENT_IMMEDIATE] = "immediate",
+};
 
-int main(void) {
-app_run();
-  return 0;
+static void usage(const char *program)
+{
+	fprintf(stderr,
+		"usage: %s [--frames-in-flight N] [--headless] [--frames N]\n"
+		"          [--readback FILE.ppm] [--mesh FILE]\n"
+		"          [--texture FILE.ntex|FILE.ppm] [--texture-budget MIB]\n"
+		"          [--instances N] [--record-threads N] [--job-threads N]\n"
+		"          [--gpu-cull] [--depth-prepass] [--bindless]\n"
+		"          [--particles N] [--lod-error PIXELS]\n"
+		"          [--pipeline-cache FILE] [--trace FILE.json|FILE.csv]\n"
+		"          [--present-mode fifo|fifo-relaxed|mailbox|immediate]\n",
+		program);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	AppConfig config = { .frames_in_flight = DEFAULT_FRAMES_IN_FLIGHT,
+			     .instance_count = 1,
+			     .lod_pixel_error = DEFAULT_LOD_PIXEL_ERROR,
+			     .pipeline_cache_path = DEFAULT_PIPELINE_CACHE_PATH };
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--frames-in-flight") == 0 && i + 1 < argc) {
+			config.frames_in_flight = (uint32_t)atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--headless") == 0) {
+			config.headless = true;
+		} else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+			config.frame_count = (uint32_t)atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--readback") == 0 && i + 1 < argc) {
+			config.readback_path = argv[++i];
+		} else if (strcmp(argv[i], "--mesh") == 0 && i + 1 < argc) {
+			config.mesh_path = argv[++i];
+		} else if (strcmp(argv[i], "--texture") == 0 && i + 1 < argc) {
+			config.texture_path = argv[++i];
+		} else if (strcmp(argv[i], "--texture-budget") == 0 &&
+			   i + 1 < argc) {
+			config.texture_budget = (uint64_t)atoi(argv[++i]) << 20;
+		} else if (strcmp(argv[i], "--instances") == 0 && i + 1 < argc) {
+			config.instance_count = (uint32_t)atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--record-threads") == 0 &&
+			   i + 1 < argc) {
+			config.record_threads = (uint32_t)atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--job-threads") == 0 &&
+			   i + 1 < argc) {
+			config.job_threads = (uint32_t)atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--gpu-cull") == 0) {
+			config.gpu_culling = true;
+		} else if (strcmp(argv[i], "--depth-prepass") == 0) {
+			config.depth_prepass = true;
+		} else if (strcmp(argv[i], "--bindless") == 0) {
+			config.bindless = true;
+		} else if (strcmp(argv[i], "--particles") == 0 &&
+			   i + 1 < argc) {
+			config.particle_count = (uint32_t)atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--lod-error") == 0 &&
+			   i + 1 < argc) {
+			config.lod_pixel_error = (float)atof(argv[++i]);
+		} else if (strcmp(argv[i], "--pipeline-cache") == 0 &&
+			   i + 1 < argc) {
+			config.pipeline_cache_path = argv[++i];
+		} else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+			config.trace_path = argv[++i];
+		} else if (strcmp(argv[i], "--present-mode") == 0 &&
+			   i + 1 < argc) {
+			const char *name = argv[++i];
+			uint32_t mode = 0;
+			while (mode <= PRESENT_IMMEDIATE &&
+			       strcmp(name, present_mode_names[mode]) != 0) {
+				mode++;
+			}
+			if (mode > PRESENT_IMMEDIATE) {
+				usage(argv[0]);
+			}
+			config.present_mode = mode;
+		} else {
+			usage(argv[0]);
+		}
+	}
+	app_run(&config);
+	return 0;
 }
@@ -0,0 +1,324 @@
+#include "mesh.h"
+#include "upload.h"
+#include <fcntl.h>
+#include <float.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static bool range_valid(uint64_t offset, uint64_t size, uint64_t file_size)
+{
+	return offset % MESH_ALIGNMENT == 0 && offset <= file_size &&
+	       size <= file_size - offset;
+}
+
+static uint32_t read_index(const Mesh *mesh, uint64_t at)
+{
+	if (mesh->header.index_size == 4) {
+		uint32_t index;
+		memcpy(&index, mesh->indices + at * 4, 4);
+		return index;
+	}
+	uint16_t index;
+	memcpy(&index, mesh->indices + at * 2, 2);
+	return index;
+}
+
+// Whether every index of [first, first + count) plus vertex_offset is a
+// vertex of the stream, the range must lie in the index stream
+static bool indices_valid(const Mesh *mesh, uint32_t first, uint32_t count,
+			  int32_t vertex_offset)
+{
+	int64_t low = (int64_t)mesh->header.vertex_count;
+	int64_t high = -1;
+	for (uint32_t i = 0; i < count; i++) {
+		int64_t index = read_index(mesh, (uint64_t)first + i);
+		low = index < low ? index : low;
+		high = index > high ? index : high;
+	}
+	return count == 0 ||
+	       (low + vertex_offset >= 0 &&
+		high + vertex_offset < (int64_t)mesh->header.vertex_count);
+}
+
+// Level 0 is the submesh's own range. Every level draws with the submesh's
+// vertex_offset, has no more indices than the one before and no smaller
+// error, the renderer stops at the first level over its error limit.
+static bool lod_valid(const Mesh *mesh, uint32_t submesh, uint32_t level)
+{
+	const MeshSubmesh *range = &mesh->submeshes[submesh];
+	const MeshLod *lods =
+		mesh->lods + (size_t)submesh * mesh->header.lod_count;
+	const MeshLod *lod = &lods[level];
+	if ((uint64_t)lod->first_index + lod->index_count >
+		    mesh->header.index_count ||
+	    !indices_valid(mesh, lod->first_index, lod->index_count,
+			   range->vertex_offset) ||
+	    !(lod->error >= 0.0f && lod->error <= FLT_MAX)) {
+		return false;
+	}
+	if (level == 0) {
+		return lod->first_index == range->first_index &&
+		       lod->index_count == range->index_count;
+	}
+	return lod->index_count <= lods[level - 1].index_count &&
+	       lod->error >= lods[level - 1].error;
+}
+
+static bool mesh_validate(const MeshHeader *header, size_t file_size,
+			  const char *path)
+{
+	const char *error = nullptr;
+	if (file_size < sizeof(MeshHeader) || header->magic != MESH_MAGIC) {
+		error = "not a mesh file";
+	} else if (header->version != 1 && header->version != MESH_VERSION) {
+		error = "unsupported version";
+	} else if (header->version > 1 && header->lod_count > MESH_MAX_LODS) {
+		error = "too many levels of detail";
+	} else if (header->index_size != 2 && header->index_size != 4) {
+		error = "index size must be 2 or 4";
+	} else if (header->vertex_stride == 0 || header->vertex_count == 0 ||
+		   header->index_count == 0 || header->submesh_count == 0) {
+		error = "empty mesh";
+	} else if (!range_valid(header->submesh_offset,
+				(uint64_t)header->submesh_count *
+					sizeof(MeshSubmesh),
+				file_size) ||
+		   !range_valid(header->vertex_offset,
+				(uint64_t)header->vertex_count *
+					header->vertex_stride,
+				file_size) ||
+		   !range_valid(header->index_offset,
+				(uint64_t)header->index_count *
+					header->index_size,
+				file_size) ||
+		   (header->version > 1 &&
+		    !range_valid(header->lod_offset,
+				 (uint64_t)header->submesh_count *
+					 header->lod_count * sizeof(MeshLod),
+				 file_size))) {
+		error = "stream out of bounds";
+	}
+	if (error != nullptr) {
+		fprintf(stderr, "%s: %s\n", path, error);
+		return false;
+	}
+	return true;
+}
+
+bool mesh_open(const char *path, Mesh *mesh)
+{
+	*mesh = (Mesh){};
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror(path);
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		fprintf(stderr, "%s: empty or unreadable\n", path);
+		close(fd);
+		return false;
+	}
+	void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		perror(path);
+		return false;
+	}
+	const MeshHeader *header = map;
+	if (!mesh_validate(header, st.st_size, path)) {
+		munmap(map, st.st_size);
+		return false;
+	}
+	// Streams are consumed front to back exactly once
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	const unsigned char *bytes = map;
+	mesh->header = *header;
+	if (header->version == 1) {
+		// Submeshes start where the version 1 header ended
+		mesh->header.lod_count = 0;
+		mesh->header.lod_offset = 0;
+	}
+	mesh->lods = (const MeshLod *)(bytes + mesh->header.lod_offset);
+	mesh->submeshes =
+		(const MeshSubmesh *)(bytes + header->submesh_offset);
+	mesh->vertices = bytes + header->vertex_offset;
+	mesh->indices = bytes + header->index_offset;
+	mesh->map = map;
+	mesh->map_size = st.st_size;
+	for (uint32_t i = 0; i < header->submesh_count; i++) {
+		const MeshSubmesh *submesh = &mesh->submeshes[i];
+		if ((uint64_t)submesh->first_index + submesh->index_count >
+			    header->index_count ||
+		    !indices_valid(mesh, submesh->first_index,
+				   submesh->index_count,
+				   submesh->vertex_offset)) {
+			fprintf(stderr, "%s: submesh %u out of bounds\n", path,
+				i);
+			mesh_close(mesh);
+			return false;
+		}
+	}
+	for (uint32_t i = 0; i < header->submesh_count; i++) {
+		for (uint32_t level = 0; level < mesh->header.lod_count;
+		     level++) {
+			if (!lod_valid(mesh, i, level)) {
+				fprintf(stderr,
+					"%s: submesh %u level of detail %u "
+					"invalid\n",
+					path, i, level);
+				mesh_close(mesh);
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+void mesh_from_memory(Mesh *mesh, const void *vertices, uint32_t vertex_count,
+		      uint32_t vertex_stride, const void *indices,
+		      uint32_t index_count, uint32_t index_size)
+{
+	*mesh = (Mesh){
+		.header = { .magic = MESH_MAGIC,
+			    .version = MESH_VERSION,
+			    .vertex_stride = vertex_stride,
+			    .index_size = index_size,
+			    .vertex_count = vertex_count,
+			    .index_count = index_count,
+			    .submesh_count = 1 },
+		.vertices = vertices,
+		.indices = indices,
+		.whole = { .index_count = index_count }
+	};
+	mesh->submeshes = &mesh->whole;
+}
+
+void mesh_close(Mesh *mesh)
+{
+	if (mesh->map != nullptr) {
+		munmap(mesh->map, mesh->map_size);
+	}
+	*mesh = (Mesh){};
+}
+
+VkDeviceSize mesh_vertex_bytes(const Mesh *mesh)
+{
+	return (VkDeviceSize)mesh->header.vertex_count *
+	       mesh->header.vertex_stride;
+}
+
+VkDeviceSize mesh_index_bytes(const Mesh *mesh)
+{
+	return (VkDeviceSize)mesh->header.index_count *
+	       mesh->header.index_size;
+}
+
+VkIndexType mesh_index_type(const Mesh *mesh)
+{
+	return mesh->header.index_size == 4 ? VK_INDEX_TYPE_UINT32 :
+					      VK_INDEX_TYPE_UINT16;
+}
+
+uint32_t mesh_lod_count(const Mesh *mesh)
+{
+	return mesh->header.lod_count > 0 ? mesh->header.lod_count : 1;
+}
+
+MeshLod mesh_lod(const Mesh *mesh, uint32_t submesh, uint32_t level)
+{
+	if (mesh->header.lod_count == 0) {
+		const MeshSubmesh *range = &mesh->submeshes[submesh];
+		return (MeshLod){ .first_index = range->first_index,
+				  .index_count = range->index_count };
+	}
+	return mesh->lods[(size_t)submesh * mesh->header.lod_count + level];
+}
+
+bool mesh_submesh_bounds(const Mesh *mesh, uint32_t submesh, float min[3],
+			 float max[3])
+{
+	const MeshSubmesh *range = &mesh->submeshes[submesh];
+	const MeshHeader *header = &mesh->header;
+	bool found = false;
+	for (uint32_t i = 0; i < range->index_count; i++) {
+		uint64_t at = (uint64_t)range->first_index + i;
+		if (at >= header->index_count) {
+			break;
+		}
+		int64_t vertex =
+			(int64_t)read_index(mesh, at) + range->vertex_offset;
+		if (vertex < 0 || vertex >= header->vertex_count) {
+			continue;
+		}
+		float position[3];
+		memcpy(position,
+		       mesh->vertices + (size_t)vertex * header->vertex_stride,
+		       sizeof(position));
+		for (uint32_t axis = 0; axis < 3; axis++) {
+			if (!found || position[axis] < min[axis]) {
+				min[axis] = position[axis];
+			}
+			if (!found || position[axis] > max[axis]) {
+				max[axis] = position[axis];
+			}
+		}
+		found = true;
+	}
+	return found;
+}
+
+// Drops the whole pages of [begin, end) from the mapping, they were already
+// copied into the staging ring
+static void release_pages(const Mesh *mesh, const unsigned char *begin,
+			  const unsigned char *end)
+{
+	uintptr_t page = sysconf(_SC_PAGESIZE);
+	uintptr_t first = ((uintptr_t)begin + page - 1) & ~(page - 1);
+	uintptr_t last = (uintptr_t)end & ~(page - 1);
+	if (mesh->map != nullptr && last > first) {
+		madvise((void *)first, last - first, MADV_DONTNEED);
+	}
+}
+
+static void stream_range(Mesh *mesh, const unsigned char *src,
+			 VkDeviceSize total, VkDeviceSize *streamed,
+			 VkBuffer dst, VkDeviceSize *budget)
+{
+	VkDeviceSize size = total - *streamed;
+	if (size > *budget) {
+		size = *budget;
+	}
+	if (size == 0) {
+		return;
+	}
+	const unsigned char *begin = src + *streamed;
+	upload_buffer(dst, *streamed, begin, size);
+	release_pages(mesh, begin, begin + size);
+	*streamed += size;
+	*budget -= size;
+
+	// Start reading the next chunk while this one is being copied
+	VkDeviceSize ahead = total - *streamed;
+	if (mesh->map != nullptr && ahead > 0) {
+		uintptr_t page = sysconf(_SC_PAGESIZE);
+		uintptr_t next = (uintptr_t)(src + *streamed) & ~(page - 1);
+		madvise((void *)next, ahead < size ? ahead : size,
+			MADV_WILLNEED);
+	}
+}
+
+bool mesh_stream(Mesh *mesh, VkBuffer vertex_buffer, VkBuffer index_buffer,
+		 VkDeviceSize budget)
+{
+	stream_range(mesh, mesh->vertices, mesh_vertex_bytes(mesh),
+		     &mesh->vertex_streamed, vertex_buffer, &budget);
+	stream_range(mesh, mesh->indices, mesh_index_bytes(mesh),
+		     &mesh->index_streamed, index_buffer, &budget);
+	return mesh->vertex_streamed == mesh_vertex_bytes(mesh) &&
+	       mesh->index_streamed == mesh_index_bytes(mesh);
+}
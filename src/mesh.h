@@ -0,0 +1,110 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <vulkan/vulkan.h>
+
+// Binary mesh container, little endian, laid out to be used straight from
+// an mmap of the file:
+//
+//   MeshHeader
+//   MeshSubmesh[submesh_count]   at submesh_offset
+//   MeshLod[submesh_count * lod_count]
+//                                at lod_offset, submesh by submesh
+//   vertex stream                at vertex_offset, vertex_count * stride
+//   index stream                 at index_offset, index_count * index_size
+//
+// Every offset is a multiple of MESH_ALIGNMENT. Version 1 files have no
+// levels of detail and end the header before lod_offset, they still load.
+// nebula-cook writes these files from OBJ sources.
+
+#define MESH_MAGIC 0x4853454eu // "NESH"
+#define MESH_VERSION 2
+#define MESH_ALIGNMENT 16
+#define MESH_MAX_LODS 8
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t vertex_stride;
+	// 2 or 4 bytes per index
+	uint32_t index_size;
+	uint32_t vertex_count;
+	uint32_t index_count;
+	uint32_t submesh_count;
+	// Levels of detail of every submesh, 0 when there are none
+	uint32_t lod_count;
+	uint64_t submesh_offset;
+	uint64_t vertex_offset;
+	uint64_t index_offset;
+	uint64_t lod_offset;
+} MeshHeader;
+
+// A range of the index stream, drawn with one vkCmdDrawIndexed
+typedef struct {
+	uint32_t first_index;
+	uint32_t index_count;
+	int32_t vertex_offset;
+	uint32_t reserved;
+} MeshSubmesh;
+
+// A simplified copy of a submesh, a range of the index stream drawn with
+// the submesh's vertex_offset. It only references the submesh's vertices.
+// Level 0 is the submesh itself, every level has fewer triangles than the
+// one before.
+typedef struct {
+	uint32_t first_index;
+	uint32_t index_count;
+	// Estimated distance between this level's surface and level 0, in
+	// the units of the vertex positions
+	float error;
+	uint32_t reserved;
+} MeshLod;
+
+typedef struct {
+	MeshHeader header;
+	const MeshSubmesh *submeshes;
+	const MeshLod *lods;
+	const unsigned char *vertices;
+	const unsigned char *indices;
+	// File mapping, nullptr for meshes wrapping memory
+	void *map;
+	size_t map_size;
+	// Bytes of each stream handed to the upload path so far
+	VkDeviceSize vertex_streamed;
+	VkDeviceSize index_streamed;
+	MeshSubmesh whole;
+} Mesh;
+
+// Maps and validates a mesh file. The index ranges it draws are read once
+// to check that every index lands in the vertex stream, the vertex stream
+// is not read until it is streamed.
+bool mesh_open(const char *path, Mesh *mesh);
+// Wraps arrays that outlive the mesh as a single submesh
+void mesh_from_memory(Mesh *mesh, const void *vertices, uint32_t vertex_count,
+		      uint32_t vertex_stride, const void *indices,
+		      uint32_t index_count, uint32_t index_size);
+void mesh_close(Mesh *mesh);
+
+VkDeviceSize mesh_vertex_bytes(const Mesh *mesh);
+VkDeviceSize mesh_index_bytes(const Mesh *mesh);
+VkIndexType mesh_index_type(const Mesh *mesh);
+
+// Levels of detail per submesh, 1 when the file has none
+uint32_t mesh_lod_count(const Mesh *mesh);
+// Level `level` of `submesh`, the submesh itself for level 0 of a mesh
+// without levels
+MeshLod mesh_lod(const Mesh *mesh, uint32_t submesh, uint32_t level);
+
+// Axis aligned box of the vertices a submesh references, reading the
+// position from the first three floats of every vertex. Walks the index
+// range, so call it before the mesh is streamed out of the page cache.
+// Returns false for a submesh without valid indices.
+bool mesh_submesh_bounds(const Mesh *mesh, uint32_t submesh, float min[3],
+			 float max[3]);
+
+// Queues at most `budget` more bytes of the mesh on the upload path, vertex
+// stream first. Pages already handed over are released from the mapping so
+// a large file is never resident as a whole. Returns true once everything
+// has been queued.
+bool mesh_stream(Mesh *mesh, VkBuffer vertex_buffer, VkBuffer index_buffer,
+		 VkDeviceSize budget);
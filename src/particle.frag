@@ -0,0 +1,10 @@
+#version 450
+
+layout(location = 0) in vec4 fragColor;
+
+layout(location = 0) out vec4 outColor;
+
+// Blended additively, the color is already premultiplied
+void main() {
+    outColor = fragColor;
+}
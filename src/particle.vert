@@ -0,0 +1,19 @@
+#version 450
+
+layout(binding = 0) uniform UniformBufferObject {
+    mat4 view;
+    mat4 proj;
+} ubo;
+
+// Straight from the simulation's buffer, see Particle in src/particles.h
+layout(location = 0) in vec4 inPosition;
+layout(location = 1) in vec4 inColor;
+
+layout(location = 0) out vec4 fragColor;
+
+void main() {
+    gl_Position = ubo.proj * ubo.view * vec4(inPosition.xyz, 1.0);
+    // Anything larger needs the largePoints feature
+    gl_PointSize = 1.0;
+    fragColor = inColor;
+}
@@ -0,0 +1,221 @@
+#include "particles.h"
+#include "allocator.h"
+#include "descriptors.h"
+#include "shaders.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define PARTICLES_GROUP_SIZE 256
+// Longest step taken at once, a hitch must not fling particles away
+#define PARTICLES_MAX_STEP (1.0f / 20.0f)
+
+// Push constants of particles.comp
+typedef struct {
+	float dt;
+	float time;
+	uint32_t count;
+	uint32_t seed;
+} ParticleConstants;
+
+static VkDevice device;
+static uint32_t particle_count;
+// State of the last step is in buffers[current]
+static VkBuffer buffers[2];
+static Allocation allocations[2];
+static uint32_t current;
+static bool cleared;
+static float elapsed;
+static uint32_t steps;
+// sets[i] reads buffers[i] and writes the other one
+static VkDescriptorSet sets[2];
+static VkDescriptorSetLayout set_layout;
+static VkPipelineLayout pipeline_layout;
+static VkPipeline pipeline;
+
+static void create_pipeline(VkPipelineCache pipeline_cache)
+{
+	VkDescriptorSetLayoutBinding bindings[2];
+	for (uint32_t i = 0; i < 2; i++) {
+		bindings[i] = (VkDescriptorSetLayoutBinding){
+			.binding = i,
+			.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+			.descriptorCount = 1,
+			.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT
+		};
+	}
+	VkDescriptorSetLayoutCreateInfo layoutInfo = {
+		.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+		.bindingCount = 2,
+		.pBindings = bindings
+	};
+	set_layout = descriptors_layout(&layoutInfo);
+	VkPushConstantRange pushConstantRange = {
+		.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+		.offset = 0,
+		.size = sizeof(ParticleConstants)
+	};
+	VkPipelineLayoutCreateInfo pipelineLayoutInfo = {
+		.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+		.setLayoutCount = 1,
+		.pSetLayouts = &set_layout,
+		.pushConstantRangeCount = 1,
+		.pPushConstantRanges = &pushConstantRange
+	};
+	if (vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr,
+				   &pipeline_layout) != VK_SUCCESS) {
+		fprintf(stderr, "Can't create particle pipeline layout");
+		exit(1);
+	}
+
+	ShaderBinary code = shader_get("particles");
+	VkShaderModuleCreateInfo moduleInfo = {
+		.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
+		.codeSize = code.size,
+		.pCode = code.code
+	};
+	VkShaderModule module;
+	if (vkCreateShaderModule(device, &moduleInfo, nullptr, &module) !=
+	    VK_SUCCESS) {
+		fprintf(stderr, "Can't create particle shader module");
+		exit(1);
+	}
+	shader_release(code);
+	VkComputePipelineCreateInfo pipelineInfo = {
+		.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
+		.stage = {
+			.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+			.stage = VK_SHADER_STAGE_COMPUTE_BIT,
+			.module = module,
+			.pName = "main" },
+		.layout = pipeline_layout
+	};
+	if (vkCreateComputePipelines(device, pipeline_cache, 1, &pipelineInfo,
+				     nullptr, &pipeline) != VK_SUCCESS) {
+		fprintf(stderr, "Can't create particle pipeline");
+		exit(1);
+	}
+	vkDestroyShaderModule(device, module, nullptr);
+}
+
+static void create_descriptor_sets()
+{
+	for (uint32_t i = 0; i < 2; i++) {
+		sets[i] = descriptors_allocate(set_layout);
+		VkDescriptorBufferInfo infos[2] = {
+			{ buffers[i], 0, VK_WHOLE_SIZE },
+			{ buffers[i ^ 1], 0, VK_WHOLE_SIZE },
+		};
+		VkWriteDescriptorSet writes[2];
+		for (uint32_t j = 0; j < 2; j++) {
+			writes[j] = (VkWriteDescriptorSet){
+				.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+				.dstSet = sets[i],
+				.dstBinding = j,
+				.descriptorCount = 1,
+				.descriptorType =
+					VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+				.pBufferInfo = &infos[j]
+			};
+		}
+		vkUpdateDescriptorSets(device, 2, writes, 0, nullptr);
+	}
+}
+
+void particles_init(VkDevice logical_device, VkPipelineCache pipeline_cache,
+		    uint32_t count)
+{
+	device = logical_device;
+	particle_count = count;
+	for (uint32_t i = 0; i < 2; i++) {
+		allocator_create_buffer(sizeof(Particle) * count,
+					VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+						VK_BUFFER_USAGE_VERTEX_BUFFER_BIT |
+						VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+					VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0,
+					&buffers[i], &allocations[i]);
+	}
+	create_pipeline(pipeline_cache);
+	create_descriptor_sets();
+	printf("Simulating %u particles on the GPU\n", count);
+}
+
+void particles_destroy()
+{
+	vkDestroyPipeline(device, pipeline, nullptr);
+	vkDestroyPipelineLayout(device, pipeline_layout, nullptr);
+	for (uint32_t i = 0; i < 2; i++) {
+		allocator_destroy_buffer(buffers[i], &allocations[i]);
+	}
+}
+
+uint32_t particles_count()
+{
+	return particle_count;
+}
+
+void particles_simulate(VkCommandBuffer command_buffer, float dt)
+{
+	VkBuffer source = buffers[current];
+	if (!cleared) {
+		// Zeroed particles have no life left, so the first step spawns
+		// all of them
+		vkCmdFillBuffer(command_buffer, source, 0, VK_WHOLE_SIZE, 0);
+		VkMemoryBarrier clear = {
+			.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+			.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+			.dstAccessMask = VK_ACCESS_SHADER_READ_BIT
+		};
+		vkCmdPipelineBarrier(command_buffer,
+				     VK_PIPELINE_STAGE_TRANSFER_BIT,
+				     VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1,
+				     &clear, 0, nullptr, 0, nullptr);
+		cleared = true;
+	}
+	// The destination was last read by the draw of an earlier frame and
+	// by the step before, both have to be done before it is overwritten.
+	// Execution order is enough for write after read.
+	vkCmdPipelineBarrier(command_buffer,
+			     VK_PIPELINE_STAGE_VERTEX_INPUT_BIT |
+				     VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+			     VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0,
+			     nullptr, 0, nullptr, 0, nullptr);
+
+	dt = dt < PARTICLES_MAX_STEP ? dt : PARTICLES_MAX_STEP;
+	elapsed += dt;
+	ParticleConstants constants = { .dt = dt,
+					.time = elapsed,
+					.count = particle_count,
+					.seed = steps++ };
+	vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+			  pipeline);
+	vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+				pipeline_layout, 0, 1, &sets[current], 0,
+				nullptr);
+	vkCmdPushConstants(command_buffer, pipeline_layout,
+			   VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(constants),
+			   &constants);
+	vkCmdDispatch(command_buffer,
+		      (particle_count + PARTICLES_GROUP_SIZE - 1) /
+			      PARTICLES_GROUP_SIZE,
+		      1, 1);
+	VkMemoryBarrier written = {
+		.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+		.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+		.dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT |
+				 VK_ACCESS_SHADER_READ_BIT
+	};
+	vkCmdPipelineBarrier(command_buffer,
+			     VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+			     VK_PIPELINE_STAGE_VERTEX_INPUT_BIT |
+				     VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+			     0, 1, &written, 0, nullptr, 0, nullptr);
+	current ^= 1;
+}
+
+void particles_draw(VkCommandBuffer command_buffer)
+{
+	VkDeviceSize offset = 0;
+	vkCmdBindVertexBuffers(command_buffer, 0, 1, &buffers[current],
+			       &offset);
+	vkCmdDraw(command_buffer, particle_count, 1, 0, 0);
+}
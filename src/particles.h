@@ -0,0 +1,37 @@
+#pragma once
+#include <cglm/cglm.h>
+#include <vulkan/vulkan.h>
+
+// GPU particle system. Particle state lives in two device local buffers a
+// compute pass ping-pongs between: each step reads the state of the last
+// one and writes the other buffer, which the graphics pass then draws as
+// points straight from the vertex stream. The CPU only records the
+// dispatch and the draw, it never touches or reads back a particle.
+//
+// Particles that ran out of life respawn in the shader, so the count stays
+// constant. Steps and draws are recorded on the graphics queue, every step
+// depends on the one before and feeds the frame's draw.
+
+// Laid out like Particle in particles.comp, also the vertex stride
+typedef struct {
+	// xyz position, w seconds left to live
+	vec4 position;
+	// xyz velocity, w lifetime the particle was spawned with
+	vec4 velocity;
+	// Premultiplied by the fade in and out
+	vec4 color;
+} Particle;
+
+void particles_init(VkDevice device, VkPipelineCache pipeline_cache,
+		    uint32_t count);
+// The device must be idle
+void particles_destroy();
+
+uint32_t particles_count();
+
+// Records one simulation step of `dt` seconds, outside of a render pass.
+// Draws recorded afterwards in the same queue see its result.
+void particles_simulate(VkCommandBuffer command_buffer, float dt);
+// Binds the current state as vertex binding 0 and draws every particle as
+// a point. The pipeline and descriptor state must already be bound.
+void particles_draw(VkCommandBuffer command_buffer);
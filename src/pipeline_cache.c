@@ -0,0 +1,151 @@
+#include "pipeline_cache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static VkDevice device;
+static VkPipelineCache cache;
+static const char *cache_path;
+static bool warm;
+
+// Reads the whole file, nullptr when it does not exist or is unreadable
+static void *read_cache_file(const char *path, size_t *size)
+{
+	FILE *file = fopen(path, "rb");
+	if (file == nullptr) {
+		return nullptr;
+	}
+	void *data = nullptr;
+	long length = -1;
+	if (fseek(file, 0, SEEK_END) == 0) {
+		length = ftell(file);
+		rewind(file);
+	}
+	if (length > 0) {
+		data = malloc(length);
+		if (data != nullptr &&
+		    fread(data, 1, length, file) != (size_t)length) {
+			free(data);
+			data = nullptr;
+		}
+	}
+	fclose(file);
+	*size = length > 0 ? (size_t)length : 0;
+	return data;
+}
+
+static const char *validate_header(const void *data, size_t size,
+				   const VkPhysicalDeviceProperties *properties)
+{
+	VkPipelineCacheHeaderVersionOne header;
+	if (size < sizeof(header)) {
+		return "truncated";
+	}
+	memcpy(&header, data, sizeof(header));
+	if (header.headerVersion != VK_PIPELINE_CACHE_HEADER_VERSION_ONE ||
+	    header.headerSize < sizeof(header) || header.headerSize > size) {
+		return "unknown header";
+	}
+	if (header.vendorID != properties->vendorID ||
+	    header.deviceID != properties->deviceID) {
+		return "different device";
+	}
+	// The UUID changes with the driver build as well
+	if (memcmp(header.pipelineCacheUUID, properties->pipelineCacheUUID,
+		   VK_UUID_SIZE) != 0) {
+		return "different driver";
+	}
+	return nullptr;
+}
+
+VkPipelineCache pipeline_cache_init(VkPhysicalDevice physical_device,
+				    VkDevice logical_device, const char *path)
+{
+	device = logical_device;
+	cache_path = path;
+	warm = false;
+
+	VkPhysicalDeviceProperties properties;
+	vkGetPhysicalDeviceProperties(physical_device, &properties);
+	size_t size = 0;
+	void *data = read_cache_file(path, &size);
+	const char *reason = data == nullptr ? "no cache file" :
+			     validate_header(data, size, &properties);
+
+	VkPipelineCacheCreateInfo createInfo = {
+		.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO
+	};
+	if (reason == nullptr) {
+		createInfo.initialDataSize = size;
+		createInfo.pInitialData = data;
+	}
+	VkResult result =
+		vkCreatePipelineCache(device, &createInfo, nullptr, &cache);
+	if (result != VK_SUCCESS && reason == nullptr) {
+		// The driver refused the data, retry without it
+		reason = "rejected by driver";
+		createInfo.initialDataSize = 0;
+		createInfo.pInitialData = nullptr;
+		result = vkCreatePipelineCache(device, &createInfo, nullptr,
+					       &cache);
+	}
+	free(data);
+	if (result != VK_SUCCESS) {
+		fprintf(stderr, "Failed to create pipeline cache");
+		exit(1);
+	}
+	warm = reason == nullptr;
+	if (warm) {
+		printf("Pipeline cache: warm, %zu bytes from %s\n", size, path);
+	} else {
+		printf("Pipeline cache: cold (%s)\n", reason);
+	}
+	return cache;
+}
+
+bool pipeline_cache_warm()
+{
+	return warm;
+}
+
+// Writes to a temporary file and renames it over the old one, so a crash
+// mid-write never leaves a torn cache behind
+static void write_cache_file(const void *data, size_t size)
+{
+	size_t length = strlen(cache_path);
+	char tmp_path[length + 5];
+	memcpy(tmp_path, cache_path, length);
+	memcpy(tmp_path + length, ".tmp", 5);
+
+	FILE *file = fopen(tmp_path, "wb");
+	if (file == nullptr) {
+		perror(tmp_path);
+		return;
+	}
+	bool ok = fwrite(data, 1, size, file) == size && fflush(file) == 0 &&
+		  fsync(fileno(file)) == 0;
+	ok = fclose(file) == 0 && ok;
+	if (!ok || rename(tmp_path, cache_path) != 0) {
+		perror(cache_path);
+		remove(tmp_path);
+	}
+}
+
+void pipeline_cache_destroy()
+{
+	size_t size = 0;
+	if (vkGetPipelineCacheData(device, cache, &size, nullptr) ==
+		    VK_SUCCESS &&
+	    size > 0) {
+		void *data = malloc(size);
+		if (data != nullptr &&
+		    vkGetPipelineCacheData(device, cache, &size, data) ==
+			    VK_SUCCESS) {
+			write_cache_file(data, size);
+		}
+		free(data);
+	}
+	vkDestroyPipelineCache(device, cache, nullptr);
+	cache = VK_NULL_HANDLE;
+}
@@ -0,0 +1,14 @@
+#pragma once
+#include <vulkan/vulkan.h>
+
+// VkPipelineCache persisted across runs. The file is only used when its
+// header matches this device and driver, otherwise the cache starts cold.
+
+// Creates the cache, seeded from `path` when the file is valid. Every
+// pipeline should be created against the returned handle.
+VkPipelineCache pipeline_cache_init(VkPhysicalDevice physical_device,
+				    VkDevice device, const char *path);
+// True when the cache was seeded from disk
+bool pipeline_cache_warm();
+// Writes the cache back atomically and destroys it
+void pipeline_cache_destroy();
@@ -0,0 +1,253 @@
+#include "profiler.h"
+#include "app.h"
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Thread id of samples measured on the GPU
+#define GPU_THREAD UINT32_MAX
+// Sequence of a sample a writer is filling in
+#define SAMPLE_BUSY UINT64_MAX
+
+typedef struct {
+	// index + 1 once the sample written for `index` is complete, so a
+	// reader can tell finished samples from ones being overwritten
+	atomic_uint_fast64_t sequence;
+	const char *name;
+	uint64_t start;
+	uint64_t end;
+	uint32_t frame;
+	uint32_t thread;
+} Sample;
+
+typedef struct {
+	VkQueryPool pool;
+	bool pending;
+	uint64_t submit_time;
+	uint32_t frame;
+} GpuSlot;
+
+static Sample ring[PROFILER_RING_SIZE];
+static atomic_uint_fast64_t ring_head;
+static atomic_uint frame_number;
+static atomic_uint next_thread;
+static _Thread_local uint32_t thread_id = UINT32_MAX;
+static uint64_t epoch;
+
+static VkDevice device;
+static GpuSlot gpu_slots[MAX_FRAMES_IN_FLIGHT];
+static uint32_t gpu_slot_count;
+static bool gpu_enabled;
+static float timestamp_period;
+static uint64_t timestamp_mask;
+
+uint64_t profiler_now()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+static void push_sample(const char *name, uint64_t start, uint64_t end,
+			uint32_t frame, uint32_t thread)
+{
+	uint64_t index = atomic_fetch_add_explicit(&ring_head, 1,
+						   memory_order_relaxed);
+	Sample *sample = &ring[index % PROFILER_RING_SIZE];
+	// Claim the slot. A writer that lapped the ring while another still
+	// fills the slot drops its sample instead of waiting.
+	uint64_t sequence =
+		atomic_load_explicit(&sample->sequence, memory_order_relaxed);
+	if (sequence == SAMPLE_BUSY || sequence > index ||
+	    !atomic_compare_exchange_strong_explicit(
+		    &sample->sequence, &sequence, SAMPLE_BUSY,
+		    memory_order_acquire, memory_order_relaxed)) {
+		return;
+	}
+	sample->name = name;
+	sample->start = start;
+	sample->end = end;
+	sample->frame = frame;
+	sample->thread = thread;
+	atomic_store_explicit(&sample->sequence, index + 1,
+			      memory_order_release);
+}
+
+void profiler_init(VkPhysicalDevice physical_device, VkDevice logical_device,
+		   uint32_t queue_family, uint32_t frame_slots)
+{
+	device = logical_device;
+	epoch = profiler_now();
+	gpu_slot_count = frame_slots;
+
+	VkPhysicalDeviceProperties properties;
+	vkGetPhysicalDeviceProperties(physical_device, &properties);
+	uint32_t familyCount = 0;
+	vkGetPhysicalDeviceQueueFamilyProperties(physical_device, &familyCount,
+						 nullptr);
+	VkQueueFamilyProperties families[familyCount];
+	vkGetPhysicalDeviceQueueFamilyProperties(physical_device, &familyCount,
+						 families);
+	uint32_t validBits = families[queue_family].timestampValidBits;
+	timestamp_period = properties.limits.timestampPeriod;
+	timestamp_mask = validBits >= 64 ? UINT64_MAX : (1ull << validBits) - 1;
+	gpu_enabled = validBits > 0 && timestamp_period > 0.0f;
+	if (!gpu_enabled) {
+		printf("GPU timestamps not supported, profiling CPU only\n");
+		return;
+	}
+
+	VkQueryPoolCreateInfo poolInfo = {
+		.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+		.queryType = VK_QUERY_TYPE_TIMESTAMP,
+		.queryCount = 2
+	};
+	for (uint32_t i = 0; i < gpu_slot_count; i++) {
+		gpu_slots[i] = (GpuSlot){};
+		if (vkCreateQueryPool(device, &poolInfo, nullptr,
+				      &gpu_slots[i].pool) != VK_SUCCESS) {
+			fprintf(stderr, "Failed to create query pool");
+			exit(1);
+		}
+	}
+}
+
+void profiler_destroy()
+{
+	if (!gpu_enabled) {
+		return;
+	}
+	for (uint32_t i = 0; i < gpu_slot_count; i++) {
+		vkDestroyQueryPool(device, gpu_slots[i].pool, nullptr);
+	}
+}
+
+void profiler_frame_begin()
+{
+	atomic_fetch_add_explicit(&frame_number, 1, memory_order_relaxed);
+}
+
+uint64_t profiler_begin()
+{
+	return profiler_now();
+}
+
+void profiler_end(const char *name, uint64_t start)
+{
+	if (thread_id == UINT32_MAX) {
+		thread_id = atomic_fetch_add_explicit(&next_thread, 1,
+						      memory_order_relaxed);
+	}
+	push_sample(name, start, profiler_now(),
+		    atomic_load_explicit(&frame_number, memory_order_relaxed),
+		    thread_id);
+}
+
+void profiler_gpu_begin(VkCommandBuffer command_buffer, uint32_t slot)
+{
+	if (!gpu_enabled) {
+		return;
+	}
+	vkCmdResetQueryPool(command_buffer, gpu_slots[slot].pool, 0, 2);
+	vkCmdWriteTimestamp(command_buffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+			    gpu_slots[slot].pool, 0);
+}
+
+void profiler_gpu_end(VkCommandBuffer command_buffer, uint32_t slot)
+{
+	if (!gpu_enabled) {
+		return;
+	}
+	vkCmdWriteTimestamp(command_buffer,
+			    VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+			    gpu_slots[slot].pool, 1);
+}
+
+void profiler_gpu_submitted(uint32_t slot)
+{
+	if (!gpu_enabled) {
+		return;
+	}
+	gpu_slots[slot].pending = true;
+	gpu_slots[slot].submit_time = profiler_now();
+	gpu_slots[slot].frame =
+		atomic_load_explicit(&frame_number, memory_order_relaxed);
+}
+
+void profiler_gpu_collect(uint32_t slot)
+{
+	GpuSlot *gpu = &gpu_slots[slot];
+	if (!gpu_enabled || !gpu->pending) {
+		return;
+	}
+	gpu->pending = false;
+	uint64_t timestamps[2];
+	if (vkGetQueryPoolResults(device, gpu->pool, 0, 2, sizeof(timestamps),
+				  timestamps, sizeof(uint64_t),
+				  VK_QUERY_RESULT_64_BIT) != VK_SUCCESS) {
+		return;
+	}
+	uint64_t ticks = (timestamps[1] - timestamps[0]) & timestamp_mask;
+	uint64_t duration = (uint64_t)(ticks * (double)timestamp_period);
+	push_sample("gpu render pass", gpu->submit_time,
+		    gpu->submit_time + duration, gpu->frame, GPU_THREAD);
+}
+
+bool profiler_export(const char *path)
+{
+	FILE *file = fopen(path, "w");
+	if (file == nullptr) {
+		perror(path);
+		return false;
+	}
+	size_t length = strlen(path);
+	bool csv = length >= 4 && strcmp(path + length - 4, ".csv") == 0;
+	if (csv) {
+		fprintf(file, "frame,thread,name,start_us,duration_us\n");
+	} else {
+		fprintf(file, "{\"traceEvents\":[\n");
+	}
+
+	uint64_t head = atomic_load_explicit(&ring_head, memory_order_acquire);
+	uint64_t first = head > PROFILER_RING_SIZE ? head - PROFILER_RING_SIZE :
+						     0;
+	bool separator = false;
+	for (uint64_t i = first; i < head; i++) {
+		Sample *sample = &ring[i % PROFILER_RING_SIZE];
+		if (atomic_load_explicit(&sample->sequence,
+					 memory_order_acquire) != i + 1) {
+			continue;
+		}
+		double start = (sample->start - epoch) / 1e3;
+		double duration = (sample->end - sample->start) / 1e3;
+		if (csv) {
+			fprintf(file, "%u,%s%u,%s,%.3f,%.3f\n", sample->frame,
+				sample->thread == GPU_THREAD ? "gpu" : "cpu",
+				sample->thread == GPU_THREAD ? 0 :
+							       sample->thread,
+				sample->name, start, duration);
+			continue;
+		}
+		// The GPU gets its own track after the CPU threads
+		fprintf(file,
+			"%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\","
+			"\"ts\":%.3f,\"dur\":%.3f,\"pid\":0,\"tid\":%u,"
+			"\"args\":{\"frame\":%u}}",
+			separator ? ",\n" : "", sample->name,
+			sample->thread == GPU_THREAD ? "gpu" : "cpu", start,
+			duration,
+			sample->thread == GPU_THREAD ? 1000 : sample->thread,
+			sample->frame);
+		separator = true;
+	}
+	if (!csv) {
+		fprintf(file, "\n]}\n");
+	}
+	bool ok = fclose(file) == 0;
+	if (ok) {
+		printf("Wrote %s\n", path);
+	}
+	return ok;
+}
@@ -0,0 +1,39 @@
+#pragma once
+#include <stdint.h>
+#include <vulkan/vulkan.h>
+
+// Frame instrumentation. CPU scopes from any thread and GPU timestamp pairs
+// around the render pass are pushed into one lock-free ring of samples,
+// which can be exported as a Chrome trace (chrome://tracing, Perfetto) or
+// as CSV.
+
+// Samples kept, older ones are overwritten
+#define PROFILER_RING_SIZE (1u << 16)
+
+void profiler_init(VkPhysicalDevice physical_device, VkDevice device,
+		   uint32_t queue_family, uint32_t frame_slots);
+void profiler_destroy();
+
+// Monotonic time in nanoseconds
+uint64_t profiler_now();
+// Marks the start of a new frame, samples are tagged with its number
+void profiler_frame_begin();
+
+// CPU scope: `uint64_t start = profiler_begin(); ...; profiler_end(name,
+// start);`. `name` must outlive the profiler, string literals in practice.
+uint64_t profiler_begin();
+void profiler_end(const char *name, uint64_t start);
+
+// Brackets GPU work in `slot`'s command buffer with timestamps
+void profiler_gpu_begin(VkCommandBuffer command_buffer, uint32_t slot);
+void profiler_gpu_end(VkCommandBuffer command_buffer, uint32_t slot);
+// Call right after submitting `slot`'s command buffer
+void profiler_gpu_submitted(uint32_t slot);
+// Reads back `slot`'s timestamps once its fence has signaled. GPU and CPU
+// clocks are not related, so the GPU sample starts at the CPU time of its
+// submit and only its duration is measured on the GPU.
+void profiler_gpu_collect(uint32_t slot);
+
+// Writes every sample still in the ring, CSV when `path` ends in .csv and
+// Chrome trace JSON otherwise. Call once no thread is recording anymore.
+bool profiler_export(const char *path);
@@ -0,0 +1,135 @@
+#include "record.h"
+#include "app.h"
+#include "jobs.h"
+#include "profiler.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+// Slices run as jobs on whatever thread picks them up. A slice's pools are
+// only ever used by the one job recording it, so they need no locking.
+typedef struct {
+	VkCommandPool pools[MAX_FRAMES_IN_FLIGHT];
+	VkCommandBuffer buffers[MAX_FRAMES_IN_FLIGHT];
+	bool recorded;
+} RecordSlice;
+
+static VkDevice device;
+static RecordSlice slices[MAX_RECORD_THREADS];
+static uint32_t slice_count;
+static uint32_t slot_count;
+
+typedef struct {
+	uint32_t slot;
+	const VkCommandBufferInheritanceInfo *inheritance;
+	uint32_t count;
+	RecordDrawsFn fn;
+	void *user;
+} RecordJob;
+
+static void record_slice(const RecordJob *job, uint32_t index)
+{
+	RecordSlice *slice = &slices[index];
+	uint32_t first = (uint64_t)job->count * index / slice_count;
+	uint32_t last = (uint64_t)job->count * (index + 1) / slice_count;
+	slice->recorded = false;
+	if (first == last) {
+		return;
+	}
+	uint64_t scope = profiler_begin();
+	// The slot's fence signaled, nothing recorded from this pool is
+	// still in use
+	vkResetCommandPool(device, slice->pools[job->slot], 0);
+	VkCommandBufferBeginInfo beginInfo = {
+		.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+		.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT |
+			 VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT,
+		.pInheritanceInfo = job->inheritance
+	};
+	VkCommandBuffer commandBuffer = slice->buffers[job->slot];
+	if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS) {
+		fprintf(stderr, "Failed to begin secondary command buffer");
+		exit(1);
+	}
+	job->fn(commandBuffer, first, last - first, job->user);
+	if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
+		fprintf(stderr, "Failed to record secondary command buffer");
+		exit(1);
+	}
+	slice->recorded = true;
+	profiler_end("record slice", scope);
+}
+
+static void record_slices(void *data, uint32_t begin, uint32_t end)
+{
+	for (uint32_t i = begin; i < end; i++) {
+		record_slice(data, i);
+	}
+}
+
+void record_init(VkDevice logical_device, uint32_t queue_family,
+		 uint32_t slices_per_frame, uint32_t frame_slots)
+{
+	device = logical_device;
+	slice_count = slices_per_frame;
+	slot_count = frame_slots;
+
+	VkCommandPoolCreateInfo poolInfo = {
+		.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+		.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT,
+		.queueFamilyIndex = queue_family
+	};
+	for (uint32_t i = 0; i < slice_count; i++) {
+		RecordSlice *slice = &slices[i];
+		for (uint32_t slot = 0; slot < slot_count; slot++) {
+			if (vkCreateCommandPool(device, &poolInfo, nullptr,
+						&slice->pools[slot]) !=
+			    VK_SUCCESS) {
+				fprintf(stderr,
+					"Failed to create recording pool");
+				exit(1);
+			}
+			VkCommandBufferAllocateInfo allocInfo = {
+				.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+				.commandPool = slice->pools[slot],
+				.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY,
+				.commandBufferCount = 1
+			};
+			if (vkAllocateCommandBuffers(device, &allocInfo,
+						     &slice->buffers[slot]) !=
+			    VK_SUCCESS) {
+				fprintf(stderr,
+					"Failed to allocate secondary command buffer");
+				exit(1);
+			}
+		}
+	}
+}
+
+void record_destroy()
+{
+	for (uint32_t i = 0; i < slice_count; i++) {
+		for (uint32_t slot = 0; slot < slot_count; slot++) {
+			vkDestroyCommandPool(device, slices[i].pools[slot],
+					     nullptr);
+		}
+	}
+	slice_count = 0;
+}
+
+uint32_t record_secondaries(uint32_t slot,
+			    const VkCommandBufferInheritanceInfo *inheritance,
+			    uint32_t count, RecordDrawsFn fn, void *user,
+			    VkCommandBuffer out[MAX_RECORD_THREADS])
+{
+	RecordJob job = { slot, inheritance, count, fn, user };
+	jobs_parallel_for(slice_count, 1, record_slices, &job);
+
+	// Keep draw order, slices cover the draw list front to back
+	uint32_t recorded = 0;
+	for (uint32_t i = 0; i < slice_count; i++) {
+		if (slices[i].recorded) {
+			out[recorded++] = slices[i].buffers[slot];
+		}
+	}
+	return recorded;
+}
@@ -0,0 +1,47 @@
+#pragma once
+#include <cglm/cglm.h>
+#include <vulkan/vulkan.h>
+
+// Parallel command recording on the job system. The draw list is cut into a
+// fixed number of slices and every slice owns one command pool per frame
+// slot, so recording never shares a pool between jobs and a slot's pools
+// can be reset as a whole once its fence signaled.
+
+#define MAX_RECORD_THREADS 16
+
+// Per-draw data pushed with vkCmdPushConstants right before the draw, laid
+// out like the push_constant block in shader.vert. Stays within the 128
+// bytes every device supports.
+typedef struct {
+	mat4 model;
+	uint32_t material;
+} DrawConstants;
+
+typedef struct {
+	DrawConstants constants;
+	uint32_t index_count;
+	uint32_t instance_count;
+	uint32_t first_index;
+	int32_t vertex_offset;
+	uint32_t first_instance;
+} DrawCommand;
+
+// Records draws [first, first + count) of the caller's sorted draw list
+// into `command_buffer`, including whatever state they need. Called
+// concurrently from several jobs with disjoint slices.
+typedef void (*RecordDrawsFn)(VkCommandBuffer command_buffer, uint32_t first,
+			      uint32_t count, void *user);
+
+void record_init(VkDevice device, uint32_t queue_family,
+		 uint32_t slices_per_frame, uint32_t frame_slots);
+void record_destroy();
+
+// Splits `count` draws into contiguous slices and records each as a job
+// into a secondary command buffer continuing the render pass described by
+// `inheritance`. Blocks until every slice is done, working on slices
+// itself, and returns the number of buffers stored in `out`, in draw order
+// and ready for vkCmdExecuteCommands.
+uint32_t record_secondaries(uint32_t slot,
+			    const VkCommandBufferInheritanceInfo *inheritance,
+			    uint32_t count, RecordDrawsFn fn, void *user,
+			    VkCommandBuffer out[MAX_RECORD_THREADS]);
@@ -0,0 +1,149 @@
+#include "render_queue.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEPTH_SHIFT 0
+#define MESH_SHIFT (DEPTH_SHIFT + RENDER_KEY_DEPTH_BITS)
+#define MATERIAL_SHIFT (MESH_SHIFT + RENDER_KEY_MESH_BITS)
+#define PIPELINE_SHIFT (MATERIAL_SHIFT + RENDER_KEY_MATERIAL_BITS)
+#define PASS_SHIFT (PIPELINE_SHIFT + RENDER_KEY_PIPELINE_BITS)
+
+#define FIELD_MASK(bits) ((1ull << (bits)) - 1)
+
+// Radix sort digit
+#define RADIX_BITS 8
+#define RADIX_BUCKETS (1u << RADIX_BITS)
+#define RADIX_PASSES (64 / RADIX_BITS)
+
+static RenderItem *items;
+// Ping-pong buffer of the radix sort
+static RenderItem *scratch;
+static uint32_t count;
+static uint32_t capacity;
+
+uint64_t render_key(uint32_t pass, uint32_t pipeline, uint32_t material,
+		    uint32_t mesh, float depth)
+{
+	// Non-negative floats order like their bit patterns, the top 24 of
+	// the 31 bits below the sign keep the exponent and 16 mantissa bits
+	uint32_t bits = 0;
+	if (depth > 0.0f) {
+		memcpy(&bits, &depth, sizeof(bits));
+		bits >>= 31 - RENDER_KEY_DEPTH_BITS;
+	}
+	return (pass & FIELD_MASK(RENDER_KEY_PASS_BITS)) << PASS_SHIFT |
+	       (pipeline & FIELD_MASK(RENDER_KEY_PIPELINE_BITS))
+		       << PIPELINE_SHIFT |
+	       (material & FIELD_MASK(RENDER_KEY_MATERIAL_BITS))
+		       << MATERIAL_SHIFT |
+	       (mesh & FIELD_MASK(RENDER_KEY_MESH_BITS)) << MESH_SHIFT |
+	       (uint64_t)bits << DEPTH_SHIFT;
+}
+
+uint32_t render_key_pass(uint64_t key)
+{
+	return key >> PASS_SHIFT & FIELD_MASK(RENDER_KEY_PASS_BITS);
+}
+
+uint32_t render_key_pipeline(uint64_t key)
+{
+	return key >> PIPELINE_SHIFT & FIELD_MASK(RENDER_KEY_PIPELINE_BITS);
+}
+
+uint32_t render_key_material(uint64_t key)
+{
+	return key >> MATERIAL_SHIFT & FIELD_MASK(RENDER_KEY_MATERIAL_BITS);
+}
+
+uint32_t render_key_mesh(uint64_t key)
+{
+	return key >> MESH_SHIFT & FIELD_MASK(RENDER_KEY_MESH_BITS);
+}
+
+void render_queue_init(uint32_t itemCapacity)
+{
+	capacity = itemCapacity;
+	count = 0;
+	items = malloc(sizeof(RenderItem) * (capacity > 0 ? capacity : 1));
+	scratch = malloc(sizeof(RenderItem) * (capacity > 0 ? capacity : 1));
+	if (items == nullptr || scratch == nullptr) {
+		fprintf(stderr, "Can't allocate the render queue");
+		exit(1);
+	}
+}
+
+void render_queue_destroy()
+{
+	free(items);
+	free(scratch);
+	items = nullptr;
+	scratch = nullptr;
+	count = 0;
+	capacity = 0;
+}
+
+RenderItem *render_queue_begin(uint32_t itemCount)
+{
+	if (itemCount > capacity) {
+		fprintf(stderr, "Render queue holds %u items, %u queued\n",
+			capacity, itemCount);
+		exit(1);
+	}
+	count = itemCount;
+	return items;
+}
+
+// LSD radix sort, 8 bits at a time. All histograms come from a single read
+// of the keys, and digits every key shares are skipped: in a typical frame
+// pass, pipeline, material and mesh take a handful of values, so only the
+// depth bytes and a few state bytes are actually moved.
+void render_queue_sort()
+{
+	static uint32_t histogram[RADIX_PASSES][RADIX_BUCKETS];
+	memset(histogram, 0, sizeof(histogram));
+	for (uint32_t i = 0; i < count; i++) {
+		uint64_t key = items[i].key;
+		for (uint32_t pass = 0; pass < RADIX_PASSES; pass++) {
+			histogram[pass][key >> (pass * RADIX_BITS) &
+					(RADIX_BUCKETS - 1)]++;
+		}
+	}
+
+	RenderItem *from = items;
+	RenderItem *to = scratch;
+	for (uint32_t pass = 0; pass < RADIX_PASSES; pass++) {
+		uint32_t *buckets = histogram[pass];
+		uint32_t shift = pass * RADIX_BITS;
+		if (count == 0 ||
+		    buckets[from[0].key >> shift & (RADIX_BUCKETS - 1)] ==
+			    count) {
+			continue;
+		}
+		uint32_t offset = 0;
+		for (uint32_t b = 0; b < RADIX_BUCKETS; b++) {
+			uint32_t size = buckets[b];
+			buckets[b] = offset;
+			offset += size;
+		}
+		for (uint32_t i = 0; i < count; i++) {
+			to[buckets[from[i].key >> shift &
+				   (RADIX_BUCKETS - 1)]++] = from[i];
+		}
+		RenderItem *swap = from;
+		from = to;
+		to = swap;
+	}
+	items = from;
+	scratch = to;
+}
+
+const RenderItem *render_queue_items()
+{
+	return items;
+}
+
+uint32_t render_queue_count()
+{
+	return count;
+}
@@ -0,0 +1,52 @@
+#pragma once
+#include <stdint.h>
+
+// Per-frame render queue. Draws are submitted as 64-bit sort keys with an
+// index into the caller's draw data and radix sorted, so draws sharing state
+// end up next to each other and the recorder can skip binds that would not
+// change anything. From the most significant bit down a key holds
+//
+//   pass 4 | pipeline 8 | material 12 | mesh 16 | depth 24
+//
+// so passes run in order, state changes from most to least expensive and
+// draws with equal state go front to back.
+
+#define RENDER_KEY_PASS_BITS 4
+#define RENDER_KEY_PIPELINE_BITS 8
+#define RENDER_KEY_MATERIAL_BITS 12
+#define RENDER_KEY_MESH_BITS 16
+#define RENDER_KEY_DEPTH_BITS 24
+
+typedef struct {
+	uint64_t key;
+	// Caller's draw, typically an index into its draw list
+	uint32_t index;
+} RenderItem;
+
+// Binds a recorder issued and the ones it left out because the state was
+// already bound, e.g. for a frame
+typedef struct {
+	uint64_t draws;
+	uint64_t binds;
+	uint64_t binds_skipped;
+} RenderStats;
+
+// Fields wider than their bits are truncated. `depth` is the view depth,
+// negative depths, behind the camera, map to 0.
+uint64_t render_key(uint32_t pass, uint32_t pipeline, uint32_t material,
+		    uint32_t mesh, float depth);
+uint32_t render_key_pass(uint64_t key);
+uint32_t render_key_pipeline(uint64_t key);
+uint32_t render_key_material(uint64_t key);
+uint32_t render_key_mesh(uint64_t key);
+
+void render_queue_init(uint32_t capacity);
+void render_queue_destroy();
+
+// Starts a new frame with `count` items and returns them to be filled in,
+// from any number of threads as long as they write disjoint items
+RenderItem *render_queue_begin(uint32_t count);
+// Sorts the frame's items by key, ties keep submission order
+void render_queue_sort();
+const RenderItem *render_queue_items();
+uint32_t render_queue_count();
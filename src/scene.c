@@ -0,0 +1,266 @@
+#include "scene.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCENE_X86
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define SCENE_NEON
+#endif
+
+// Arrays are padded to whole AVX registers, padding objects never pass
+#define SCENE_LANES SCENE_CULL_BLOCK
+
+typedef uint32_t (*CullKernel)(vec4 planes[6], uint32_t first, uint32_t last,
+			       uint32_t *visible);
+
+static float *center_x;
+static float *center_y;
+static float *center_z;
+static float *radius;
+static uint32_t count;
+static uint32_t capacity;
+static CullKernel kernel;
+static const char *kernel_name;
+
+static uint32_t cull_scalar(vec4 planes[6], uint32_t first, uint32_t last,
+			     uint32_t *visible)
+{
+	uint32_t visibleCount = 0;
+	for (uint32_t i = first; i < last; i++) {
+		bool inside = true;
+		for (uint32_t p = 0; p < 6; p++) {
+			float distance = planes[p][0] * center_x[i] +
+					 planes[p][1] * center_y[i] +
+					 planes[p][2] * center_z[i] +
+					 planes[p][3];
+			inside &= distance >= -radius[i];
+		}
+		visible[visibleCount] = i;
+		visibleCount += inside;
+	}
+	return visibleCount;
+}
+
+// Appends the lanes set in `mask` as ids starting at `base`
+static inline uint32_t emit(uint32_t *visible, uint32_t visibleCount,
+			    uint32_t base, uint32_t mask)
+{
+	while (mask != 0) {
+		visible[visibleCount++] = base + __builtin_ctz(mask);
+		mask &= mask - 1;
+	}
+	return visibleCount;
+}
+
+#ifdef SCENE_X86
+static uint32_t cull_sse(vec4 planes[6], uint32_t first, uint32_t last,
+			  uint32_t *visible)
+{
+	__m128 px[6], py[6], pz[6], pw[6];
+	for (uint32_t p = 0; p < 6; p++) {
+		px[p] = _mm_set1_ps(planes[p][0]);
+		py[p] = _mm_set1_ps(planes[p][1]);
+		pz[p] = _mm_set1_ps(planes[p][2]);
+		pw[p] = _mm_set1_ps(planes[p][3]);
+	}
+	__m128 sign = _mm_set1_ps(-0.0f);
+	uint32_t visibleCount = 0;
+	for (uint32_t i = first; i < last; i += 4) {
+		__m128 x = _mm_load_ps(center_x + i);
+		__m128 y = _mm_load_ps(center_y + i);
+		__m128 z = _mm_load_ps(center_z + i);
+		__m128 r = _mm_xor_ps(_mm_load_ps(radius + i), sign);
+		__m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+		for (uint32_t p = 0; p < 6; p++) {
+			__m128 d = _mm_add_ps(
+				_mm_add_ps(_mm_mul_ps(px[p], x),
+					   _mm_mul_ps(py[p], y)),
+				_mm_add_ps(_mm_mul_ps(pz[p], z), pw[p]));
+			inside = _mm_and_ps(inside, _mm_cmpge_ps(d, r));
+		}
+		visibleCount = emit(visible, visibleCount, i,
+				    _mm_movemask_ps(inside));
+	}
+	return visibleCount;
+}
+
+__attribute__((target("avx,fma"))) static uint32_t
+cull_avx(vec4 planes[6], uint32_t first, uint32_t last, uint32_t *visible)
+{
+	__m256 px[6], py[6], pz[6], pw[6];
+	for (uint32_t p = 0; p < 6; p++) {
+		px[p] = _mm256_set1_ps(planes[p][0]);
+		py[p] = _mm256_set1_ps(planes[p][1]);
+		pz[p] = _mm256_set1_ps(planes[p][2]);
+		pw[p] = _mm256_set1_ps(planes[p][3]);
+	}
+	__m256 sign = _mm256_set1_ps(-0.0f);
+	uint32_t visibleCount = 0;
+	for (uint32_t i = first; i < last; i += 8) {
+		__m256 x = _mm256_load_ps(center_x + i);
+		__m256 y = _mm256_load_ps(center_y + i);
+		__m256 z = _mm256_load_ps(center_z + i);
+		__m256 r = _mm256_xor_ps(_mm256_load_ps(radius + i), sign);
+		__m256 inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+		for (uint32_t p = 0; p < 6; p++) {
+			__m256 d = _mm256_fmadd_ps(
+				px[p], x,
+				_mm256_fmadd_ps(py[p], y,
+						_mm256_fmadd_ps(pz[p], z,
+								pw[p])));
+			inside = _mm256_and_ps(inside,
+					       _mm256_cmp_ps(d, r, _CMP_GE_OQ));
+		}
+		visibleCount = emit(visible, visibleCount, i,
+				    _mm256_movemask_ps(inside));
+	}
+	return visibleCount;
+}
+#endif
+
+#ifdef SCENE_NEON
+static uint32_t cull_neon(vec4 planes[6], uint32_t first, uint32_t last,
+			   uint32_t *visible)
+{
+	static const uint32_t lane_bits[4] = { 1, 2, 4, 8 };
+	uint32x4_t bits = vld1q_u32(lane_bits);
+	uint32_t visibleCount = 0;
+	for (uint32_t i = first; i < last; i += 4) {
+		float32x4_t x = vld1q_f32(center_x + i);
+		float32x4_t y = vld1q_f32(center_y + i);
+		float32x4_t z = vld1q_f32(center_z + i);
+		float32x4_t r = vnegq_f32(vld1q_f32(radius + i));
+		uint32x4_t inside = vdupq_n_u32(UINT32_MAX);
+		for (uint32_t p = 0; p < 6; p++) {
+			float32x4_t d = vdupq_n_f32(planes[p][3]);
+			d = vfmaq_n_f32(d, x, planes[p][0]);
+			d = vfmaq_n_f32(d, y, planes[p][1]);
+			d = vfmaq_n_f32(d, z, planes[p][2]);
+			inside = vandq_u32(inside, vcgeq_f32(d, r));
+		}
+		visibleCount = emit(visible, visibleCount, i,
+				    vaddvq_u32(vandq_u32(inside, bits)));
+	}
+	return visibleCount;
+}
+#endif
+
+static float *alloc_lanes(uint32_t lanes)
+{
+	float *array = aligned_alloc(SCENE_LANES * sizeof(float),
+				     sizeof(float) * lanes);
+	if (array == nullptr) {
+		fprintf(stderr, "Can't allocate %u scene objects\n", lanes);
+		exit(1);
+	}
+	return array;
+}
+
+static void grow(uint32_t needed)
+{
+	uint32_t lanes = capacity > 0 ? capacity : SCENE_LANES;
+	while (lanes < needed) {
+		lanes *= 2;
+	}
+	lanes = (lanes + SCENE_LANES - 1) / SCENE_LANES * SCENE_LANES;
+	float **arrays[] = { &center_x, &center_y, &center_z, &radius };
+	for (uint32_t a = 0; a < 4; a++) {
+		float *array = alloc_lanes(lanes);
+		if (*arrays[a] != nullptr) {
+			memcpy(array, *arrays[a], sizeof(float) * count);
+			free(*arrays[a]);
+		}
+		*arrays[a] = array;
+	}
+	// Padding lanes get an infinitely negative radius, no distance is
+	// ever >= +inf, so they never pass the test
+	for (uint32_t i = count; i < lanes; i++) {
+		center_x[i] = center_y[i] = center_z[i] = 0.0f;
+		radius[i] = -INFINITY;
+	}
+	capacity = lanes;
+}
+
+void scene_init(uint32_t initial_capacity)
+{
+	count = 0;
+	capacity = 0;
+	grow(initial_capacity);
+	kernel = cull_scalar;
+	kernel_name = "scalar";
+#ifdef SCENE_X86
+	kernel = cull_sse;
+	kernel_name = "sse";
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx") && __builtin_cpu_supports("fma")) {
+		kernel = cull_avx;
+		kernel_name = "avx";
+	}
+#elif defined(SCENE_NEON)
+	kernel = cull_neon;
+	kernel_name = "neon";
+#endif
+}
+
+void scene_destroy()
+{
+	free(center_x);
+	free(center_y);
+	free(center_z);
+	free(radius);
+	center_x = center_y = center_z = radius = nullptr;
+	count = capacity = 0;
+}
+
+uint32_t scene_add(vec3 center, float object_radius)
+{
+	if (count + 1 > capacity) {
+		grow(count + 1);
+	}
+	scene_set_bounds(count, center, object_radius);
+	return count++;
+}
+
+void scene_set_bounds(uint32_t id, vec3 center, float object_radius)
+{
+	center_x[id] = center[0];
+	center_y[id] = center[1];
+	center_z[id] = center[2];
+	radius[id] = object_radius;
+}
+
+void scene_get_bounds(uint32_t id, vec3 center, float *object_radius)
+{
+	center[0] = center_x[id];
+	center[1] = center_y[id];
+	center[2] = center_z[id];
+	*object_radius = radius[id];
+}
+
+uint32_t scene_count()
+{
+	return count;
+}
+
+uint32_t scene_cull(vec4 planes[6], uint32_t *visible)
+{
+	return kernel(planes, 0, count, visible);
+}
+
+uint32_t scene_cull_range(vec4 planes[6], uint32_t first, uint32_t last,
+			  uint32_t *visible)
+{
+	if (last > count) {
+		last = count;
+	}
+	return first < last ? kernel(planes, first, last, visible) : 0;
+}
+
+const char *scene_cull_kernel()
+{
+	return kernel_name;
+}
@@ -0,0 +1,33 @@
+#pragma once
+#include <cglm/cglm.h>
+#include <stdint.h>
+
+// Scene object store. Bounding spheres are kept as structure of arrays so
+// the frustum test runs on 4 (SSE, NEON) or 8 (AVX) objects at a time.
+// Object ids are dense indices in insertion order.
+
+// Granularity of scene_cull_range, a whole number of SIMD registers
+#define SCENE_CULL_BLOCK 8
+
+void scene_init(uint32_t capacity);
+void scene_destroy();
+
+// Returns the new object's id
+uint32_t scene_add(vec3 center, float radius);
+void scene_set_bounds(uint32_t id, vec3 center, float radius);
+void scene_get_bounds(uint32_t id, vec3 center, float *radius);
+uint32_t scene_count();
+
+// Writes the ids of every object intersecting the frustum to `visible` in
+// ascending order and returns how many there are. `planes` are normalized
+// with normals pointing inward, as glm_frustum_planes makes them, and
+// `visible` has room for scene_count() ids.
+uint32_t scene_cull(vec4 planes[6], uint32_t *visible);
+// Same for the objects in [first, last), so blocks can be culled on
+// different threads. Both bounds must be multiples of SCENE_CULL_BLOCK,
+// `last` may lie past the final object.
+uint32_t scene_cull_range(vec4 planes[6], uint32_t first, uint32_t last,
+			  uint32_t *visible);
+
+// Name of the kernel scene_cull uses on this CPU
+const char *scene_cull_kernel();
@@ -1,17 +1,31 @@
 #version 450
 
 layout(binding = 0) uniform UniformBufferObject {
-    mat4 model;
     mat4 view;
     mat4 proj;
 } ubo;
 
-layout(location = 0) in vec2 inPosition;
+// Per draw, see DrawConstants in record.h
+layout(push_constant) uniform DrawConstants {
+    mat4 model;
+    uint material;
+} draw;
+
+layout(location = 0) in vec3 inPosition;
 layout(location = 1) in vec3 inColor;
+layout(location = 2) in mat4 inModel;
 
 layout(location = 0) out vec3 fragColor;
+layout(location = 1) out vec2 fragTexCoord;
+layout(location = 2) flat out uint fragMaterial;
+
+// The depth pre-pass runs this shader too, its depth must match exactly
+invariant gl_Position;
 
 void main() {
-    gl_Position = ubo.proj * ubo.view * ubo.model * vec4(inPosition, 0.0, 1.0);
+    gl_Position = ubo.proj * ubo.view * draw.model * inModel * vec4(inPosition, 1.0);
     fragColor = inColor;
+    // Vertices carry no texture coordinates, project along z instead
+    fragTexCoord = inPosition.xy + 0.5;
+    fragMaterial = draw.material;
 }
@@ -0,0 +1,71 @@
+#include "shaders.h"
+#include "utils.h"
+#include <string.h>
+
+// Generated by glslc -mfmt=num, a comma separated list of 32-bit words
+static const uint32_t vert_spv[] = {
+#include "vert.spv.h"
+};
+static const uint32_t frag_spv[] = {
+#include "frag.spv.h"
+};
+static const uint32_t bindless_spv[] = {
+#include "bindless.spv.h"
+};
+static const uint32_t cull_spv[] = {
+#include "cull.spv.h"
+};
+static const uint32_t particles_spv[] = {
+#include "particles.spv.h"
+};
+static const uint32_t particle_vert_spv[] = {
+#include "particle_vert.spv.h"
+};
+static const uint32_t particle_frag_spv[] = {
+#include "particle_frag.spv.h"
+};
+
+static const struct {
+	const char *name;
+	const uint32_t *code;
+	size_t size;
+} embedded[] = {
+	{ "vert", vert_spv, sizeof(vert_spv) },
+	{ "frag", frag_spv, sizeof(frag_spv) },
+	{ "bindless", bindless_spv, sizeof(bindless_spv) },
+	{ "cull", cull_spv, sizeof(cull_spv) },
+	{ "particles", particles_spv, sizeof(particles_spv) },
+	{ "particle_vert", particle_vert_spv, sizeof(particle_vert_spv) },
+	{ "particle_frag", particle_frag_spv, sizeof(particle_frag_spv) },
+};
+
+ShaderBinary shader_get(const char *name)
+{
+	const char *dir = getenv("NEBULA_SHADER_DIR");
+	if (dir != nullptr && dir[0] != '\0') {
+		char path[strlen(dir) + strlen(name) + 6];
+		sprintf(path, "%s/%s.spv", dir, name);
+		size_t size = 0;
+		unsigned char *code = read_binary_file(path, &size);
+		printf("Loaded shader override %s\n", path);
+		return (ShaderBinary){ (const uint32_t *)code, size };
+	}
+	for (size_t i = 0; i < sizeof(embedded) / sizeof(embedded[0]); i++) {
+		if (strcmp(embedded[i].name, name) == 0) {
+			return (ShaderBinary){ embedded[i].code,
+					       embedded[i].size };
+		}
+	}
+	fprintf(stderr, "Unknown shader %s\n", name);
+	exit(1);
+}
+
+void shader_release(ShaderBinary binary)
+{
+	for (size_t i = 0; i < sizeof(embedded) / sizeof(embedded[0]); i++) {
+		if (embedded[i].code == binary.code) {
+			return;
+		}
+	}
+	free((void *)binary.code);
+}
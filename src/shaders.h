@@ -0,0 +1,18 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// SPIR-V compiled from the shaders in src at build time and linked into the
+// executable. For shader development, NEBULA_SHADER_DIR=<dir> loads
+// <dir>/<name>.spv instead of the embedded code.
+
+typedef struct {
+	const uint32_t *code;
+	// In bytes, as VkShaderModuleCreateInfo wants it
+	size_t size;
+} ShaderBinary;
+
+// `name` is "vert", "frag", "bindless", "cull", "particles",
+// "particle_vert" or "particle_frag"
+ShaderBinary shader_get(const char *name);
+void shader_release(ShaderBinary binary);
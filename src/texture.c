@@ -0,0 +1,743 @@
+#include "texture.h"
+#include "descriptors.h"
+#include "jobs.h"
+#include "upload.h"
+#include <fcntl.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <threads.h>
+#include <unistd.h>
+
+#define TEXEL_SIZE 4
+// Largest level 0 a full chain of TEXTURE_MAX_MIPS levels allows
+#define MAX_EXTENT (1u << (TEXTURE_MAX_MIPS - 1))
+// Resolution of the linear to sRGB table
+#define ENCODE_STEPS 4096
+
+typedef enum {
+	DECODE_PENDING,
+	DECODE_DONE,
+	DECODE_FAILED,
+} DecodeState;
+
+// One GPU copy of a texture, levels `base` down to the smallest
+typedef struct {
+	VkImage image;
+	Allocation allocation;
+	VkImageView view;
+	// Bindless image slot, TEXTURE_NONE without bindless descriptors
+	uint32_t slot;
+	uint32_t base;
+} Residency;
+
+typedef struct {
+	atomic_uint state;
+	// Source, a file or pixels to encode, dropped once decoded
+	char *path;
+	unsigned char *pixels;
+	uint32_t width;
+	uint32_t height;
+	// The container, mapped from a .ntex file or malloc'ed
+	unsigned char *data;
+	size_t size;
+	bool mapped;
+	const TextureHeader *header;
+	const TextureMip *mips;
+	// First level of the mip tail
+	uint32_t tail;
+	Residency resident;
+	// Copy being uploaded to replace `resident`
+	Residency staged;
+	UploadTicket ticket;
+	bool staging;
+} Texture;
+
+typedef struct {
+	Residency residency;
+	uint64_t retired_at;
+} RetiredResidency;
+
+static VkDevice device;
+static uint32_t slot_count;
+static VkDeviceSize budget;
+static VkSampler sampler;
+static Residency fallback;
+static Texture textures[TEXTURE_MAX];
+static uint32_t texture_count;
+static JobCounter decode_jobs;
+static RetiredResidency *retired;
+static uint32_t retired_count;
+static uint32_t retired_capacity;
+// texture_update calls so far
+static uint64_t tick;
+// Texture moving up or down a level, one at a time
+static TextureId restaging = TEXTURE_NONE;
+static VkDeviceSize resident_bytes;
+static uint64_t promotions;
+static uint64_t demotions;
+
+static once_flag tables_once = ONCE_FLAG_INIT;
+static float srgb_to_linear[256];
+static uint8_t linear_to_srgb[ENCODE_STEPS];
+
+static void build_tables()
+{
+	for (uint32_t i = 0; i < 256; i++) {
+		float c = i / 255.0f;
+		srgb_to_linear[i] = c <= 0.04045f ?
+					    c / 12.92f :
+					    powf((c + 0.055f) / 1.055f, 2.4f);
+	}
+	for (uint32_t i = 0; i < ENCODE_STEPS; i++) {
+		float l = (float)i / (ENCODE_STEPS - 1);
+		float c = l <= 0.0031308f ?
+				  l * 12.92f :
+				  1.055f * powf(l, 1.0f / 2.4f) - 0.055f;
+		linear_to_srgb[i] = (uint8_t)(c * 255.0f + 0.5f);
+	}
+}
+
+static uint64_t align_up(uint64_t value)
+{
+	return (value + TEXTURE_ALIGNMENT - 1) &
+	       ~(uint64_t)(TEXTURE_ALIGNMENT - 1);
+}
+
+static uint32_t level_extent(uint32_t extent, uint32_t level)
+{
+	return extent >> level > 0 ? extent >> level : 1;
+}
+
+// 2x2 box filter in linear space, odd edges repeat their last texel. Alpha
+// is not gamma encoded and is averaged as is.
+static void downsample(const unsigned char *src, uint32_t srcWidth,
+		       uint32_t srcHeight, unsigned char *dst, uint32_t width,
+		       uint32_t height)
+{
+	for (uint32_t y = 0; y < height; y++) {
+		uint32_t y0 = 2 * y < srcHeight ? 2 * y : srcHeight - 1;
+		uint32_t y1 = 2 * y + 1 < srcHeight ? 2 * y + 1 : y0;
+		for (uint32_t x = 0; x < width; x++) {
+			uint32_t x0 = 2 * x < srcWidth ? 2 * x : srcWidth - 1;
+			uint32_t x1 = 2 * x + 1 < srcWidth ? 2 * x + 1 : x0;
+			const unsigned char *texels[4] = {
+				src + ((size_t)y0 * srcWidth + x0) * TEXEL_SIZE,
+				src + ((size_t)y0 * srcWidth + x1) * TEXEL_SIZE,
+				src + ((size_t)y1 * srcWidth + x0) * TEXEL_SIZE,
+				src + ((size_t)y1 * srcWidth + x1) * TEXEL_SIZE
+			};
+			unsigned char *out =
+				dst + ((size_t)y * width + x) * TEXEL_SIZE;
+			for (uint32_t c = 0; c < 3; c++) {
+				float sum = 0.0f;
+				for (uint32_t i = 0; i < 4; i++) {
+					sum += srgb_to_linear[texels[i][c]];
+				}
+				out[c] = linear_to_srgb[(uint32_t)(
+					sum * 0.25f * (ENCODE_STEPS - 1) +
+					0.5f)];
+			}
+			out[3] = (texels[0][3] + texels[1][3] + texels[2][3] +
+				  texels[3][3] + 2) /
+				 4;
+		}
+	}
+}
+
+void *texture_encode(uint32_t width, uint32_t height, const void *rgba,
+		     size_t *size)
+{
+	if (width == 0 || height == 0 || width > MAX_EXTENT ||
+	    height > MAX_EXTENT) {
+		return nullptr;
+	}
+	call_once(&tables_once, build_tables);
+	uint32_t mipCount = 1;
+	while ((width >> mipCount | height >> mipCount) != 0) {
+		mipCount++;
+	}
+
+	// Smallest level first, level 0 ends the file
+	TextureMip mips[TEXTURE_MAX_MIPS];
+	uint64_t offset =
+		align_up(sizeof(TextureHeader) + sizeof(TextureMip) * mipCount);
+	for (uint32_t i = mipCount; i-- > 0;) {
+		uint32_t w = level_extent(width, i);
+		uint32_t h = level_extent(height, i);
+		mips[i] = (TextureMip){ .offset = offset,
+					.size = (uint64_t)w * h * TEXEL_SIZE,
+					.width = w,
+					.height = h };
+		offset = align_up(offset + mips[i].size);
+	}
+	unsigned char *data = calloc(1, offset);
+	if (data == nullptr) {
+		return nullptr;
+	}
+	TextureHeader header = { .magic = TEXTURE_MAGIC,
+				 .version = TEXTURE_VERSION,
+				 .format = TEXTURE_FORMAT_RGBA8_SRGB,
+				 .width = width,
+				 .height = height,
+				 .mip_count = mipCount };
+	memcpy(data, &header, sizeof(header));
+	memcpy(data + sizeof(header), mips, sizeof(TextureMip) * mipCount);
+	memcpy(data + mips[0].offset, rgba, mips[0].size);
+	for (uint32_t i = 1; i < mipCount; i++) {
+		downsample(data + mips[i - 1].offset, mips[i - 1].width,
+			   mips[i - 1].height, data + mips[i].offset,
+			   mips[i].width, mips[i].height);
+	}
+	*size = offset;
+	return data;
+}
+
+static bool range_valid(uint64_t offset, uint64_t size, uint64_t file_size)
+{
+	return offset % TEXTURE_ALIGNMENT == 0 && offset <= file_size &&
+	       size <= file_size - offset;
+}
+
+static bool texture_validate(const unsigned char *data, size_t size,
+			     const char *path)
+{
+	const TextureHeader *header = (const TextureHeader *)data;
+	const TextureMip *mips = (const TextureMip *)(header + 1);
+	const char *error = nullptr;
+	if (size < sizeof(TextureHeader) || header->magic != TEXTURE_MAGIC) {
+		error = "not a texture file";
+	} else if (header->version != TEXTURE_VERSION) {
+		error = "unsupported version";
+	} else if (header->format != TEXTURE_FORMAT_RGBA8_SRGB) {
+		error = "unsupported format";
+	} else if (header->width == 0 || header->height == 0 ||
+		   header->width > MAX_EXTENT || header->height > MAX_EXTENT) {
+		error = "bad extent";
+	} else if (header->mip_count == 0 ||
+		   header->mip_count > TEXTURE_MAX_MIPS ||
+		   sizeof(TextureHeader) +
+				   sizeof(TextureMip) * header->mip_count >
+			   size) {
+		error = "bad mip count";
+	}
+	for (uint32_t i = 0; error == nullptr && i < header->mip_count; i++) {
+		uint32_t w = level_extent(header->width, i);
+		uint32_t h = level_extent(header->height, i);
+		if (mips[i].width != w || mips[i].height != h ||
+		    mips[i].size != (uint64_t)w * h * TEXEL_SIZE ||
+		    !range_valid(mips[i].offset, mips[i].size, size)) {
+			error = "mip out of bounds";
+		}
+	}
+	if (error != nullptr) {
+		fprintf(stderr, "%s: %s\n", path, error);
+		return false;
+	}
+	return true;
+}
+
+static const unsigned char *ppm_skip(const unsigned char *p,
+				     const unsigned char *end)
+{
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' ||
+			   *p == '\r' || *p == '#')) {
+		if (*p == '#') {
+			while (p < end && *p != '\n') {
+				p++;
+			}
+		} else {
+			p++;
+		}
+	}
+	return p;
+}
+
+static const unsigned char *ppm_number(const unsigned char *p,
+				       const unsigned char *end,
+				       uint32_t *value)
+{
+	p = ppm_skip(p, end);
+	if (p == end || *p < '0' || *p > '9') {
+		return nullptr;
+	}
+	uint64_t n = 0;
+	while (p < end && *p >= '0' && *p <= '9' && n <= UINT32_MAX) {
+		n = n * 10 + (*p++ - '0');
+	}
+	*value = n > UINT32_MAX ? UINT32_MAX : (uint32_t)n;
+	return p;
+}
+
+// Binary PPM with 8-bit channels, expanded to opaque RGBA
+static unsigned char *ppm_decode(const unsigned char *data, size_t size,
+				 uint32_t *width, uint32_t *height)
+{
+	const unsigned char *end = data + size;
+	uint32_t maxval = 0;
+	const unsigned char *p = data + 2;
+	if (size < 2 || data[0] != 'P' || data[1] != '6' ||
+	    (p = ppm_number(p, end, width)) == nullptr ||
+	    (p = ppm_number(p, end, height)) == nullptr ||
+	    (p = ppm_number(p, end, &maxval)) == nullptr || maxval != 255 ||
+	    p == end || *width == 0 || *height == 0 ||
+	    *width > MAX_EXTENT || *height > MAX_EXTENT) {
+		return nullptr;
+	}
+	// A single whitespace separates the header from the raster
+	p++;
+	size_t texels = (size_t)*width * *height;
+	if ((size_t)(end - p) < texels * 3) {
+		return nullptr;
+	}
+	unsigned char *rgba = malloc(texels * TEXEL_SIZE);
+	if (rgba == nullptr) {
+		return nullptr;
+	}
+	for (size_t i = 0; i < texels; i++) {
+		rgba[i * 4 + 0] = p[i * 3 + 0];
+		rgba[i * 4 + 1] = p[i * 3 + 1];
+		rgba[i * 4 + 2] = p[i * 3 + 2];
+		rgba[i * 4 + 3] = 255;
+	}
+	return rgba;
+}
+
+// Maps the file, a container is used straight from the mapping and a PPM
+// is encoded into a new one
+static bool load_file(Texture *texture)
+{
+	const char *path = texture->path;
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror(path);
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		fprintf(stderr, "%s: empty or unreadable\n", path);
+		close(fd);
+		return false;
+	}
+	void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		perror(path);
+		return false;
+	}
+	const unsigned char *bytes = map;
+	if (st.st_size >= 2 && bytes[0] == 'P' && bytes[1] == '6') {
+		uint32_t width = 0, height = 0;
+		unsigned char *rgba =
+			ppm_decode(bytes, st.st_size, &width, &height);
+		munmap(map, st.st_size);
+		if (rgba == nullptr) {
+			fprintf(stderr, "%s: unsupported PPM\n", path);
+			return false;
+		}
+		texture->data = texture_encode(width, height, rgba,
+					       &texture->size);
+		free(rgba);
+		return texture->data != nullptr;
+	}
+	if (!texture_validate(bytes, st.st_size, path)) {
+		munmap(map, st.st_size);
+		return false;
+	}
+	texture->data = map;
+	texture->size = st.st_size;
+	texture->mapped = true;
+	return true;
+}
+
+static void decode_job(void *data)
+{
+	Texture *texture = data;
+	bool decoded;
+	if (texture->pixels != nullptr) {
+		texture->data = texture_encode(texture->width, texture->height,
+					       texture->pixels, &texture->size);
+		decoded = texture->data != nullptr;
+		free(texture->pixels);
+		texture->pixels = nullptr;
+	} else {
+		decoded = load_file(texture);
+	}
+	if (decoded) {
+		texture->header = (const TextureHeader *)texture->data;
+		texture->mips = (const TextureMip *)(texture->header + 1);
+		uint32_t tail = texture->header->mip_count - 1;
+		uint64_t bytes = texture->mips[tail].size;
+		while (tail > 0 &&
+		       bytes + texture->mips[tail - 1].size <=
+			       TEXTURE_TAIL_BYTES) {
+			bytes += texture->mips[--tail].size;
+		}
+		texture->tail = tail;
+	}
+	atomic_store_explicit(&texture->state,
+			      decoded ? DECODE_DONE : DECODE_FAILED,
+			      memory_order_release);
+}
+
+static TextureId texture_add(const char *path, unsigned char *pixels,
+			     uint32_t width, uint32_t height)
+{
+	if (texture_count == TEXTURE_MAX) {
+		fprintf(stderr, "More than %u textures\n", TEXTURE_MAX);
+		exit(1);
+	}
+	TextureId id = texture_count++;
+	Texture *texture = &textures[id];
+	*texture = (Texture){ .path = path != nullptr ? strdup(path) : nullptr,
+			      .pixels = pixels,
+			      .width = width,
+			      .height = height,
+			      .resident = { .slot = TEXTURE_NONE },
+			      .staged = { .slot = TEXTURE_NONE } };
+	atomic_init(&texture->state, DECODE_PENDING);
+	// Workers only, a frame waiting on its jobs never picks up a decode
+	jobs_run_background(decode_job, texture, &decode_jobs);
+	return id;
+}
+
+TextureId texture_load(const char *path)
+{
+	return texture_add(path, nullptr, 0, 0);
+}
+
+TextureId texture_create(uint32_t width, uint32_t height, const void *rgba)
+{
+	size_t size = (size_t)width * height * TEXEL_SIZE;
+	unsigned char *pixels = malloc(size > 0 ? size : 1);
+	if (pixels == nullptr) {
+		fprintf(stderr, "Can't allocate %ux%u texture\n", width,
+			height);
+		exit(1);
+	}
+	memcpy(pixels, rgba, size);
+	return texture_add(nullptr, pixels, width, height);
+}
+
+static uint64_t chain_bytes(const Texture *texture, uint32_t base)
+{
+	uint64_t bytes = 0;
+	for (uint32_t i = base; i < texture->header->mip_count; i++) {
+		bytes += texture->mips[i].size;
+	}
+	return bytes;
+}
+
+// Queues levels `base` and smaller of `data` into a new image, smallest
+// first. The caller flushes.
+static void residency_create(Residency *residency, const TextureHeader *header,
+			     const TextureMip *mips, const unsigned char *data,
+			     uint32_t base)
+{
+	*residency = (Residency){ .slot = TEXTURE_NONE, .base = base };
+	uint32_t levels = header->mip_count - base;
+	VkImageCreateInfo imageInfo = {
+		.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+		.imageType = VK_IMAGE_TYPE_2D,
+		.format = VK_FORMAT_R8G8B8A8_SRGB,
+		.extent = { mips[base].width, mips[base].height, 1 },
+		.mipLevels = levels,
+		.arrayLayers = 1,
+		.samples = VK_SAMPLE_COUNT_1_BIT,
+		.tiling = VK_IMAGE_TILING_OPTIMAL,
+		.usage = VK_IMAGE_USAGE_SAMPLED_BIT,
+		.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED
+	};
+	upload_create_image(&imageInfo, &residency->image,
+			    &residency->allocation);
+	resident_bytes += residency->allocation.size;
+	VkImageViewCreateInfo viewInfo = {
+		.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+		.image = residency->image,
+		.viewType = VK_IMAGE_VIEW_TYPE_2D,
+		.format = imageInfo.format,
+		.subresourceRange = { .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+				      .levelCount = levels,
+				      .layerCount = 1 }
+	};
+	if (vkCreateImageView(device, &viewInfo, nullptr, &residency->view) !=
+	    VK_SUCCESS) {
+		fprintf(stderr, "Failed to create texture view");
+		exit(1);
+	}
+	for (uint32_t i = levels; i-- > 0;) {
+		const TextureMip *mip = &mips[base + i];
+		upload_image(residency->image, i, mip->width, mip->height,
+			     TEXEL_SIZE, data + mip->offset);
+	}
+}
+
+static void residency_destroy(Residency *residency)
+{
+	if (residency->image == VK_NULL_HANDLE) {
+		return;
+	}
+	if (residency->slot != TEXTURE_NONE) {
+		descriptors_bindless_remove_image(residency->slot);
+	}
+	vkDestroyImageView(device, residency->view, nullptr);
+	resident_bytes -= residency->allocation.size;
+	allocator_destroy_image(residency->image, &residency->allocation);
+	*residency = (Residency){ .slot = TEXTURE_NONE };
+}
+
+// Frames in flight may still sample it
+static void residency_retire(Residency *residency)
+{
+	if (residency->image == VK_NULL_HANDLE) {
+		return;
+	}
+	if (retired_count == retired_capacity) {
+		retired_capacity = retired_capacity ? retired_capacity * 2 : 16;
+		retired = realloc(retired, sizeof(*retired) * retired_capacity);
+		if (retired == nullptr) {
+			fprintf(stderr, "Can't allocate retired textures");
+			exit(1);
+		}
+	}
+	retired[retired_count++] =
+		(RetiredResidency){ .residency = *residency,
+				    .retired_at = tick };
+	*residency = (Residency){ .slot = TEXTURE_NONE };
+}
+
+static void texture_stage(Texture *texture, uint32_t base)
+{
+	residency_create(&texture->staged, texture->header, texture->mips,
+			 texture->data, base);
+	texture->staging = true;
+	// Set by texture_update once the batch is flushed
+	texture->ticket = 0;
+}
+
+void texture_init(VkPhysicalDevice physical_device, VkDevice logical_device,
+		  uint32_t frame_slots, VkDeviceSize memory_budget)
+{
+	(void)physical_device;
+	device = logical_device;
+	slot_count = frame_slots;
+	budget = memory_budget > 0 ? memory_budget : TEXTURE_DEFAULT_BUDGET;
+	atomic_init(&decode_jobs.pending, 0);
+
+	VkSamplerCreateInfo samplerInfo = {
+		.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
+		.magFilter = VK_FILTER_LINEAR,
+		.minFilter = VK_FILTER_LINEAR,
+		.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR,
+		.addressModeU = VK_SAMPLER_ADDRESS_MODE_REPEAT,
+		.addressModeV = VK_SAMPLER_ADDRESS_MODE_REPEAT,
+		.addressModeW = VK_SAMPLER_ADDRESS_MODE_REPEAT,
+		.maxLod = VK_LOD_CLAMP_NONE
+	};
+	if (vkCreateSampler(device, &samplerInfo, nullptr, &sampler) !=
+	    VK_SUCCESS) {
+		fprintf(stderr, "Failed to create texture sampler");
+		exit(1);
+	}
+
+	// What every texture reads as until its tail arrived
+	const uint8_t white[TEXEL_SIZE] = { 255, 255, 255, 255 };
+	size_t size = 0;
+	unsigned char *data = texture_encode(1, 1, white, &size);
+	const TextureHeader *header = (const TextureHeader *)data;
+	residency_create(&fallback, header, (const TextureMip *)(header + 1),
+			 data, 0);
+	upload_wait(upload_flush());
+	free(data);
+	if (descriptors_bindless()) {
+		fallback.slot =
+			descriptors_bindless_add_image(fallback.view, sampler);
+	}
+}
+
+void texture_destroy()
+{
+	jobs_wait(&decode_jobs);
+	for (uint32_t i = 0; i < texture_count; i++) {
+		Texture *texture = &textures[i];
+		residency_destroy(&texture->resident);
+		residency_destroy(&texture->staged);
+		if (texture->mapped) {
+			munmap(texture->data, texture->size);
+		} else {
+			free(texture->data);
+		}
+		free(texture->pixels);
+		free(texture->path);
+		*texture = (Texture){};
+	}
+	for (uint32_t i = 0; i < retired_count; i++) {
+		residency_destroy(&retired[i].residency);
+	}
+	free(retired);
+	retired = nullptr;
+	retired_count = retired_capacity = 0;
+	residency_destroy(&fallback);
+	vkDestroySampler(device, sampler, nullptr);
+	texture_count = 0;
+	restaging = TEXTURE_NONE;
+}
+
+static bool texture_decoded(const Texture *texture)
+{
+	return atomic_load_explicit(&texture->state, memory_order_acquire) ==
+	       DECODE_DONE;
+}
+
+// Largest resident level, what budget decisions compare
+static uint64_t resident_texels(const Texture *texture)
+{
+	const TextureMip *mip = &texture->mips[texture->resident.base];
+	return (uint64_t)mip->width * mip->height;
+}
+
+// Promotes the texture with the least detail if the budget allows, else
+// makes room by demoting one with at least 16 times its texels, two levels
+// finer, so textures never trade a level back and forth
+static void texture_rebalance()
+{
+	Texture *coarsest = nullptr;
+	Texture *finest = nullptr;
+	for (uint32_t i = 0; i < texture_count; i++) {
+		Texture *texture = &textures[i];
+		if (!texture_decoded(texture) ||
+		    texture->resident.image == VK_NULL_HANDLE ||
+		    texture->staging) {
+			continue;
+		}
+		if (texture->resident.base > 0 &&
+		    (coarsest == nullptr ||
+		     resident_texels(texture) < resident_texels(coarsest))) {
+			coarsest = texture;
+		}
+		if (texture->resident.base < texture->tail &&
+		    (finest == nullptr ||
+		     resident_texels(texture) > resident_texels(finest))) {
+			finest = texture;
+		}
+	}
+	if (coarsest == nullptr) {
+		return;
+	}
+	uint32_t base = coarsest->resident.base - 1;
+	// The current copy stays allocated until the new one replaced it
+	if (resident_bytes + chain_bytes(coarsest, base) <= budget) {
+		texture_stage(coarsest, base);
+		restaging = coarsest - textures;
+		promotions++;
+	} else if (finest != nullptr &&
+		   resident_texels(finest) >= resident_texels(coarsest) * 16) {
+		texture_stage(finest, finest->resident.base + 1);
+		restaging = finest - textures;
+		demotions++;
+	}
+}
+
+bool texture_update()
+{
+	tick++;
+	uint32_t kept = 0;
+	for (uint32_t i = 0; i < retired_count; i++) {
+		if (tick < retired[i].retired_at + slot_count) {
+			retired[kept++] = retired[i];
+		} else {
+			residency_destroy(&retired[i].residency);
+		}
+	}
+	retired_count = kept;
+
+	bool changed = false;
+	bool staged = false;
+	for (uint32_t i = 0; i < texture_count; i++) {
+		Texture *texture = &textures[i];
+		if (texture->staging) {
+			if (!upload_is_visible(texture->ticket)) {
+				continue;
+			}
+			residency_retire(&texture->resident);
+			texture->resident = texture->staged;
+			texture->staged = (Residency){ .slot = TEXTURE_NONE };
+			texture->staging = false;
+			if (descriptors_bindless()) {
+				texture->resident.slot =
+					descriptors_bindless_add_image(
+						texture->resident.view,
+						sampler);
+			}
+			if (restaging == i) {
+				restaging = TEXTURE_NONE;
+			}
+			changed = true;
+		} else if (texture->resident.image == VK_NULL_HANDLE &&
+			   texture_decoded(texture)) {
+			// Tails go up whatever the budget
+			texture_stage(texture, texture->tail);
+			staged = true;
+		}
+	}
+	if (restaging == TEXTURE_NONE) {
+		texture_rebalance();
+		staged = staged || restaging != TEXTURE_NONE;
+	}
+	if (staged) {
+		UploadTicket ticket = upload_flush();
+		for (uint32_t i = 0; i < texture_count; i++) {
+			if (textures[i].staging && textures[i].ticket == 0) {
+				textures[i].ticket = ticket;
+			}
+		}
+	}
+	return changed;
+}
+
+VkImageView texture_view(TextureId texture)
+{
+	if (texture < texture_count &&
+	    textures[texture].resident.image != VK_NULL_HANDLE) {
+		return textures[texture].resident.view;
+	}
+	return fallback.view;
+}
+
+VkSampler texture_sampler()
+{
+	return sampler;
+}
+
+uint32_t texture_slot(TextureId texture)
+{
+	if (texture < texture_count &&
+	    textures[texture].resident.image != VK_NULL_HANDLE) {
+		return textures[texture].resident.slot;
+	}
+	return fallback.slot;
+}
+
+void texture_get_stats(TextureStats *stats)
+{
+	*stats = (TextureStats){ .textures = texture_count,
+				 .resident_bytes = resident_bytes,
+				 .budget_bytes = budget,
+				 .promotions = promotions,
+				 .demotions = demotions };
+	for (uint32_t i = 0; i < texture_count; i++) {
+		const Texture *texture = &textures[i];
+		if (atomic_load_explicit(&texture->state,
+					 memory_order_acquire) ==
+		    DECODE_PENDING) {
+			stats->decoding++;
+		} else if (texture->resident.image != VK_NULL_HANDLE &&
+			   texture->resident.base == 0) {
+			stats->complete++;
+		}
+	}
+}
@@ -0,0 +1,103 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <vulkan/vulkan.h>
+
+// Streamed textures. Images are decoded on the job system into a pre-mipped
+// container, little endian, that is uploaded level by level as is:
+//
+//   TextureHeader
+//   TextureMip[mip_count]        level 0, the largest, first
+//   level data                   smallest level first, tightly packed rows
+//
+// Every level offset is a multiple of TEXTURE_ALIGNMENT.
+//
+// Residency works on whole mip tails. As soon as a texture is decoded, the
+// levels fitting in TEXTURE_TAIL_BYTES are uploaded whatever the budget, so
+// something close to the final image is on screen within a few frames.
+// Finer levels are then added one at a time, coarsest texture first, while
+// the resident levels fit in the budget, and taken away again from the
+// most detailed textures when another texture needs the room more.
+//
+// Not thread safe, call from the main thread.
+
+#define TEXTURE_MAGIC 0x5845544eu // "NTEX"
+#define TEXTURE_VERSION 1
+#define TEXTURE_ALIGNMENT 16
+#define TEXTURE_MAX_MIPS 16
+#define TEXTURE_MAX 256
+// Levels resident as soon as a texture is decoded
+#define TEXTURE_TAIL_BYTES (64u << 10)
+#define TEXTURE_DEFAULT_BUDGET (256ull << 20)
+#define TEXTURE_NONE UINT32_MAX
+
+typedef enum {
+	TEXTURE_FORMAT_RGBA8_SRGB = 1,
+} TextureFormat;
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	// TextureFormat
+	uint32_t format;
+	uint32_t width;
+	uint32_t height;
+	uint32_t mip_count;
+	uint64_t reserved;
+} TextureHeader;
+
+typedef struct {
+	uint64_t offset;
+	uint64_t size;
+	uint32_t width;
+	uint32_t height;
+} TextureMip;
+
+typedef uint32_t TextureId;
+
+typedef struct {
+	uint32_t textures;
+	// Still decoding
+	uint32_t decoding;
+	// Textures with their finest level resident
+	uint32_t complete;
+	VkDeviceSize resident_bytes;
+	VkDeviceSize budget_bytes;
+	uint64_t promotions;
+	uint64_t demotions;
+} TextureStats;
+
+// `budget` bounds the device memory of the resident levels, only tails are
+// uploaded past it. Resources a frame slot may still read are kept for
+// `frame_slots` updates.
+void texture_init(VkPhysicalDevice physical_device, VkDevice device,
+		  uint32_t frame_slots, VkDeviceSize budget);
+// The device must be idle
+void texture_destroy();
+
+// Starts decoding a .ntex container or a binary PPM (P6, 8 bits) in the
+// background. Until its tail is resident the texture reads as white.
+TextureId texture_load(const char *path);
+// Same for `width` x `height` RGBA8 sRGB pixels, copied before returning
+TextureId texture_create(uint32_t width, uint32_t height, const void *rgba);
+
+// Builds a container with a full mip chain from RGBA8 sRGB pixels, filtered
+// in linear space. Returns a malloc'ed buffer, nullptr when the image is
+// empty or too large.
+void *texture_encode(uint32_t width, uint32_t height, const void *rgba,
+		     size_t *size);
+
+// Once a frame, after the frame slot's fence signaled: uploads newly
+// decoded tails, moves one texture up or down a level within the budget and
+// frees what no frame in flight reads anymore. Returns true when a view or
+// bindless slot changed.
+bool texture_update();
+
+// View of the resident levels, the white fallback when nothing is resident
+VkImageView texture_view(TextureId texture);
+// Trilinear sampler for every texture
+VkSampler texture_sampler();
+// Bindless image slot of texture_view, with bindless descriptors only
+uint32_t texture_slot(TextureId texture);
+
+void texture_get_stats(TextureStats *stats);
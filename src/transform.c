@@ -0,0 +1,341 @@
+#include "transform.h"
+#include "jobs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TRANSFORM_X86
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define TRANSFORM_NEON
+#endif
+
+// Nodes of a level composed by one job
+#define TRANSFORM_JOB_NODES 1024
+
+// Computes world = world[parent] * local for every node in `ids`, none of
+// which may be another's parent
+typedef void (*ComposeKernel)(const uint32_t *ids, uint32_t count);
+
+static mat4 *local;
+static mat4 *world;
+static uint32_t *parent;
+static uint32_t *first_child;
+static uint32_t *next_sibling;
+static uint32_t *depth;
+// One bit per node
+static uint64_t *dirty;
+static uint32_t count;
+static uint32_t capacity;
+
+// Nodes gathered by the last update, in id order, then sorted by depth
+static uint32_t *gathered;
+static uint32_t *updated;
+static uint32_t updated_count;
+// Per depth node counts, then start offsets into `updated`
+static uint32_t *level_start;
+static uint32_t level_count;
+
+static ComposeKernel kernel;
+static const char *kernel_name;
+
+static void compose_scalar(const uint32_t *ids, uint32_t idCount)
+{
+	for (uint32_t n = 0; n < idCount; n++) {
+		uint32_t id = ids[n];
+		if (parent[id] == TRANSFORM_NONE) {
+			memcpy(world[id], local[id], sizeof(mat4));
+			continue;
+		}
+		vec4 *a = world[parent[id]];
+		vec4 *b = local[id];
+		for (uint32_t c = 0; c < 4; c++) {
+			for (uint32_t r = 0; r < 4; r++) {
+				world[id][c][r] = a[0][r] * b[c][0] +
+						  a[1][r] * b[c][1] +
+						  a[2][r] * b[c][2] +
+						  a[3][r] * b[c][3];
+			}
+		}
+	}
+}
+
+#ifdef TRANSFORM_X86
+static void compose_sse(const uint32_t *ids, uint32_t idCount)
+{
+	for (uint32_t n = 0; n < idCount; n++) {
+		uint32_t id = ids[n];
+		if (parent[id] == TRANSFORM_NONE) {
+			memcpy(world[id], local[id], sizeof(mat4));
+			continue;
+		}
+		vec4 *a = world[parent[id]];
+		__m128 a0 = _mm_load_ps(a[0]);
+		__m128 a1 = _mm_load_ps(a[1]);
+		__m128 a2 = _mm_load_ps(a[2]);
+		__m128 a3 = _mm_load_ps(a[3]);
+		for (uint32_t c = 0; c < 4; c++) {
+			__m128 b = _mm_load_ps(local[id][c]);
+			__m128 r0 = _mm_mul_ps(a0, _mm_shuffle_ps(b, b, 0x00));
+			__m128 r1 = _mm_mul_ps(a1, _mm_shuffle_ps(b, b, 0x55));
+			__m128 r2 = _mm_mul_ps(a2, _mm_shuffle_ps(b, b, 0xaa));
+			__m128 r3 = _mm_mul_ps(a3, _mm_shuffle_ps(b, b, 0xff));
+			_mm_store_ps(world[id][c],
+				     _mm_add_ps(_mm_add_ps(r0, r1),
+						_mm_add_ps(r2, r3)));
+		}
+	}
+}
+
+// Two columns per register, the parent's columns are repeated in both
+// halves and every half broadcasts its own column's elements
+__attribute__((target("avx,fma"))) static void
+compose_avx(const uint32_t *ids, uint32_t idCount)
+{
+	for (uint32_t n = 0; n < idCount; n++) {
+		uint32_t id = ids[n];
+		if (parent[id] == TRANSFORM_NONE) {
+			memcpy(world[id], local[id], sizeof(mat4));
+			continue;
+		}
+		vec4 *a = world[parent[id]];
+		__m256 a0 = _mm256_broadcast_ps((const __m128 *)a[0]);
+		__m256 a1 = _mm256_broadcast_ps((const __m128 *)a[1]);
+		__m256 a2 = _mm256_broadcast_ps((const __m128 *)a[2]);
+		__m256 a3 = _mm256_broadcast_ps((const __m128 *)a[3]);
+		for (uint32_t c = 0; c < 4; c += 2) {
+			__m256 b = _mm256_load_ps(local[id][c]);
+			__m256 r =
+				_mm256_mul_ps(a0, _mm256_permute_ps(b, 0x00));
+			r = _mm256_fmadd_ps(a1, _mm256_permute_ps(b, 0x55), r);
+			r = _mm256_fmadd_ps(a2, _mm256_permute_ps(b, 0xaa), r);
+			r = _mm256_fmadd_ps(a3, _mm256_permute_ps(b, 0xff), r);
+			_mm256_store_ps(world[id][c], r);
+		}
+	}
+}
+#endif
+
+#ifdef TRANSFORM_NEON
+static void compose_neon(const uint32_t *ids, uint32_t idCount)
+{
+	for (uint32_t n = 0; n < idCount; n++) {
+		uint32_t id = ids[n];
+		if (parent[id] == TRANSFORM_NONE) {
+			memcpy(world[id], local[id], sizeof(mat4));
+			continue;
+		}
+		vec4 *a = world[parent[id]];
+		float32x4_t a0 = vld1q_f32(a[0]);
+		float32x4_t a1 = vld1q_f32(a[1]);
+		float32x4_t a2 = vld1q_f32(a[2]);
+		float32x4_t a3 = vld1q_f32(a[3]);
+		for (uint32_t c = 0; c < 4; c++) {
+			float32x4_t b = vld1q_f32(local[id][c]);
+			float32x4_t r = vmulq_laneq_f32(a0, b, 0);
+			r = vfmaq_laneq_f32(r, a1, b, 1);
+			r = vfmaq_laneq_f32(r, a2, b, 2);
+			r = vfmaq_laneq_f32(r, a3, b, 3);
+			vst1q_f32(world[id][c], r);
+		}
+	}
+}
+#endif
+
+// Moves the first `count` elements to a new array of `elements`
+static void *resize(void *array, size_t size, uint32_t elements)
+{
+	// Matrices are loaded two columns at a time by the AVX kernel.
+	// aligned_alloc wants a multiple of the alignment.
+	void *resized = aligned_alloc(32, (size * elements + 31) & ~(size_t)31);
+	if (resized == nullptr) {
+		fprintf(stderr, "Can't allocate %u transforms\n", elements);
+		exit(1);
+	}
+	if (array != nullptr) {
+		memcpy(resized, array, size * count);
+		free(array);
+	}
+	return resized;
+}
+
+static void grow(uint32_t needed)
+{
+	uint32_t nodes = capacity > 0 ? capacity : 64;
+	while (nodes < needed) {
+		nodes *= 2;
+	}
+	local = resize(local, sizeof(mat4), nodes);
+	world = resize(world, sizeof(mat4), nodes);
+	parent = resize(parent, sizeof(uint32_t), nodes);
+	first_child = resize(first_child, sizeof(uint32_t), nodes);
+	next_sibling = resize(next_sibling, sizeof(uint32_t), nodes);
+	depth = resize(depth, sizeof(uint32_t), nodes);
+	free(gathered);
+	free(updated);
+	gathered = resize(nullptr, sizeof(uint32_t), nodes);
+	updated = resize(nullptr, sizeof(uint32_t), nodes);
+	updated_count = 0;
+	// Bits past the old words start clean
+	uint32_t oldWords = (capacity + 63) / 64;
+	uint32_t words = (nodes + 63) / 64;
+	uint64_t *bits = resize(nullptr, sizeof(uint64_t), words);
+	if (dirty != nullptr) {
+		memcpy(bits, dirty, sizeof(uint64_t) * oldWords);
+		free(dirty);
+	}
+	memset(bits + oldWords, 0, sizeof(uint64_t) * (words - oldWords));
+	dirty = bits;
+	capacity = nodes;
+}
+
+static void mark_dirty(uint32_t id)
+{
+	dirty[id / 64] |= 1ull << (id % 64);
+}
+
+void transform_init(uint32_t initial_capacity)
+{
+	count = 0;
+	capacity = 0;
+	grow(initial_capacity);
+	level_count = 0;
+	kernel = compose_scalar;
+	kernel_name = "scalar";
+#ifdef TRANSFORM_X86
+	kernel = compose_sse;
+	kernel_name = "sse";
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx") && __builtin_cpu_supports("fma")) {
+		kernel = compose_avx;
+		kernel_name = "avx";
+	}
+#elif defined(TRANSFORM_NEON)
+	kernel = compose_neon;
+	kernel_name = "neon";
+#endif
+}
+
+void transform_destroy()
+{
+	free(local);
+	free(world);
+	free(parent);
+	free(first_child);
+	free(next_sibling);
+	free(depth);
+	free(dirty);
+	free(gathered);
+	free(updated);
+	free(level_start);
+	local = world = nullptr;
+	parent = first_child = next_sibling = depth = nullptr;
+	gathered = updated = level_start = nullptr;
+	dirty = nullptr;
+	count = capacity = updated_count = level_count = 0;
+}
+
+uint32_t transform_add(uint32_t parent_id, mat4 local_matrix)
+{
+	if (count + 1 > capacity) {
+		grow(count + 1);
+	}
+	uint32_t id = count++;
+	parent[id] = parent_id;
+	first_child[id] = TRANSFORM_NONE;
+	next_sibling[id] = TRANSFORM_NONE;
+	depth[id] = 0;
+	if (parent_id != TRANSFORM_NONE) {
+		// Children are linked newest first, their order does not matter
+		next_sibling[id] = first_child[parent_id];
+		first_child[parent_id] = id;
+		depth[id] = depth[parent_id] + 1;
+	}
+	if (depth[id] + 1 > level_count) {
+		level_count = depth[id] + 1;
+		free(level_start);
+		level_start =
+			resize(nullptr, sizeof(uint32_t), level_count + 1);
+	}
+	transform_set_local(id, local_matrix);
+	return id;
+}
+
+void transform_set_local(uint32_t id, mat4 local_matrix)
+{
+	glm_mat4_copy(local_matrix, local[id]);
+	mark_dirty(id);
+}
+
+uint32_t transform_count()
+{
+	return count;
+}
+
+static void compose_range(void *data, uint32_t begin, uint32_t end)
+{
+	const uint32_t *ids = data;
+	kernel(ids + begin, end - begin);
+}
+
+uint32_t transform_update()
+{
+	// Ids only grow from parent to child, so children marked here are
+	// picked up later in the same scan
+	uint32_t gatheredCount = 0;
+	uint32_t words = (count + 63) / 64;
+	for (uint32_t w = 0; w < words; w++) {
+		while (dirty[w] != 0) {
+			uint32_t id = w * 64 + __builtin_ctzll(dirty[w]);
+			dirty[w] &= dirty[w] - 1;
+			gathered[gatheredCount++] = id;
+			for (uint32_t child = first_child[id];
+			     child != TRANSFORM_NONE;
+			     child = next_sibling[child]) {
+				mark_dirty(child);
+			}
+		}
+	}
+	updated_count = gatheredCount;
+	// Also covers an empty hierarchy, which has no levels to sort into
+	if (gatheredCount == 0) {
+		return 0;
+	}
+
+	// Counting sort by depth, a level depends only on the ones above it
+	memset(level_start, 0, sizeof(uint32_t) * (level_count + 1));
+	for (uint32_t i = 0; i < gatheredCount; i++) {
+		level_start[depth[gathered[i]] + 1]++;
+	}
+	for (uint32_t level = 0; level < level_count; level++) {
+		level_start[level + 1] += level_start[level];
+	}
+	for (uint32_t i = 0; i < gatheredCount; i++) {
+		updated[level_start[depth[gathered[i]]]++] = gathered[i];
+	}
+	// The placement loop advanced every start to the next level's
+	uint32_t first = 0;
+	for (uint32_t level = 0; level < level_count; level++) {
+		uint32_t end = level_start[level];
+		jobs_parallel_for(end - first, TRANSFORM_JOB_NODES,
+				  compose_range, updated + first);
+		first = end;
+	}
+	return updated_count;
+}
+
+const uint32_t *transform_updated()
+{
+	return updated;
+}
+
+void transform_get_world(uint32_t id, mat4 dest)
+{
+	glm_mat4_copy(world[id], dest);
+}
+
+const char *transform_kernel()
+{
+	return kernel_name;
+}
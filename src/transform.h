@@ -0,0 +1,34 @@
+#pragma once
+#include <cglm/cglm.h>
+#include <stdint.h>
+
+// Transform hierarchy. Nodes are stored as structure of arrays of local and
+// world matrices plus parent and child links. A parent always has a lower
+// id than its children, so one pass in id order sees parents first.
+//
+// Changing a local matrix only sets a dirty bit. transform_update walks the
+// dirty bits, pulls in the descendants of every dirty node and recomputes
+// the world matrices one depth level at a time, so a level is a batch of
+// independent 4x4 multiplies for the SIMD kernel and the job system. Clean
+// subtrees are never visited.
+
+#define TRANSFORM_NONE UINT32_MAX
+
+void transform_init(uint32_t capacity);
+void transform_destroy();
+
+// `parent` is TRANSFORM_NONE or an existing node. Returns the new node's id,
+// its world matrix is valid after the next transform_update.
+uint32_t transform_add(uint32_t parent, mat4 local);
+void transform_set_local(uint32_t id, mat4 local);
+uint32_t transform_count();
+
+// Recomputes the world matrices of dirty nodes and their descendants and
+// returns how many were recomputed
+uint32_t transform_update();
+// Ids recomputed by the last transform_update, parents before children
+const uint32_t *transform_updated();
+void transform_get_world(uint32_t id, mat4 dest);
+
+// Name of the kernel transform_update composes matrices with on this CPU
+const char *transform_kernel();
@@ -0,0 +1,72 @@
+#include "uniform_ring.h"
+#include "allocator.h"
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static VkBuffer buffer;
+static Allocation allocation;
+static VkDeviceSize alignment;
+static uint32_t slot_count;
+// Start of the current slot's region and the bytes allocated in it
+static VkDeviceSize slot_base;
+static atomic_uint_fast64_t slot_used;
+
+void uniform_ring_init(VkPhysicalDevice physical_device, uint32_t frame_slots)
+{
+	VkPhysicalDeviceProperties properties;
+	vkGetPhysicalDeviceProperties(physical_device, &properties);
+	alignment = properties.limits.minUniformBufferOffsetAlignment;
+	if (alignment == 0) {
+		alignment = 1;
+	}
+	slot_count = frame_slots;
+
+	// Host writes go straight to the GPU's memory when it is device
+	// local, otherwise the GPU reads them over the bus
+	allocator_create_buffer(UNIFORM_RING_SLOT_SIZE * slot_count,
+				VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+				VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+					VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+				VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &buffer,
+				&allocation);
+	uniform_ring_begin(0);
+}
+
+void uniform_ring_destroy()
+{
+	allocator_destroy_buffer(buffer, &allocation);
+}
+
+VkBuffer uniform_ring_buffer()
+{
+	return buffer;
+}
+
+void uniform_ring_begin(uint32_t slot)
+{
+	slot_base = UNIFORM_RING_SLOT_SIZE * slot;
+	atomic_store_explicit(&slot_used, 0, memory_order_relaxed);
+}
+
+void *uniform_ring_alloc(VkDeviceSize size, uint32_t *offset)
+{
+	VkDeviceSize aligned = (size + alignment - 1) / alignment * alignment;
+	VkDeviceSize start = atomic_fetch_add_explicit(&slot_used, aligned,
+						       memory_order_relaxed);
+	if (start + aligned > UNIFORM_RING_SLOT_SIZE) {
+		fprintf(stderr, "Uniform ring slot exhausted (%llu bytes)\n",
+			(unsigned long long)UNIFORM_RING_SLOT_SIZE);
+		exit(1);
+	}
+	*offset = (uint32_t)(slot_base + start);
+	return (char *)allocation.mapped + slot_base + start;
+}
+
+uint32_t uniform_ring_push(const void *data, VkDeviceSize size)
+{
+	uint32_t offset;
+	memcpy(uniform_ring_alloc(size, &offset), data, size);
+	return offset;
+}
@@ -0,0 +1,28 @@
+#pragma once
+#include <vulkan/vulkan.h>
+
+// Per-frame uniform data in one persistently mapped buffer. Every frame slot
+// owns a fixed region that is filled front to back by a bump allocator and
+// rewound once the slot's fence signaled, so the CPU never writes data the
+// GPU may still read. Shaders see it through a single
+// VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC binding, an allocation is
+// selected by its dynamic offset.
+
+// Bytes of uniform data one frame may allocate
+#define UNIFORM_RING_SLOT_SIZE (1ull << 20)
+
+void uniform_ring_init(VkPhysicalDevice physical_device, uint32_t frame_slots);
+void uniform_ring_destroy();
+
+VkBuffer uniform_ring_buffer();
+
+// Rewinds `slot`'s region, call after waiting on the slot's fence
+void uniform_ring_begin(uint32_t slot);
+
+// Reserves `size` bytes in the current slot, aligned for use as a dynamic
+// offset. Returns the host pointer and stores the offset in `offset`.
+// Safe to call from several threads at once.
+void *uniform_ring_alloc(VkDeviceSize size, uint32_t *offset);
+
+// Copies `size` bytes into a fresh allocation and returns its offset
+uint32_t uniform_ring_push(const void *data, VkDeviceSize size);
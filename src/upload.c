@@ -0,0 +1,499 @@
+#include "upload.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define STAGING_ALIGNMENT 16
+// Single copies are capped so one upload can never need the whole ring
+#define MAX_CHUNK_SIZE (UPLOAD_RING_SIZE / 4)
+
+// Either a buffer copy or, when `image` is set, a copy into an image
+typedef struct {
+	VkBuffer dst;
+	VkBufferCopy region;
+	VkImage image;
+	VkBufferImageCopy image_region;
+} PendingCopy;
+
+// Image layout transitions recorded before and after a batch's copies
+typedef struct {
+	VkImageMemoryBarrier *barriers;
+	uint32_t count;
+	uint32_t capacity;
+} BarrierList;
+
+typedef struct {
+	VkCommandBuffer command_buffer;
+	VkFence fence;
+	VkSemaphore semaphore;
+	// Ring position just past this batch's staging data
+	uint64_t end_pos;
+	UploadTicket ticket;
+	// Oldest ticket whose data the semaphore covers, earlier than
+	// `ticket` when an unconsumed signal was carried over
+	UploadTicket first_ticket;
+	bool in_flight;
+	// Signaled semaphore that no queue has waited on yet
+	bool semaphore_pending;
+} UploadBatch;
+
+static VkDevice device;
+static VkQueue queue;
+static uint32_t queue_families[3];
+static uint32_t queue_family_count;
+static VkCommandPool command_pool;
+static VkBuffer staging_buffer;
+static Allocation staging_allocation;
+// Positions grow forever, the ring offset is position % UPLOAD_RING_SIZE
+static uint64_t head_pos;
+static uint64_t tail_pos;
+static UploadBatch batches[UPLOAD_MAX_BATCHES];
+static uint32_t next_batch;
+static UploadTicket submitted_ticket;
+static UploadTicket completed_ticket;
+static UploadTicket visible_ticket;
+static PendingCopy *pending;
+static uint32_t pending_count;
+static uint32_t pending_capacity;
+static BarrierList pre_barriers;
+static BarrierList post_barriers;
+
+static void batch_retire(UploadBatch *batch)
+{
+	batch->in_flight = false;
+	tail_pos = batch->end_pos;
+	completed_ticket = batch->ticket;
+}
+
+// Retires finished batches in submission order
+static void upload_poll()
+{
+	for (uint32_t i = 0; i < UPLOAD_MAX_BATCHES; i++) {
+		UploadBatch *batch =
+			&batches[(next_batch + i) % UPLOAD_MAX_BATCHES];
+		if (!batch->in_flight) {
+			continue;
+		}
+		if (vkGetFenceStatus(device, batch->fence) != VK_SUCCESS) {
+			break;
+		}
+		batch_retire(batch);
+	}
+}
+
+static void wait_oldest()
+{
+	for (uint32_t i = 0; i < UPLOAD_MAX_BATCHES; i++) {
+		UploadBatch *batch =
+			&batches[(next_batch + i) % UPLOAD_MAX_BATCHES];
+		if (batch->in_flight) {
+			vkWaitForFences(device, 1, &batch->fence, VK_TRUE,
+					UINT64_MAX);
+			batch_retire(batch);
+			return;
+		}
+	}
+}
+
+void upload_init(VkPhysicalDevice physical_device, VkDevice logical_device,
+		 uint32_t transfer_family, VkQueue transfer_queue,
+		 uint32_t graphics_family, uint32_t compute_family)
+{
+	(void)physical_device;
+	device = logical_device;
+	queue = transfer_queue;
+	uint32_t families[] = { graphics_family, transfer_family,
+				compute_family };
+	queue_family_count = 0;
+	for (uint32_t i = 0; i < 3; i++) {
+		bool seen = false;
+		for (uint32_t j = 0; j < queue_family_count; j++) {
+			seen |= queue_families[j] == families[i];
+		}
+		if (!seen) {
+			queue_families[queue_family_count++] = families[i];
+		}
+	}
+
+	VkCommandPoolCreateInfo poolInfo = {
+		.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+		.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT |
+			 VK_COMMAND_POOL_CREATE_TRANSIENT_BIT,
+		.queueFamilyIndex = transfer_family
+	};
+	if (vkCreateCommandPool(device, &poolInfo, nullptr, &command_pool) !=
+	    VK_SUCCESS) {
+		fprintf(stderr, "Failed to create upload command pool");
+		exit(1);
+	}
+	VkCommandBufferAllocateInfo allocInfo = {
+		.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+		.commandPool = command_pool,
+		.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+		.commandBufferCount = 1
+	};
+	VkFenceCreateInfo fenceInfo = {
+		.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO
+	};
+	VkSemaphoreCreateInfo semaphoreInfo = {
+		.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO
+	};
+	for (uint32_t i = 0; i < UPLOAD_MAX_BATCHES; i++) {
+		if (vkAllocateCommandBuffers(device, &allocInfo,
+					     &batches[i].command_buffer) !=
+			    VK_SUCCESS ||
+		    vkCreateFence(device, &fenceInfo, nullptr,
+				  &batches[i].fence) != VK_SUCCESS ||
+		    vkCreateSemaphore(device, &semaphoreInfo, nullptr,
+				      &batches[i].semaphore) != VK_SUCCESS) {
+			fprintf(stderr, "Failed to create upload batches");
+			exit(1);
+		}
+	}
+
+	allocator_create_buffer(UPLOAD_RING_SIZE,
+				VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+				VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+					VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+				0, &staging_buffer, &staging_allocation);
+}
+
+void upload_destroy()
+{
+	for (uint32_t i = 0; i < UPLOAD_MAX_BATCHES; i++) {
+		if (batches[i].in_flight) {
+			vkWaitForFences(device, 1, &batches[i].fence, VK_TRUE,
+					UINT64_MAX);
+		}
+		vkDestroyFence(device, batches[i].fence, nullptr);
+		vkDestroySemaphore(device, batches[i].semaphore, nullptr);
+	}
+	vkDestroyCommandPool(device, command_pool, nullptr);
+	allocator_destroy_buffer(staging_buffer, &staging_allocation);
+	free(pending);
+	pending = nullptr;
+	pending_count = pending_capacity = 0;
+	free(pre_barriers.barriers);
+	free(post_barriers.barriers);
+	pre_barriers = (BarrierList){};
+	post_barriers = (BarrierList){};
+}
+
+void upload_create_buffer(VkDeviceSize size, VkBufferUsageFlags usage,
+			  VkBuffer *buffer, Allocation *allocation)
+{
+	// Concurrent sharing lets a dedicated transfer queue write the buffer
+	// and the other queues read it without queue family ownership
+	// transfers
+	VkBufferCreateInfo bufferInfo = {
+		.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+		.size = size,
+		.usage = usage | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+		.sharingMode = queue_family_count > 1 ?
+				       VK_SHARING_MODE_CONCURRENT :
+				       VK_SHARING_MODE_EXCLUSIVE,
+		.queueFamilyIndexCount = queue_family_count,
+		.pQueueFamilyIndices = queue_families
+	};
+	allocator_create_buffer_info(&bufferInfo,
+				     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0,
+				     buffer, allocation);
+}
+
+void upload_create_image(const VkImageCreateInfo *info, VkImage *image,
+			 Allocation *allocation)
+{
+	VkImageCreateInfo imageInfo = *info;
+	imageInfo.usage |= VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+	imageInfo.sharingMode = queue_family_count > 1 ?
+					VK_SHARING_MODE_CONCURRENT :
+					VK_SHARING_MODE_EXCLUSIVE;
+	imageInfo.queueFamilyIndexCount = queue_family_count;
+	imageInfo.pQueueFamilyIndices = queue_families;
+	allocator_create_image(&imageInfo, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+			       image, allocation);
+}
+
+static uint64_t ring_reserve(VkDeviceSize size)
+{
+	for (;;) {
+		uint64_t pos = (head_pos + STAGING_ALIGNMENT - 1) &
+			       ~(uint64_t)(STAGING_ALIGNMENT - 1);
+		uint64_t offset = pos % UPLOAD_RING_SIZE;
+		if (offset + size > UPLOAD_RING_SIZE) {
+			// Never straddle the end of the ring
+			pos += UPLOAD_RING_SIZE - offset;
+		}
+		if (pos + size - tail_pos <= UPLOAD_RING_SIZE) {
+			head_pos = pos + size;
+			return pos;
+		}
+		upload_poll();
+		if (pos + size - tail_pos <= UPLOAD_RING_SIZE) {
+			continue;
+		}
+		// The ring is full. Everything still unsubmitted is what
+		// keeps it full, so submit it before blocking on the GPU.
+		if (pending_count > 0 || pre_barriers.count > 0) {
+			upload_flush();
+		}
+		wait_oldest();
+	}
+}
+
+static PendingCopy *push_copy()
+{
+	if (pending_count == pending_capacity) {
+		uint32_t grown = pending_capacity ? pending_capacity * 2 : 64;
+		PendingCopy *copies =
+			realloc(pending, grown * sizeof(*pending));
+		if (copies == nullptr) {
+			fprintf(stderr, "Can't queue %u uploads\n", grown);
+			exit(1);
+		}
+		pending = copies;
+		pending_capacity = grown;
+	}
+	return &pending[pending_count++];
+}
+
+static void push_barrier(BarrierList *list, VkImageMemoryBarrier barrier)
+{
+	if (list->count == list->capacity) {
+		uint32_t capacity = list->capacity ? list->capacity * 2 : 32;
+		VkImageMemoryBarrier *barriers = realloc(
+			list->barriers, capacity * sizeof(*list->barriers));
+		if (barriers == nullptr) {
+			fprintf(stderr, "Can't queue %u upload barriers\n",
+				capacity);
+			exit(1);
+		}
+		list->barriers = barriers;
+		list->capacity = capacity;
+	}
+	list->barriers[list->count++] = barrier;
+}
+
+void upload_buffer(VkBuffer dst, VkDeviceSize dst_offset, const void *src,
+		   VkDeviceSize size)
+{
+	const char *bytes = src;
+	while (size > 0) {
+		VkDeviceSize chunk = size < MAX_CHUNK_SIZE ? size :
+							     MAX_CHUNK_SIZE;
+		uint64_t pos = ring_reserve(chunk);
+		VkDeviceSize offset = pos % UPLOAD_RING_SIZE;
+		memcpy((char *)staging_allocation.mapped + offset, bytes,
+		       chunk);
+
+		*push_copy() = (PendingCopy){
+			.dst = dst,
+			.region = { .srcOffset = offset,
+				    .dstOffset = dst_offset,
+				    .size = chunk }
+		};
+		bytes += chunk;
+		dst_offset += chunk;
+		size -= chunk;
+	}
+}
+
+void upload_image(VkImage image, uint32_t mip, uint32_t width,
+		  uint32_t height, uint32_t texel_size, const void *src)
+{
+	VkImageMemoryBarrier barrier = {
+		.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+		.srcAccessMask = 0,
+		.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+		.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+		.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+		.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+		.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+		.image = image,
+		.subresourceRange = { .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+				      .baseMipLevel = mip,
+				      .levelCount = 1,
+				      .layerCount = 1 }
+	};
+	push_barrier(&pre_barriers, barrier);
+
+	// Bands of whole rows, so every chunk is a single region
+	VkDeviceSize row = (VkDeviceSize)width * texel_size;
+	uint32_t band = row < MAX_CHUNK_SIZE ? MAX_CHUNK_SIZE / row : 1;
+	const char *bytes = src;
+	for (uint32_t y = 0; y < height; y += band) {
+		uint32_t rows = height - y < band ? height - y : band;
+		uint64_t pos = ring_reserve(row * rows);
+		VkDeviceSize offset = pos % UPLOAD_RING_SIZE;
+		memcpy((char *)staging_allocation.mapped + offset,
+		       bytes + row * y, row * rows);
+		*push_copy() = (PendingCopy){
+			.image = image,
+			.image_region = {
+				.bufferOffset = offset,
+				.imageSubresource = {
+					.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+					.mipLevel = mip,
+					.layerCount = 1 },
+				.imageOffset = { 0, (int32_t)y, 0 },
+				.imageExtent = { width, rows, 1 } }
+		};
+	}
+
+	// Visibility to the graphics queue comes from the batch semaphore
+	barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	barrier.dstAccessMask = 0;
+	barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+	barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+	push_barrier(&post_barriers, barrier);
+}
+
+UploadTicket upload_flush()
+{
+	if (pending_count == 0 && pre_barriers.count == 0 &&
+	    post_barriers.count == 0) {
+		return submitted_ticket;
+	}
+	UploadBatch *batch = &batches[next_batch];
+	if (batch->in_flight) {
+		vkWaitForFences(device, 1, &batch->fence, VK_TRUE, UINT64_MAX);
+		batch_retire(batch);
+	}
+	// Nobody consumed the last signal yet. The new submission waits on it
+	// before signaling again, so whoever waits next covers both batches.
+	bool carried = batch->semaphore_pending;
+	UploadTicket first_ticket =
+		carried ? batch->first_ticket : submitted_ticket + 1;
+	vkResetFences(device, 1, &batch->fence);
+	vkResetCommandBuffer(batch->command_buffer, 0);
+
+	VkCommandBufferBeginInfo beginInfo = {
+		.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+		.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT
+	};
+	if (vkBeginCommandBuffer(batch->command_buffer, &beginInfo) !=
+	    VK_SUCCESS) {
+		fprintf(stderr, "Failed to begin upload command buffer\n");
+		exit(1);
+	}
+	// Every image level of the batch goes to TRANSFER_DST at once
+	if (pre_barriers.count > 0) {
+		vkCmdPipelineBarrier(batch->command_buffer,
+				     VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+				     VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0,
+				     nullptr, 0, nullptr, pre_barriers.count,
+				     pre_barriers.barriers);
+	}
+	// Consecutive copies into the same buffer or image share one command
+	uint32_t first = 0;
+	VkBufferCopy regions[64];
+	VkBufferImageCopy imageRegions[64];
+	while (first < pending_count) {
+		uint32_t count = 0;
+		VkBuffer dst = pending[first].dst;
+		VkImage image = pending[first].image;
+		while (first + count < pending_count && count < 64 &&
+		       pending[first + count].dst == dst &&
+		       pending[first + count].image == image) {
+			regions[count] = pending[first + count].region;
+			imageRegions[count] =
+				pending[first + count].image_region;
+			count++;
+		}
+		if (image != VK_NULL_HANDLE) {
+			vkCmdCopyBufferToImage(
+				batch->command_buffer, staging_buffer, image,
+				VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, count,
+				imageRegions);
+		} else {
+			vkCmdCopyBuffer(batch->command_buffer, staging_buffer,
+					dst, count, regions);
+		}
+		first += count;
+	}
+	// Levels whose last copy is in this batch become readable. A level
+	// split across batches stays in TRANSFER_DST until its final one.
+	if (post_barriers.count > 0) {
+		vkCmdPipelineBarrier(batch->command_buffer,
+				     VK_PIPELINE_STAGE_TRANSFER_BIT,
+				     VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0,
+				     nullptr, 0, nullptr, post_barriers.count,
+				     post_barriers.barriers);
+	}
+	if (vkEndCommandBuffer(batch->command_buffer) != VK_SUCCESS) {
+		fprintf(stderr, "Failed to record upload command buffer\n");
+		exit(1);
+	}
+
+	VkPipelineStageFlags waitStage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+	VkSubmitInfo submitInfo = {
+		.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+		.waitSemaphoreCount = carried ? 1 : 0,
+		.pWaitSemaphores = &batch->semaphore,
+		.pWaitDstStageMask = &waitStage,
+		.commandBufferCount = 1,
+		.pCommandBuffers = &batch->command_buffer,
+		.signalSemaphoreCount = 1,
+		.pSignalSemaphores = &batch->semaphore
+	};
+	if (vkQueueSubmit(queue, 1, &submitInfo, batch->fence) != VK_SUCCESS) {
+		fprintf(stderr, "Failed to submit upload batch");
+		exit(1);
+	}
+	batch->in_flight = true;
+	batch->semaphore_pending = true;
+	batch->end_pos = head_pos;
+	batch->ticket = ++submitted_ticket;
+	batch->first_ticket = first_ticket;
+	next_batch = (next_batch + 1) % UPLOAD_MAX_BATCHES;
+	pending_count = 0;
+	pre_barriers.count = 0;
+	post_barriers.count = 0;
+	return batch->ticket;
+}
+
+bool upload_is_complete(UploadTicket ticket)
+{
+	if (ticket > completed_ticket) {
+		upload_poll();
+	}
+	return ticket <= completed_ticket;
+}
+
+void upload_wait(UploadTicket ticket)
+{
+	while (!upload_is_complete(ticket)) {
+		wait_oldest();
+	}
+}
+
+uint32_t upload_take_semaphores(VkSemaphore *semaphores, uint32_t max)
+{
+	upload_poll();
+	uint32_t count = 0;
+	for (uint32_t i = 0; i < UPLOAD_MAX_BATCHES && count < max; i++) {
+		UploadBatch *batch =
+			&batches[(next_batch + i) % UPLOAD_MAX_BATCHES];
+		// Only finished batches, waiting on in-flight ones would
+		// stall the graphics queue behind the copies
+		if (batch->semaphore_pending && !batch->in_flight) {
+			semaphores[count++] = batch->semaphore;
+			batch->semaphore_pending = false;
+		}
+	}
+	// Everything before the oldest data still waiting for a consumer
+	UploadTicket oldest = submitted_ticket + 1;
+	for (uint32_t i = 0; i < UPLOAD_MAX_BATCHES; i++) {
+		if (batches[i].semaphore_pending &&
+		    batches[i].first_ticket < oldest) {
+			oldest = batches[i].first_ticket;
+		}
+	}
+	visible_ticket = oldest - 1;
+	return count;
+}
+
+bool upload_is_visible(UploadTicket ticket)
+{
+	return ticket <= visible_ticket;
+}
@@ -0,0 +1,60 @@
+#pragma once
+#include "allocator.h"
+#include <vulkan/vulkan.h>
+
+// Batched host to device uploads through a persistently mapped staging ring.
+// Copies are queued with upload_buffer and upload_image and submitted
+// together on the transfer queue by upload_flush, image layout transitions
+// batched into one barrier before and one after the copies. Only call from
+// the main thread.
+
+#define UPLOAD_RING_SIZE (32ull << 20)
+// Submitted batches that can be in flight at once
+#define UPLOAD_MAX_BATCHES 8
+
+// Monotonic batch id, a ticket is complete once its batch's fence signaled
+// and visible once a renderer submission waited on its batch's semaphore
+typedef uint64_t UploadTicket;
+
+// Resources are shared between the transfer, graphics and compute families,
+// which may all be the same
+void upload_init(VkPhysicalDevice physical_device, VkDevice device,
+		 uint32_t transfer_family, VkQueue transfer_queue,
+		 uint32_t graphics_family, uint32_t compute_family);
+void upload_destroy();
+
+// Creates a DEVICE_LOCAL buffer that can be filled with upload_buffer and is
+// shared between the transfer, graphics and compute queues.
+void upload_create_buffer(VkDeviceSize size, VkBufferUsageFlags usage,
+			  VkBuffer *buffer, Allocation *allocation);
+
+// Same for a sampled image to be filled with upload_image
+void upload_create_image(const VkImageCreateInfo *info, VkImage *image,
+			 Allocation *allocation);
+
+// Copies `size` bytes from `src` into the staging ring right away, `src` may
+// be reused on return. Large uploads are split across several batches.
+void upload_buffer(VkBuffer dst, VkDeviceSize dst_offset, const void *src,
+		   VkDeviceSize size);
+
+// Copies the tightly packed texels of one level of a color image, leaving
+// the level in SHADER_READ_ONLY_OPTIMAL. The level must not have been
+// written before, its old contents are discarded. Levels larger than a
+// chunk are split by rows.
+void upload_image(VkImage image, uint32_t mip, uint32_t width,
+		  uint32_t height, uint32_t texel_size, const void *src);
+
+// Submits every queued copy as one batch. Returns the ticket of the last
+// submitted batch, which covers everything queued so far.
+UploadTicket upload_flush();
+bool upload_is_complete(UploadTicket ticket);
+void upload_wait(UploadTicket ticket);
+
+// Hands out the semaphores of finished batches that nobody waited on yet,
+// at most UPLOAD_MAX_BATCHES. The caller must wait on all of them in its
+// next submission. Their tickets are visible from then on.
+uint32_t upload_take_semaphores(VkSemaphore *semaphores, uint32_t max);
+// Whether the data of `ticket` may be used by the submission that waits on
+// the last semaphores taken, and by everything submitted after it. Uploads
+// are consumed by the frame whose submission waits on them, never earlier.
+bool upload_is_visible(UploadTicket ticket);
@@ -0,0 +1,138 @@
+#include "jobs.h"
+#include <unity.h>
+
+// Stress tests of the job system, run under ThreadSanitizer with
+// -Db_sanitize=thread to check the deques and counters for races
+
+#define SUM_COUNT 1000000
+#define TREE_DEPTH 12
+#define REPEATS 20
+
+typedef struct {
+	uint32_t depth;
+	atomic_uint *leaves;
+} TreeNode;
+
+static const uint32_t thread_counts[] = { 1, 2, 4, 8 };
+
+void setUp(void)
+{
+}
+
+void tearDown(void)
+{
+}
+
+static void sum_range(void *data, uint32_t begin, uint32_t end)
+{
+	atomic_uint_fast64_t *sum = data;
+	uint64_t local = 0;
+	for (uint32_t i = begin; i < end; i++) {
+		local += i;
+	}
+	atomic_fetch_add(sum, local);
+}
+
+// Each node spawns one child as a job and runs the other itself, so the
+// tree exercises nested jobs_run and jobs_wait from inside jobs
+static void tree_node(void *data)
+{
+	TreeNode *node = data;
+	if (node->depth == 0) {
+		atomic_fetch_add(node->leaves, 1);
+		return;
+	}
+	TreeNode children[2] = { { node->depth - 1, node->leaves },
+				 { node->depth - 1, node->leaves } };
+	JobCounter counter = {};
+	jobs_run(tree_node, &children[0], &counter);
+	tree_node(&children[1]);
+	jobs_wait(&counter);
+}
+
+static void count_job(void *data)
+{
+	atomic_fetch_add((atomic_uint *)data, 1);
+}
+
+static void background_job(void *data)
+{
+	if (jobs_thread_index() == 0) {
+		atomic_fetch_add((atomic_uint *)data, 1);
+	}
+}
+
+void test_parallel_for_sums_every_item_once(void)
+{
+	uint64_t expected = (uint64_t)SUM_COUNT * (SUM_COUNT - 1) / 2;
+	for (uint32_t i = 0; i < 4; i++) {
+		jobs_init(thread_counts[i]);
+		for (uint32_t repeat = 0; repeat < REPEATS; repeat++) {
+			atomic_uint_fast64_t sum = 0;
+			jobs_parallel_for(SUM_COUNT, 1 + repeat * 97,
+					  sum_range, &sum);
+			TEST_ASSERT_EQUAL_UINT64(expected, atomic_load(&sum));
+		}
+		jobs_destroy();
+	}
+}
+
+void test_parallel_for_handles_small_ranges(void)
+{
+	jobs_init(4);
+	for (uint32_t count = 0; count < 64; count++) {
+		atomic_uint_fast64_t sum = 0;
+		jobs_parallel_for(count, 1, sum_range, &sum);
+		TEST_ASSERT_EQUAL_UINT64((uint64_t)count * (count - 1) / 2,
+					 atomic_load(&sum));
+	}
+	jobs_destroy();
+}
+
+void test_nested_spawn_tree_runs_every_leaf(void)
+{
+	for (uint32_t i = 0; i < 4; i++) {
+		jobs_init(thread_counts[i]);
+		for (uint32_t repeat = 0; repeat < REPEATS; repeat++) {
+			atomic_uint leaves = 0;
+			TreeNode root = { TREE_DEPTH, &leaves };
+			tree_node(&root);
+			TEST_ASSERT_EQUAL_UINT32(1u << TREE_DEPTH,
+						 atomic_load(&leaves));
+		}
+		jobs_destroy();
+	}
+}
+
+// More jobs than a deque holds, the overflow runs inline
+void test_deque_overflow_runs_inline(void)
+{
+	jobs_init(2);
+	atomic_uint ran = 0;
+	JobCounter counter = {};
+	for (uint32_t i = 0; i < JOBS_DEQUE_SIZE * 3; i++) {
+		jobs_run(count_job, &ran, &counter);
+	}
+	jobs_wait(&counter);
+	TEST_ASSERT_EQUAL_UINT32(JOBS_DEQUE_SIZE * 3, atomic_load(&ran));
+	jobs_destroy();
+}
+
+// Waiting on frame work must not pick up background jobs while there are
+// workers to run them
+void test_background_jobs_stay_off_the_calling_thread(void)
+{
+	jobs_init(4);
+	atomic_uint on_caller = 0;
+	JobCounter background = {};
+	for (uint32_t i = 0; i < 256; i++) {
+		jobs_run_background(background_job, &on_caller, &background);
+	}
+	for (uint32_t repeat = 0; repeat < REPEATS; repeat++) {
+		atomic_uint_fast64_t sum = 0;
+		jobs_parallel_for(SUM_COUNT, 64, sum_range, &sum);
+	}
+	jobs_wait(&background);
+	TEST_ASSERT_EQUAL_UINT32(0, atomic_load(&on_caller));
+	jobs_destroy();
+}
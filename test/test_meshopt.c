@@ -0,0 +1,208 @@
+#include "meshopt.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unity.h>
+
+// A GRID x GRID quad grid in the z = 0 plane, two triangles per quad
+#define GRID 32
+#define GRID_VERTICES ((GRID + 1) * (GRID + 1))
+#define GRID_INDICES (GRID * GRID * 6)
+#define CACHE_SIZE 16
+
+typedef struct {
+	float pos[3];
+	float color[3];
+} TestVertex;
+
+static uint32_t indices[GRID_INDICES];
+static TestVertex vertices[GRID_INDICES];
+
+static uint32_t grid_vertex(uint32_t x, uint32_t y)
+{
+	return y * (GRID + 1) + x;
+}
+
+static void build_grid()
+{
+	for (uint32_t y = 0; y <= GRID; y++) {
+		for (uint32_t x = 0; x <= GRID; x++) {
+			vertices[grid_vertex(x, y)] = (TestVertex){
+				.pos = { (float)x, (float)y, 0.0f },
+				.color = { 1.0f, 1.0f, 1.0f }
+			};
+		}
+	}
+	uint32_t *out = indices;
+	for (uint32_t y = 0; y < GRID; y++) {
+		for (uint32_t x = 0; x < GRID; x++) {
+			uint32_t quad[4] = { grid_vertex(x, y),
+					     grid_vertex(x + 1, y),
+					     grid_vertex(x + 1, y + 1),
+					     grid_vertex(x, y + 1) };
+			*out++ = quad[0];
+			*out++ = quad[1];
+			*out++ = quad[2];
+			*out++ = quad[0];
+			*out++ = quad[2];
+			*out++ = quad[3];
+		}
+	}
+}
+
+// Every triangle gets vertices of its own with a color per triangle, like
+// a flat shaded OBJ, so every grid position is an attribute seam
+static void split_grid()
+{
+	TestVertex shared[GRID_VERTICES];
+	memcpy(shared, vertices, sizeof(shared));
+	for (uint32_t i = 0; i < GRID_INDICES; i++) {
+		vertices[i] = shared[indices[i]];
+		vertices[i].color[0] = (float)(i / 3 % 7);
+		indices[i] = i;
+	}
+}
+
+// Triangles as sorted index triples, the orders an optimization may
+// change
+static int compare_triangles(const void *a, const void *b)
+{
+	return memcmp(a, b, sizeof(uint32_t) * 3);
+}
+
+static void canonical_triangles(const uint32_t *source, uint32_t *sorted)
+{
+	memcpy(sorted, source, sizeof(uint32_t) * GRID_INDICES);
+	for (uint32_t t = 0; t < GRID_INDICES / 3; t++) {
+		uint32_t *triangle = sorted + t * 3;
+		// Rotate the smallest index first, keeping the winding
+		while (triangle[0] > triangle[1] || triangle[0] > triangle[2]) {
+			uint32_t first = triangle[0];
+			triangle[0] = triangle[1];
+			triangle[1] = triangle[2];
+			triangle[2] = first;
+		}
+	}
+	qsort(sorted, GRID_INDICES / 3, sizeof(uint32_t) * 3,
+	      compare_triangles);
+}
+
+void setUp(void)
+{
+	build_grid();
+	srand(5);
+}
+
+void tearDown(void)
+{
+}
+
+void test_acmr_of_unshared_triangles_is_three(void)
+{
+	uint32_t triangle[3] = { 0, 1, 2 };
+	TEST_ASSERT_FLOAT_WITHIN(1e-6f, 3.0f,
+				 meshopt_acmr(triangle, 3, 3, CACHE_SIZE));
+}
+
+// Shuffled triangles thrash the cache, the optimized order must not only
+// beat them but also keep every triangle with its winding
+void test_optimize_cache_lowers_acmr_and_keeps_triangles(void)
+{
+	for (uint32_t t = GRID_INDICES / 3 - 1; t > 0; t--) {
+		uint32_t other = (uint32_t)rand() % (t + 1);
+		uint32_t swap[3];
+		memcpy(swap, indices + t * 3, sizeof(swap));
+		memcpy(indices + t * 3, indices + other * 3, sizeof(swap));
+		memcpy(indices + other * 3, swap, sizeof(swap));
+	}
+	static uint32_t before[GRID_INDICES], after[GRID_INDICES];
+	canonical_triangles(indices, before);
+	float acmrBefore =
+		meshopt_acmr(indices, GRID_INDICES, GRID_VERTICES, CACHE_SIZE);
+
+	meshopt_optimize_cache(indices, GRID_INDICES, GRID_VERTICES);
+	float acmrAfter =
+		meshopt_acmr(indices, GRID_INDICES, GRID_VERTICES, CACHE_SIZE);
+	TEST_ASSERT_TRUE(acmrAfter < acmrBefore);
+	TEST_ASSERT_TRUE(acmrAfter >= 0.5f);
+	// A regular grid reaches well under one vertex per triangle
+	TEST_ASSERT_TRUE(acmrAfter < 0.8f);
+	canonical_triangles(indices, after);
+	TEST_ASSERT_EQUAL_MEMORY(before, after, sizeof(before));
+}
+
+// Vertices are numbered in first use order, unreferenced ones dropped
+void test_fetch_remap_numbers_vertices_in_first_use_order(void)
+{
+	// Leaves out the grid's first row of quads
+	const uint32_t *used = indices + GRID * 6;
+	uint32_t count = GRID_INDICES - GRID * 6;
+	uint32_t remap[GRID_VERTICES];
+	uint32_t kept = meshopt_fetch_remap(remap, used, count,
+					    GRID_VERTICES);
+	TEST_ASSERT_EQUAL_UINT32(GRID_VERTICES - (GRID + 1), kept);
+	for (uint32_t x = 0; x <= GRID; x++) {
+		TEST_ASSERT_EQUAL_UINT32(UINT32_MAX, remap[grid_vertex(x, 0)]);
+	}
+	uint32_t next = 0;
+	for (uint32_t i = 0; i < count; i++) {
+		uint32_t vertex = remap[used[i]];
+		TEST_ASSERT_TRUE(vertex <= next);
+		next += vertex == next;
+	}
+	TEST_ASSERT_EQUAL_UINT32(kept, next);
+}
+
+// Checks the simplified levels of a chain: fewer triangles each level, a
+// growing error, valid indices and no degenerate triangles
+static void check_chain(uint32_t vertex_count)
+{
+	MeshoptSimplifier *simplifier = meshopt_simplifier_create(
+		indices, GRID_INDICES, vertices[0].pos, sizeof(TestVertex),
+		vertex_count);
+	TEST_ASSERT_EQUAL_FLOAT(0.0f, meshopt_simplifier_error(simplifier));
+	size_t previous = GRID_INDICES;
+	float previousError = 0.0f;
+	for (size_t target = GRID_INDICES / 2; target >= 48; target /= 2) {
+		size_t count = meshopt_simplifier_reduce(simplifier,
+							 target / 3 * 3);
+		const uint32_t *result = meshopt_simplifier_indices(simplifier);
+		TEST_ASSERT_TRUE(count < previous);
+		TEST_ASSERT_EQUAL_UINT32(0, count % 3);
+		float error = meshopt_simplifier_error(simplifier);
+		TEST_ASSERT_TRUE(error >= previousError);
+		for (size_t i = 0; i < count; i += 3) {
+			for (uint32_t corner = 0; corner < 3; corner++) {
+				TEST_ASSERT_TRUE(result[i + corner] <
+						 vertex_count);
+			}
+			TEST_ASSERT_TRUE(
+				memcmp(vertices[result[i]].pos,
+				       vertices[result[i + 1]].pos,
+				       sizeof(float) * 3) != 0 &&
+				memcmp(vertices[result[i + 1]].pos,
+				       vertices[result[i + 2]].pos,
+				       sizeof(float) * 3) != 0 &&
+				memcmp(vertices[result[i]].pos,
+				       vertices[result[i + 2]].pos,
+				       sizeof(float) * 3) != 0);
+		}
+		previous = count;
+		previousError = error;
+	}
+	// The grid is flat and its border planes hold the outline, so the
+	// coarsest level stays on the input surface
+	TEST_ASSERT_TRUE(previous < GRID_INDICES / 8);
+	TEST_ASSERT_FLOAT_WITHIN(1e-3f, 0.0f, previousError);
+	meshopt_simplifier_destroy(simplifier);
+}
+
+void test_simplifier_chains_levels_of_a_grid(void)
+{
+	check_chain(GRID_VERTICES);
+}
+
+void test_simplifier_reduces_flat_shaded_grid(void)
+{
+	split_grid();
+	check_chain(GRID_INDICES);
+}
@@ -0,0 +1,98 @@
+#include "render_queue.h"
+#include <stdlib.h>
+#include <unity.h>
+
+#define ITEM_COUNT 50000
+
+void setUp(void)
+{
+	render_queue_init(ITEM_COUNT);
+	srand(7);
+}
+
+void tearDown(void)
+{
+	render_queue_destroy();
+}
+
+void test_key_fields_round_trip(void)
+{
+	uint64_t key = render_key(3, 200, 4000, 60000, 12.5f);
+	TEST_ASSERT_EQUAL_UINT32(3, render_key_pass(key));
+	TEST_ASSERT_EQUAL_UINT32(200, render_key_pipeline(key));
+	TEST_ASSERT_EQUAL_UINT32(4000, render_key_material(key));
+	TEST_ASSERT_EQUAL_UINT32(60000, render_key_mesh(key));
+	// Wider values are truncated instead of spilling into other fields
+	key = render_key(1u << RENDER_KEY_PASS_BITS, 0, 0, 0, 0.0f);
+	TEST_ASSERT_EQUAL_UINT64(0, key);
+}
+
+// Within equal state nearer draws sort first, behind the camera counts as
+// depth 0
+void test_depth_orders_front_to_back(void)
+{
+	float depths[] = { -5.0f, 0.0f, 0.001f, 0.5f, 1.0f, 3.0f, 1000.0f };
+	uint64_t previous = 0;
+	for (uint32_t i = 0; i < sizeof(depths) / sizeof(depths[0]); i++) {
+		uint64_t key = render_key(0, 1, 2, 3, depths[i]);
+		TEST_ASSERT_TRUE(key >= previous);
+		TEST_ASSERT_TRUE(i < 2 || key > previous);
+		previous = key;
+	}
+}
+
+// State outranks depth: pass, then pipeline, material and mesh
+void test_fields_order_by_significance(void)
+{
+	TEST_ASSERT_TRUE(render_key(1, 0, 0, 0, 0.0f) >
+			 render_key(0, 255, 4095, 65535, 1e30f));
+	TEST_ASSERT_TRUE(render_key(0, 1, 0, 0, 0.0f) >
+			 render_key(0, 0, 4095, 65535, 1e30f));
+	TEST_ASSERT_TRUE(render_key(0, 0, 1, 0, 0.0f) >
+			 render_key(0, 0, 0, 65535, 1e30f));
+	TEST_ASSERT_TRUE(render_key(0, 0, 0, 1, 0.0f) >
+			 render_key(0, 0, 0, 0, 1e30f));
+}
+
+// Keys come from a small set so most of them tie, ties must keep the
+// order they were submitted in
+void test_sort_orders_keys_and_is_stable(void)
+{
+	RenderItem *items = render_queue_begin(ITEM_COUNT);
+	for (uint32_t i = 0; i < ITEM_COUNT; i++) {
+		items[i] = (RenderItem){
+			render_key(rand() % 2, rand() % 3, rand() % 4,
+				   rand() % 2, (float)(rand() % 5)),
+			i
+		};
+	}
+	render_queue_sort();
+	TEST_ASSERT_EQUAL_UINT32(ITEM_COUNT, render_queue_count());
+	const RenderItem *sorted = render_queue_items();
+	bool seen[ITEM_COUNT] = {};
+	for (uint32_t i = 0; i < ITEM_COUNT; i++) {
+		TEST_ASSERT_TRUE(sorted[i].index < ITEM_COUNT);
+		TEST_ASSERT_FALSE(seen[sorted[i].index]);
+		seen[sorted[i].index] = true;
+		if (i == 0) {
+			continue;
+		}
+		TEST_ASSERT_TRUE(sorted[i - 1].key <= sorted[i].key);
+		if (sorted[i - 1].key == sorted[i].key) {
+			TEST_ASSERT_TRUE(sorted[i - 1].index < sorted[i].index);
+		}
+	}
+}
+
+void test_sort_handles_empty_and_single_queues(void)
+{
+	render_queue_begin(0);
+	render_queue_sort();
+	TEST_ASSERT_EQUAL_UINT32(0, render_queue_count());
+
+	RenderItem *items = render_queue_begin(1);
+	items[0] = (RenderItem){ render_key(2, 3, 4, 5, 6.0f), 42 };
+	render_queue_sort();
+	TEST_ASSERT_EQUAL_UINT32(1, render_queue_count());
+	TEST_ASSERT_EQUAL_UINT32(42, render_queue_items()[0].index);
+}
@@ -0,0 +1,130 @@
+#include "scene.h"
+#include <stdlib.h>
+#include <unity.h>
+
+// Not a multiple of SCENE_CULL_BLOCK, so the last block has padding lanes
+#define OBJECT_COUNT 1003
+
+// Inward normals of the box [-1, 1]^3
+static vec4 planes[6] = {
+	{ 1.0f, 0.0f, 0.0f, 1.0f },  { -1.0f, 0.0f, 0.0f, 1.0f },
+	{ 0.0f, 1.0f, 0.0f, 1.0f },  { 0.0f, -1.0f, 0.0f, 1.0f },
+	{ 0.0f, 0.0f, 1.0f, 1.0f },  { 0.0f, 0.0f, -1.0f, 1.0f },
+};
+
+static uint32_t visible[OBJECT_COUNT + SCENE_CULL_BLOCK];
+
+static float random_coordinate()
+{
+	return rand() / (float)RAND_MAX * 6.0f - 3.0f;
+}
+
+// Same test as the kernels, one object at a time
+static bool inside(uint32_t id)
+{
+	vec3 center;
+	float radius;
+	scene_get_bounds(id, center, &radius);
+	for (uint32_t p = 0; p < 6; p++) {
+		float distance = planes[p][0] * center[0] +
+				 planes[p][1] * center[1] +
+				 planes[p][2] * center[2] + planes[p][3];
+		if (distance < -radius) {
+			return false;
+		}
+	}
+	return true;
+}
+
+void setUp(void)
+{
+	// Smaller than the scene, adding has to grow the padded arrays
+	scene_init(10);
+	srand(11);
+	for (uint32_t i = 0; i < OBJECT_COUNT; i++) {
+		vec3 center = { random_coordinate(), random_coordinate(),
+				random_coordinate() };
+		TEST_ASSERT_EQUAL_UINT32(
+			i, scene_add(center, rand() / (float)RAND_MAX));
+	}
+}
+
+void tearDown(void)
+{
+	scene_destroy();
+}
+
+void test_cull_matches_reference_in_ascending_order(void)
+{
+	uint32_t visibleCount = scene_cull(planes, visible);
+	uint32_t expected = 0;
+	for (uint32_t i = 0; i < OBJECT_COUNT; i++) {
+		if (!inside(i)) {
+			continue;
+		}
+		TEST_ASSERT_TRUE(expected < visibleCount);
+		TEST_ASSERT_EQUAL_UINT32(i, visible[expected]);
+		expected++;
+	}
+	TEST_ASSERT_EQUAL_UINT32(expected, visibleCount);
+}
+
+// A sphere touching a plane from outside still intersects the frustum
+void test_cull_keeps_touching_spheres(void)
+{
+	scene_set_bounds(0, (vec3){ 2.0f, 0.0f, 0.0f }, 1.0f);
+	scene_set_bounds(1, (vec3){ 2.5f, 0.0f, 0.0f }, 1.0f);
+	uint32_t visibleCount = scene_cull(planes, visible);
+	TEST_ASSERT_TRUE(visibleCount > 0);
+	TEST_ASSERT_EQUAL_UINT32(0, visible[0]);
+	TEST_ASSERT_TRUE(visibleCount == 1 || visible[1] != 1);
+}
+
+// Padding lanes past the last object never show up, even with planes
+// every real object passes
+void test_padding_never_passes(void)
+{
+	vec4 everything[6];
+	for (uint32_t p = 0; p < 6; p++) {
+		glm_vec4_copy(planes[p], everything[p]);
+		everything[p][3] = 1e30f;
+	}
+	TEST_ASSERT_EQUAL_UINT32(OBJECT_COUNT,
+				 scene_cull(everything, visible));
+	TEST_ASSERT_EQUAL_UINT32(OBJECT_COUNT - 1,
+				 visible[OBJECT_COUNT - 1]);
+}
+
+// Blocks culled separately add up to the whole, the last block is clamped
+// to the object count and blocks past it are empty
+void test_cull_range_blocks_cover_the_scene(void)
+{
+	uint32_t whole[OBJECT_COUNT];
+	uint32_t wholeCount = scene_cull(planes, whole);
+	uint32_t total = 0;
+	uint32_t end = (OBJECT_COUNT / SCENE_CULL_BLOCK + 2) *
+		       SCENE_CULL_BLOCK;
+	for (uint32_t first = 0; first < end; first += SCENE_CULL_BLOCK) {
+		uint32_t blockCount =
+			scene_cull_range(planes, first,
+					 first + SCENE_CULL_BLOCK, visible);
+		TEST_ASSERT_TRUE(first < OBJECT_COUNT || blockCount == 0);
+		for (uint32_t i = 0; i < blockCount; i++) {
+			TEST_ASSERT_TRUE(total + i < wholeCount);
+			TEST_ASSERT_EQUAL_UINT32(whole[total + i], visible[i]);
+		}
+		total += blockCount;
+	}
+	TEST_ASSERT_EQUAL_UINT32(wholeCount, total);
+}
+
+void test_set_bounds_moves_objects(void)
+{
+	scene_set_bounds(5, (vec3){ 0.0f, 0.0f, 0.0f }, 0.5f);
+	TEST_ASSERT_TRUE(inside(5));
+	scene_set_bounds(5, (vec3){ 0.0f, 10.0f, 0.0f }, 0.5f);
+	uint32_t visibleCount = scene_cull(planes, visible);
+	for (uint32_t i = 0; i < visibleCount; i++) {
+		TEST_ASSERT_TRUE(visible[i] != 5);
+	}
+}
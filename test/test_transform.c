@@ -0,0 +1,138 @@
+#include "jobs.h"
+#include "transform.h"
+#include <math.h>
+#include <stdlib.h>
+#include <unity.h>
+
+// transform_update against a naive composition in id order, which is valid
+// because parents have lower ids than their children
+
+#define NODE_COUNT 20000
+// Share of nodes that start a tree of their own
+#define ROOT_ONE_IN 50
+#define MAX_RELATIVE_ERROR 1e-5
+
+static uint32_t parents[NODE_COUNT];
+static mat4 locals[NODE_COUNT];
+static mat4 expected[NODE_COUNT];
+
+static float random_unit()
+{
+	return rand() / (float)RAND_MAX - 0.5f;
+}
+
+static void compose_naive()
+{
+	for (uint32_t i = 0; i < NODE_COUNT; i++) {
+		if (parents[i] == TRANSFORM_NONE) {
+			glm_mat4_copy(locals[i], expected[i]);
+		} else {
+			glm_mat4_mul(expected[parents[i]], locals[i],
+				     expected[i]);
+		}
+	}
+}
+
+static double max_relative_error()
+{
+	double worst = 0.0;
+	for (uint32_t i = 0; i < NODE_COUNT; i++) {
+		mat4 world;
+		transform_get_world(i, world);
+		for (uint32_t column = 0; column < 4; column++) {
+			for (uint32_t row = 0; row < 4; row++) {
+				double want = expected[i][column][row];
+				double error = fabs(world[column][row] - want) /
+					       (1.0 + fabs(want));
+				worst = error > worst ? error : worst;
+			}
+		}
+	}
+	return worst;
+}
+
+void setUp(void)
+{
+	jobs_init(4);
+	// Small on purpose, the store has to grow
+	transform_init(16);
+	srand(3);
+	for (uint32_t i = 0; i < NODE_COUNT; i++) {
+		parents[i] = i == 0 || rand() % ROOT_ONE_IN == 0 ?
+				     TRANSFORM_NONE :
+				     (uint32_t)(rand() % i);
+		for (uint32_t column = 0; column < 4; column++) {
+			for (uint32_t row = 0; row < 4; row++) {
+				locals[i][column][row] =
+					(column == row) + random_unit() * 0.1f;
+			}
+		}
+		TEST_ASSERT_EQUAL_UINT32(i, transform_add(parents[i],
+							  locals[i]));
+	}
+}
+
+void tearDown(void)
+{
+	transform_destroy();
+	jobs_destroy();
+}
+
+void test_update_matches_naive_composition(void)
+{
+	TEST_ASSERT_EQUAL_UINT32(NODE_COUNT, transform_update());
+	compose_naive();
+	TEST_ASSERT_TRUE(max_relative_error() <= MAX_RELATIVE_ERROR);
+}
+
+// Before any node is added, and again after a destroy and init
+void test_empty_update_recomputes_nothing(void)
+{
+	for (uint32_t i = 0; i < 2; i++) {
+		transform_destroy();
+		transform_init(16);
+		TEST_ASSERT_EQUAL_UINT32(0, transform_update());
+		TEST_ASSERT_EQUAL_UINT32(0, transform_count());
+	}
+}
+
+void test_clean_update_recomputes_nothing(void)
+{
+	transform_update();
+	TEST_ASSERT_EQUAL_UINT32(0, transform_update());
+}
+
+// Only the dirty nodes and their descendants are recomputed, parents
+// first, and the result still matches
+void test_dirty_subtrees_update_alone(void)
+{
+	transform_update();
+	bool dirty[NODE_COUNT] = {};
+	for (uint32_t i = 0; i < 8; i++) {
+		uint32_t id = (uint32_t)rand() % NODE_COUNT;
+		locals[id][3][0] += 0.25f;
+		transform_set_local(id, locals[id]);
+		dirty[id] = true;
+	}
+	uint32_t affected = 0;
+	for (uint32_t i = 0; i < NODE_COUNT; i++) {
+		if (parents[i] != TRANSFORM_NONE && dirty[parents[i]]) {
+			dirty[i] = true;
+		}
+		affected += dirty[i];
+	}
+
+	uint32_t updated = transform_update();
+	TEST_ASSERT_EQUAL_UINT32(affected, updated);
+	const uint32_t *ids = transform_updated();
+	bool seen[NODE_COUNT] = {};
+	for (uint32_t i = 0; i < updated; i++) {
+		TEST_ASSERT_TRUE(dirty[ids[i]]);
+		uint32_t parent = parents[ids[i]];
+		TEST_ASSERT_TRUE(parent == TRANSFORM_NONE || !dirty[parent] ||
+				 seen[parent]);
+		seen[ids[i]] = true;
+	}
+	compose_naive();
+	TEST_ASSERT_TRUE(max_relative_error() <= MAX_RELATIVE_ERROR);
+}
@@ -0,0 +1,546 @@
+#include "mesh.h"
+#include "meshopt.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Cooks a Wavefront OBJ into a mesh file the renderer maps as is: one
+// submesh per object or group, triangles ordered for the post-transform
+// cache, vertices in first use order, and a chain of simplified levels of
+// detail sharing each submesh's vertices.
+
+#define DEFAULT_LODS 4
+#define DEFAULT_LOD_RATIO 0.5f
+// Cache size the ACMR is reported for, a common hardware FIFO size
+#define ACMR_CACHE_SIZE 16
+// A level that doesn't remove this share of the triangles of the one before
+// ends the chain, the simplifier got stuck on borders or folds
+#define MIN_LOD_PROGRESS 0.1f
+
+// Matches Vertex in app.c, the renderer rejects meshes with another stride
+typedef struct {
+	float pos[3];
+	float color[3];
+} CookVertex;
+
+// Growable array of `size` byte elements
+typedef struct {
+	void *data;
+	size_t count;
+	size_t capacity;
+	size_t size;
+} Array;
+
+static void *array_push(Array *array)
+{
+	if (array->count == array->capacity) {
+		array->capacity = array->capacity ? array->capacity * 2 : 256;
+		array->data =
+			realloc(array->data, array->capacity * array->size);
+		if (array->data == nullptr) {
+			fprintf(stderr, "Can't allocate %zu bytes\n",
+				array->capacity * array->size);
+			exit(1);
+		}
+	}
+	return (char *)array->data + array->count++ * array->size;
+}
+
+// A corner of a face, 0-based indices into the OBJ's arrays, normal
+// UINT32_MAX when there is none
+typedef struct {
+	uint32_t position;
+	uint32_t normal;
+} Corner;
+
+typedef struct {
+	char name[64];
+	// Corners of its triangles, three by three
+	Array corners;
+} Group;
+
+typedef struct {
+	// xyz and rgb, rgb negative when the OBJ gives no color
+	Array positions;
+	Array normals;
+	Array groups;
+} Obj;
+
+typedef struct {
+	uint32_t lods;
+	float lod_ratio;
+	const char *input;
+	const char *output;
+} CookConfig;
+
+static void usage(const char *program)
+{
+	fprintf(stderr,
+		"usage: %s [--lods N] [--lod-ratio R] INPUT.obj OUTPUT.mesh\n",
+		program);
+	exit(1);
+}
+
+static size_t align_up(size_t value)
+{
+	return (value + MESH_ALIGNMENT - 1) & ~(size_t)(MESH_ALIGNMENT - 1);
+}
+
+static Group *obj_group(Obj *obj, const char *name)
+{
+	Group *group = array_push(&obj->groups);
+	*group = (Group){ .corners = { .size = sizeof(Corner) } };
+	snprintf(group->name, sizeof(group->name), "%s", name);
+	return group;
+}
+
+// OBJ indices are 1-based, negative ones count back from the last element
+static bool obj_index(long value, size_t count, uint32_t *index)
+{
+	if (value < 0) {
+		value += (long)count;
+	} else {
+		value -= 1;
+	}
+	if (value < 0 || (size_t)value >= count) {
+		return false;
+	}
+	*index = (uint32_t)value;
+	return true;
+}
+
+// Parses "v", "v/vt", "v//vn" or "v/vt/vn"
+static bool obj_corner(const char *token, const Obj *obj, Corner *corner)
+{
+	char *end;
+	long position = strtol(token, &end, 10);
+	if (end == token ||
+	    !obj_index(position, obj->positions.count, &corner->position)) {
+		return false;
+	}
+	corner->normal = UINT32_MAX;
+	if (*end != '/') {
+		return true;
+	}
+	const char *texcoord = end + 1;
+	strtol(texcoord, &end, 10);
+	if (*end != '/') {
+		return true;
+	}
+	const char *normal = end + 1;
+	long value = strtol(normal, &end, 10);
+	return end == normal ||
+	       obj_index(value, obj->normals.count, &corner->normal);
+}
+
+static void obj_load(const char *path, Obj *obj)
+{
+	*obj = (Obj){ .positions = { .size = sizeof(float) * 6 },
+		      .normals = { .size = sizeof(float) * 3 },
+		      .groups = { .size = sizeof(Group) } };
+	FILE *file = fopen(path, "r");
+	if (file == nullptr) {
+		perror(path);
+		exit(1);
+	}
+	Group *group = nullptr;
+	char line[4096];
+	for (uint32_t number = 1; fgets(line, sizeof(line), file) != nullptr;
+	     number++) {
+		char *save;
+		char *keyword = strtok_r(line, " \t\r\n", &save);
+		if (keyword == nullptr || keyword[0] == '#') {
+			continue;
+		}
+		if (strcmp(keyword, "v") == 0) {
+			float *v = array_push(&obj->positions);
+			int read = sscanf(save, "%f %f %f %f %f %f", &v[0],
+					  &v[1], &v[2], &v[3], &v[4], &v[5]);
+			if (read < 3) {
+				fprintf(stderr, "%s:%u: bad vertex\n", path,
+					number);
+				exit(1);
+			}
+			if (read < 6) {
+				v[3] = -1.0f;
+			}
+		} else if (strcmp(keyword, "vn") == 0) {
+			float *n = array_push(&obj->normals);
+			if (sscanf(save, "%f %f %f", &n[0], &n[1], &n[2]) !=
+			    3) {
+				fprintf(stderr, "%s:%u: bad normal\n", path,
+					number);
+				exit(1);
+			}
+		} else if (strcmp(keyword, "o") == 0 ||
+			   strcmp(keyword, "g") == 0) {
+			const char *name = strtok_r(nullptr, " \t\r\n", &save);
+			group = obj_group(obj, name != nullptr ? name : "");
+		} else if (strcmp(keyword, "f") == 0) {
+			if (group == nullptr) {
+				group = obj_group(obj, "default");
+			}
+			// Triangulates polygons as fans around their first
+			// corner
+			Corner first, previous, corner;
+			uint32_t corners = 0;
+			for (char *token = strtok_r(nullptr, " \t\r\n", &save);
+			     token != nullptr;
+			     token = strtok_r(nullptr, " \t\r\n", &save)) {
+				if (!obj_corner(token, obj, &corner)) {
+					fprintf(stderr,
+						"%s:%u: bad face corner %s\n",
+						path, number, token);
+					exit(1);
+				}
+				if (corners >= 2) {
+					Corner triangle[3] = { first, previous,
+							       corner };
+					for (uint32_t i = 0; i < 3; i++) {
+						*(Corner *)array_push(
+							&group->corners) =
+							triangle[i];
+					}
+				} else if (corners == 0) {
+					first = corner;
+				}
+				previous = corner;
+				corners++;
+			}
+		}
+	}
+	fclose(file);
+}
+
+// One group ready to be written: its own vertex range and every level's
+// indices, local to that range
+typedef struct {
+	CookVertex *vertices;
+	uint32_t vertex_count;
+	uint32_t *levels[MESH_MAX_LODS];
+	size_t level_counts[MESH_MAX_LODS];
+	float errors[MESH_MAX_LODS];
+	uint32_t level_count;
+} Cooked;
+
+// Welds the corners sharing a position and a normal into one vertex, open
+// addressing on the pair
+static void cook_weld(const Obj *obj, const Group *group, Cooked *cooked,
+		      uint32_t *indices)
+{
+	size_t count = group->corners.count;
+	const Corner *corners = group->corners.data;
+	size_t size = 16;
+	while (size < count * 2) {
+		size *= 2;
+	}
+	uint64_t *keys = malloc(sizeof(uint64_t) * size);
+	uint32_t *values = malloc(sizeof(uint32_t) * size);
+	cooked->vertices = malloc(sizeof(CookVertex) * (count > 0 ? count : 1));
+	if (keys == nullptr || values == nullptr ||
+	    cooked->vertices == nullptr) {
+		fprintf(stderr, "Can't allocate %zu vertices\n", count);
+		exit(1);
+	}
+	memset(keys, 0xff, sizeof(uint64_t) * size);
+	const float *positions = obj->positions.data;
+	const float *normals = obj->normals.data;
+	cooked->vertex_count = 0;
+	for (size_t i = 0; i < count; i++) {
+		uint64_t key = (uint64_t)corners[i].position << 32 |
+			       corners[i].normal;
+		size_t slot = (key * 0x9e3779b97f4a7c15ull >> 17) & (size - 1);
+		while (keys[slot] != UINT64_MAX && keys[slot] != key) {
+			slot = (slot + 1) & (size - 1);
+		}
+		if (keys[slot] == key) {
+			indices[i] = values[slot];
+			continue;
+		}
+		keys[slot] = key;
+		values[slot] = cooked->vertex_count;
+		indices[i] = cooked->vertex_count;
+		CookVertex *vertex = &cooked->vertices[cooked->vertex_count++];
+		const float *p = positions + (size_t)corners[i].position * 6;
+		memcpy(vertex->pos, p, sizeof(vertex->pos));
+		// Vertex color if the OBJ has one, else the normal, else white
+		for (uint32_t axis = 0; axis < 3; axis++) {
+			if (p[3] >= 0.0f) {
+				vertex->color[axis] = p[3 + axis];
+			} else if (corners[i].normal != UINT32_MAX) {
+				vertex->color[axis] =
+					normals[(size_t)corners[i].normal * 3 +
+						axis] * 0.5f +
+					0.5f;
+			} else {
+				vertex->color[axis] = 1.0f;
+			}
+		}
+	}
+	free(values);
+	free(keys);
+}
+
+static void cook_group(const Obj *obj, const Group *group,
+		       const CookConfig *config, Cooked *cooked)
+{
+	size_t count = group->corners.count;
+	uint32_t *base = malloc(sizeof(uint32_t) * (count > 0 ? count : 1));
+	if (base == nullptr) {
+		fprintf(stderr, "Can't allocate %zu indices\n", count);
+		exit(1);
+	}
+	cook_weld(obj, group, cooked, base);
+	float acmr_before = meshopt_acmr(base, count, cooked->vertex_count,
+					 ACMR_CACHE_SIZE);
+
+	// Every level simplifies the one before, so the error of the chain is
+	// the largest of its collapses and never decreases
+	cooked->levels[0] = base;
+	cooked->level_counts[0] = count;
+	cooked->errors[0] = 0.0f;
+	cooked->level_count = 1;
+	MeshoptSimplifier *simplifier = meshopt_simplifier_create(
+		base, count, cooked->vertices[0].pos, sizeof(CookVertex),
+		cooked->vertex_count);
+	float target = (float)count;
+	while (cooked->level_count < config->lods) {
+		target *= config->lod_ratio;
+		size_t previous = cooked->level_counts[cooked->level_count - 1];
+		size_t level_count = meshopt_simplifier_reduce(
+			simplifier, (size_t)target / 3 * 3);
+		if (level_count == 0 ||
+		    level_count > previous * (1.0f - MIN_LOD_PROGRESS)) {
+			break;
+		}
+		uint32_t *level = malloc(sizeof(uint32_t) * level_count);
+		if (level == nullptr) {
+			fprintf(stderr, "Can't allocate %zu indices\n",
+				level_count);
+			exit(1);
+		}
+		memcpy(level, meshopt_simplifier_indices(simplifier),
+		       sizeof(uint32_t) * level_count);
+		cooked->levels[cooked->level_count] = level;
+		cooked->level_counts[cooked->level_count] = level_count;
+		cooked->errors[cooked->level_count] =
+			meshopt_simplifier_error(simplifier);
+		cooked->level_count++;
+	}
+	meshopt_simplifier_destroy(simplifier);
+	for (uint32_t i = 0; i < cooked->level_count; i++) {
+		meshopt_optimize_cache(cooked->levels[i],
+				       cooked->level_counts[i],
+				       cooked->vertex_count);
+	}
+	float acmr_after = meshopt_acmr(base, count, cooked->vertex_count,
+					ACMR_CACHE_SIZE);
+
+	// Coarser levels only reference vertices of level 0, which are stored
+	// in the order it first uses them
+	uint32_t *remap = malloc(sizeof(uint32_t) * cooked->vertex_count);
+	CookVertex *vertices = malloc(sizeof(CookVertex) *
+				      (cooked->vertex_count > 0 ?
+					       cooked->vertex_count :
+					       1));
+	if (remap == nullptr || vertices == nullptr) {
+		fprintf(stderr, "Can't allocate %u vertices\n",
+			cooked->vertex_count);
+		exit(1);
+	}
+	uint32_t kept = meshopt_fetch_remap(remap, base, count,
+					    cooked->vertex_count);
+	for (uint32_t v = 0; v < cooked->vertex_count; v++) {
+		if (remap[v] != UINT32_MAX) {
+			vertices[remap[v]] = cooked->vertices[v];
+		}
+	}
+	for (uint32_t i = 0; i < cooked->level_count; i++) {
+		for (size_t j = 0; j < cooked->level_counts[i]; j++) {
+			cooked->levels[i][j] = remap[cooked->levels[i][j]];
+		}
+	}
+	free(cooked->vertices);
+	free(remap);
+	cooked->vertices = vertices;
+	cooked->vertex_count = kept;
+
+	printf("%s: %u vertices, ACMR %.3f -> %.3f\n", group->name, kept,
+	       acmr_before, acmr_after);
+	for (uint32_t i = 0; i < cooked->level_count; i++) {
+		printf("  LOD %u: %zu triangles, error %g\n", i,
+		       cooked->level_counts[i] / 3, cooked->errors[i]);
+	}
+}
+
+static void cook_write(const Cooked *cooked, uint32_t cooked_count,
+		       const char *path)
+{
+	uint32_t lod_count = 1;
+	uint64_t vertex_count = 0;
+	uint64_t index_count = 0;
+	uint32_t index_size = 2;
+	for (uint32_t i = 0; i < cooked_count; i++) {
+		if (cooked[i].level_count > lod_count) {
+			lod_count = cooked[i].level_count;
+		}
+		vertex_count += cooked[i].vertex_count;
+		for (uint32_t level = 0; level < cooked[i].level_count;
+		     level++) {
+			index_count += cooked[i].level_counts[level];
+		}
+		if (cooked[i].vertex_count > UINT16_MAX + 1) {
+			index_size = 4;
+		}
+	}
+	if (vertex_count > INT32_MAX || index_count > UINT32_MAX) {
+		fprintf(stderr, "%s: mesh too large\n", path);
+		exit(1);
+	}
+
+	MeshHeader header = {
+		.magic = MESH_MAGIC,
+		.version = MESH_VERSION,
+		.vertex_stride = sizeof(CookVertex),
+		.index_size = index_size,
+		.vertex_count = vertex_count,
+		.index_count = index_count,
+		.submesh_count = cooked_count,
+		.lod_count = lod_count,
+	};
+	header.submesh_offset = align_up(sizeof(header));
+	header.lod_offset = align_up(header.submesh_offset +
+				     sizeof(MeshSubmesh) * cooked_count);
+	header.vertex_offset =
+		align_up(header.lod_offset +
+			 sizeof(MeshLod) * cooked_count * lod_count);
+	header.index_offset = align_up(header.vertex_offset +
+				       vertex_count * sizeof(CookVertex));
+	size_t size = header.index_offset + index_count * index_size;
+
+	unsigned char *data = calloc(1, size);
+	if (data == nullptr) {
+		fprintf(stderr, "Can't allocate %zu bytes for the mesh\n",
+			size);
+		exit(1);
+	}
+	memcpy(data, &header, sizeof(header));
+	MeshSubmesh *submeshes = (MeshSubmesh *)(data + header.submesh_offset);
+	MeshLod *lods = (MeshLod *)(data + header.lod_offset);
+	CookVertex *vertices = (CookVertex *)(data + header.vertex_offset);
+	unsigned char *indices = data + header.index_offset;
+
+	uint32_t first_vertex = 0;
+	uint32_t first_index = 0;
+	for (uint32_t i = 0; i < cooked_count; i++) {
+		const Cooked *group = &cooked[i];
+		memcpy(vertices + first_vertex, group->vertices,
+		       sizeof(CookVertex) * group->vertex_count);
+		MeshLod *group_lods = lods + (size_t)i * lod_count;
+		for (uint32_t level = 0; level < group->level_count; level++) {
+			size_t level_count = group->level_counts[level];
+			for (size_t j = 0; j < level_count; j++) {
+				uint32_t index = group->levels[level][j];
+				size_t at = first_index + j;
+				if (index_size == 4) {
+					((uint32_t *)indices)[at] = index;
+				} else {
+					((uint16_t *)indices)[at] = index;
+				}
+			}
+			group_lods[level] =
+				(MeshLod){ .first_index = first_index,
+					   .index_count = level_count,
+					   .error = group->errors[level] };
+			first_index += level_count;
+		}
+		// Groups with a shorter chain repeat their coarsest level
+		for (uint32_t level = group->level_count; level < lod_count;
+		     level++) {
+			group_lods[level] = group_lods[level - 1];
+		}
+		submeshes[i] = (MeshSubmesh){
+			.first_index = group_lods[0].first_index,
+			.index_count = group_lods[0].index_count,
+			.vertex_offset = first_vertex
+		};
+		first_vertex += group->vertex_count;
+	}
+
+	FILE *file = fopen(path, "wb");
+	if (file == nullptr || fwrite(data, 1, size, file) != size ||
+	    fclose(file) != 0) {
+		perror(path);
+		exit(1);
+	}
+	free(data);
+	printf("Wrote %s: %u submeshes, %u levels of detail, %llu vertices, "
+	       "%llu indices\n",
+	       path, cooked_count, lod_count, (unsigned long long)vertex_count,
+	       (unsigned long long)index_count);
+}
+
+int main(int argc, char **argv)
+{
+	CookConfig config = { .lods = DEFAULT_LODS,
+			      .lod_ratio = DEFAULT_LOD_RATIO };
+	for (int i = 1; i < argc; i++) {
+		const char *arg = argv[i];
+		if (strcmp(arg, "--lods") == 0 && i + 1 < argc) {
+			config.lods = (uint32_t)atoi(argv[++i]);
+		} else if (strcmp(arg, "--lod-ratio") == 0 && i + 1 < argc) {
+			config.lod_ratio = strtof(argv[++i], nullptr);
+		} else if (config.input == nullptr) {
+			config.input = arg;
+		} else if (config.output == nullptr) {
+			config.output = arg;
+		} else {
+			usage(argv[0]);
+		}
+	}
+	if (config.input == nullptr || config.output == nullptr ||
+	    config.lods < 1 || config.lods > MESH_MAX_LODS ||
+	    !(config.lod_ratio > 0.0f && config.lod_ratio < 1.0f)) {
+		usage(argv[0]);
+	}
+
+	Obj obj;
+	obj_load(config.input, &obj);
+	Cooked *cooked = calloc(obj.groups.count + 1, sizeof(Cooked));
+	if (cooked == nullptr) {
+		fprintf(stderr, "Can't allocate %zu groups\n",
+			obj.groups.count);
+		return 1;
+	}
+	uint32_t cooked_count = 0;
+	const Group *groups = obj.groups.data;
+	for (size_t i = 0; i < obj.groups.count; i++) {
+		// o and g lines without faces name nothing to draw
+		if (groups[i].corners.count > 0) {
+			cook_group(&obj, &groups[i], &config,
+				   &cooked[cooked_count++]);
+		}
+	}
+	if (cooked_count == 0) {
+		fprintf(stderr, "%s: no faces\n", config.input);
+		return 1;
+	}
+	cook_write(cooked, cooked_count, config.output);
+
+	for (uint32_t i = 0; i < cooked_count; i++) {
+		for (uint32_t level = 0; level < cooked[i].level_count;
+		     level++) {
+			free(cooked[i].levels[level]);
+		}
+		free(cooked[i].vertices);
+	}
+	for (size_t i = 0; i < obj.groups.count; i++) {
+		free(groups[i].corners.data);
+	}
+	free(cooked);
+	free(obj.groups.data);
+	free(obj.normals.data);
+	free(obj.positions.data);
+	return 0;
+}
@@ -0,0 +1,758 @@
+#include "meshopt.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Post-transform cache the triangle order is optimized for. Small enough
+// for every GPU, larger caches still benefit.
+#define CACHE_SIZE 32
+// Weight of the planes keeping borders in place, relative to the surface
+#define BORDER_WEIGHT 10.0
+// A collapse may turn a triangle's normal by at most about 85 degrees
+#define MIN_NORMAL_DOT 0.1
+#define EDGE_EMPTY UINT64_MAX
+
+static void *checked_malloc(size_t size)
+{
+	void *data = malloc(size > 0 ? size : 1);
+	if (data == nullptr) {
+		fprintf(stderr, "Can't allocate %zu bytes\n", size);
+		exit(1);
+	}
+	return data;
+}
+
+static void *checked_calloc(size_t count, size_t size)
+{
+	void *data = calloc(count > 0 ? count : 1, size);
+	if (data == nullptr) {
+		fprintf(stderr, "Can't allocate %zu bytes\n", count * size);
+		exit(1);
+	}
+	return data;
+}
+
+// Triangles around each vertex: the ones of vertex v are
+// triangles[offsets[v]] up to triangles[offsets[v] + counts[v]]
+typedef struct {
+	uint32_t *offsets;
+	uint32_t *counts;
+	uint32_t *triangles;
+} Adjacency;
+
+static void adjacency_build(Adjacency *adjacency, const uint32_t *indices,
+			    size_t index_count, uint32_t vertex_count)
+{
+	adjacency->offsets = checked_malloc(sizeof(uint32_t) * vertex_count);
+	adjacency->counts = checked_calloc(vertex_count, sizeof(uint32_t));
+	adjacency->triangles = checked_malloc(sizeof(uint32_t) * index_count);
+	for (size_t i = 0; i < index_count; i++) {
+		adjacency->counts[indices[i]]++;
+	}
+	uint32_t offset = 0;
+	for (uint32_t v = 0; v < vertex_count; v++) {
+		adjacency->offsets[v] = offset;
+		offset += adjacency->counts[v];
+		adjacency->counts[v] = 0;
+	}
+	for (size_t i = 0; i < index_count; i++) {
+		uint32_t v = indices[i];
+		adjacency->triangles[adjacency->offsets[v] +
+				     adjacency->counts[v]++] = i / 3;
+	}
+}
+
+static void adjacency_free(Adjacency *adjacency)
+{
+	free(adjacency->offsets);
+	free(adjacency->counts);
+	free(adjacency->triangles);
+}
+
+// Forsyth's vertex score: vertices in the cache score higher the more
+// recently they were used, except the last triangle's which are penalized
+// to avoid strips, and vertices with few triangles left score higher so
+// they leave the working set
+static float vertex_score(int32_t cache_position, uint32_t remaining)
+{
+	if (remaining == 0) {
+		return -1.0f;
+	}
+	float score = 0.0f;
+	if (cache_position >= 0 && cache_position < 3) {
+		score = 0.75f;
+	} else if (cache_position >= 3) {
+		float scaled = 1.0f - (float)(cache_position - 3) /
+					      (CACHE_SIZE - 3);
+		score = powf(scaled, 1.5f);
+	}
+	return score + 2.0f / sqrtf((float)remaining);
+}
+
+void meshopt_optimize_cache(uint32_t *indices, size_t index_count,
+			    uint32_t vertex_count)
+{
+	size_t triangle_count = index_count / 3;
+	if (triangle_count == 0) {
+		return;
+	}
+	// The triangles not emitted yet around every vertex, emitted ones are
+	// swapped past the end of their vertex's range
+	Adjacency adjacency;
+	adjacency_build(&adjacency, indices, triangle_count * 3, vertex_count);
+	int32_t *cache_position =
+		checked_malloc(sizeof(int32_t) * vertex_count);
+	float *scores = checked_malloc(sizeof(float) * vertex_count);
+	float *triangle_scores = checked_calloc(triangle_count, sizeof(float));
+	bool *emitted = checked_calloc(triangle_count, sizeof(bool));
+	uint32_t *output =
+		checked_malloc(sizeof(uint32_t) * triangle_count * 3);
+	for (uint32_t v = 0; v < vertex_count; v++) {
+		cache_position[v] = -1;
+		scores[v] = vertex_score(-1, adjacency.counts[v]);
+	}
+	for (size_t i = 0; i < triangle_count * 3; i++) {
+		triangle_scores[i / 3] += scores[indices[i]];
+	}
+
+	uint32_t cache[CACHE_SIZE + 3];
+	uint32_t cache_count = 0;
+	size_t scan = 0;
+	size_t best = SIZE_MAX;
+	for (size_t written = 0; written < triangle_count; written++) {
+		if (best == SIZE_MAX) {
+			// Nothing in the cache has triangles left, take the
+			// next one in input order
+			while (emitted[scan]) {
+				scan++;
+			}
+			best = scan;
+		}
+		const uint32_t *triangle = indices + best * 3;
+		memcpy(output + written * 3, triangle, sizeof(uint32_t) * 3);
+		emitted[best] = true;
+		for (uint32_t corner = 0; corner < 3; corner++) {
+			uint32_t v = triangle[corner];
+			uint32_t *around =
+				adjacency.triangles + adjacency.offsets[v];
+			for (uint32_t i = 0; i < adjacency.counts[v]; i++) {
+				if (around[i] == best) {
+					around[i] =
+						around[--adjacency.counts[v]];
+					break;
+				}
+			}
+		}
+
+		// The triangle's vertices move to the front of the cache
+		uint32_t next[CACHE_SIZE + 3];
+		uint32_t next_count = 0;
+		for (uint32_t corner = 0; corner < 3; corner++) {
+			uint32_t v = triangle[corner];
+			if (next_count == 0 || next[0] != v) {
+				if (next_count < 2 || next[1] != v) {
+					next[next_count++] = v;
+				}
+			}
+		}
+		for (uint32_t i = 0; i < cache_count; i++) {
+			uint32_t v = cache[i];
+			bool used = false;
+			for (uint32_t j = 0; j < 3; j++) {
+				used = used || triangle[j] == v;
+			}
+			if (!used) {
+				next[next_count++] = v;
+			}
+		}
+		// Rescore everything whose position changed, including the
+		// vertices that fell out
+		for (uint32_t i = 0; i < next_count; i++) {
+			uint32_t v = next[i];
+			cache_position[v] = i < CACHE_SIZE ? (int32_t)i : -1;
+			float score = vertex_score(cache_position[v],
+						   adjacency.counts[v]);
+			float delta = score - scores[v];
+			scores[v] = score;
+			const uint32_t *around =
+				adjacency.triangles + adjacency.offsets[v];
+			for (uint32_t j = 0; j < adjacency.counts[v]; j++) {
+				triangle_scores[around[j]] += delta;
+			}
+		}
+		cache_count = next_count < CACHE_SIZE ? next_count : CACHE_SIZE;
+		memcpy(cache, next, sizeof(uint32_t) * cache_count);
+
+		best = SIZE_MAX;
+		float best_score = -1.0f;
+		for (uint32_t i = 0; i < cache_count; i++) {
+			uint32_t v = cache[i];
+			const uint32_t *around =
+				adjacency.triangles + adjacency.offsets[v];
+			for (uint32_t j = 0; j < adjacency.counts[v]; j++) {
+				if (triangle_scores[around[j]] > best_score) {
+					best_score = triangle_scores[around[j]];
+					best = around[j];
+				}
+			}
+		}
+	}
+	memcpy(indices, output, sizeof(uint32_t) * triangle_count * 3);
+	free(output);
+	free(emitted);
+	free(triangle_scores);
+	free(scores);
+	free(cache_position);
+	adjacency_free(&adjacency);
+}
+
+float meshopt_acmr(const uint32_t *indices, size_t index_count,
+		   uint32_t vertex_count, uint32_t cache_size)
+{
+	if (index_count < 3) {
+		return 0.0f;
+	}
+	// A vertex is in the FIFO while fewer than cache_size misses happened
+	// since it entered
+	uint32_t *entered = checked_calloc(vertex_count, sizeof(uint32_t));
+	uint32_t misses = cache_size + 1;
+	uint32_t first = misses;
+	for (size_t i = 0; i < index_count; i++) {
+		uint32_t v = indices[i];
+		if (misses - entered[v] > cache_size) {
+			entered[v] = misses++;
+		}
+	}
+	free(entered);
+	return (float)(misses - first) / (index_count / 3);
+}
+
+uint32_t meshopt_fetch_remap(uint32_t *remap, const uint32_t *indices,
+			     size_t index_count, uint32_t vertex_count)
+{
+	for (uint32_t v = 0; v < vertex_count; v++) {
+		remap[v] = UINT32_MAX;
+	}
+	uint32_t kept = 0;
+	for (size_t i = 0; i < index_count; i++) {
+		if (remap[indices[i]] == UINT32_MAX) {
+			remap[indices[i]] = kept++;
+		}
+	}
+	return kept;
+}
+
+// Sum of squared distances to a set of planes, as a symmetric matrix A,
+// vector b and constant c: p'Ap + 2b'p + c. Every plane counts at least
+// once whatever the size of its triangle, so the square root of the sum
+// bounds the distance to each of the planes.
+typedef struct {
+	double a00, a01, a02, a11, a12, a22;
+	double b0, b1, b2;
+	double c;
+} Quadric;
+
+static void quadric_add_plane(Quadric *q, const double n[3], double d,
+			      double weight)
+{
+	q->a00 += weight * n[0] * n[0];
+	q->a01 += weight * n[0] * n[1];
+	q->a02 += weight * n[0] * n[2];
+	q->a11 += weight * n[1] * n[1];
+	q->a12 += weight * n[1] * n[2];
+	q->a22 += weight * n[2] * n[2];
+	q->b0 += weight * n[0] * d;
+	q->b1 += weight * n[1] * d;
+	q->b2 += weight * n[2] * d;
+	q->c += weight * d * d;
+}
+
+static void quadric_add(Quadric *q, const Quadric *other)
+{
+	q->a00 += other->a00;
+	q->a01 += other->a01;
+	q->a02 += other->a02;
+	q->a11 += other->a11;
+	q->a12 += other->a12;
+	q->a22 += other->a22;
+	q->b0 += other->b0;
+	q->b1 += other->b1;
+	q->b2 += other->b2;
+	q->c += other->c;
+}
+
+// Squared distance bound of `p` to the planes of `a` and `b` together
+static double quadric_error(const Quadric *a, const Quadric *b,
+			    const float p[3])
+{
+	Quadric q = *a;
+	quadric_add(&q, b);
+	double x = p[0], y = p[1], z = p[2];
+	double sum = q.a00 * x * x + q.a11 * y * y + q.a22 * z * z +
+		     2.0 * (q.a01 * x * y + q.a02 * x * z + q.a12 * y * z) +
+		     2.0 * (q.b0 * x + q.b1 * y + q.b2 * z) + q.c;
+	return sum > 0.0 ? sum : 0.0;
+}
+
+// Set of directed edges, open addressing on a power of two table
+typedef struct {
+	uint64_t *keys;
+	size_t mask;
+} EdgeSet;
+
+static size_t edge_slot(const EdgeSet *set, uint64_t key)
+{
+	uint64_t hash = key * 0x9e3779b97f4a7c15ull;
+	size_t slot = (hash >> 17) & set->mask;
+	while (set->keys[slot] != EDGE_EMPTY && set->keys[slot] != key) {
+		slot = (slot + 1) & set->mask;
+	}
+	return slot;
+}
+
+static void edge_set_build(EdgeSet *set, const uint32_t *indices,
+			   size_t index_count)
+{
+	size_t size = 16;
+	while (size < index_count * 2) {
+		size *= 2;
+	}
+	set->keys = checked_malloc(sizeof(uint64_t) * size);
+	set->mask = size - 1;
+	memset(set->keys, 0xff, sizeof(uint64_t) * size);
+	for (size_t i = 0; i < index_count; i++) {
+		uint64_t key = (uint64_t)indices[i] << 32 |
+			       indices[i - i % 3 + (i + 1) % 3];
+		set->keys[edge_slot(set, key)] = key;
+	}
+}
+
+static bool edge_set_contains(const EdgeSet *set, uint32_t from, uint32_t to)
+{
+	uint64_t key = (uint64_t)from << 32 | to;
+	return set->keys[edge_slot(set, key)] == key;
+}
+
+static const float *position(const float *positions, size_t stride,
+			     uint32_t vertex)
+{
+	return (const float *)((const char *)positions + stride * vertex);
+}
+
+static void triangle_normal(const float *p0, const float *p1, const float *p2,
+			    double n[3])
+{
+	double e1[3], e2[3];
+	for (uint32_t axis = 0; axis < 3; axis++) {
+		e1[axis] = p1[axis] - p0[axis];
+		e2[axis] = p2[axis] - p0[axis];
+	}
+	n[0] = e1[1] * e2[2] - e1[2] * e2[1];
+	n[1] = e1[2] * e2[0] - e1[0] * e2[2];
+	n[2] = e1[0] * e2[1] - e1[1] * e2[0];
+}
+
+typedef struct {
+	uint32_t from;
+	uint32_t to;
+	double cost;
+} Collapse;
+
+struct MeshoptSimplifier {
+	const float *positions;
+	size_t stride;
+	uint32_t vertex_count;
+	// Vertices sharing a position are one vertex to the simplifier:
+	// canonical[v] is the first of them, and the ones at canonical
+	// vertex c are wedges[wedge_offsets[c]] up to
+	// wedges[wedge_offsets[c + 1]]
+	uint32_t *canonical;
+	uint32_t *wedge_offsets;
+	uint32_t *wedges;
+	// By canonical vertex
+	Quadric *quadrics;
+	uint32_t *indices;
+	size_t index_count;
+	// Canonical vertices of `indices`, rebuilt every pass
+	uint32_t *welded;
+	Collapse *collapses;
+	bool *touched;
+	double max_error;
+};
+
+static const float *sort_positions;
+static size_t sort_stride;
+
+// By position, ties by index so the first vertex of a run is the smallest
+static int compare_positions(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a;
+	uint32_t y = *(const uint32_t *)b;
+	int order = memcmp(position(sort_positions, sort_stride, x),
+			   position(sort_positions, sort_stride, y),
+			   sizeof(float) * 3);
+	return order != 0 ? order : (x > y) - (x < y);
+}
+
+// Vertices sharing a position differ in some attribute, an attribute seam.
+// Simplifying them as one vertex keeps flat shaded or split meshes
+// connected, collapses then move every wedge of the seam together.
+static void simplifier_weld(MeshoptSimplifier *simplifier)
+{
+	uint32_t vertex_count = simplifier->vertex_count;
+	bool *used = checked_calloc(vertex_count, sizeof(bool));
+	for (size_t i = 0; i < simplifier->index_count; i++) {
+		used[simplifier->indices[i]] = true;
+	}
+	uint32_t *order = checked_malloc(sizeof(uint32_t) * vertex_count);
+	uint32_t used_count = 0;
+	for (uint32_t v = 0; v < vertex_count; v++) {
+		simplifier->canonical[v] = v;
+		if (used[v]) {
+			order[used_count++] = v;
+		}
+	}
+	sort_positions = simplifier->positions;
+	sort_stride = simplifier->stride;
+	qsort(order, used_count, sizeof(uint32_t), compare_positions);
+
+	uint32_t *offsets = simplifier->wedge_offsets;
+	memset(offsets, 0, sizeof(uint32_t) * (vertex_count + 1));
+	for (uint32_t i = 0; i < used_count; i++) {
+		uint32_t first = order[i];
+		if (i > 0 &&
+		    memcmp(position(sort_positions, sort_stride, order[i - 1]),
+			   position(sort_positions, sort_stride, order[i]),
+			   sizeof(float) * 3) == 0) {
+			first = simplifier->canonical[order[i - 1]];
+		}
+		simplifier->canonical[order[i]] = first;
+		offsets[first + 1]++;
+	}
+	for (uint32_t v = 0; v < vertex_count; v++) {
+		offsets[v + 1] += offsets[v];
+	}
+	// Sorted by index within a position, the canonical vertex first
+	uint32_t *fill = checked_calloc(vertex_count, sizeof(uint32_t));
+	for (uint32_t i = 0; i < used_count; i++) {
+		uint32_t first = simplifier->canonical[order[i]];
+		simplifier->wedges[offsets[first] + fill[first]++] = order[i];
+	}
+	free(fill);
+	free(order);
+	free(used);
+}
+
+// Drops the triangles with two corners at one position
+static void simplifier_remove_degenerate(MeshoptSimplifier *simplifier)
+{
+	uint32_t *indices = simplifier->indices;
+	const uint32_t *canonical = simplifier->canonical;
+	size_t kept = 0;
+	for (size_t i = 0; i < simplifier->index_count; i += 3) {
+		uint32_t a = indices[i], b = indices[i + 1], c = indices[i + 2];
+		if (canonical[a] != canonical[b] &&
+		    canonical[b] != canonical[c] &&
+		    canonical[a] != canonical[c]) {
+			indices[kept++] = a;
+			indices[kept++] = b;
+			indices[kept++] = c;
+		}
+	}
+	simplifier->index_count = kept;
+}
+
+static void simplifier_weld_indices(MeshoptSimplifier *simplifier)
+{
+	for (size_t i = 0; i < simplifier->index_count; i++) {
+		simplifier->welded[i] =
+			simplifier->canonical[simplifier->indices[i]];
+	}
+}
+
+// Every triangle adds its plane to its corners. A border edge has no twin
+// running the other way, the plane through it perpendicular to the
+// triangle keeps its vertices on the border.
+static void simplifier_build_quadrics(MeshoptSimplifier *simplifier)
+{
+	const uint32_t *welded = simplifier->welded;
+	size_t index_count = simplifier->index_count;
+	EdgeSet edges;
+	edge_set_build(&edges, welded, index_count);
+	for (size_t t = 0; t < index_count / 3; t++) {
+		const uint32_t *triangle = welded + t * 3;
+		const float *p[3];
+		for (uint32_t corner = 0; corner < 3; corner++) {
+			p[corner] = position(simplifier->positions,
+					     simplifier->stride,
+					     triangle[corner]);
+		}
+		double n[3];
+		triangle_normal(p[0], p[1], p[2], n);
+		double length = sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+		if (length == 0.0) {
+			continue;
+		}
+		for (uint32_t axis = 0; axis < 3; axis++) {
+			n[axis] /= length;
+		}
+		double d = -(n[0] * p[0][0] + n[1] * p[0][1] + n[2] * p[0][2]);
+		for (uint32_t corner = 0; corner < 3; corner++) {
+			Quadric *q = &simplifier->quadrics[triangle[corner]];
+			quadric_add_plane(q, n, d, 1.0);
+		}
+
+		for (uint32_t corner = 0; corner < 3; corner++) {
+			uint32_t a = triangle[corner];
+			uint32_t b = triangle[(corner + 1) % 3];
+			if (edge_set_contains(&edges, b, a)) {
+				continue;
+			}
+			const float *pa = p[corner];
+			const float *pb = p[(corner + 1) % 3];
+			double e[3] = { pb[0] - pa[0], pb[1] - pa[1],
+					pb[2] - pa[2] };
+			double m[3] = { e[1] * n[2] - e[2] * n[1],
+					e[2] * n[0] - e[0] * n[2],
+					e[0] * n[1] - e[1] * n[0] };
+			double m_length =
+				sqrt(m[0] * m[0] + m[1] * m[1] + m[2] * m[2]);
+			if (m_length == 0.0) {
+				continue;
+			}
+			for (uint32_t axis = 0; axis < 3; axis++) {
+				m[axis] /= m_length;
+			}
+			double md = -(m[0] * pa[0] + m[1] * pa[1] +
+				      m[2] * pa[2]);
+			quadric_add_plane(&simplifier->quadrics[a], m, md,
+					  BORDER_WEIGHT);
+			quadric_add_plane(&simplifier->quadrics[b], m, md,
+					  BORDER_WEIGHT);
+		}
+	}
+	free(edges.keys);
+}
+
+MeshoptSimplifier *meshopt_simplifier_create(const uint32_t *indices,
+					     size_t index_count,
+					     const float *positions,
+					     size_t stride,
+					     uint32_t vertex_count)
+{
+	index_count -= index_count % 3;
+	MeshoptSimplifier *simplifier =
+		checked_calloc(1, sizeof(MeshoptSimplifier));
+	*simplifier = (MeshoptSimplifier){
+		.positions = positions,
+		.stride = stride,
+		.vertex_count = vertex_count,
+		.canonical = checked_malloc(sizeof(uint32_t) * vertex_count),
+		.wedge_offsets =
+			checked_malloc(sizeof(uint32_t) * (vertex_count + 1)),
+		.wedges = checked_malloc(sizeof(uint32_t) * vertex_count),
+		.quadrics = checked_calloc(vertex_count, sizeof(Quadric)),
+		.indices = checked_malloc(sizeof(uint32_t) * index_count),
+		.index_count = index_count,
+		.welded = checked_malloc(sizeof(uint32_t) * index_count),
+		.collapses = checked_malloc(sizeof(Collapse) * index_count),
+		.touched = checked_malloc(sizeof(bool) * vertex_count)
+	};
+	memcpy(simplifier->indices, indices, sizeof(uint32_t) * index_count);
+	simplifier_weld(simplifier);
+	simplifier_remove_degenerate(simplifier);
+	simplifier_weld_indices(simplifier);
+	simplifier_build_quadrics(simplifier);
+	return simplifier;
+}
+
+void meshopt_simplifier_destroy(MeshoptSimplifier *simplifier)
+{
+	free(simplifier->touched);
+	free(simplifier->collapses);
+	free(simplifier->welded);
+	free(simplifier->indices);
+	free(simplifier->quadrics);
+	free(simplifier->wedges);
+	free(simplifier->wedge_offsets);
+	free(simplifier->canonical);
+	free(simplifier);
+}
+
+const uint32_t *meshopt_simplifier_indices(const MeshoptSimplifier *simplifier)
+{
+	return simplifier->indices;
+}
+
+float meshopt_simplifier_error(const MeshoptSimplifier *simplifier)
+{
+	return (float)sqrt(simplifier->max_error);
+}
+
+static int compare_collapses(const void *a, const void *b)
+{
+	double x = ((const Collapse *)a)->cost;
+	double y = ((const Collapse *)b)->cost;
+	return (x > y) - (x < y);
+}
+
+// Whether moving `from` onto `to` turns any triangle around `from` that
+// survives the collapse over
+static bool collapse_flips(const MeshoptSimplifier *simplifier,
+			   const Adjacency *adjacency, uint32_t from,
+			   uint32_t to)
+{
+	const float *positions = simplifier->positions;
+	size_t stride = simplifier->stride;
+	const uint32_t *around =
+		adjacency->triangles + adjacency->offsets[from];
+	for (uint32_t i = 0; i < adjacency->counts[from]; i++) {
+		const uint32_t *triangle = simplifier->welded + around[i] * 3;
+		if (triangle[0] == to || triangle[1] == to ||
+		    triangle[2] == to) {
+			continue;
+		}
+		const float *before[3], *after[3];
+		for (uint32_t corner = 0; corner < 3; corner++) {
+			before[corner] =
+				position(positions, stride, triangle[corner]);
+			after[corner] = before[corner];
+			if (triangle[corner] == from) {
+				after[corner] = position(positions, stride, to);
+			}
+		}
+		double n0[3], n1[3];
+		triangle_normal(before[0], before[1], before[2], n0);
+		triangle_normal(after[0], after[1], after[2], n1);
+		double dot = n0[0] * n1[0] + n0[1] * n1[1] + n0[2] * n1[2];
+		double length0 = sqrt(n0[0] * n0[0] + n0[1] * n0[1] +
+				      n0[2] * n0[2]);
+		double length1 = sqrt(n1[0] * n1[0] + n1[1] * n1[1] +
+				      n1[2] * n1[2]);
+		if (dot <= MIN_NORMAL_DOT * length0 * length1) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// The wedge at canonical vertex `to` whose attributes after the position
+// are closest to those of `vertex`, so every side of a seam moves onto its
+// own side
+static uint32_t nearest_wedge(const MeshoptSimplifier *simplifier,
+			      uint32_t to, uint32_t vertex)
+{
+	uint32_t attributes = simplifier->stride / sizeof(float) - 3;
+	const float *source =
+		position(simplifier->positions, simplifier->stride, vertex);
+	uint32_t best = to;
+	double best_distance = INFINITY;
+	for (uint32_t i = simplifier->wedge_offsets[to];
+	     i < simplifier->wedge_offsets[to + 1]; i++) {
+		const float *wedge = position(simplifier->positions,
+					      simplifier->stride,
+					      simplifier->wedges[i]);
+		double distance = 0.0;
+		for (uint32_t j = 3; j < 3 + attributes; j++) {
+			double delta = wedge[j] - source[j];
+			distance += delta * delta;
+		}
+		if (distance < best_distance) {
+			best_distance = distance;
+			best = simplifier->wedges[i];
+		}
+	}
+	return best;
+}
+
+// Collapses the cheapest edges that don't share a vertex or a triangle, so
+// the costs and adjacency of the pass stay valid throughout it. Returns the
+// number of collapses.
+static size_t simplifier_pass(MeshoptSimplifier *simplifier,
+			      size_t target_index_count)
+{
+	const float *positions = simplifier->positions;
+	size_t stride = simplifier->stride;
+	uint32_t *welded = simplifier->welded;
+	size_t count = simplifier->index_count;
+	Quadric *quadrics = simplifier->quadrics;
+	Collapse *collapses = simplifier->collapses;
+	simplifier_weld_indices(simplifier);
+
+	EdgeSet edges;
+	edge_set_build(&edges, welded, count);
+	size_t candidates = 0;
+	for (size_t i = 0; i < count; i++) {
+		uint32_t a = welded[i];
+		uint32_t b = welded[i - i % 3 + (i + 1) % 3];
+		// Interior edges show up once in each direction
+		if (a > b && edge_set_contains(&edges, b, a)) {
+			continue;
+		}
+		double ab = quadric_error(&quadrics[a], &quadrics[b],
+					  position(positions, stride, b));
+		double ba = quadric_error(&quadrics[a], &quadrics[b],
+					  position(positions, stride, a));
+		collapses[candidates++] = ab <= ba ? (Collapse){ a, b, ab } :
+						     (Collapse){ b, a, ba };
+	}
+	free(edges.keys);
+	qsort(collapses, candidates, sizeof(Collapse), compare_collapses);
+
+	Adjacency adjacency;
+	adjacency_build(&adjacency, welded, count, simplifier->vertex_count);
+	bool *touched = simplifier->touched;
+	memset(touched, 0, sizeof(bool) * simplifier->vertex_count);
+	size_t triangles = count / 3;
+	size_t target_triangles = target_index_count / 3;
+	size_t removed = 0;
+	size_t collapsed = 0;
+	for (size_t i = 0; i < candidates; i++) {
+		if (triangles - removed <= target_triangles) {
+			break;
+		}
+		uint32_t from = collapses[i].from;
+		uint32_t to = collapses[i].to;
+		if (touched[from] || touched[to] ||
+		    collapse_flips(simplifier, &adjacency, from, to)) {
+			continue;
+		}
+		const uint32_t *around =
+			adjacency.triangles + adjacency.offsets[from];
+		for (uint32_t j = 0; j < adjacency.counts[from]; j++) {
+			uint32_t *t = welded + around[j] * 3;
+			uint32_t *vertices =
+				simplifier->indices + around[j] * 3;
+			// The triangles along the edge collapse to lines
+			removed += t[0] == to || t[1] == to || t[2] == to;
+			for (uint32_t corner = 0; corner < 3; corner++) {
+				if (t[corner] == from) {
+					t[corner] = to;
+					vertices[corner] = nearest_wedge(
+						simplifier, to,
+						vertices[corner]);
+				}
+				touched[t[corner]] = true;
+			}
+		}
+		touched[from] = true;
+		quadric_add(&quadrics[to], &quadrics[from]);
+		if (collapses[i].cost > simplifier->max_error) {
+			simplifier->max_error = collapses[i].cost;
+		}
+		collapsed++;
+	}
+	adjacency_free(&adjacency);
+	simplifier_remove_degenerate(simplifier);
+	return collapsed;
+}
+
+size_t meshopt_simplifier_reduce(MeshoptSimplifier *simplifier,
+				 size_t target_index_count)
+{
+	while (simplifier->index_count > target_index_count &&
+	       simplifier_pass(simplifier, target_index_count) > 0) {
+	}
+	return simplifier->index_count;
+}
@@ -0,0 +1,50 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// Offline triangle list processing for nebula-cook. Indices are 32-bit and
+// local to one vertex range of `vertex_count` vertices. Positions are three
+// floats at the start of every `stride` bytes.
+
+// Reorders the triangles of `indices` in place so consecutive triangles
+// reuse the vertices still in the post-transform cache, with Tom Forsyth's
+// linear-speed algorithm
+void meshopt_optimize_cache(uint32_t *indices, size_t index_count,
+			    uint32_t vertex_count);
+
+// Average vertices transformed per triangle with a FIFO cache of
+// `cache_size` entries, between 0.5 and 3, lower is better
+float meshopt_acmr(const uint32_t *indices, size_t index_count,
+		   uint32_t vertex_count, uint32_t cache_size);
+
+// Fills `remap` with the new place of every vertex when they are stored in
+// the order `indices` first references them, UINT32_MAX for vertices it
+// never references. Returns the number of vertices kept.
+uint32_t meshopt_fetch_remap(uint32_t *remap, const uint32_t *indices,
+			     size_t index_count, uint32_t vertex_count);
+
+// Simplifies a triangle list by collapsing edges onto one of their
+// vertices, cheapest first by quadric error. Only existing vertices are
+// referenced, so every level of detail shares the vertex stream. Vertices
+// sharing a position, the sides of an attribute seam, simplify as one and
+// move together, every side onto the vertex whose remaining floats are
+// closest to its own. Borders are kept in place by extra planes. The state
+// persists, so each level of detail is simplified from the previous one.
+typedef struct MeshoptSimplifier MeshoptSimplifier;
+
+// Copies `indices`, `positions` must outlive the simplifier
+MeshoptSimplifier *meshopt_simplifier_create(const uint32_t *indices,
+					     size_t index_count,
+					     const float *positions,
+					     size_t stride,
+					     uint32_t vertex_count);
+void meshopt_simplifier_destroy(MeshoptSimplifier *simplifier);
+
+// Collapses edges until at most `target_index_count` indices are left or
+// no collapse is possible. Returns the index count left.
+size_t meshopt_simplifier_reduce(MeshoptSimplifier *simplifier,
+				 size_t target_index_count);
+const uint32_t *meshopt_simplifier_indices(const MeshoptSimplifier *simplifier);
+// Upper bound on the distance between the current triangles and the input
+// surface, in position units. Never decreases.
+float meshopt_simplifier_error(const MeshoptSimplifier *simplifier);